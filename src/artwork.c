@@ -31,8 +31,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 #include <pthread.h>
 
+#include <event2/event.h>
+
 #include "db.h"
 #include "misc.h"
 #include "misc_json.h"
@@ -42,6 +47,9 @@
 #include "cache.h"
 #include "http.h"
 #include "transcode.h"
+#include "commands.h"
+#include "listener.h"
+#include "player.h"
 
 #include "artwork.h"
 
@@ -73,6 +81,14 @@
 #define ONLINE_SEARCH_COOLDOWN_TIME 3600
 #define ONLINE_SEARCH_FAILURES_MAX 3
 
+// Seconds to wait after a library change before pre-rendering, and ms to wait
+// between albums while pre-rendering
+#define PRERENDER_DELAY 30
+#define PRERENDER_INTERVAL_MS 250
+
+// Number of threads that serve artwork_get_*_async()
+#define ARTWORK_ASYNC_THREADS 2
+
 enum artwork_cache
 {
   NEVER = 0,       // No caching of any results
@@ -118,6 +134,17 @@ struct artwork_ctx {
   struct query_params qp;
   // Not to be used by handler - should the result be cached
   enum artwork_cache cache;
+  // Not to be used by handler - where to put the hash of a cached image, may
+  // be NULL
+  char *hash;
+  // Not to be used by handler - name of the source that found the artwork
+  const char *source;
+  // Not to be used by handler - if set, process_items() only tries this source
+  const char *only_source;
+  // Not to be used by handler - state of the group's files, see memo_key_get()
+  bool memo_valid;
+  time_t memo_mtime;
+  int memo_nitems;
 };
 
 /* Definition of an artwork source. Covers both item and group sources.
@@ -192,6 +219,93 @@ static const char *cover_extension[] =
     "jpg", "png",
   };
 
+/* State of the background pre-rendering, see artwork_init()
+ */
+struct artwork_prerender
+{
+  bool enabled;
+  pthread_t tid;
+  struct event_base *evbase;
+  struct commands_base *cmdbase;
+
+  // Configured image sizes
+  int *sizes;
+  int nsizes;
+
+  // Albums (group ids) waiting to be rendered, next is the first not done
+  int *ids;
+  int ids_size;
+  int nids;
+  int next;
+
+  // Albums with files added or modified at or after this time are rendered.
+  // Files from the second of the last walk are included, since they may have
+  // been added after its query, which just means a few cache hits.
+  time_t last_walk;
+  bool paused;
+
+  struct event *startev;
+  struct event *stepev;
+};
+
+static struct artwork_prerender prerender;
+
+/* A caller waiting for an async artwork request, see artwork_get_item_async().
+ * The result is delivered to the caller's event loop through ev.
+ */
+struct artwork_waiter
+{
+  struct event_base *evbase;
+  struct event *ev;
+  artwork_cb cb;
+  void *cb_arg;
+
+  // The result, set when the job is done
+  struct evbuffer *evbuf;
+  int format;
+  char hash[ART_HASH_LEN];
+
+  // The job, NULL when it is done
+  struct artwork_job *job;
+  struct artwork_waiter *job_next;
+
+  // List of all waiters, so they can be cancelled
+  struct artwork_waiter *prev;
+  struct artwork_waiter *next;
+};
+
+/* A queued or running async artwork request. Requests with the same parameters
+ * share a job.
+ */
+struct artwork_job
+{
+  bool is_group;
+  int id;
+  int max_w;
+  int max_h;
+  int format;
+
+  bool running;
+  struct artwork_waiter *waiters;
+
+  struct artwork_job *next;
+};
+
+struct artwork_async_state
+{
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  pthread_t tid[ARTWORK_ASYNC_THREADS];
+  int nthreads;
+  bool exit;
+
+  struct artwork_job *jobs;
+  struct artwork_waiter *waiters;
+};
+
+static struct artwork_async_state artwork_async = { .lck = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
 /* ----------------- DECLARE AND CONFIGURE SOURCE HANDLERS ----------------- */
 
 /* Forward - group handlers */
@@ -352,6 +466,10 @@ static enum parse_result response_jparse_musicbrainz(char **artwork_url, json_ob
 static int credentials_get_spotify(char **auth_key, char **auth_secret);
 static int credentials_get_discogs(char **auth_key, char **auth_secret);
 
+// Canonical artwork sizes, see size_bucket(). Includes the sizes clients
+// typically request, and steps between them are at most a third.
+static const int size_buckets[] = { 32, 48, 64, 96, 128, 150, 200, 256, 300, 400, 512, 600, 800, 1024, 1200, 1600, 2048 };
+
 static struct online_search_history search_history_spotify = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 static struct online_search_history search_history_discogs = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 static struct online_search_history search_history_musicbrainz = { .mutex = PTHREAD_MUTEX_INITIALIZER };
@@ -582,6 +700,29 @@ size_calculate(int *dst_w, int *dst_h, int src_w, int src_h, int max_w, int max_
   DPRINTF(E_DBG, L_ART, "Rescale required, destination width %d height %d\n", *dst_w, *dst_h);
 }
 
+/* Rounds a requested size down to the nearest of size_buckets, so the cache
+ * gets a few renders of an image instead of one for every size any client has
+ * asked for. Sizes outside the range of the buckets are returned as is. The
+ * price is that a client may get an image up to a third smaller than it
+ * asked for (documented with cache_artwork_size in owntone.conf).
+ *
+ * @in  size   Requested width or height
+ * @return     Normalized width or height
+ */
+static int
+size_bucket(int size)
+{
+  int i;
+
+  if (size < size_buckets[0] || size > size_buckets[ARRAY_SIZE(size_buckets) - 1])
+    return size;
+
+  for (i = ARRAY_SIZE(size_buckets) - 1; size_buckets[i] > size; i--)
+    ; // Loop terminates because size >= size_buckets[0]
+
+  return size_buckets[i];
+}
+
 #ifdef HAVE_LIBEVENT2_OLD
 // This is not how this function is actually defined in libevent 2.1+, but it
 // works as a less optimal stand-in
@@ -1419,7 +1560,7 @@ source_group_cache_get(struct artwork_ctx *ctx)
   int cached;
   int ret;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf, ctx->hash);
   if (ret < 0)
     return ART_E_ERROR;
 
@@ -1494,7 +1635,7 @@ source_item_cache_get(struct artwork_ctx *ctx)
   if (!ctx->individual)
     return ART_E_NONE;
 
-  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf);
+  ret = cache_artwork_get(CACHE_ARTWORK_INDIVIDUAL, ctx->id, ctx->req_params.max_w, ctx->req_params.max_h, &cached, &format, ctx->evbuf, ctx->hash);
   if (ret < 0)
     return ART_E_ERROR;
 
@@ -1859,6 +2000,9 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	  if ((artwork_item_source[i].media_kinds & ctx->media_kind) == 0)
 	    continue;
 
+	  if (ctx->only_source && strcmp(artwork_item_source[i].name, ctx->only_source) != 0)
+	    continue;
+
 	  // If just one handler says we should not cache a negative result then we obey that
 	  if ((artwork_item_source[i].cache & ON_FAILURE) == 0)
 	    ctx->cache = NEVER;
@@ -1873,6 +2017,7 @@ process_items(struct artwork_ctx *ctx, int item_mode)
 	    {
 	      DPRINTF(E_DBG, L_ART, "Artwork for '%s' found in source '%s'\n", dbmfi.title, artwork_item_source[i].name);
 	      ctx->cache = artwork_item_source[i].cache;
+	      ctx->source = artwork_item_source[i].name;
 	      db_query_end(&ctx->qp);
 	      return ret;
 	    }
@@ -1902,6 +2047,100 @@ process_items(struct artwork_ctx *ctx, int item_mode)
   return -1;
 }
 
+/* ------------------------------ SOURCE MEMO ------------------------------ */
+
+/* For each group we remember which source had the artwork the last time it was
+ * searched, or that none had. That lets a request for a size that isn't cached
+ * go straight to the right source, or skip the search altogether. The memo is
+ * only valid for the state of the group's files it was made with, which this
+ * function gets: the newest mtime of the files and their number. It is looked
+ * up with one indexed query, so that it is cheap compared to the search. Cover
+ * images that are added later make the filescanner clear the memos.
+ */
+static int
+memo_key_get(time_t *mtime, int *nitems, int64_t persistentid)
+{
+  *mtime = 0;
+  *nitems = 0;
+
+  return db_group_files_state_get(mtime, nitems, persistentid);
+}
+
+/* Saves the outcome of a search through the sources. Hits in the cache don't
+ * tell us anything, and a negative result is only saved if it could be cached.
+ */
+static void
+memo_save(struct artwork_ctx *ctx, int ret)
+{
+  if (!ctx->memo_valid)
+    return;
+
+  if (ret > 0 && ctx->source && strcmp(ctx->source, "cache") != 0)
+    cache_artwork_source_set(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->memo_mtime, ctx->memo_nitems, ctx->source);
+  else if (ret <= 0 && (ctx->cache & ON_FAILURE))
+    cache_artwork_source_set(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->memo_mtime, ctx->memo_nitems, "");
+}
+
+/* Returns ART_FMT_XXX if the memo'ed source had the artwork, ART_E_ABORT if
+ * the memo says there is no artwork and ART_E_NONE if the caller should search
+ * all the sources.
+ */
+static int
+memo_process(struct artwork_ctx *ctx)
+{
+  char source[CACHE_ARTWORK_SOURCE_LEN];
+  enum artwork_cache cache;
+  int i;
+  int ret;
+
+  ret = memo_key_get(&ctx->memo_mtime, &ctx->memo_nitems, ctx->persistentid);
+  if (ret < 0)
+    return ART_E_NONE;
+
+  ctx->memo_valid = true;
+
+  ret = cache_artwork_source_get(CACHE_ARTWORK_GROUP, ctx->persistentid, ctx->memo_mtime, ctx->memo_nitems, source);
+  if (ret < 0)
+    return ART_E_NONE;
+
+  if (source[0] == '\0')
+    {
+      DPRINTF(E_DBG, L_ART, "Group %" PRIi64 " is known to have no artwork\n", ctx->persistentid);
+      return ART_E_ABORT;
+    }
+
+  DPRINTF(E_SPAM, L_ART, "Trying source '%s' for group %" PRIi64 " first\n", source, ctx->persistentid);
+
+  cache = ctx->cache;
+
+  for (i = 0; artwork_group_source[i].handler; i++)
+    {
+      if (strcmp(artwork_group_source[i].name, source) != 0)
+	continue;
+
+      ret = artwork_group_source[i].handler(ctx);
+      if (ret > 0)
+	{
+	  ctx->cache = artwork_group_source[i].cache;
+	  ctx->source = artwork_group_source[i].name;
+	  return ret;
+	}
+
+      return ART_E_NONE;
+    }
+
+  ctx->only_source = source;
+  ret = process_items(ctx, 0);
+  ctx->only_source = NULL;
+  if (ret > 0)
+    return ret;
+
+  // Let the full search start over
+  ctx->cache = cache;
+
+  return ART_E_NONE;
+}
+
 static int
 process_group(struct artwork_ctx *ctx)
 {
@@ -1946,6 +2185,8 @@ process_group(struct artwork_ctx *ctx)
 	{
 	  DPRINTF(E_DBG, L_ART, "Artwork for group %" PRIi64 " found in source '%s'\n", ctx->persistentid, artwork_group_source[i].name);
 	  ctx->cache = artwork_group_source[i].cache;
+	  ctx->source = artwork_group_source[i].name;
+	  memo_save(ctx, ret);
 	  return ret;
 	}
       else if (ret == ART_E_ABORT)
@@ -1959,8 +2200,22 @@ process_group(struct artwork_ctx *ctx)
 	  DPRINTF(E_LOG, L_ART, "Source '%s' returned an error for group %" PRIi64 "\n", artwork_group_source[i].name, ctx->persistentid);
 	  ctx->cache = NEVER;
 	}
+
+      // Not in the cache, so check if we know where to look
+      if (artwork_group_source[i].handler != source_group_cache_get)
+	continue;
+
+      ret = memo_process(ctx);
+      if (ret > 0)
+	return ret;
+      else if (ret == ART_E_ABORT)
+	return -1; // The "no artwork" result can be cached for this size
     }
 
+  ret = process_items(ctx, 0);
+  memo_save(ctx, ret);
+  return ret;
+
  invalid_group:
   return process_items(ctx, 0);
 }
@@ -1969,12 +2224,15 @@ process_group(struct artwork_ctx *ctx)
 /* ------------------------------ ARTWORK API ------------------------------ */
 
 int
-artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format, char *hash)
 {
   struct artwork_ctx ctx;
   char filter[32];
   int ret;
 
+  max_w = size_bucket(max_w);
+  max_h = size_bucket(max_h);
+
   DPRINTF(E_DBG, L_ART, "Artwork request for item %d (max_w=%d, max_h=%d)\n", id, max_w, max_h);
 
   if (id == DB_MEDIA_FILE_NON_PERSISTENT_ID)
@@ -1990,6 +2248,9 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   ctx.req_params.format = format;
   ctx.cache = ON_FAILURE;
   ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+  ctx.hash = hash;
+  if (hash)
+    hash[0] = '\0';
 
   ret = db_snprintf(filter, sizeof(filter), "id = %d", id);
   if (ret < 0)
@@ -2004,7 +2265,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_INDIVIDUAL, id, max_w, max_h, ret, ctx.path, evbuf, hash);
 
       return ret;
     }
@@ -2016,7 +2277,7 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf, hash);
 
       return ret;
     }
@@ -2024,17 +2285,20 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
   DPRINTF(E_DBG, L_ART, "No artwork found for item %d\n", id);
 
   if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
+    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf, NULL);
 
   return -1;
 }
 
 int
-artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format)
+artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format, char *hash)
 {
   struct artwork_ctx ctx;
   int ret;
 
+  max_w = size_bucket(max_w);
+  max_h = size_bucket(max_h);
+
   DPRINTF(E_DBG, L_ART, "Artwork request for group %d (max_w=%d, max_h=%d)\n", id, max_w, max_h);
 
   memset(&ctx, 0, sizeof(struct artwork_ctx));
@@ -2055,12 +2319,15 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   ctx.req_params.format = format;
   ctx.cache = ON_FAILURE;
   ctx.individual = cfg_getbool(cfg_getsec(cfg, "library"), "artwork_individual");
+  ctx.hash = hash;
+  if (hash)
+    hash[0] = '\0';
 
   ret = process_group(&ctx);
   if (ret > 0)
     {
       if (ctx.cache & ON_SUCCESS)
-	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf);
+	cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, ret, ctx.path, evbuf, hash);
 
       return ret;
     }
@@ -2068,7 +2335,7 @@ artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int form
   DPRINTF(E_DBG, L_ART, "No artwork found for group %d\n", id);
 
   if (ctx.cache & ON_FAILURE)
-    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf);
+    cache_artwork_add(CACHE_ARTWORK_GROUP, ctx.persistentid, max_w, max_h, 0, "", evbuf, NULL);
 
   return -1;
 }
@@ -2135,3 +2402,651 @@ artwork_extension_is_artwork(const char *path)
 
   return false;
 }
+
+
+/* ------------------------- ASYNC ARTWORK SERVICE ------------------------- */
+
+/* Getting artwork may mean decoding and rescaling an image, or waiting for an
+ * online source, so event loop threads shouldn't do it themselves. Instead they
+ * can queue a job for the artwork threads, and get a callback in their own
+ * event loop when it is done. A request for the same image as a job that is
+ * already queued or running is added to that job.
+ */
+
+/* Thread: artwork_get */
+static void
+async_waiters_deliver(struct artwork_job *job, struct evbuffer *evbuf, int format, const char *hash)
+{
+  struct artwork_waiter *waiter;
+  uint8_t *data;
+  size_t len;
+
+  len = evbuffer_get_length(evbuf);
+  data = (job->waiters && job->waiters->job_next) ? evbuffer_pullup(evbuf, -1) : NULL;
+
+  for (waiter = job->waiters; waiter; waiter = waiter->job_next)
+    {
+      // The last one takes the buffer as it is, so a single waiter gets the
+      // image without a copy (and served from a file if it is in the cache)
+      if (!waiter->job_next)
+	evbuffer_add_buffer(waiter->evbuf, evbuf);
+      else if (data)
+	evbuffer_add(waiter->evbuf, data, len);
+
+      waiter->format = format;
+      snprintf(waiter->hash, sizeof(waiter->hash), "%s", hash);
+      waiter->job = NULL;
+
+      event_active(waiter->ev, 0, 0);
+    }
+
+  job->waiters = NULL;
+}
+
+/* Must be called with the lock held */
+static void
+async_waiter_unlink(struct artwork_waiter *waiter)
+{
+  struct artwork_waiter **w;
+
+  if (waiter->prev)
+    waiter->prev->next = waiter->next;
+  else
+    artwork_async.waiters = waiter->next;
+
+  if (waiter->next)
+    waiter->next->prev = waiter->prev;
+
+  if (!waiter->job)
+    return;
+
+  for (w = &waiter->job->waiters; *w; w = &(*w)->job_next)
+    {
+      if (*w != waiter)
+	continue;
+
+      *w = waiter->job_next;
+      break;
+    }
+
+  waiter->job = NULL;
+}
+
+static void
+async_waiter_free(struct artwork_waiter *waiter)
+{
+  event_free(waiter->ev);
+  evbuffer_free(waiter->evbuf);
+  free(waiter);
+}
+
+/* Thread: the waiter's event loop */
+static void
+async_waiter_done_cb(int fd, short what, void *arg)
+{
+  struct artwork_waiter *waiter = arg;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+  async_waiter_unlink(waiter);
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  waiter->cb(waiter->evbuf, waiter->format, waiter->hash, waiter->cb_arg);
+
+  async_waiter_free(waiter);
+}
+
+/* Must be called with the lock held */
+static struct artwork_job *
+async_job_next(void)
+{
+  struct artwork_job *job;
+
+  for (job = artwork_async.jobs; job; job = job->next)
+    {
+      if (!job->running)
+	return job;
+    }
+
+  return NULL;
+}
+
+/* Must be called with the lock held */
+static void
+async_job_remove(struct artwork_job *job)
+{
+  struct artwork_job **j;
+
+  for (j = &artwork_async.jobs; *j; j = &(*j)->next)
+    {
+      if (*j != job)
+	continue;
+
+      *j = job->next;
+      break;
+    }
+}
+
+/* Thread: artwork_get */
+static void *
+async_thread(void *arg)
+{
+  struct artwork_job *job;
+  struct evbuffer *evbuf;
+  char hash[ART_HASH_LEN];
+  int format;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Error: DB init failed (artwork_get thread)\n");
+      pthread_exit(NULL);
+    }
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+
+  while (!artwork_async.exit)
+    {
+      job = async_job_next();
+      if (!job)
+	{
+	  CHECK_ERR(L_ART, pthread_cond_wait(&artwork_async.cond, &artwork_async.lck));
+	  continue;
+	}
+
+      job->running = true;
+
+      CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+      if (job->is_group)
+	format = artwork_get_group(evbuf, job->id, job->max_w, job->max_h, job->format, hash);
+      else
+	format = artwork_get_item(evbuf, job->id, job->max_w, job->max_h, job->format, hash);
+
+      CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+
+      async_job_remove(job);
+      async_waiters_deliver(job, evbuf, format, hash);
+      free(job);
+
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  evbuffer_free(evbuf);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+static struct artwork_waiter *
+async_get(struct event_base *evbase, bool is_group, int id, int max_w, int max_h, int format, artwork_cb cb, void *cb_arg)
+{
+  struct artwork_waiter *waiter;
+  struct artwork_job *job;
+  struct artwork_job **j;
+
+  if (artwork_async.nthreads == 0)
+    return NULL;
+
+  // Normalized here as well, so that requests for sizes in the same bucket
+  // share a job
+  max_w = size_bucket(max_w);
+  max_h = size_bucket(max_h);
+
+  CHECK_NULL(L_ART, waiter = calloc(1, sizeof(struct artwork_waiter)));
+  CHECK_NULL(L_ART, waiter->ev = event_new(evbase, -1, 0, async_waiter_done_cb, waiter));
+  CHECK_NULL(L_ART, waiter->evbuf = evbuffer_new());
+  waiter->evbase = evbase;
+  waiter->cb = cb;
+  waiter->cb_arg = cb_arg;
+  waiter->format = -1;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+
+  for (job = artwork_async.jobs; job; job = job->next)
+    {
+      if (job->is_group == is_group && job->id == id && job->max_w == max_w && job->max_h == max_h && job->format == format)
+	break;
+    }
+
+  if (job)
+    {
+      DPRINTF(E_SPAM, L_ART, "Artwork request for %s %d joins a queued request\n", is_group ? "group" : "item", id);
+    }
+  else
+    {
+      CHECK_NULL(L_ART, job = calloc(1, sizeof(struct artwork_job)));
+      job->is_group = is_group;
+      job->id = id;
+      job->max_w = max_w;
+      job->max_h = max_h;
+      job->format = format;
+
+      for (j = &artwork_async.jobs; *j; j = &(*j)->next)
+	; // Queue at the end
+      *j = job;
+
+      CHECK_ERR(L_ART, pthread_cond_signal(&artwork_async.cond));
+    }
+
+  waiter->job = job;
+  waiter->job_next = job->waiters;
+  job->waiters = waiter;
+
+  waiter->next = artwork_async.waiters;
+  if (waiter->next)
+    waiter->next->prev = waiter;
+  artwork_async.waiters = waiter;
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  return waiter;
+}
+
+struct artwork_waiter *
+artwork_get_item_async(struct event_base *evbase, int id, int max_w, int max_h, int format, artwork_cb cb, void *cb_arg)
+{
+  if (id == DB_MEDIA_FILE_NON_PERSISTENT_ID)
+    return NULL;
+
+  return async_get(evbase, false, id, max_w, max_h, format, cb, cb_arg);
+}
+
+struct artwork_waiter *
+artwork_get_group_async(struct event_base *evbase, int id, int max_w, int max_h, int format, artwork_cb cb, void *cb_arg)
+{
+  return async_get(evbase, true, id, max_w, max_h, format, cb, cb_arg);
+}
+
+/* Thread: the waiter's event loop */
+void
+artwork_async_request_cancel(struct artwork_waiter *waiter)
+{
+  struct artwork_job *job;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+
+  job = waiter->job;
+  async_waiter_unlink(waiter);
+
+  // Nobody is waiting for the job any more, so drop it unless it is already
+  // running (then it will just deliver to no one)
+  if (job && !job->waiters && !job->running)
+    {
+      async_job_remove(job);
+      free(job);
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  // If the result was delivered, but the callback not yet made, then freeing
+  // the event also removes it from the event loop's active events
+  async_waiter_free(waiter);
+}
+
+void
+artwork_async_cancel(struct event_base *evbase)
+{
+  struct artwork_waiter *cancelled;
+  struct artwork_waiter *waiter;
+  struct artwork_waiter *next;
+
+  cancelled = NULL;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+
+  for (waiter = artwork_async.waiters; waiter; waiter = next)
+    {
+      next = waiter->next;
+      if (waiter->evbase != evbase)
+	continue;
+
+      async_waiter_unlink(waiter);
+      waiter->next = cancelled;
+      cancelled = waiter;
+    }
+
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  // Waiters that were already delivered get their result, the rest -1
+  for (waiter = cancelled; waiter; waiter = next)
+    {
+      next = waiter->next;
+
+      waiter->cb(waiter->evbuf, waiter->format, waiter->hash, waiter->cb_arg);
+
+      async_waiter_free(waiter);
+    }
+}
+
+static int
+async_init(void)
+{
+  int i;
+  int ret;
+
+  artwork_async.exit = false;
+  artwork_async.nthreads = 0;
+
+  for (i = 0; i < ARTWORK_ASYNC_THREADS; i++)
+    {
+      ret = pthread_create(&artwork_async.tid[i], NULL, async_thread, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_ART, "Could not spawn artwork_get thread: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(artwork_async.tid[i], "artwork_get");
+      artwork_async.nthreads++;
+    }
+
+  return (artwork_async.nthreads > 0) ? 0 : -1;
+}
+
+static void
+async_deinit(void)
+{
+  struct artwork_job *job;
+  int i;
+
+  CHECK_ERR(L_ART, pthread_mutex_lock(&artwork_async.lck));
+  artwork_async.exit = true;
+  CHECK_ERR(L_ART, pthread_cond_broadcast(&artwork_async.cond));
+  CHECK_ERR(L_ART, pthread_mutex_unlock(&artwork_async.lck));
+
+  for (i = 0; i < artwork_async.nthreads; i++)
+    {
+      CHECK_ERR(L_ART, pthread_join(artwork_async.tid[i], NULL));
+    }
+
+  artwork_async.nthreads = 0;
+
+  // Any waiters left belong to event loops that should have called
+  // artwork_async_cancel(), so only the jobs are freed
+  while ((job = artwork_async.jobs))
+    {
+      artwork_async.jobs = job->next;
+      free(job);
+    }
+}
+
+
+/* ------------------------- ARTWORK PRE-RENDERING ------------------------- */
+/*                             Thread: artwork                              */
+
+/* Rescaling artwork on first request means that the first visit to the album
+ * grid after a scan triggers a decode and rescale for every album on the page.
+ * To avoid that, the artwork thread walks the albums that were added or changed
+ * since its last walk and requests the configured sizes, so they end up in the
+ * cache. It does one album per tick, and not while something is playing.
+ */
+
+static void
+prerender_walk_start(int fd, short what, void *arg)
+{
+  struct query_params qp;
+  struct db_group_info dbgri;
+  struct player_status status;
+  time_t now;
+  int32_t id;
+  int ret;
+
+  now = time(NULL);
+
+  memset(&qp, 0, sizeof(struct query_params));
+  qp.type = Q_GROUP_ALBUMS;
+  qp.idx_type = I_NONE;
+  qp.filter = db_mprintf("(f.time_modified >= %" PRIi64 " OR f.time_added >= %" PRIi64 ")", (int64_t)prerender.last_walk, (int64_t)prerender.last_walk);
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not start query for artwork pre-rendering\n");
+      goto out;
+    }
+
+  // Albums still queued from an earlier walk are kept, they may be rendered
+  // twice but that is just a cache hit
+  while ((ret = db_query_fetch_group(&dbgri, &qp)) == 0)
+    {
+      if (safe_atoi32(dbgri.id, &id) < 0)
+	continue;
+
+      if (prerender.nids == prerender.ids_size)
+	{
+	  prerender.ids_size = prerender.ids_size ? 2 * prerender.ids_size : 64;
+	  CHECK_NULL(L_ART, prerender.ids = realloc(prerender.ids, prerender.ids_size * sizeof(int)));
+	}
+
+      prerender.ids[prerender.nids] = id;
+      prerender.nids++;
+    }
+
+  db_query_end(&qp);
+
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Error fetching albums for artwork pre-rendering\n");
+      goto out;
+    }
+
+  prerender.last_walk = now;
+
+  if (prerender.next >= prerender.nids)
+    goto out;
+
+  DPRINTF(E_INFO, L_ART, "Pre-rendering artwork for %d albums\n", prerender.nids - prerender.next);
+
+  ret = player_get_status(&status);
+  prerender.paused = (ret == 0 && status.status == PLAY_PLAYING);
+
+  if (!prerender.paused)
+    event_active(prerender.stepev, 0, 0);
+
+ out:
+  free(qp.filter);
+}
+
+static void
+prerender_step(int fd, short what, void *arg)
+{
+  struct timeval interval = { 0, PRERENDER_INTERVAL_MS * 1000 };
+  struct evbuffer *evbuf;
+  int i;
+
+  if (prerender.paused)
+    return;
+
+  if (prerender.next >= prerender.nids)
+    {
+      DPRINTF(E_INFO, L_ART, "Artwork pre-rendering done\n");
+
+      free(prerender.ids);
+      prerender.ids = NULL;
+      prerender.ids_size = 0;
+      prerender.nids = 0;
+      prerender.next = 0;
+      return;
+    }
+
+  CHECK_NULL(L_ART, evbuf = evbuffer_new());
+
+  for (i = 0; i < prerender.nsizes; i++)
+    {
+      artwork_get_group(evbuf, prerender.ids[prerender.next], prerender.sizes[i], prerender.sizes[i], 0, NULL);
+      evbuffer_drain(evbuf, evbuffer_get_length(evbuf));
+    }
+
+  evbuffer_free(evbuf);
+
+  prerender.next++;
+
+  evtimer_add(prerender.stepev, &interval);
+}
+
+static enum command_state
+prerender_listener_event(void *arg, int *retval)
+{
+  struct timeval delay = { PRERENDER_DELAY, 0 };
+  struct player_status status;
+  short *event_mask = arg;
+  int ret;
+
+  if (*event_mask & LISTENER_DATABASE)
+    evtimer_add(prerender.startev, &delay); // Restarts the timer if pending
+
+  if ((*event_mask & LISTENER_PLAYER) && prerender.next < prerender.nids)
+    {
+      ret = player_get_status(&status);
+      if (ret == 0 && (status.status == PLAY_PLAYING) != prerender.paused)
+	{
+	  prerender.paused = (status.status == PLAY_PLAYING);
+
+	  DPRINTF(E_DBG, L_ART, "Artwork pre-rendering %s\n", prerender.paused ? "paused" : "resumed");
+
+	  if (prerender.paused)
+	    evtimer_del(prerender.stepev);
+	  else
+	    event_active(prerender.stepev, 0, 0);
+	}
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+}
+
+/* Thread: player, library */
+static void
+prerender_listener_cb(short event_mask)
+{
+  short *arg;
+
+  CHECK_NULL(L_ART, arg = malloc(sizeof(short)));
+  *arg = event_mask;
+
+  commands_exec_async(prerender.cmdbase, prerender_listener_event, arg);
+}
+
+static void *
+prerender_thread(void *arg)
+{
+  struct timeval delay = { PRERENDER_DELAY, 0 };
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Error: DB init failed (artwork thread)\n");
+      pthread_exit(NULL);
+    }
+
+  // The first walk after startup covers the whole library, but albums that
+  // are already cached are just cache hits
+  evtimer_add(prerender.startev, &delay);
+
+  event_base_dispatch(prerender.evbase);
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+int
+artwork_init(void)
+{
+  cfg_t *lib;
+  int ret;
+  int i;
+
+  ret = async_init();
+  if (ret < 0)
+    return -1;
+
+  lib = cfg_getsec(cfg, "library");
+
+  prerender.nsizes = cfg_size(lib, "artwork_prerender_sizes");
+  if (prerender.nsizes == 0)
+    return 0;
+
+  CHECK_NULL(L_ART, prerender.sizes = calloc(prerender.nsizes, sizeof(int)));
+  for (i = 0; i < prerender.nsizes; i++)
+    prerender.sizes[i] = cfg_getnint(lib, "artwork_prerender_sizes", i);
+
+  CHECK_NULL(L_ART, prerender.evbase = event_base_new());
+  CHECK_NULL(L_ART, prerender.startev = evtimer_new(prerender.evbase, prerender_walk_start, NULL));
+  CHECK_NULL(L_ART, prerender.stepev = evtimer_new(prerender.evbase, prerender_step, NULL));
+  CHECK_NULL(L_ART, prerender.cmdbase = commands_base_new(prerender.evbase, NULL));
+
+  ret = listener_add(prerender_listener_cb, LISTENER_DATABASE | LISTENER_PLAYER);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not create listener event\n");
+      goto listener_fail;
+    }
+
+  ret = pthread_create(&prerender.tid, NULL, prerender_thread, NULL);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_ART, "Could not spawn artwork thread: %s\n", strerror(errno));
+      goto thread_fail;
+    }
+
+  thread_setname(prerender.tid, "artwork");
+
+  prerender.enabled = true;
+
+  return 0;
+
+ thread_fail:
+  listener_remove(prerender_listener_cb);
+ listener_fail:
+  commands_base_free(prerender.cmdbase);
+  event_free(prerender.stepev);
+  event_free(prerender.startev);
+  event_base_free(prerender.evbase);
+  free(prerender.sizes);
+  async_deinit();
+
+  return -1;
+}
+
+static void
+prerender_deinit(void)
+{
+  int ret;
+
+  prerender.enabled = false;
+
+  listener_remove(prerender_listener_cb);
+
+  commands_base_destroy(prerender.cmdbase);
+
+  ret = pthread_join(prerender.tid, NULL);
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_ART, "Could not join artwork thread: %s\n", strerror(errno));
+      return;
+    }
+
+  event_free(prerender.stepev);
+  event_free(prerender.startev);
+  event_base_free(prerender.evbase);
+
+  free(prerender.sizes);
+  free(prerender.ids);
+}
+
+void
+artwork_deinit(void)
+{
+  if (prerender.enabled)
+    prerender_deinit();
+
+  async_deinit();
+}
@@ -9,9 +9,29 @@
 #define ART_DEFAULT_HEIGHT 600
 #define ART_DEFAULT_WIDTH  600
 
+// Size of the hash returned with the image (SHA-256 in hex incl. the
+// terminating zero, same as CACHE_ARTWORK_HASH_LEN)
+#define ART_HASH_LEN 65
+
+#include <event2/event.h>
 #include <event2/buffer.h>
 #include <stdbool.h>
 
+// Handle of an async artwork request
+struct artwork_waiter;
+
+/*
+ * Callback for the async artwork requests
+ *
+ * @in  evbuf    The (scaled) image, the callback may take the data but must not
+ *               free the buffer
+ * @in  format   ART_FMT_* on success, -1 on error, no artwork found or if the
+ *               request was cancelled
+ * @in  hash     See artwork_get_item()
+ * @in  arg      The argument given with the request
+ */
+typedef void (*artwork_cb)(struct evbuffer *evbuf, int format, const char *hash, void *arg);
+
 /*
  * Get the artwork image for an individual item (track)
  *
@@ -20,10 +40,13 @@
  * @in  max_w    Requested maximum image width (may not be obeyed)
  * @in  max_h    Requested maximum image height (may not be obeyed)
  * @in  format   Requested format (may not be obeyed), 0 for default
+ * @out hash     If not NULL, set to the content hash of the image if it is in
+ *               the cache (can be used as ETag), otherwise an empty string.
+ *               Must have room for ART_HASH_LEN.
  * @return       ART_FMT_* on success, -1 on error or no artwork found
  */
 int
-artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
+artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int format, char *hash);
 
 /*
  * Get the artwork image for a group (an album or an artist)
@@ -33,10 +56,53 @@ artwork_get_item(struct evbuffer *evbuf, int id, int max_w, int max_h, int forma
  * @in  max_w    Requested maximum image width (may not be obeyed)
  * @in  max_h    Requested maximum image height (may not be obeyed)
  * @in  format   Requested format (may not be obeyed), 0 for default
+ * @out hash     See artwork_get_item()
  * @return       ART_FMT_* on success, -1 on error or no artwork found
  */
 int
-artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format);
+artwork_get_group(struct evbuffer *evbuf, int id, int max_w, int max_h, int format, char *hash);
+
+/*
+ * Async versions of the above, which don't block the calling thread. The
+ * artwork is found by an artwork thread, and then cb is called from evbase,
+ * which must be the caller's event loop. Requests with the same parameters as
+ * one that is in progress will share its result.
+ *
+ * @in  evbase   Event base the callback should be made from
+ * @in  cb       Callback with the result
+ * @in  cb_arg   Argument for the callback
+ * @return       Handle of the request, which can be used to cancel it, or NULL
+ *               if the request was not queued (e.g. if the artwork threads are
+ *               not running, the caller may then use the synchronous version)
+ */
+struct artwork_waiter *
+artwork_get_item_async(struct event_base *evbase, int id, int max_w, int max_h, int format, artwork_cb cb, void *cb_arg);
+
+struct artwork_waiter *
+artwork_get_group_async(struct event_base *evbase, int id, int max_w, int max_h, int format, artwork_cb cb, void *cb_arg);
+
+/*
+ * Cancels an async request, e.g. because the client that wanted the artwork
+ * has gone away. Must be called from the request's event loop, and only before
+ * its callback has been made. The callback will then not be made. If no other
+ * request is waiting for the same artwork, the job is dropped, unless an
+ * artwork thread has already started on it.
+ *
+ * @in  waiter   Handle returned by artwork_get_*_async()
+ */
+void
+artwork_async_request_cancel(struct artwork_waiter *waiter);
+
+/*
+ * Cancels the async requests that will make callbacks from evbase. Must be
+ * called when the event loop has stopped, before the event base is freed. The
+ * callbacks are made from the calling thread, with format -1 unless the result
+ * was ready.
+ *
+ * @in  evbase   Event base of the requests
+ */
+void
+artwork_async_cancel(struct event_base *evbase);
 
 /*
  * Checks if the file is an artwork file (based on user config)
@@ -58,4 +124,17 @@ artwork_file_is_artwork(const char *filename);
 bool
 artwork_extension_is_artwork(const char *path);
 
+/*
+ * Starts the threads that serve the async requests, and the artwork thread,
+ * which pre-renders the sizes configured with artwork_prerender_sizes after
+ * library changes (only if sizes are configured).
+ *
+ * @return       0 on success, -1 on error
+ */
+int
+artwork_init(void);
+
+void
+artwork_deinit(void);
+
 #endif /* !__ARTWORK_H__ */
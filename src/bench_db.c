@@ -0,0 +1,701 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Query benchmark, run with "make bench-db". Creates a synthetic library in a
+ * temporary directory and prints the latency of the db queries, DAAP replies
+ * and JSON api replies that clients use the most.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <pwd.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "conffile.h"
+#include "logger.h"
+#include "misc.h"
+#include "db.h"
+#include "httpd_daap.h"
+#include "httpd_jsonapi.h"
+
+
+#define BENCH_GENRES    20
+#define BENCH_COMPOSERS 100
+#define BENCH_PL_ITEMS  100
+
+enum bench_kind {
+  BENCH_QUERY,
+  BENCH_DAAP,
+  BENCH_JSON,
+};
+
+struct bench_case {
+  enum bench_kind kind;
+  const char *name;
+
+  // BENCH_QUERY
+  enum query_type type;
+  enum index_type idx_type;
+  enum sort_type sort;
+  const char *filter;
+
+  // BENCH_DAAP and BENCH_JSON, may contain one %d or %" PRIi64 " for the ids below
+  const char *uri;
+};
+
+struct bench_ids {
+  int plain_plid;
+  int smart_plid;
+  int file_id;
+  int64_t album_persistentid;
+  int64_t artist_persistentid;
+};
+
+// Referenced by modules that run in the main thread of the server
+struct event_base *evbase_main;
+
+static int bench_tracks = 20000;
+static int bench_albums;
+static int bench_artists;
+static int bench_playlists = 50;
+static int bench_smartpls = 10;
+static int bench_iterations = 20;
+
+static const char *smartpl_queries[] =
+  {
+    "f.genre = 'Genre 3'",
+    "f.year >= 1990 AND f.year < 2000",
+    "f.rating >= 60",
+    "f.media_kind = 1 AND f.play_count > 5",
+  };
+
+static const struct bench_case bench_cases[] =
+  {
+    { BENCH_QUERY, "items",                       Q_ITEMS, I_NONE, S_NONE },
+    { BENCH_QUERY, "items sorted by name",        Q_ITEMS, I_NONE, S_NAME },
+    { BENCH_QUERY, "items sorted by album",       Q_ITEMS, I_NONE, S_ALBUM },
+    { BENCH_QUERY, "items by genre",              Q_ITEMS, I_NONE, S_ARTIST, "f.genre = 'Genre 1'" },
+    { BENCH_QUERY, "items page at offset 5000",   Q_ITEMS, I_SUB, S_NAME },
+    { BENCH_QUERY, "playlists",                   Q_PL, I_NONE, S_PLAYLIST },
+    { BENCH_QUERY, "playlists with item",         Q_FIND_PL, I_NONE, S_NONE },
+    { BENCH_QUERY, "plain playlist items",        Q_PLITEMS, I_NONE, S_NONE },
+    { BENCH_QUERY, "smart playlist items",        Q_PLITEMS, I_NONE, S_NONE },
+    { BENCH_QUERY, "group albums",                Q_GROUP_ALBUMS, I_NONE, S_ALBUM },
+    { BENCH_QUERY, "group artists",               Q_GROUP_ARTISTS, I_NONE, S_ARTIST },
+    { BENCH_QUERY, "group artists keyset page",   Q_GROUP_ARTISTS, I_KEYSET, S_ARTIST },
+    { BENCH_QUERY, "group items",                 Q_GROUP_ITEMS, I_NONE, S_NONE },
+    { BENCH_QUERY, "group dirs",                  Q_GROUP_DIRS, I_NONE, S_NONE },
+    { BENCH_QUERY, "count items",                 Q_COUNT_ITEMS, I_NONE, S_NONE },
+    { BENCH_QUERY, "count items by genre",        Q_COUNT_ITEMS, I_NONE, S_NONE, "f.genre = 'Genre 1'" },
+    { BENCH_QUERY, "browse artists",              Q_BROWSE_ARTISTS, I_NONE, S_ARTIST },
+    { BENCH_QUERY, "browse albums",               Q_BROWSE_ALBUMS, I_NONE, S_ALBUM },
+    { BENCH_QUERY, "browse genres",               Q_BROWSE_GENRES, I_NONE, S_GENRE },
+    { BENCH_QUERY, "browse composers",            Q_BROWSE_COMPOSERS, I_NONE, S_COMPOSER },
+    { BENCH_QUERY, "browse years",                Q_BROWSE_YEARS, I_NONE, S_YEAR },
+    { BENCH_QUERY, "browse discs",                Q_BROWSE_DISCS, I_NONE, S_DISC },
+    { BENCH_QUERY, "browse tracks",               Q_BROWSE_TRACKS, I_NONE, S_TRACK },
+    { BENCH_QUERY, "browse vpath",                Q_BROWSE_VPATH, I_NONE, S_VPATH },
+    { BENCH_QUERY, "browse path",                 Q_BROWSE_PATH, I_NONE, S_NONE },
+
+    { BENCH_DAAP, "daap items",                   .uri = "/databases/1/items?type=music&meta=dmap.itemkind,dmap.itemid,dmap.itemname,daap.songalbum,daap.songartist,daap.songgenre,daap.songtime,daap.songtracknumber" },
+    { BENCH_DAAP, "daap containers",              .uri = "/databases/1/containers?meta=dmap.itemid,dmap.itemname,dmap.persistentid,dmap.itemcount,com.apple.itunes.smart-playlist" },
+    { BENCH_DAAP, "daap plain playlist items",    .uri = "/databases/1/containers/%d/items?type=music&meta=dmap.itemkind,dmap.itemid,dmap.containeritemid,dmap.itemname" },
+    { BENCH_DAAP, "daap smart playlist items",    .uri = "/databases/1/containers/%d/items?type=music&meta=dmap.itemkind,dmap.itemid,dmap.containeritemid,dmap.itemname" },
+    { BENCH_DAAP, "daap group albums",            .uri = "/databases/1/groups?type=music&group-type=albums&meta=dmap.itemname,dmap.itemid,dmap.persistentid,daap.songartist,dmap.itemcount&sort=album" },
+    { BENCH_DAAP, "daap group artists",           .uri = "/databases/1/groups?type=music&group-type=artists&meta=dmap.itemname,dmap.itemid,dmap.persistentid,daap.songartist,dmap.itemcount&sort=album" },
+    { BENCH_DAAP, "daap browse artists",          .uri = "/databases/1/browse/artists" },
+    { BENCH_DAAP, "daap browse genres",           .uri = "/databases/1/browse/genres" },
+
+    { BENCH_JSON, "json artists",                 .uri = "/api/library/artists" },
+    { BENCH_JSON, "json artists page",            .uri = "/api/library/artists?offset=100&limit=50" },
+    { BENCH_JSON, "json artist",                  .uri = "/api/library/artists/%" PRIi64 },
+    { BENCH_JSON, "json artist albums",           .uri = "/api/library/artists/%" PRIi64 "/albums" },
+    { BENCH_JSON, "json albums",                  .uri = "/api/library/albums" },
+    { BENCH_JSON, "json album",                   .uri = "/api/library/albums/%" PRIi64 },
+    { BENCH_JSON, "json album tracks",            .uri = "/api/library/albums/%" PRIi64 "/tracks" },
+    { BENCH_JSON, "json playlists",               .uri = "/api/library/playlists" },
+    { BENCH_JSON, "json plain playlist tracks",   .uri = "/api/library/playlists/%d/tracks" },
+    { BENCH_JSON, "json smart playlist tracks",   .uri = "/api/library/playlists/%d/tracks" },
+    { BENCH_JSON, "json track",                   .uri = "/api/library/tracks/%d" },
+    { BENCH_JSON, "json genres",                  .uri = "/api/library/genres" },
+    { BENCH_JSON, "json count",                   .uri = "/api/library/count?expression=genre+is+%22Genre+1%22" },
+    { BENCH_JSON, "json search",                  .uri = "/api/search?type=tracks,artists,albums&query=Title+12" },
+    { BENCH_JSON, "json search by expression",    .uri = "/api/search?type=tracks&expression=artist+is+%22Artist+12%22" },
+  };
+
+
+static double
+time_us(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000.0 + (end->tv_nsec - start->tv_nsec) / 1000.0;
+}
+
+static int
+double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(double *sorted, int n, int p)
+{
+  int i;
+
+  i = (n * p + 99) / 100 - 1;
+  if (i < 0)
+    i = 0;
+
+  return sorted[i];
+}
+
+
+/* ------------------------------ LIBRARY SETUP ----------------------------- */
+
+static int
+library_populate(struct bench_ids *ids)
+{
+  struct media_file_info mfi;
+  struct playlist_info pli;
+  char path[256];
+  char buf[64];
+  int album;
+  int artist;
+  enum pl_type type;
+  int plid;
+  int i;
+  int j;
+  int ret;
+
+  srand(1);
+
+  db_transaction_begin_write();
+
+  for (i = 0; i < bench_tracks; i++)
+    {
+      album = i % bench_albums;
+      artist = album % bench_artists;
+
+      memset(&mfi, 0, sizeof(struct media_file_info));
+
+      snprintf(path, sizeof(path), "/bench/music/Artist %d/Album %d/%02d Title %d.mp3", artist, album, i / bench_albums + 1, i);
+      mfi.path = strdup(path);
+      snprintf(path, sizeof(path), "/file:/bench/music/Artist %d/Album %d/%02d Title %d.mp3", artist, album, i / bench_albums + 1, i);
+      mfi.virtual_path = strdup(path);
+      mfi.fname = strdup(strrchr(mfi.path, '/') + 1);
+      mfi.directory_id = DIR_FILE;
+
+      snprintf(buf, sizeof(buf), "Title %d", i);
+      mfi.title = strdup(buf);
+      snprintf(buf, sizeof(buf), "Artist %d", artist);
+      mfi.artist = strdup(buf);
+      mfi.album_artist = strdup(buf);
+      snprintf(buf, sizeof(buf), "Album %d", album);
+      mfi.album = strdup(buf);
+      snprintf(buf, sizeof(buf), "Genre %d", album % BENCH_GENRES);
+      mfi.genre = strdup(buf);
+      snprintf(buf, sizeof(buf), "Composer %d", i % BENCH_COMPOSERS);
+      mfi.composer = strdup(buf);
+      mfi.type = strdup("mp3");
+      mfi.codectype = strdup("mpeg");
+
+      mfi.year = 1960 + album % 60;
+      mfi.track = i / bench_albums + 1;
+      mfi.disc = 1;
+      mfi.song_length = 120000 + rand() % 300000;
+      mfi.file_size = mfi.song_length * 40;
+      mfi.bitrate = 320;
+      mfi.samplerate = 44100;
+      mfi.channels = 2;
+      mfi.rating = (rand() % 6) * 20;
+      mfi.play_count = rand() % 10;
+      mfi.time_added = time(NULL) - rand() % (365 * 24 * 3600);
+      mfi.time_modified = mfi.time_added;
+      mfi.data_kind = DATA_KIND_FILE;
+      mfi.media_kind = MEDIA_KIND_MUSIC;
+      mfi.item_kind = 2; // music
+      mfi.scan_kind = SCAN_KIND_FILES;
+
+      ret = db_file_add(&mfi);
+      free_mfi(&mfi, 1);
+      if (ret < 0)
+	goto error;
+    }
+
+  for (i = 0; i < bench_playlists + bench_smartpls; i++)
+    {
+      memset(&pli, 0, sizeof(struct playlist_info));
+
+      if (i < bench_playlists)
+	{
+	  snprintf(buf, sizeof(buf), "Playlist %d", i);
+	  pli.type = PL_PLAIN;
+	}
+      else
+	{
+	  snprintf(buf, sizeof(buf), "Smart playlist %d", i);
+	  pli.type = PL_SMART;
+	  pli.query = strdup(smartpl_queries[i % ARRAY_SIZE(smartpl_queries)]);
+	}
+
+      pli.title = strdup(buf);
+      snprintf(path, sizeof(path), "/bench/playlists/%s.m3u", buf);
+      pli.path = strdup(path);
+      snprintf(path, sizeof(path), "/file:/bench/playlists/%s.m3u", buf);
+      pli.virtual_path = strdup(path);
+      pli.directory_id = DIR_FILE;
+      pli.scan_kind = SCAN_KIND_FILES;
+
+      type = pli.type;
+      plid = db_pl_add(&pli);
+      free_pli(&pli, 1);
+      if (plid < 0)
+	goto error;
+
+      if (type == PL_SMART)
+	{
+	  if (!ids->smart_plid)
+	    ids->smart_plid = plid;
+	  continue;
+	}
+
+      if (!ids->plain_plid)
+	ids->plain_plid = plid;
+
+      for (j = 0; j < BENCH_PL_ITEMS; j++)
+	{
+	  ret = db_pl_add_item_byid(plid, 1 + rand() % bench_tracks);
+	  if (ret < 0)
+	    goto error;
+	}
+    }
+
+  db_transaction_end();
+
+  ids->file_id = 1 + bench_tracks / 2;
+  ids->album_persistentid = two_str_hash("Artist 1", "Album 1");
+  ids->artist_persistentid = two_str_hash("Artist 1", NULL);
+
+  // Updates stats and the like, like after a library scan
+  db_hook_post_scan();
+
+  return 0;
+
+ error:
+  db_transaction_end();
+  return -1;
+}
+
+static void
+db_files_remove(const char *db_path)
+{
+  char path[PATH_MAX];
+
+  if (!db_path[0])
+    return;
+
+  unlink(db_path);
+  snprintf(path, sizeof(path), "%s-wal", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-shm", db_path);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s-journal", db_path);
+  unlink(path);
+}
+
+static int
+config_write(const char *dir, char *conf_path, size_t conf_path_len)
+{
+  struct passwd *pw;
+  FILE *f;
+
+  pw = getpwuid(getuid());
+  if (!pw)
+    {
+      fprintf(stderr, "Could not look up current user: %s\n", strerror(errno));
+      return -1;
+    }
+
+  snprintf(conf_path, conf_path_len, "%s/bench.conf", dir);
+
+  f = fopen(conf_path, "w");
+  if (!f)
+    {
+      fprintf(stderr, "Could not create '%s': %s\n", conf_path, strerror(errno));
+      return -1;
+    }
+
+  fprintf(f,
+	  "general {\n"
+	  "\tuid = \"%s\"\n"
+	  "\tdb_path = \"%s/songs3.db\"\n"
+	  "}\n"
+	  "library {\n"
+	  "\tdirectories = { \"%s\" }\n"
+	  "\tfilescan_disable = true\n"
+	  "}\n",
+	  pw->pw_name, dir, dir);
+
+  fclose(f);
+  return 0;
+}
+
+
+/* -------------------------------- BENCHMARK ------------------------------- */
+
+static int
+query_run(const struct bench_case *bc, struct bench_ids *ids)
+{
+  struct query_params qp;
+  struct db_media_file_info dbmfi;
+  struct db_playlist_info dbpli;
+  struct db_group_info dbgri;
+  struct db_browse_info dbbi;
+  struct filecount_info fci;
+  char *str;
+  char filter[64];
+  int nrows;
+  int ret;
+
+  memset(&qp, 0, sizeof(struct query_params));
+
+  qp.type = bc->type;
+  qp.idx_type = bc->idx_type;
+  qp.sort = bc->sort;
+
+  if (bc->filter)
+    qp.filter = strdup(bc->filter);
+
+  if (qp.idx_type == I_SUB)
+    {
+      qp.offset = 5000;
+      qp.limit = 100;
+    }
+  else if (qp.idx_type == I_KEYSET)
+    qp.limit = 100;
+
+  if (qp.type == Q_FIND_PL)
+    {
+      snprintf(filter, sizeof(filter), "filepath = (SELECT path FROM files WHERE id = %d)", ids->file_id);
+      qp.filter = strdup(filter);
+    }
+  else if (qp.type == Q_PLITEMS)
+    qp.id = (strstr(bc->name, "smart")) ? ids->smart_plid : ids->plain_plid;
+  else if (qp.type == Q_GROUP_ITEMS || qp.type == Q_GROUP_DIRS)
+    qp.persistentid = ids->album_persistentid;
+
+  ret = db_query_start(&qp);
+  if (ret < 0)
+    {
+      free_query_params(&qp, 1);
+      return -1;
+    }
+
+  nrows = 0;
+  do
+    {
+      if (qp.type == Q_ITEMS || qp.type == Q_PLITEMS || qp.type == Q_GROUP_ITEMS)
+	ret = db_query_fetch_file(&dbmfi, &qp);
+      else if (qp.type == Q_PL || qp.type == Q_FIND_PL)
+	ret = db_query_fetch_pl(&dbpli, &qp);
+      else if (qp.type == Q_GROUP_ALBUMS || qp.type == Q_GROUP_ARTISTS)
+	ret = db_query_fetch_group(&dbgri, &qp);
+      else if (qp.type == Q_GROUP_DIRS)
+	ret = (db_query_fetch_string(&str, &qp) == 0 && !str) ? 1 : 0;
+      else if (qp.type == Q_COUNT_ITEMS)
+	ret = (nrows == 0) ? db_query_fetch_count(&fci, &qp) : 1;
+      else
+	ret = db_query_fetch_browse(&dbbi, &qp);
+
+      if (ret == 0)
+	nrows++;
+    }
+  while (ret == 0);
+
+  db_query_end(&qp);
+  free_query_params(&qp, 1);
+
+  return (ret < 0) ? -1 : nrows;
+}
+
+static int
+reply_run(const struct bench_case *bc, struct bench_ids *ids)
+{
+  struct evbuffer *evbuf;
+  char uri[512];
+  int status_code;
+  int len;
+
+  if (strstr(bc->uri, "%" PRIi64))
+    snprintf(uri, sizeof(uri), bc->uri, (strstr(bc->uri, "artists")) ? ids->artist_persistentid : ids->album_persistentid);
+  else if (strstr(bc->uri, "/tracks/"))
+    snprintf(uri, sizeof(uri), bc->uri, ids->file_id);
+  else if (strstr(bc->uri, "%d"))
+    snprintf(uri, sizeof(uri), bc->uri, (strstr(bc->name, "smart")) ? ids->smart_plid : ids->plain_plid);
+  else
+    snprintf(uri, sizeof(uri), "%s", bc->uri);
+
+  if (bc->kind == BENCH_DAAP)
+    {
+      evbuf = daap_reply_build(uri, "iTunes/12.0", 0);
+      status_code = evbuf ? 200 : 500;
+    }
+  else
+    evbuf = jsonapi_reply_build(uri, &status_code);
+
+  if (!evbuf)
+    return -1;
+
+  len = evbuffer_get_length(evbuf);
+  evbuffer_free(evbuf);
+
+  return (status_code == 200) ? len : -1;
+}
+
+static void
+bench_run(const struct bench_case *bc, struct bench_ids *ids)
+{
+  struct timespec start;
+  struct timespec end;
+  double *samples;
+  int result;
+  int i;
+
+  CHECK_NULL(L_MAIN, samples = calloc(bench_iterations, sizeof(double)));
+
+  // First run warms up the page cache and the statement cache
+  result = (bc->kind == BENCH_QUERY) ? query_run(bc, ids) : reply_run(bc, ids);
+  if (result < 0)
+    {
+      printf("%-30s %12s\n", bc->name, "FAILED");
+      free(samples);
+      return;
+    }
+
+  for (i = 0; i < bench_iterations; i++)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      if (bc->kind == BENCH_QUERY)
+	query_run(bc, ids);
+      else
+	reply_run(bc, ids);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      samples[i] = time_us(&start, &end);
+    }
+
+  qsort(samples, bench_iterations, sizeof(double), double_cmp);
+
+  printf("%-30s %12d %10.2f %10.2f %10.2f\n", bc->name, result,
+	 percentile(samples, bench_iterations, 50) / 1000.0,
+	 percentile(samples, bench_iterations, 99) / 1000.0,
+	 samples[bench_iterations - 1] / 1000.0);
+
+  free(samples);
+}
+
+static void
+usage(const char *program)
+{
+  printf("Usage: %s [options]\n\n", program);
+  printf("Options:\n");
+  printf("  -t <count>    Number of tracks (default %d)\n", bench_tracks);
+  printf("  -a <count>    Number of albums (default tracks / 10)\n");
+  printf("  -r <count>    Number of artists (default albums / 4)\n");
+  printf("  -p <count>    Number of plain playlists (default %d)\n", bench_playlists);
+  printf("  -s <count>    Number of smart playlists (default %d)\n", bench_smartpls);
+  printf("  -n <count>    Iterations per benchmark (default %d)\n", bench_iterations);
+  printf("  -m <filter>   Only run benchmarks whose name contains <filter>\n");
+  printf("  -d <dir>      Directory for the db (default is a new temporary directory)\n");
+  printf("  -v            Log debug messages\n");
+  printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bench_ids ids = { 0 };
+  struct timespec start;
+  struct timespec end;
+  char tmpl[] = "/tmp/owntone-bench-XXXXXX";
+  char conf_path[PATH_MAX] = "";
+  char db_path[PATH_MAX] = "";
+  bool is_tmpdir = false;
+  const char *match = NULL;
+  const char *dir = NULL;
+  int severity = E_LOG;
+  int option;
+  int i;
+  int ret;
+
+  while ((option = getopt(argc, argv, "t:a:r:p:s:n:m:d:vh")) != -1)
+    {
+      switch (option)
+	{
+	  case 't':
+	    bench_tracks = atoi(optarg);
+	    break;
+	  case 'a':
+	    bench_albums = atoi(optarg);
+	    break;
+	  case 'r':
+	    bench_artists = atoi(optarg);
+	    break;
+	  case 'p':
+	    bench_playlists = atoi(optarg);
+	    break;
+	  case 's':
+	    bench_smartpls = atoi(optarg);
+	    break;
+	  case 'n':
+	    bench_iterations = atoi(optarg);
+	    break;
+	  case 'm':
+	    match = optarg;
+	    break;
+	  case 'd':
+	    dir = optarg;
+	    break;
+	  case 'v':
+	    severity = E_DBG;
+	    break;
+	  case 'h':
+	  default:
+	    usage(argv[0]);
+	    return (option == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+
+  if (bench_albums <= 0)
+    bench_albums = (bench_tracks >= 10) ? bench_tracks / 10 : 1;
+  if (bench_artists <= 0)
+    bench_artists = (bench_albums >= 4) ? bench_albums / 4 : 1;
+  if (bench_tracks <= 0 || bench_iterations <= 0 || bench_playlists < 1 || bench_smartpls < 1)
+    {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  if (!dir)
+    {
+      dir = mkdtemp(tmpl);
+      if (!dir)
+	{
+	  fprintf(stderr, "Could not create temporary directory: %s\n", strerror(errno));
+	  return EXIT_FAILURE;
+	}
+
+      is_tmpdir = true;
+    }
+
+  ret = config_write(dir, conf_path, sizeof(conf_path));
+  if (ret < 0)
+    goto config_fail;
+
+  ret = logger_init(NULL, NULL, severity);
+  if (ret < 0)
+    goto logger_fail;
+
+  ret = conffile_load(conf_path);
+  if (ret < 0)
+    goto conffile_fail;
+
+  // Always start with a new library
+  snprintf(db_path, sizeof(db_path), "%s/songs3.db", dir);
+  db_files_remove(db_path);
+
+  ret = db_init();
+  if (ret < 0)
+    goto db_fail;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    goto perthread_fail;
+
+  ret = daap_init();
+  if (ret < 0)
+    goto daap_fail;
+
+  ret = jsonapi_init();
+  if (ret < 0)
+    goto jsonapi_fail;
+
+  printf("Creating library with %d tracks, %d albums, %d artists, %d playlists and %d smart playlists in %s\n",
+	 bench_tracks, bench_albums, bench_artists, bench_playlists, bench_smartpls, dir);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = library_populate(&ids);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (ret < 0)
+    {
+      fprintf(stderr, "Could not create library\n");
+      goto populate_fail;
+    }
+
+  printf("Library created in %.2f s\n\n", time_us(&start, &end) / 1000000.0);
+
+  printf("%-30s %12s %10s %10s %10s\n", "benchmark", "rows/bytes", "p50 ms", "p99 ms", "max ms");
+  for (i = 0; i < ARRAY_SIZE(bench_cases); i++)
+    {
+      if (match && !strstr(bench_cases[i].name, match))
+	continue;
+
+      bench_run(&bench_cases[i], &ids);
+    }
+
+  ret = 0;
+
+ populate_fail:
+  jsonapi_deinit();
+ jsonapi_fail:
+  daap_deinit();
+ daap_fail:
+  db_perthread_deinit();
+ perthread_fail:
+  db_deinit();
+ db_fail:
+  conffile_unload();
+ conffile_fail:
+  logger_deinit();
+ logger_fail:
+  db_files_remove(db_path);
+  unlink(conf_path);
+ config_fail:
+  if (is_tmpdir)
+    rmdir(dir);
+
+  return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -29,10 +29,15 @@
 #include <errno.h>
 #include <time.h>
 #include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <pthread.h>
 
 #include <event2/event.h>
 #include <sqlite3.h>
+#include <gcrypt.h>
 
 #include "conffile.h"
 #include "logger.h"
@@ -42,9 +47,25 @@
 #include "cache.h"
 #include "listener.h"
 #include "commands.h"
+#include "misc.h"
 
 
-#define CACHE_VERSION 3
+#define CACHE_VERSION 6
+
+// Number of threads that rebuild DAAP replies after a library change
+#define CACHE_DAAP_REBUILD_THREADS 2
+
+// Number of slots in the in-memory table of artwork sources
+#define CACHE_ARTWORK_SOURCE_SLOTS 4096
+
+// Artwork access times are only recorded with this resolution (in seconds),
+// and written in batches of CACHE_ARTWORK_ACCESS_BATCH entries
+#define CACHE_ARTWORK_ACCESS_RESOLUTION 3600
+#define CACHE_ARTWORK_ACCESS_BATCH 256
+
+// When the artwork images exceed the configured size, the least recently used
+// are evicted until they are below this percentage of it
+#define CACHE_ARTWORK_EVICT_TARGET 90
 
 
 struct cache_arg
@@ -64,6 +85,9 @@ struct cache_arg
   time_t mtime;
   int cached;
   int del;
+  char *hash;  // artwork content hash (CACHE_ARTWORK_HASH_LEN), may be NULL
+  char *source; // name of artwork source (CACHE_ARTWORK_SOURCE_LEN)
+  int nitems;
 
   struct evbuffer *evbuf;
 };
@@ -83,6 +107,10 @@ static int g_initialized;
 static sqlite3 *g_db_hdl;
 static char *g_db_path;
 
+// Directory with the artwork images, named by their hash. The artwork table
+// only has the metadata.
+static char g_artwork_dir[PATH_MAX];
+
 // Global artwork stash
 struct stash
 {
@@ -98,6 +126,109 @@ static int g_suspended;
 // that will have their reply cached
 static int g_cfg_threshold;
 
+// Memory tier in front of the replies table, so that hot replies can be served
+// without a round trip to the cache thread. Entries are kept in LRU order with
+// the most recently used first. Only the cache thread adds entries, any thread
+// may read them.
+struct cache_daap_mem_entry
+{
+  char *query;
+  uint8_t *data;
+  size_t len;
+
+  struct cache_daap_mem_entry *prev;
+  struct cache_daap_mem_entry *next;
+};
+
+struct cache_daap_mem
+{
+  pthread_mutex_t lck;
+
+  struct cache_daap_mem_entry *head;
+  struct cache_daap_mem_entry *tail;
+  int count;
+  size_t size;
+  size_t max_size;
+
+  uint64_t mem_hits;
+  uint64_t db_hits;
+  uint64_t misses;
+};
+
+static struct cache_daap_mem g_daap_mem = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+// A query whose reply must be rebuilt. It is taken by one of the rebuild
+// threads and then handed back to the cache thread with the result.
+struct cache_daap_rebuild_job
+{
+  int id;            // id in the queries table
+  char *query;
+  char *ua;
+  int is_remote;
+
+  bool built;        // false if the rebuild thread couldn't try
+  struct evbuffer *gzbuf; // NULL if the reply couldn't be built
+};
+
+struct cache_daap_rebuild
+{
+  pthread_mutex_t lck;
+
+  pthread_t tid[CACHE_DAAP_REBUILD_THREADS];
+  int nthreads;
+  bool abort;
+
+  struct cache_daap_rebuild_job **jobs;
+  int njobs;
+  int next;          // Next job for a rebuild thread to take
+  int ndone;         // Only accessed by the cache thread
+};
+
+static struct cache_daap_rebuild g_daap_rebuild = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+// Which source provided the artwork for a group the last time it was searched
+// (an empty name if none did), and the state of the group's files at the
+// time. The artwork_sources table has all of them, the in-memory table the
+// recently used. The in-memory table is direct-mapped by persistentid, so a
+// slot just gets overwritten on a collision. An empty slot has persistentid 0.
+struct cache_artwork_source_entry
+{
+  int type;
+  int64_t persistentid;
+  time_t mtime;
+  int nitems;
+  char source[CACHE_ARTWORK_SOURCE_LEN];
+};
+
+struct cache_artwork_sources
+{
+  pthread_mutex_t lck;
+
+  struct cache_artwork_source_entry slots[CACHE_ARTWORK_SOURCE_SLOTS];
+};
+
+static struct cache_artwork_sources g_artwork_sources = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+// Size of the artwork images in the store, and the configured max size (0 is
+// no limit). Artwork entries that were used since their last_access was
+// updated are collected in accessed, so the update can be made in batches
+// instead of with a write per cache hit. Only accessed by the cache thread.
+struct cache_artwork_usage
+{
+  int64_t size;
+  int64_t max_size;
+
+  int64_t accessed[CACHE_ARTWORK_ACCESS_BATCH];
+  int naccessed;
+};
+
+static struct cache_artwork_usage g_artwork_usage;
+
+// Listener events since the last update, and the table change counters at the
+// time of the last update. Only accessed by the cache thread.
+static short g_daap_update_events;
+static struct db_table_changes g_daap_built;
+
 /* --------------------------------- HELPERS ------------------------------- */
 
 /* The purpose of this function is to remove transient tags from a request 
@@ -120,6 +251,166 @@ remove_tag(char *in, const char *tag)
     *(s - 1) = '\0';
 }
 
+static void
+cache_daap_query_normalize(char *query)
+{
+  remove_tag(query, "session-id");
+  remove_tag(query, "revision-number");
+}
+
+
+/* ------------------------- DAAP reply memory tier ------------------------ */
+/*                               Thread: any                               */
+
+// Must be called with the lock held
+static void
+cache_daap_mem_unlink(struct cache_daap_mem_entry *entry)
+{
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    g_daap_mem.head = entry->next;
+
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    g_daap_mem.tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+// Must be called with the lock held
+static void
+cache_daap_mem_push(struct cache_daap_mem_entry *entry)
+{
+  entry->prev = NULL;
+  entry->next = g_daap_mem.head;
+
+  if (g_daap_mem.head)
+    g_daap_mem.head->prev = entry;
+  else
+    g_daap_mem.tail = entry;
+
+  g_daap_mem.head = entry;
+}
+
+// Must be called with the lock held
+static void
+cache_daap_mem_remove(struct cache_daap_mem_entry *entry)
+{
+  cache_daap_mem_unlink(entry);
+
+  g_daap_mem.count--;
+  g_daap_mem.size -= entry->len;
+
+  free(entry->query);
+  free(entry->data);
+  free(entry);
+}
+
+// Must be called with the lock held
+static struct cache_daap_mem_entry *
+cache_daap_mem_find(const char *query)
+{
+  struct cache_daap_mem_entry *entry;
+
+  for (entry = g_daap_mem.head; entry; entry = entry->next)
+    {
+      if (strcmp(entry->query, query) == 0)
+	return entry;
+    }
+
+  return NULL;
+}
+
+// Copies the reply for the (normalized) query to evbuf, returns -1 if not found
+static int
+cache_daap_mem_get(struct evbuffer *evbuf, const char *query)
+{
+  struct cache_daap_mem_entry *entry;
+  int ret;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+
+  entry = cache_daap_mem_find(query);
+  if (!entry)
+    {
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+      return -1;
+    }
+
+  ret = evbuffer_add(evbuf, entry->data, entry->len);
+  if (ret == 0)
+    {
+      cache_daap_mem_unlink(entry);
+      cache_daap_mem_push(entry);
+      g_daap_mem.mem_hits++;
+    }
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+
+  return ret;
+}
+
+// Adds or replaces the reply for the query, evicting the least recently used
+// replies if we are over the size limit
+static void
+cache_daap_mem_add(const char *query, const uint8_t *data, size_t len)
+{
+  struct cache_daap_mem_entry *entry;
+  struct cache_daap_mem_entry *old;
+
+  if (len == 0 || len > g_daap_mem.max_size)
+    return;
+
+  CHECK_NULL(L_CACHE, entry = calloc(1, sizeof(struct cache_daap_mem_entry)));
+  CHECK_NULL(L_CACHE, entry->query = strdup(query));
+  CHECK_NULL(L_CACHE, entry->data = malloc(len));
+  memcpy(entry->data, data, len);
+  entry->len = len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+
+  old = cache_daap_mem_find(query);
+  if (old)
+    cache_daap_mem_remove(old);
+
+  while (g_daap_mem.tail && g_daap_mem.size + len > g_daap_mem.max_size)
+    cache_daap_mem_remove(g_daap_mem.tail);
+
+  cache_daap_mem_push(entry);
+  g_daap_mem.count++;
+  g_daap_mem.size += len;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+}
+
+static void
+cache_daap_mem_delete(const char *query)
+{
+  struct cache_daap_mem_entry *entry;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+
+  entry = cache_daap_mem_find(query);
+  if (entry)
+    cache_daap_mem_remove(entry);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+}
+
+static void
+cache_daap_mem_clear(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+
+  while (g_daap_mem.head)
+    cache_daap_mem_remove(g_daap_mem.head);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+}
+
 
 /* --------------------------------- MAIN --------------------------------- */
 /*                              Thread: cache                              */
@@ -154,12 +445,26 @@ cache_create_tables(void)
   "   format              INTEGER NOT NULL,"		\
   "   filepath            VARCHAR(4096) NOT NULL,"	\
   "   db_timestamp        INTEGER DEFAULT 0,"		\
-  "   data                BLOB"				\
+  "   hash                VARCHAR(64),"			\
+  "   size                INTEGER DEFAULT 0,"		\
+  "   last_access         INTEGER DEFAULT 0"		\
   ");"
 #define I_ARTWORK_ID				\
   "CREATE INDEX IF NOT EXISTS idx_persistentidwh ON artwork(type, persistentid, max_w, max_h);"
 #define I_ARTWORK_PATH				\
   "CREATE INDEX IF NOT EXISTS idx_pathtime ON artwork(filepath, db_timestamp);"
+#define I_ARTWORK_HASH				\
+  "CREATE INDEX IF NOT EXISTS idx_hash ON artwork(hash);"
+#define T_ARTWORK_SOURCES				\
+  "CREATE TABLE IF NOT EXISTS artwork_sources ("	\
+  "   type                INTEGER NOT NULL DEFAULT 0,"  \
+  "   persistentid        INTEGER NOT NULL,"		\
+  "   source              VARCHAR(32) NOT NULL,"	\
+  "   mtime               INTEGER DEFAULT 0,"		\
+  "   items               INTEGER DEFAULT 0,"		\
+  "   db_timestamp        INTEGER DEFAULT 0,"		\
+  "   PRIMARY KEY (type, persistentid)"			\
+  ");"
 #define T_ADMIN_CACHE	\
   "CREATE TABLE IF NOT EXISTS admin_cache("	\
   " key VARCHAR(32) PRIMARY KEY NOT NULL,"	\
@@ -232,6 +537,26 @@ cache_create_tables(void)
     {
       DPRINTF(E_FATAL, L_CACHE, "Error creating index on artwork(filepath, db_timestamp): %s\n", errmsg);
 
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+  ret = sqlite3_exec(g_db_hdl, I_ARTWORK_HASH, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error creating index on artwork(hash): %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+
+  // Create artwork sources table
+  ret = sqlite3_exec(g_db_hdl, T_ARTWORK_SOURCES, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error creating cache table 'artwork_sources': %s\n", errmsg);
+
       sqlite3_free(errmsg);
       sqlite3_close(g_db_hdl);
       return -1;
@@ -268,7 +593,9 @@ cache_create_tables(void)
 #undef I_QUERY
 #undef T_ARTWORK
 #undef I_ARTWORK_ID
+#undef I_ARTWORK_HASH
 #undef I_ARTWORK_PATH
+#undef T_ARTWORK_SOURCES
 #undef T_ADMIN_CACHE
 #undef Q_CACHE_VERSION
 }
@@ -282,6 +609,8 @@ cache_drop_tables(void)
 #define D_ARTWORK	"DROP TABLE IF EXISTS artwork;"
 #define D_ARTWORK_ID	"DROP INDEX IF EXISTS idx_persistentidwh;"
 #define D_ARTWORK_PATH	"DROP INDEX IF EXISTS idx_pathtime;"
+#define D_ARTWORK_HASH	"DROP INDEX IF EXISTS idx_hash;"
+#define D_ARTWORK_SOURCES	"DROP TABLE IF EXISTS artwork_sources;"
 #define D_ADMIN_CACHE	"DROP TABLE IF EXISTS admin_cache;"
 #define Q_VACUUM	"VACUUM;"
 
@@ -348,6 +677,26 @@ cache_drop_tables(void)
     {
       DPRINTF(E_FATAL, L_CACHE, "Error dropping artwork path index: %s\n", errmsg);
 
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+  ret = sqlite3_exec(g_db_hdl, D_ARTWORK_HASH, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error dropping artwork hash index: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      sqlite3_close(g_db_hdl);
+      return -1;
+    }
+
+  // Drop artwork sources table
+  ret = sqlite3_exec(g_db_hdl, D_ARTWORK_SOURCES, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_CACHE, "Error dropping artwork sources table: %s\n", errmsg);
+
       sqlite3_free(errmsg);
       sqlite3_close(g_db_hdl);
       return -1;
@@ -384,6 +733,8 @@ cache_drop_tables(void)
 #undef D_ARTWORK
 #undef D_ARTWORK_ID
 #undef D_ARTWORK_PATH
+#undef D_ARTWORK_HASH
+#undef D_ARTWORK_SOURCES
 #undef D_ADMIN_CACHE
 #undef Q_VACUUM
 }
@@ -647,8 +998,7 @@ cache_daap_query_add(void *arg, int *retval)
        (strncmp(cmdarg->query, "/databases/1/browse/", strlen("/databases/1/browse/")) != 0) )
     goto error_add;
 
-  remove_tag(cmdarg->query, "session-id");
-  remove_tag(cmdarg->query, "revision-number");
+  cache_daap_query_normalize(cmdarg->query);
 
   query = sqlite3_mprintf(Q_TMPL, cmdarg->ua, cmdarg->is_remote, cmdarg->query, cmdarg->msec, (int64_t)time(NULL));
   if (!query)
@@ -717,8 +1067,6 @@ cache_daap_query_get(void *arg, int *retval)
 
   cmdarg = arg;
   query = cmdarg->query;
-  remove_tag(query, "session-id");
-  remove_tag(query, "revision-number");
 
   // Look in the DB
   ret = sqlite3_prepare_v2(g_db_hdl, Q_TMPL, -1, &stmt, 0);
@@ -755,6 +1103,9 @@ cache_daap_query_get(void *arg, int *retval)
       goto error_get;
     }
 
+  // Next time the reader can get it without asking us
+  cache_daap_mem_add(query, sqlite3_column_blob(stmt, 0), datalen);
+
   ret = sqlite3_finalize(stmt);
   if (ret != SQLITE_OK)
     DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(g_db_hdl));
@@ -799,179 +1150,890 @@ cache_daap_query_delete(const int id)
 #undef Q_TMPL
 }
 
-/* Here we actually update the cache by asking httpd_daap for responses
- * to the queries set for caching
- */
-static void
-cache_daap_update_cb(int fd, short what, void *arg)
+/* Removes the reply for the query from the cache */
+static int
+cache_daap_reply_delete(const char *query)
 {
-  sqlite3_stmt *stmt;
-  struct evbuffer *evbuf;
-  struct evbuffer *gzbuf;
+#define Q_TMPL "DELETE FROM replies WHERE query = '%q';"
+  char *q;
   char *errmsg;
-  char *query;
   int ret;
 
-  if (g_suspended)
-    {
-      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
-      return;
-    }
-
-  DPRINTF(E_LOG, L_CACHE, "Beginning DAAP cache update\n");
+  q = sqlite3_mprintf(Q_TMPL, query);
 
-  ret = sqlite3_exec(g_db_hdl, "DELETE FROM replies;", NULL, NULL, &errmsg);
+  ret = sqlite3_exec(g_db_hdl, q, NULL, NULL, &errmsg);
+  sqlite3_free(q);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_LOG, L_CACHE, "Error clearing reply cache before update: %s\n", errmsg);
-      sqlite3_free(errmsg);
-      return;
-    }
+      DPRINTF(E_LOG, L_CACHE, "Error deleting reply from cache: %s\n", errmsg);
 
-  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT id, user_agent, is_remote, query FROM queries;", -1, &stmt, 0);
-  if (ret != SQLITE_OK)
-    {
-      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
-      return;
+      sqlite3_free(errmsg);
+      return -1;
     }
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-      query = strdup((char *)sqlite3_column_text(stmt, 3));
-
-      evbuf = daap_reply_build(query, (char *)sqlite3_column_text(stmt, 1), sqlite3_column_int(stmt, 2));
-      if (!evbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
-
-	  continue;
-	}
-
-      gzbuf = httpd_gzip_deflate(evbuf);
-      if (!gzbuf)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
-	  cache_daap_query_delete(sqlite3_column_int(stmt, 0));
-	  free(query);
-	  evbuffer_free(evbuf);
-
-	  continue;
-	}
-
-      evbuffer_free(evbuf);
+  return 0;
+#undef Q_TMPL
+}
 
-      cache_daap_reply_add(query, gzbuf);
+/* Returns the reply for the query gzipped, or NULL if it couldn't be built.
+ * Thread: cache or daap rebuild
+ */
+static struct evbuffer *
+cache_daap_reply_build(const char *query, const char *ua, int is_remote)
+{
+  struct evbuffer *evbuf;
+  struct evbuffer *gzbuf;
 
-      free(query);
-      evbuffer_free(gzbuf);
+  evbuf = daap_reply_build(query, ua, is_remote);
+  if (!evbuf)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error building DAAP reply for query: %s\n", query);
+      return NULL;
     }
 
-  if (ret != SQLITE_DONE)
-    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+  gzbuf = httpd_gzip_deflate(evbuf);
+  if (!gzbuf)
+    DPRINTF(E_LOG, L_CACHE, "Error gzipping DAAP reply for query: %s\n", query);
 
-  sqlite3_finalize(stmt);
+  evbuffer_free(evbuf);
 
-  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated\n");
+  return gzbuf;
 }
 
-/* Sets off an update by activating the event. The delay is because we are low
- * priority compared to other listeners of database updates.
+/* Only the replies for containers depend on the playlist tables, the rest only
+ * depend on files (and the groups that are derived from files)
  */
-static enum command_state
-cache_daap_update(void *arg, int *retval)
+static bool
+cache_daap_query_affected(const char *query, bool files_changed, bool playlists_changed)
 {
-  struct timeval delay = { 10, 0 };
+  if (files_changed)
+    return true;
 
-  *retval = event_add(cache_daap_updateev, &delay);
-  return COMMAND_END;
+  return playlists_changed && (strncmp(query, "/databases/1/containers", strlen("/databases/1/containers")) == 0);
 }
 
-/* Callback from filescanner thread */
 static void
-cache_daap_listener_cb(short event_mask)
+cache_daap_rebuild_finish(void)
 {
-  commands_exec_async(cmdbase, cache_daap_update, NULL);
+  pthread_t tid[CACHE_DAAP_REBUILD_THREADS];
+  int nthreads;
+  int i;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_rebuild.lck));
+  nthreads = g_daap_rebuild.nthreads;
+  memcpy(tid, g_daap_rebuild.tid, sizeof(tid));
+  g_daap_rebuild.nthreads = 0;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_rebuild.lck));
+
+  // The threads have no more jobs, so they are about to exit
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tid[i], NULL);
+
+  DPRINTF(E_LOG, L_CACHE, "DAAP cache updated, %d replies rebuilt\n", g_daap_rebuild.njobs);
+
+  free(g_daap_rebuild.jobs);
+  g_daap_rebuild.jobs = NULL;
+  g_daap_rebuild.njobs = 0;
+  g_daap_rebuild.next = 0;
+  g_daap_rebuild.ndone = 0;
 }
 
-
-/*
- * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
- * after the cached timestamp. All cache entries for the given path are deleted, if the file was
- * modified after the cached timestamp.
- *
- * @param cmdarg->pathcopy the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
- * @param cmdarg->mtime modified timestamp of the artwork file
- * @return 0 if successful, -1 if an error occurred
+/* Replaces the old reply with the rebuilt one. Until now clients got the old
+ * one, so there is never a moment where the query isn't cached.
  */
 static enum command_state
-cache_artwork_ping_impl(void *arg, int *retval)
+cache_daap_rebuild_store(void *arg, int *retval)
 {
-#define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
-#define Q_TMPL_DEL "DELETE FROM artwork WHERE filepath = '%q' AND db_timestamp < %" PRIi64 ";"
-
-  struct cache_arg *cmdarg;
-  char *query;
-  char *errmsg;
+  struct cache_daap_rebuild_job *job = arg;
   int ret;
 
-  cmdarg = arg;
-  query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)time(NULL), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
-
-  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
-
-  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-  sqlite3_free(query);
-  if (ret != SQLITE_OK)
+  if (job->gzbuf)
     {
-      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+      cache_daap_reply_delete(job->query);
+      ret = cache_daap_reply_add(job->query, job->gzbuf);
+      if (ret == 0)
+	cache_daap_mem_add(job->query, evbuffer_pullup(job->gzbuf, -1), evbuffer_get_length(job->gzbuf));
+      else
+	cache_daap_mem_delete(job->query);
 
-      goto error_ping;
+      evbuffer_free(job->gzbuf);
     }
-
-  if (cmdarg->del > 0)
+  else if (job->built)
     {
-      query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->pathcopy, (int64_t)cmdarg->mtime);
-
-      DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
-
-      ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
-      sqlite3_free(query);
-      if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
-
-	  goto error_ping;
-	}
+      cache_daap_query_delete(job->id);
+      cache_daap_reply_delete(job->query);
+      cache_daap_mem_delete(job->query);
     }
 
-  free(cmdarg->pathcopy);
+  free(job->query);
+  free(job->ua);
+
+  g_daap_rebuild.ndone++;
+  if (g_daap_rebuild.ndone == g_daap_rebuild.njobs)
+    cache_daap_rebuild_finish();
 
   *retval = 0;
   return COMMAND_END;
+}
 
- error_ping:
-  sqlite3_free(errmsg);
-  free(cmdarg->pathcopy);
-
-  *retval = -1;
+/* Thread: daap rebuild */
+static void *
+cache_daap_rebuild_thread(void *arg)
+{
+  struct cache_daap_rebuild_job *job;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    DPRINTF(E_LOG, L_CACHE, "Error: DB init failed, DAAP cache replies will not be rebuilt\n");
+
+  for (;;)
+    {
+      CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_rebuild.lck));
+      if (!g_daap_rebuild.abort && g_daap_rebuild.next < g_daap_rebuild.njobs)
+	job = g_daap_rebuild.jobs[g_daap_rebuild.next++];
+      else
+	job = NULL;
+      CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_rebuild.lck));
+
+      if (!job)
+	break;
+
+      // If we have no db connection the job is returned unbuilt, so the old
+      // reply is kept
+      if (ret == 0)
+	{
+	  job->gzbuf = cache_daap_reply_build(job->query, job->ua, job->is_remote);
+	  job->built = true;
+	}
+
+      // The cache thread stores the result and frees the job
+      commands_exec_async(cmdbase, cache_daap_rebuild_store, job);
+    }
+
+  if (ret == 0)
+    db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+/* Starts the rebuild threads, returns the number that could be started */
+static int
+cache_daap_rebuild_start(void)
+{
+  char name[16];
+  int nthreads;
+  int ret;
+  int i;
+
+  nthreads = 0;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_rebuild.lck));
+
+  for (i = 0; i < CACHE_DAAP_REBUILD_THREADS && i < g_daap_rebuild.njobs; i++)
+    {
+      ret = pthread_create(&g_daap_rebuild.tid[nthreads], NULL, cache_daap_rebuild_thread, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not spawn DAAP cache rebuild thread: %s\n", strerror(ret));
+	  continue;
+	}
+
+      snprintf(name, sizeof(name), "cache_daap%d", nthreads);
+      thread_setname(g_daap_rebuild.tid[nthreads], name);
+      nthreads++;
+    }
+
+  g_daap_rebuild.nthreads = nthreads;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_rebuild.lck));
+
+  return nthreads;
+}
+
+/* Here we actually update the cache by asking httpd_daap for responses to the
+ * queries set for caching. Only replies that are missing or that depend on a
+ * table that has changed since the last update are rebuilt. That is done in
+ * the rebuild threads, and meanwhile the old replies are still served.
+ */
+static void
+cache_daap_update_cb(int fd, short what, void *arg)
+{
+  struct timeval delay = { 10, 0 };
+  struct cache_daap_rebuild_job *job;
+  struct db_table_changes changes;
+  sqlite3_stmt *stmt;
+  bool files_changed;
+  bool playlists_changed;
+  short events;
+  int nqueries;
+  int ret;
+  int i;
+
+  if (g_suspended)
+    {
+      DPRINTF(E_DBG, L_CACHE, "Got a request to update DAAP cache while suspended\n");
+      return;
+    }
+
+  // Let the running rebuild complete first, and then try again
+  if (g_daap_rebuild.njobs > 0)
+    {
+      DPRINTF(E_DBG, L_CACHE, "DAAP cache update already running, trying again later\n");
+      evtimer_add(cache_daap_updateev, &delay);
+      return;
+    }
+
+  events = g_daap_update_events;
+  g_daap_update_events = 0;
+
+  db_table_changes_get(&changes);
+  files_changed = (changes.files != g_daap_built.files);
+  // Can't count on the counters for playlistitems, see db_xupdate()
+  playlists_changed = (changes.playlists != g_daap_built.playlists) || (changes.playlistitems != g_daap_built.playlistitems) || (events & LISTENER_STORED_PLAYLIST);
+
+  DPRINTF(E_LOG, L_CACHE, "Beginning DAAP cache update (files changed: %s, playlists changed: %s)\n",
+    files_changed ? "yes" : "no", playlists_changed ? "yes" : "no");
+
+  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT q.id, q.user_agent, q.is_remote, q.query, EXISTS (SELECT 1 FROM replies r WHERE r.query = q.query) FROM queries q;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error preparing for cache update: %s\n", sqlite3_errmsg(g_db_hdl));
+      return;
+    }
+
+  nqueries = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      nqueries++;
+
+      if (sqlite3_column_int(stmt, 4) && !cache_daap_query_affected((char *)sqlite3_column_text(stmt, 3), files_changed, playlists_changed))
+	continue;
+
+      CHECK_NULL(L_CACHE, job = calloc(1, sizeof(struct cache_daap_rebuild_job)));
+      job->id = sqlite3_column_int(stmt, 0);
+      job->ua = safe_strdup((char *)sqlite3_column_text(stmt, 1));
+      job->is_remote = sqlite3_column_int(stmt, 2);
+      CHECK_NULL(L_CACHE, job->query = strdup((char *)sqlite3_column_text(stmt, 3)));
+
+      CHECK_NULL(L_CACHE, g_daap_rebuild.jobs = realloc(g_daap_rebuild.jobs, (g_daap_rebuild.njobs + 1) * sizeof(struct cache_daap_rebuild_job *)));
+      g_daap_rebuild.jobs[g_daap_rebuild.njobs] = job;
+      g_daap_rebuild.njobs++;
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+
+  sqlite3_finalize(stmt);
+
+  // Replies built from now on will reflect these changes
+  g_daap_built = changes;
+
+  DPRINTF(E_DBG, L_CACHE, "%d of %d cached DAAP replies need to be rebuilt\n", g_daap_rebuild.njobs, nqueries);
+
+  if (g_daap_rebuild.njobs == 0)
+    {
+      free(g_daap_rebuild.jobs);
+      g_daap_rebuild.jobs = NULL;
+      return;
+    }
+
+  if (cache_daap_rebuild_start() > 0)
+    return;
+
+  // No threads, so we have to build the replies ourselves
+  for (i = 0; i < g_daap_rebuild.njobs; i++)
+    {
+      job = g_daap_rebuild.jobs[i];
+      job->gzbuf = cache_daap_reply_build(job->query, job->ua, job->is_remote);
+      job->built = true;
+
+      cache_daap_rebuild_store(job, &ret);
+      free(job);
+    }
+}
+
+/* Makes the rebuild threads stop after their current job and waits for them.
+ * Thread: main
+ */
+static void
+cache_daap_rebuild_abort(void)
+{
+  pthread_t tid[CACHE_DAAP_REBUILD_THREADS];
+  int nthreads;
+  int i;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_rebuild.lck));
+  g_daap_rebuild.abort = true;
+  nthreads = g_daap_rebuild.nthreads;
+  memcpy(tid, g_daap_rebuild.tid, sizeof(tid));
+  g_daap_rebuild.nthreads = 0;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_rebuild.lck));
+
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tid[i], NULL);
+}
+
+/* Sets off an update by activating the event. The delay is because we are low
+ * priority compared to other listeners of database updates.
+ */
+static enum command_state
+cache_daap_update(void *arg, int *retval)
+{
+  struct timeval delay = { 10, 0 };
+  short *events = arg;
+
+  g_daap_update_events |= *events;
+
+  *retval = event_add(cache_daap_updateev, &delay);
   return COMMAND_END;
-  
-#undef Q_TMPL_PING
-#undef Q_TMPL_DEL
 }
 
+/* Callback from filescanner thread */
+static void
+cache_daap_listener_cb(short event_mask)
+{
+  short *events;
+
+  CHECK_NULL(L_CACHE, events = malloc(sizeof(short)));
+  *events = event_mask;
+
+  commands_exec_async(cmdbase, cache_daap_update, events);
+}
+
+
+/* ---------------------------- Artwork image store ------------------------ */
+/*                              Thread: cache                              */
+
+static int
+cache_artwork_file_path(char *path, size_t len, const char *hash)
+{
+  int ret;
+
+  // Images are spread over subdirectories named by the first two characters
+  // of the hash
+  ret = snprintf(path, len, "%s/%.2s/%s", g_artwork_dir, hash, hash);
+  if ((ret < 0) || (ret >= len))
+    {
+      DPRINTF(E_LOG, L_CACHE, "Artwork path exceeds PATH_MAX (%s)\n", g_artwork_dir);
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+cache_artwork_hash(char *hash, const uint8_t *data, size_t len)
+{
+  unsigned char digest[32];
+  int i;
+
+  gcry_md_hash_buffer(GCRY_MD_SHA256, digest, data, len);
+
+  for (i = 0; i < sizeof(digest); i++)
+    sprintf(hash + 2 * i, "%02x", digest[i]);
+}
+
+/* Writes the image to the store, unless it is there already. It is written to
+ * a temporary file which is then renamed, so a reader never sees a partial
+ * image.
+ */
+static int
+cache_artwork_file_write(const char *hash, const uint8_t *data, size_t len)
+{
+  char path[PATH_MAX];
+  char tmppath[PATH_MAX];
+  struct stat sb;
+  ssize_t written;
+  size_t total;
+  int fd;
+  int ret;
+
+  ret = cache_artwork_file_path(path, sizeof(path), hash);
+  if (ret < 0)
+    return -1;
+
+  if (stat(path, &sb) == 0 && sb.st_size == len)
+    return 0;
+
+  snprintf(tmppath, sizeof(tmppath), "%s/%.2s", g_artwork_dir, hash);
+  if (mkdir(tmppath, 0700) < 0 && errno != EEXIST)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork directory '%s': %s\n", tmppath, strerror(errno));
+      return -1;
+    }
+
+  ret = snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+  if ((ret < 0) || (ret >= sizeof(tmppath)))
+    return -1;
+
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not create artwork file '%s': %s\n", tmppath, strerror(errno));
+      return -1;
+    }
+
+  for (total = 0; total < len; total += written)
+    {
+      written = write(fd, data + total, len - total);
+      if (written < 0 && errno == EINTR)
+	written = 0;
+      else if (written < 0)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not write artwork file '%s': %s\n", tmppath, strerror(errno));
+	  close(fd);
+	  unlink(tmppath);
+	  return -1;
+	}
+    }
+
+  close(fd);
+
+  ret = rename(tmppath, path);
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not rename artwork file '%s': %s\n", tmppath, strerror(errno));
+      unlink(tmppath);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Returns true if an artwork entry refers to the image, or if we can't tell.
+ * stmt must be "SELECT 1 FROM artwork WHERE hash = ? LIMIT 1;"
+ */
+static bool
+cache_artwork_file_is_used(sqlite3_stmt *stmt, const char *hash)
+{
+  int ret;
+
+  sqlite3_reset(stmt);
+  sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+
+  ret = sqlite3_step(stmt);
+  if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+
+  return (ret != SQLITE_DONE);
+}
+
+/* Deletes the artwork entries matching the where clause, and the images that
+ * are no longer used by any entry
+ */
+static int
+cache_artwork_delete(const char *where)
+{
+  sqlite3_stmt *stmt;
+  char path[PATH_MAX];
+  char **hashes;
+  int64_t *sizes;
+  char *query;
+  char *errmsg;
+  int nhashes;
+  int ret;
+  int i;
+
+  hashes = NULL;
+  sizes = NULL;
+  nhashes = 0;
+
+  query = sqlite3_mprintf("SELECT hash, MAX(size) FROM artwork WHERE hash IS NOT NULL AND (%s) GROUP BY hash;", where);
+  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      return -1;
+    }
+
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+      CHECK_NULL(L_CACHE, hashes = realloc(hashes, (nhashes + 1) * sizeof(char *)));
+      CHECK_NULL(L_CACHE, hashes[nhashes] = strdup((char *)sqlite3_column_text(stmt, 0)));
+      CHECK_NULL(L_CACHE, sizes = realloc(sizes, (nhashes + 1) * sizeof(int64_t)));
+      sizes[nhashes] = sqlite3_column_int64(stmt, 1);
+      nhashes++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  query = sqlite3_mprintf("DELETE FROM artwork WHERE %s;", where);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      ret = -1;
+      goto out;
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Deleted %d rows\n", sqlite3_changes(g_db_hdl));
+
+  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT 1 FROM artwork WHERE hash = ? LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      ret = -1;
+      goto out;
+    }
+
+  for (i = 0; i < nhashes; i++)
+    {
+      if (cache_artwork_file_is_used(stmt, hashes[i]))
+	continue;
+
+      g_artwork_usage.size -= sizes[i];
+
+      if (cache_artwork_file_path(path, sizeof(path), hashes[i]) == 0 && unlink(path) < 0 && errno != ENOENT)
+	DPRINTF(E_LOG, L_CACHE, "Could not remove artwork file '%s': %s\n", path, strerror(errno));
+    }
+
+  sqlite3_finalize(stmt);
+
+  ret = 0;
+
+ out:
+  for (i = 0; i < nhashes; i++)
+    free(hashes[i]);
+  free(hashes);
+  free(sizes);
+
+  return ret;
+}
+
+/* Removes images (and leftover temporary files) that no artwork entry refers
+ * to, e.g. because the cache tables were recreated
+ */
+static void
+cache_artwork_files_sweep(void)
+{
+  sqlite3_stmt *stmt;
+  char subdir[PATH_MAX];
+  char path[PATH_MAX];
+  struct dirent *de;
+  struct dirent *sde;
+  DIR *dir;
+  DIR *sdir;
+  int nremoved;
+  int ret;
+
+  dir = opendir(g_artwork_dir);
+  if (!dir)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not open artwork directory '%s': %s\n", g_artwork_dir, strerror(errno));
+      return;
+    }
+
+  ret = sqlite3_prepare_v2(g_db_hdl, "SELECT 1 FROM artwork WHERE hash = ? LIMIT 1;", -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      closedir(dir);
+      return;
+    }
+
+  nremoved = 0;
+  while ((de = readdir(dir)))
+    {
+      if (strlen(de->d_name) != 2 || de->d_name[0] == '.')
+	continue;
+
+      ret = snprintf(subdir, sizeof(subdir), "%s/%s", g_artwork_dir, de->d_name);
+      if ((ret < 0) || (ret >= sizeof(subdir)))
+	continue;
+
+      sdir = opendir(subdir);
+      if (!sdir)
+	continue;
+
+      while ((sde = readdir(sdir)))
+	{
+	  if (sde->d_name[0] == '.')
+	    continue;
+
+	  if (strlen(sde->d_name) == CACHE_ARTWORK_HASH_LEN - 1 && cache_artwork_file_is_used(stmt, sde->d_name))
+	    continue;
+
+	  ret = snprintf(path, sizeof(path), "%s/%s", subdir, sde->d_name);
+	  if ((ret < 0) || (ret >= sizeof(path)))
+	    continue;
+
+	  if (unlink(path) == 0)
+	    nremoved++;
+	}
+
+      closedir(sdir);
+    }
+
+  sqlite3_finalize(stmt);
+  closedir(dir);
+
+  if (nremoved > 0)
+    DPRINTF(E_INFO, L_CACHE, "Removed %d unused artwork files\n", nremoved);
+}
+
+/* Sets the size of the images in the artwork store. Should be called after
+ * cache_artwork_files_sweep(), since images that no entry refers to are not
+ * counted.
+ */
+static void
+cache_artwork_usage_init(void)
+{
+#define Q_SIZE "SELECT SUM(size) FROM (SELECT MAX(size) AS size FROM artwork WHERE hash IS NOT NULL GROUP BY hash);"
+  sqlite3_stmt *stmt;
+  int ret;
+
+  g_artwork_usage.size = 0;
+  g_artwork_usage.naccessed = 0;
+
+  ret = sqlite3_prepare_v2(g_db_hdl, Q_SIZE, -1, &stmt, 0);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      return;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    g_artwork_usage.size = sqlite3_column_int64(stmt, 0);
+  else
+    DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+
+  sqlite3_finalize(stmt);
+
+  if (g_artwork_usage.max_size > 0)
+    DPRINTF(E_INFO, L_CACHE, "Artwork cache uses %" PRIi64 " of max %" PRIi64 " kB\n", g_artwork_usage.size / 1024, g_artwork_usage.max_size / 1024);
+  else
+    DPRINTF(E_INFO, L_CACHE, "Artwork cache uses %" PRIi64 " kB\n", g_artwork_usage.size / 1024);
+
+#undef Q_SIZE
+}
+
+/* Writes the collected access times to the artwork table in one transaction */
+static void
+cache_artwork_access_flush(void)
+{
+#define Q_TMPL "UPDATE artwork SET last_access = %" PRIi64 " WHERE id = ?;"
+  sqlite3_stmt *stmt;
+  char *query;
+  char *errmsg;
+  int ret;
+  int i;
+
+  if (g_artwork_usage.naccessed == 0)
+    return;
+
+  query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL));
+  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      goto out;
+    }
+
+  ret = sqlite3_exec(g_db_hdl, "BEGIN TRANSACTION;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+      sqlite3_free(errmsg);
+      sqlite3_finalize(stmt);
+      goto out;
+    }
+
+  for (i = 0; i < g_artwork_usage.naccessed; i++)
+    {
+      sqlite3_bind_int64(stmt, 1, g_artwork_usage.accessed[i]);
+
+      ret = sqlite3_step(stmt);
+      if (ret != SQLITE_DONE)
+	DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+
+      sqlite3_reset(stmt);
+    }
+
+  sqlite3_finalize(stmt);
+
+  ret = sqlite3_exec(g_db_hdl, "COMMIT;", NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+      sqlite3_free(errmsg);
+    }
+
+  DPRINTF(E_DBG, L_CACHE, "Updated access time of %d artwork entries\n", g_artwork_usage.naccessed);
+
+ out:
+  // On error the access times are just lost, which only makes the entries a
+  // bit more likely to be evicted
+  g_artwork_usage.naccessed = 0;
+
+#undef Q_TMPL
+}
+
+/* Records that an artwork entry was used. The entry's last_access is only
+ * updated if it is older than CACHE_ARTWORK_ACCESS_RESOLUTION, so a hot entry
+ * costs one write per period instead of one per hit.
+ */
+static void
+cache_artwork_access_add(int64_t id, time_t last_access)
+{
+  int i;
+
+  if (time(NULL) - last_access < CACHE_ARTWORK_ACCESS_RESOLUTION)
+    return;
+
+  for (i = 0; i < g_artwork_usage.naccessed; i++)
+    {
+      if (g_artwork_usage.accessed[i] == id)
+	return;
+    }
+
+  g_artwork_usage.accessed[g_artwork_usage.naccessed] = id;
+  g_artwork_usage.naccessed++;
+
+  if (g_artwork_usage.naccessed == CACHE_ARTWORK_ACCESS_BATCH)
+    cache_artwork_access_flush();
+}
+
+/* Removes the least recently used images, and the entries that refer to them,
+ * until the store is below CACHE_ARTWORK_EVICT_TARGET percent of max_size. An
+ * image's last use is the last use of any of its entries. Entries telling that
+ * there is no artwork have no image, so they are left to purge_cruft. The
+ * image with the hash keep (if not NULL) is never evicted, since it was just
+ * added and would otherwise evict itself if it is larger than the target.
+ */
+static void
+cache_artwork_evict(const char *keep)
+{
+#define Q_LRU "SELECT hash, MAX(size), MAX(last_access) AS la FROM artwork WHERE hash IS NOT NULL AND hash <> '%q' GROUP BY hash ORDER BY la LIMIT 64;"
+  sqlite3_stmt *stmt;
+  char *query;
+  char *where;
+  int64_t target;
+  int64_t size;
+  int64_t before;
+  int nevicted;
+  int ret;
+
+  if (g_artwork_usage.max_size <= 0 || g_artwork_usage.size <= g_artwork_usage.max_size)
+    return;
+
+  // Evicted entries should be ordered by the most recent access times
+  cache_artwork_access_flush();
+
+  target = g_artwork_usage.max_size / 100 * CACHE_ARTWORK_EVICT_TARGET;
+  before = g_artwork_usage.size;
+  nevicted = 0;
+
+  while (g_artwork_usage.size > target)
+    {
+      query = sqlite3_mprintf(Q_LRU, keep ? keep : "");
+      if (!query)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+	  break;
+	}
+
+      ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+      sqlite3_free(query);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+	  break;
+	}
+
+      where = sqlite3_mprintf("hash IN (''");
+      size = g_artwork_usage.size;
+      while (size > target && (ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+	  where = sqlite3_mprintf("%z, '%q'", where, (char *)sqlite3_column_text(stmt, 0));
+	  size -= sqlite3_column_int64(stmt, 1);
+	  nevicted++;
+	}
+      where = sqlite3_mprintf("%z)", where);
+
+      sqlite3_finalize(stmt);
+
+      if (!where)
+	{
+	  DPRINTF(E_LOG, L_CACHE, "Out of memory for query string\n");
+	  break;
+	}
+
+      // Stop if nothing could be evicted, e.g. because the accounting is off
+      size = g_artwork_usage.size;
+      ret = cache_artwork_delete(where);
+      sqlite3_free(where);
+      if (ret < 0 || g_artwork_usage.size == size)
+	break;
+    }
+
+  DPRINTF(E_INFO, L_CACHE, "Evicted %d artwork images (%" PRIi64 " kB) from the cache\n", nevicted, (before - g_artwork_usage.size) / 1024);
+
+#undef Q_LRU
+}
+
+
+/* Thread: any */
+static struct cache_artwork_source_entry *
+cache_artwork_source_slot(int type, int64_t persistentid)
+{
+  return &g_artwork_sources.slots[(uint64_t)(persistentid + type) % CACHE_ARTWORK_SOURCE_SLOTS];
+}
+
+/* Thread: any */
+static void
+cache_artwork_source_mem_set(int type, int64_t persistentid, time_t mtime, int nitems, const char *source)
+{
+  struct cache_artwork_source_entry *slot;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_sources.lck));
+
+  slot = cache_artwork_source_slot(type, persistentid);
+  slot->type = type;
+  slot->persistentid = persistentid;
+  slot->mtime = mtime;
+  slot->nitems = nitems;
+  snprintf(slot->source, sizeof(slot->source), "%s", source);
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_sources.lck));
+}
+
+/* Thread: any */
+static void
+cache_artwork_source_mem_clear(void)
+{
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_sources.lck));
+  memset(g_artwork_sources.slots, 0, sizeof(g_artwork_sources.slots));
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_sources.lck));
+}
+
+
+/* ---------------------------- Artwork cache ------------------------------ */
+/*                              Thread: cache                              */
+
 /*
- * Removes all cache entries for the given path
+ * Updates cached timestamps to current time for all cache entries for the given path, if the file was not modfied
+ * after the cached timestamp. All cache entries for the given path are deleted, if the file was
+ * modified after the cached timestamp.
  *
- * @param cmdarg->path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
+ * @param cmdarg->pathcopy the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
+ * @param cmdarg->mtime modified timestamp of the artwork file
  * @return 0 if successful, -1 if an error occurred
  */
 static enum command_state
-cache_artwork_delete_by_path_impl(void *arg, int *retval)
+cache_artwork_ping_impl(void *arg, int *retval)
 {
-#define Q_TMPL_DEL "DELETE FROM artwork WHERE filepath = '%q';"
+#define Q_TMPL_PING "UPDATE artwork SET db_timestamp = %" PRIi64 " WHERE filepath = '%q' AND db_timestamp >= %" PRIi64 ";"
+#define Q_TMPL_DEL "filepath = '%q' AND db_timestamp < %" PRIi64
 
   struct cache_arg *cmdarg;
   char *query;
@@ -979,7 +2041,7 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
   int ret;
 
   cmdarg = arg;
-  query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->path);
+  query = sqlite3_mprintf(Q_TMPL_PING, (int64_t)time(NULL), cmdarg->pathcopy, (int64_t)cmdarg->mtime);
 
   DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
 
@@ -989,16 +2051,60 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
     {
       DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
 
-      sqlite3_free(errmsg);
-      *retval = -1;
-      return COMMAND_END;
+      goto error_ping;
     }
 
-  DPRINTF(E_DBG, L_CACHE, "Deleted %d rows\n", sqlite3_changes(g_db_hdl));
+  if (cmdarg->del > 0)
+    {
+      query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->pathcopy, (int64_t)cmdarg->mtime);
+      ret = cache_artwork_delete(query);
+      sqlite3_free(query);
+      if (ret < 0)
+	{
+	  free(cmdarg->pathcopy);
+	  *retval = -1;
+	  return COMMAND_END;
+	}
+    }
+
+  free(cmdarg->pathcopy);
 
   *retval = 0;
   return COMMAND_END;
 
+ error_ping:
+  sqlite3_free(errmsg);
+  free(cmdarg->pathcopy);
+
+  *retval = -1;
+  return COMMAND_END;
+  
+#undef Q_TMPL_PING
+#undef Q_TMPL_DEL
+}
+
+/*
+ * Removes all cache entries for the given path
+ *
+ * @param cmdarg->path the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork)
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_delete_by_path_impl(void *arg, int *retval)
+{
+#define Q_TMPL_DEL "filepath = '%q'"
+
+  struct cache_arg *cmdarg;
+  char *query;
+
+  cmdarg = arg;
+  query = sqlite3_mprintf(Q_TMPL_DEL, cmdarg->path);
+
+  *retval = cache_artwork_delete(query);
+  sqlite3_free(query);
+
+  return COMMAND_END;
+
 #undef Q_TMPL_DEL
 }
 
@@ -1011,7 +2117,8 @@ cache_artwork_delete_by_path_impl(void *arg, int *retval)
 static enum command_state
 cache_artwork_purge_cruft_impl(void *arg, int *retval)
 {
-#define Q_TMPL "DELETE FROM artwork WHERE db_timestamp < %" PRIi64 ";"
+#define Q_TMPL "db_timestamp < %" PRIi64
+#define Q_TMPL_SOURCES "DELETE FROM artwork_sources WHERE source = '' AND db_timestamp < %" PRIi64 ";"
 
   struct cache_arg *cmdarg;
   char *query;
@@ -1021,7 +2128,16 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
   cmdarg = arg;
   query = sqlite3_mprintf(Q_TMPL, (int64_t)cmdarg->mtime);
 
-  DPRINTF(E_DBG, L_CACHE, "Running purge query '%s'\n", query);
+  DPRINTF(E_DBG, L_CACHE, "Purging artwork where '%s'\n", query);
+
+  *retval = cache_artwork_delete(query);
+  sqlite3_free(query);
+
+  // Negative results are forgotten together with the cached "no artwork"
+  // entries, so that e.g. a newly enabled online source gets a chance
+  query = sqlite3_mprintf(Q_TMPL_SOURCES, (int64_t)cmdarg->mtime);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
 
   ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
   sqlite3_free(query);
@@ -1031,15 +2147,14 @@ cache_artwork_purge_cruft_impl(void *arg, int *retval)
 
       sqlite3_free(errmsg);
       *retval = -1;
-      return COMMAND_END;
     }
 
-  DPRINTF(E_DBG, L_CACHE, "Purged %d rows\n", sqlite3_changes(g_db_hdl));
+  cache_artwork_source_mem_clear();
 
-  *retval = 0;
   return COMMAND_END;
 
 #undef Q_TMPL
+#undef Q_TMPL_SOURCES
 }
 
 /*
@@ -1058,13 +2173,47 @@ cache_artwork_add_impl(void *arg, int *retval)
 {
   struct cache_arg *cmdarg;
   sqlite3_stmt *stmt;
+  char hash[CACHE_ARTWORK_HASH_LEN];
   char *query;
   uint8_t *data;
-  int datalen;
+  size_t datalen;
+  bool is_new;
+  time_t now;
   int ret;
 
-  cmdarg = arg;
-  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, data, type) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?);";
+  cmdarg = arg;
+  query = "INSERT INTO artwork (id, persistentid, max_w, max_h, format, filepath, db_timestamp, hash, size, type, last_access) VALUES (NULL, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+  is_new = false;
+
+  datalen = evbuffer_get_length(cmdarg->evbuf);
+
+  // Entries without an image (format 0) tell that there is no artwork
+  if (cmdarg->format && datalen > 0)
+    {
+      data = evbuffer_pullup(cmdarg->evbuf, -1);
+
+      cache_artwork_hash(hash, data, datalen);
+
+      ret = cache_artwork_file_write(hash, data, datalen);
+      if (ret < 0)
+	{
+	  *retval = -1;
+	  return COMMAND_END;
+	}
+
+      // Only images that no other entry refers to add to the store's size
+      ret = sqlite3_prepare_v2(g_db_hdl, "SELECT 1 FROM artwork WHERE hash = ? LIMIT 1;", -1, &stmt, 0);
+      if (ret == SQLITE_OK)
+	{
+	  is_new = !cache_artwork_file_is_used(stmt, hash);
+	  sqlite3_finalize(stmt);
+	}
+    }
+  else
+    {
+      hash[0] = '\0';
+      datalen = 0;
+    }
 
   ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
   if (ret != SQLITE_OK)
@@ -1074,17 +2223,21 @@ cache_artwork_add_impl(void *arg, int *retval)
       return COMMAND_END;
     }
 
-  datalen = evbuffer_get_length(cmdarg->evbuf);
-  data = evbuffer_pullup(cmdarg->evbuf, -1);
-
   sqlite3_bind_int64(stmt, 1, cmdarg->persistentid);
   sqlite3_bind_int(stmt, 2, cmdarg->max_w);
   sqlite3_bind_int(stmt, 3, cmdarg->max_h);
   sqlite3_bind_int(stmt, 4, cmdarg->format);
   sqlite3_bind_text(stmt, 5, cmdarg->path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 6, (uint64_t)time(NULL));
-  sqlite3_bind_blob(stmt, 7, data, datalen, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 8, cmdarg->type);
+  now = time(NULL);
+
+  sqlite3_bind_int(stmt, 6, (uint64_t)now);
+  if (hash[0])
+    sqlite3_bind_text(stmt, 7, hash, -1, SQLITE_STATIC);
+  else
+    sqlite3_bind_null(stmt, 7);
+  sqlite3_bind_int64(stmt, 8, datalen);
+  sqlite3_bind_int(stmt, 9, cmdarg->type);
+  sqlite3_bind_int64(stmt, 10, now);
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_DONE)
@@ -1103,6 +2256,15 @@ cache_artwork_add_impl(void *arg, int *retval)
       return COMMAND_END;
     }
 
+  if (cmdarg->hash)
+    memcpy(cmdarg->hash, hash, sizeof(hash));
+
+  if (is_new)
+    {
+      g_artwork_usage.size += datalen;
+      cache_artwork_evict(hash);
+    }
+
   *retval = 0;
   return COMMAND_END;
 }
@@ -1119,20 +2281,30 @@ cache_artwork_add_impl(void *arg, int *retval)
  * @param cmdarg->max_h maximum image height
  * @param cmdarg->cached set by this function to 0 if no cache entry exists, otherwise 1
  * @param cmdarg->format set by this function to the format of the cache entry
- * @param cmdarg->evbuf event buffer filled by this function with the scaled image
+ * @param cmdarg->evbuf event buffer filled by this function with the scaled image (as a file segment)
+ * @param cmdarg->hash set by this function to the hash of the image, if not NULL
  * @return 0 if successful, -1 if an error occurred
  */
 static enum command_state
 cache_artwork_get_impl(void *arg, int *retval)
 {
-#define Q_TMPL "SELECT a.format, a.data FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
+#define Q_TMPL "SELECT a.format, a.hash, a.id, a.last_access FROM artwork a WHERE a.type = %d AND a.persistentid = %" PRIi64 " AND a.max_w = %d AND a.max_h = %d;"
   struct cache_arg *cmdarg;
   sqlite3_stmt *stmt;
+  char path[PATH_MAX];
+  char hash[CACHE_ARTWORK_HASH_LEN];
+  struct stat sb;
   char *query;
-  int datalen;
+  char *where;
+  int fd;
   int ret;
 
   cmdarg = arg;
+  cmdarg->cached = 0;
+  cmdarg->format = 0;
+  if (cmdarg->hash)
+    cmdarg->hash[0] = '\0';
+
   query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->max_w, cmdarg->max_h);
   if (!query)
     {
@@ -1147,15 +2319,14 @@ cache_artwork_get_impl(void *arg, int *retval)
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
-      ret = -1;
-      goto error_get;
+      sqlite3_free(query);
+      *retval = -1;
+      return COMMAND_END;
     }
 
   ret = sqlite3_step(stmt);
   if (ret != SQLITE_ROW)
     {
-      cmdarg->cached = 0;
-
       if (ret == SQLITE_DONE)
 	{
 	  ret = 0;
@@ -1167,44 +2338,204 @@ cache_artwork_get_impl(void *arg, int *retval)
 	  DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
 	}
 
-      goto error_get;
+      goto out;
     }
 
-  cmdarg->format = sqlite3_column_int(stmt, 0);
-  datalen = sqlite3_column_bytes(stmt, 1);
+  // Cached that there is no artwork
+  if (!sqlite3_column_int(stmt, 0) || sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+    {
+      cmdarg->cached = 1;
+      ret = 0;
+      goto out;
+    }
+
+  snprintf(hash, sizeof(hash), "%s", (char *)sqlite3_column_text(stmt, 1));
+
   if (!cmdarg->evbuf)
     {
       DPRINTF(E_LOG, L_CACHE, "Error: Artwork evbuffer is NULL\n");
       ret = -1;
-      goto error_get;
+      goto out;
+    }
+
+  fd = -1;
+  if (cache_artwork_file_path(path, sizeof(path), hash) == 0)
+    fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &sb) < 0)
+    {
+      // The image is gone, so drop the entries that use it and report a miss,
+      // then the caller will recreate it
+      DPRINTF(E_LOG, L_CACHE, "Artwork file for cache entry is missing: %s\n", path);
+      if (fd >= 0)
+	close(fd);
+
+      sqlite3_finalize(stmt);
+      stmt = NULL;
+
+      where = sqlite3_mprintf("hash = '%q'", hash);
+      cache_artwork_delete(where);
+      sqlite3_free(where);
+
+      ret = 0;
+      goto out;
     }
 
-  ret = evbuffer_add(cmdarg->evbuf, sqlite3_column_blob(stmt, 1), datalen);
+  // The evbuffer takes ownership of fd, and libevent will mmap or sendfile the
+  // image instead of copying it
+  ret = evbuffer_add_file(cmdarg->evbuf, fd, 0, sb.st_size);
   if (ret < 0)
     {
-      DPRINTF(E_LOG, L_CACHE, "Out of memory for artwork evbuffer\n");
+      DPRINTF(E_LOG, L_CACHE, "Could not add artwork file to evbuffer: %s\n", path);
       ret = -1;
-      goto error_get;
+      goto out;
     }
 
+  cmdarg->format = sqlite3_column_int(stmt, 0);
   cmdarg->cached = 1;
+  if (cmdarg->hash)
+    memcpy(cmdarg->hash, hash, sizeof(hash));
 
-  ret = sqlite3_finalize(stmt);
-  if (ret != SQLITE_OK)
-    DPRINTF(E_LOG, L_CACHE, "Error finalizing query for getting cache: %s\n", sqlite3_errmsg(g_db_hdl));
+  cache_artwork_access_add(sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3));
 
   DPRINTF(E_DBG, L_CACHE, "Cache hit: %s\n", query);
 
+  ret = 0;
+
+ out:
+  sqlite3_finalize(stmt);
   sqlite3_free(query);
 
-  *retval = 0;
+  *retval = ret;
   return COMMAND_END;
+#undef Q_TMPL
+}
+
+/*
+ * Gets the artwork source memo for a group
+ *
+ * @param cmdarg->type individual or group artwork
+ * @param cmdarg->persistentid persistent songalbumid or songartistid
+ * @param cmdarg->cached set by this function to 0 if there is no memo, otherwise 1
+ * @param cmdarg->source set by this function to the name of the source (CACHE_ARTWORK_SOURCE_LEN)
+ * @param cmdarg->mtime set by this function to the mtime the memo is valid for
+ * @param cmdarg->nitems set by this function to the number of items the memo is valid for
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_source_get_impl(void *arg, int *retval)
+{
+#define Q_TMPL "SELECT source, mtime, items FROM artwork_sources WHERE type = %d AND persistentid = %" PRIi64 ";"
+  struct cache_arg *cmdarg;
+  sqlite3_stmt *stmt;
+  char *query;
+  int ret;
+
+  cmdarg = arg;
+  cmdarg->cached = 0;
+
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_prepare_v2(g_db_hdl, query, -1, &stmt, 0);
+  sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not prepare statement: %s\n", sqlite3_errmsg(g_db_hdl));
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  ret = sqlite3_step(stmt);
+  if (ret == SQLITE_ROW)
+    {
+      snprintf(cmdarg->source, CACHE_ARTWORK_SOURCE_LEN, "%s", (char *)sqlite3_column_text(stmt, 0));
+      cmdarg->mtime = sqlite3_column_int64(stmt, 1);
+      cmdarg->nitems = sqlite3_column_int(stmt, 2);
+      cmdarg->cached = 1;
+    }
+  else if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not step: %s\n", sqlite3_errmsg(g_db_hdl));
+      sqlite3_finalize(stmt);
+      *retval = -1;
+      return COMMAND_END;
+    }
 
- error_get:
   sqlite3_finalize(stmt);
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+/*
+ * Saves the artwork source memo for a group
+ *
+ * @param cmdarg->type individual or group artwork
+ * @param cmdarg->persistentid persistent songalbumid or songartistid
+ * @param cmdarg->source name of the source, empty if no source had artwork (will be freed)
+ * @param cmdarg->mtime newest mtime of the group's files
+ * @param cmdarg->nitems number of items in the group
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_source_set_impl(void *arg, int *retval)
+{
+#define Q_TMPL "INSERT OR REPLACE INTO artwork_sources (type, persistentid, source, mtime, items, db_timestamp) VALUES (%d, %" PRIi64 ", '%q', %" PRIi64 ", %d, %" PRIi64 ");"
+  struct cache_arg *cmdarg;
+  char *query;
+  char *errmsg;
+  int ret;
+
+  cmdarg = arg;
+  query = sqlite3_mprintf(Q_TMPL, cmdarg->type, cmdarg->persistentid, cmdarg->source, (int64_t)cmdarg->mtime, cmdarg->nitems, (int64_t)time(NULL));
+  free(cmdarg->source);
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", query);
+
+  ret = sqlite3_exec(g_db_hdl, query, NULL, NULL, &errmsg);
   sqlite3_free(query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
 
-  *retval = ret;
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
+  return COMMAND_END;
+#undef Q_TMPL
+}
+
+/*
+ * Forgets all the artwork source memos
+ *
+ * @return 0 if successful, -1 if an error occurred
+ */
+static enum command_state
+cache_artwork_source_clear_impl(void *arg, int *retval)
+{
+#define Q_TMPL "DELETE FROM artwork_sources;"
+  char *errmsg;
+  int ret;
+
+  DPRINTF(E_DBG, L_CACHE, "Running query '%s'\n", Q_TMPL);
+
+  ret = sqlite3_exec(g_db_hdl, Q_TMPL, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Query error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      *retval = -1;
+      return COMMAND_END;
+    }
+
+  *retval = 0;
   return COMMAND_END;
 #undef Q_TMPL
 }
@@ -1289,6 +2620,19 @@ cache(void *arg)
       pthread_exit(NULL);
     }
 
+  ret = mkdir(g_artwork_dir, 0700);
+  if (ret < 0 && errno != EEXIST)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Error: Could not create artwork directory '%s': %s. Cache will be disabled.\n", g_artwork_dir, strerror(errno));
+      cache_close();
+
+      pthread_exit(NULL);
+    }
+
+  cache_artwork_files_sweep();
+  cache_artwork_usage_init();
+  cache_artwork_evict(NULL);
+
   /* The thread needs a connection with the main db, so it can generate DAAP
    * replies through httpd_daap.c
    */
@@ -1313,6 +2657,8 @@ cache(void *arg)
 
   db_perthread_deinit();
 
+  cache_artwork_access_flush();
+
   cache_close();
 
   pthread_exit(NULL);
@@ -1344,14 +2690,34 @@ int
 cache_daap_get(struct evbuffer *evbuf, const char *query)
 {
   struct cache_arg cmdarg;
+  int ret;
 
   if (!g_initialized)
     return -1;
 
-  cmdarg.query = strdup(query);
+  CHECK_NULL(L_CACHE, cmdarg.query = strdup(query));
+  cache_daap_query_normalize(cmdarg.query);
+
+  ret = cache_daap_mem_get(evbuf, cmdarg.query);
+  if (ret == 0)
+    {
+      free(cmdarg.query);
+      return 0;
+    }
+
+  // Not in memory, so ask the cache thread to look in the db (it takes
+  // ownership of cmdarg.query)
   cmdarg.evbuf = evbuf;
+  ret = commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
 
-  return commands_exec_sync(cmdbase, cache_daap_query_get, NULL, &cmdarg);
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+  if (ret == 0)
+    g_daap_mem.db_hits++;
+  else
+    g_daap_mem.misses++;
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+
+  return ret;
 }
 
 void
@@ -1383,6 +2749,26 @@ cache_daap_threshold(void)
   return g_cfg_threshold;
 }
 
+int
+cache_daap_stats_get(struct cache_daap_stats *stats)
+{
+  if (!g_initialized)
+    return -1;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_daap_mem.lck));
+
+  stats->mem_hits = g_daap_mem.mem_hits;
+  stats->db_hits = g_daap_mem.db_hits;
+  stats->misses = g_daap_mem.misses;
+  stats->mem_entries = g_daap_mem.count;
+  stats->mem_size = g_daap_mem.size;
+  stats->mem_max_size = g_daap_mem.max_size;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_daap_mem.lck));
+
+  return 0;
+}
+
 
 /* --------------------------- Artwork cache API -------------------------- */
 
@@ -1468,10 +2854,11 @@ cache_artwork_purge_cruft(time_t ref)
  * @param format ART_FMT_PNG for png, ART_FMT_JPEG for jpeg or 0 if no artwork available
  * @param filename the full path to the artwork file (could be an jpg/png image or a media file with embedded artwork) or empty if no artwork available
  * @param evbuf event buffer containing the (scaled) image
+ * @param hash set to the hash of the image (CACHE_ARTWORK_HASH_LEN), if not NULL
  * @return 0 if successful, -1 if an error occurred
  */
 int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf)
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf, char *hash)
 {
   struct cache_arg cmdarg;
 
@@ -1485,6 +2872,7 @@ cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int form
   cmdarg.format = format;
   cmdarg.path = filename;
   cmdarg.evbuf = evbuf;
+  cmdarg.hash = hash;
 
   return commands_exec_sync(cmdbase, cache_artwork_add_impl, NULL, &cmdarg);
 }
@@ -1501,10 +2889,11 @@ cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int form
  * @param cached set by this function to 0 if no cache entry exists, otherwise 1
  * @param format set by this function to the format of the cache entry
  * @param evbuf event buffer filled by this function with the scaled image
+ * @param hash set by this function to the hash of the image (CACHE_ARTWORK_HASH_LEN), if not NULL
  * @return 0 if successful, -1 if an error occurred
  */
 int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf)
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf, char *hash)
 {
   struct cache_arg cmdarg;
   int ret;
@@ -1513,6 +2902,8 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
     {
       *cached = 0;
       *format = 0;
+      if (hash)
+	hash[0] = '\0';
       return 0;
     }
 
@@ -1521,6 +2912,7 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
   cmdarg.max_w = max_w;
   cmdarg.max_h = max_h;
   cmdarg.evbuf = evbuf;
+  cmdarg.hash = hash;
 
   ret = commands_exec_sync(cmdbase, cache_artwork_get_impl, NULL, &cmdarg);
 
@@ -1530,6 +2922,111 @@ cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cac
   return ret;
 }
 
+/*
+ * Get the source that provided the artwork for a group the last time it was
+ * searched, if that search was made with the same state of the group's files.
+ *
+ * @param type individual or group artwork
+ * @param persistentid persistent songalbumid or songartistid
+ * @param mtime newest mtime of the group's files
+ * @param nitems number of items in the group
+ * @param source set by this function to the name of the source, or to an empty
+ *               string if no source had artwork (CACHE_ARTWORK_SOURCE_LEN)
+ * @return 0 if there is a valid memo, -1 if not or if an error occurred
+ */
+int
+cache_artwork_source_get(int type, int64_t persistentid, time_t mtime, int nitems, char *source)
+{
+  struct cache_artwork_source_entry *slot;
+  struct cache_arg cmdarg;
+  bool found;
+  int ret;
+
+  if (!g_initialized)
+    return -1;
+
+  CHECK_ERR(L_CACHE, pthread_mutex_lock(&g_artwork_sources.lck));
+
+  slot = cache_artwork_source_slot(type, persistentid);
+  found = (slot->persistentid == persistentid && slot->type == type);
+  if (found)
+    {
+      cmdarg.mtime = slot->mtime;
+      cmdarg.nitems = slot->nitems;
+      memcpy(source, slot->source, CACHE_ARTWORK_SOURCE_LEN);
+    }
+
+  CHECK_ERR(L_CACHE, pthread_mutex_unlock(&g_artwork_sources.lck));
+
+  if (!found)
+    {
+      cmdarg.type = type;
+      cmdarg.persistentid = persistentid;
+      cmdarg.source = source;
+
+      ret = commands_exec_sync(cmdbase, cache_artwork_source_get_impl, NULL, &cmdarg);
+      if (ret < 0 || !cmdarg.cached)
+	return -1;
+
+      cache_artwork_source_mem_set(type, persistentid, cmdarg.mtime, cmdarg.nitems, source);
+    }
+
+  if (cmdarg.mtime != mtime || cmdarg.nitems != nitems)
+    return -1;
+
+  return 0;
+}
+
+/*
+ * Remember which source provided the artwork for a group
+ *
+ * @param type individual or group artwork
+ * @param persistentid persistent songalbumid or songartistid
+ * @param mtime newest mtime of the group's files
+ * @param nitems number of items in the group
+ * @param source name of the source, or an empty string if no source had artwork
+ */
+void
+cache_artwork_source_set(int type, int64_t persistentid, time_t mtime, int nitems, const char *source)
+{
+  struct cache_arg *cmdarg;
+
+  if (!g_initialized)
+    return;
+
+  cache_artwork_source_mem_set(type, persistentid, mtime, nitems, source);
+
+  cmdarg = calloc(1, sizeof(struct cache_arg));
+  if (!cmdarg)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Could not allocate cache_arg\n");
+      return;
+    }
+
+  cmdarg->type = type;
+  cmdarg->persistentid = persistentid;
+  cmdarg->mtime = mtime;
+  cmdarg->nitems = nitems;
+  cmdarg->source = strdup(source);
+
+  commands_exec_async(cmdbase, cache_artwork_source_set_impl, cmdarg);
+}
+
+/*
+ * Forgets which sources provided the artwork, e.g. because an image file was
+ * added, which might be the artwork of groups that are known to have none
+ */
+void
+cache_artwork_source_clear(void)
+{
+  if (!g_initialized)
+    return;
+
+  cache_artwork_source_mem_clear();
+
+  commands_exec_async(cmdbase, cache_artwork_source_clear_impl, NULL);
+}
+
 /*
  * Put an artwork image in the in-memory stash (the previous will be deleted)
  *
@@ -1586,6 +3083,7 @@ cache_artwork_read(struct evbuffer *evbuf, const char *path, int *format)
 int
 cache_init(void)
 {
+  char *ptr;
   int ret;
 
   g_initialized = 0;
@@ -1597,6 +3095,27 @@ cache_init(void)
       return 0;
     }
 
+  // The artwork images are stored in a directory next to the cache db
+  ret = snprintf(g_artwork_dir, sizeof(g_artwork_dir), "%s", g_db_path);
+  if ((ret < 0) || (ret >= sizeof(g_artwork_dir)))
+    {
+      DPRINTF(E_LOG, L_CACHE, "Cache path exceeds PATH_MAX, disabling cache\n");
+      return 0;
+    }
+
+  ptr = strrchr(g_artwork_dir, '/');
+  if (ptr)
+    *(ptr + 1) = '\0';
+  else
+    g_artwork_dir[0] = '\0';
+
+  ret = safe_snprintf_cat(g_artwork_dir, sizeof(g_artwork_dir), "artwork");
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_CACHE, "Cache path exceeds PATH_MAX, disabling cache\n");
+      return 0;
+    }
+
   g_cfg_threshold = cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_threshold");
   if (g_cfg_threshold == 0)
     {
@@ -1604,6 +3123,12 @@ cache_init(void)
       return 0;
     }
 
+  // Config value is in kB, 0 disables the memory tier
+  g_daap_mem.max_size = 1024 * cfg_getint(cfg_getsec(cfg, "general"), "cache_daap_memory");
+
+  // Config value is in MB, 0 is no limit
+  g_artwork_usage.max_size = (int64_t)1024 * 1024 * cfg_getint(cfg_getsec(cfg, "general"), "cache_artwork_size");
+
   evbase_cache = event_base_new();
   if (!evbase_cache)
     {
@@ -1620,7 +3145,7 @@ cache_init(void)
 
   cmdbase = commands_base_new(evbase_cache, NULL);
 
-  ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE);
+  ret = listener_add(cache_daap_listener_cb, LISTENER_DATABASE | LISTENER_STORED_PLAYLIST);
   if (ret < 0)
     {
       DPRINTF(E_LOG, L_CACHE, "Could not create listener event\n");
@@ -1657,6 +3182,7 @@ void
 cache_deinit(void)
 {
   int ret;
+  int i;
 
   if (!g_initialized)
     return;
@@ -1665,6 +3191,9 @@ cache_deinit(void)
 
   listener_remove(cache_daap_listener_cb);
 
+  // The rebuild threads use cmdbase, so they must be stopped first
+  cache_daap_rebuild_abort();
+
   commands_base_destroy(cmdbase);
 
   ret = pthread_join(tid_cache, NULL);
@@ -1677,4 +3206,15 @@ cache_deinit(void)
   // Free event base
   event_free(cache_daap_updateev);
   event_base_free(evbase_cache);
+
+  cache_daap_mem_clear();
+
+  // Jobs the rebuild threads didn't get to
+  for (i = g_daap_rebuild.next; i < g_daap_rebuild.njobs; i++)
+    {
+      free(g_daap_rebuild.jobs[i]->query);
+      free(g_daap_rebuild.jobs[i]->ua);
+      free(g_daap_rebuild.jobs[i]);
+    }
+  free(g_daap_rebuild.jobs);
 }
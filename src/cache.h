@@ -2,6 +2,7 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <stdint.h>
 #include <event2/buffer.h>
 
 /* ---------------------------- DAAP cache API  --------------------------- */
@@ -21,12 +22,32 @@ cache_daap_add(const char *query, const char *ua, int is_remote, int msec);
 int
 cache_daap_threshold(void);
 
+struct cache_daap_stats
+{
+  uint64_t mem_hits;  // Served from the memory tier
+  uint64_t db_hits;   // Served from the cache db
+  uint64_t misses;
+  int mem_entries;
+  size_t mem_size;
+  size_t mem_max_size;
+};
+
+int
+cache_daap_stats_get(struct cache_daap_stats *stats);
+
 
 /* ---------------------------- Artwork cache API  --------------------------- */
 
 #define CACHE_ARTWORK_GROUP 0
 #define CACHE_ARTWORK_INDIVIDUAL 1
 
+// Artwork images are stored by their SHA-256, this is the size of the hex
+// string incl. the terminating zero
+#define CACHE_ARTWORK_HASH_LEN 65
+
+// Max size of an artwork source name incl. the terminating zero
+#define CACHE_ARTWORK_SOURCE_LEN 32
+
 void
 cache_artwork_ping(const char *path, time_t mtime, int del);
 
@@ -37,10 +58,19 @@ int
 cache_artwork_purge_cruft(time_t ref);
 
 int
-cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf);
+cache_artwork_add(int type, int64_t persistentid, int max_w, int max_h, int format, char *filename, struct evbuffer *evbuf, char *hash);
 
 int
-cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf);
+cache_artwork_get(int type, int64_t persistentid, int max_w, int max_h, int *cached, int *format, struct evbuffer *evbuf, char *hash);
+
+int
+cache_artwork_source_get(int type, int64_t persistentid, time_t mtime, int nitems, char *source);
+
+void
+cache_artwork_source_set(int type, int64_t persistentid, time_t mtime, int nitems, const char *source);
+
+void
+cache_artwork_source_clear(void);
 
 int
 cache_artwork_stash(struct evbuffer *evbuf, const char *path, int format);
@@ -47,6 +47,8 @@ static cfg_opt_t sec_general[] =
     CFG_STR("uid", "nobody", CFGF_NONE),
     CFG_STR("db_path", STATEDIR "/cache/" PACKAGE "/songs3.db", CFGF_NONE),
     CFG_STR("db_backup_path", NULL, CFGF_NONE),
+    CFG_INT("db_backup_pages_per_step", 256, CFGF_NONE),
+    CFG_INT("db_backup_step_delay", 10, CFGF_NONE),
     CFG_STR("logfile", STATEDIR "/log/" PACKAGE ".log", CFGF_NONE),
     CFG_INT_CB("loglevel", E_LOG, CFGF_NONE, &cb_loglevel),
     CFG_STR("admin_password", NULL, CFGF_NONE),
@@ -57,6 +59,8 @@ static cfg_opt_t sec_general[] =
     CFG_STR("bind_address", NULL, CFGF_NONE),
     CFG_STR("cache_path", STATEDIR "/cache/" PACKAGE "/cache.db", CFGF_NONE),
     CFG_INT("cache_daap_threshold", 1000, CFGF_NONE),
+    CFG_INT("cache_daap_memory", 16384, CFGF_NONE),
+    CFG_INT("cache_artwork_size", 256, CFGF_NONE),
     CFG_BOOL("speaker_autoselect", cfg_false, CFGF_NONE),
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
     CFG_BOOL("high_resolution_clock", cfg_false, CFGF_NONE),
@@ -103,6 +107,7 @@ static cfg_opt_t sec_library[] =
     CFG_STR_LIST("artwork_basenames", "{artwork,cover,Folder}", CFGF_NONE),
     CFG_BOOL("artwork_individual", cfg_false, CFGF_NONE),
     CFG_STR_LIST("artwork_online_sources", NULL, CFGF_NONE),
+    CFG_INT_LIST("artwork_prerender_sizes", NULL, CFGF_NONE),
     CFG_STR_LIST("filetypes_ignore", "{.db,.ini,.db-journal,.pdf,.metadata}", CFGF_NONE),
     CFG_STR_LIST("filepath_ignore", NULL, CFGF_NONE),
     CFG_BOOL("filescan_disable", cfg_false, CFGF_NONE),
@@ -221,6 +226,8 @@ static cfg_opt_t sec_sqlite[] =
     CFG_INT("pragma_mmap_size_library", -1, CFGF_NONE),
     CFG_INT("pragma_mmap_size_cache", -1, CFGF_NONE),
     CFG_BOOL("vacuum", cfg_true, CFGF_NONE),
+    CFG_BOOL("wal_mode", cfg_false, CFGF_NONE),
+    CFG_INT("busy_timeout", 5000, CFGF_NONE),
     CFG_END()
   };
 
@@ -22,6 +22,7 @@
 #endif
 
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -33,6 +34,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unicase.h>
 #include <unictype.h>
 #include <uninorm.h>
 #include <unistr.h>
@@ -64,20 +66,15 @@
 #define DB_FLAG_NO_ZERO  (1 << 1)
 
 // The two last columns of playlist_info are calculated fields, so all playlist retrieval functions must use this query
-#define Q_PL_SELECT "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')" \
-                    " FROM playlists f LEFT JOIN playlistitems pi ON (f.id = pi.playlistid)"
+#define Q_PL_COLS "SELECT f.*, COUNT(pi.id), SUM(pi.filepath NOT NULL AND pi.filepath LIKE 'http%%')"
+#define Q_PL_FROM " FROM playlists f LEFT JOIN playlistitems pi ON (f.id = pi.playlistid)"
+#define Q_PL_SELECT Q_PL_COLS Q_PL_FROM
 
 enum group_type {
   G_ALBUMS = 1,
   G_ARTISTS = 2,
 };
 
-enum field_type {
-  DB_TYPE_INT,
-  DB_TYPE_INT64,
-  DB_TYPE_STRING,
-};
-
 enum fixup_type {
   DB_FIXUP_STANDARD = 0,
   DB_FIXUP_NO_SANITIZE,
@@ -96,6 +93,11 @@ enum fixup_type {
   DB_FIXUP_ALBUM_SORT,
   DB_FIXUP_ALBUM_ARTIST_SORT,
   DB_FIXUP_COMPOSER_SORT,
+  DB_FIXUP_TITLE_SORT_KEY,
+  DB_FIXUP_ARTIST_SORT_KEY,
+  DB_FIXUP_ALBUM_SORT_KEY,
+  DB_FIXUP_ALBUM_ARTIST_SORT_KEY,
+  DB_FIXUP_COMPOSER_SORT_KEY,
   DB_FIXUP_TIME_MODIFIED,
   DB_FIXUP_SONGARTISTID,
   DB_FIXUP_SONGALBUMID,
@@ -107,17 +109,151 @@ struct db_unlock {
   pthread_mutex_t lck;
 };
 
+// Counts how often and how long threads had to wait for another connection,
+// either for an unlock notification (shared-cache mode) or in the busy handler
+// (WAL mode)
+struct db_wait_stats {
+  pthread_mutex_t lck;
+  unsigned int waits;
+  uint64_t wait_ms;
+  uint64_t max_ms;
+};
+
+// Run time statistics per query shape, collected from the profile callback of
+// all connections. The table is fixed size, shapes that don't fit are only
+// counted as dropped.
+#define DB_QUERY_STATS_MAX 256
+#define DB_QUERY_STATS_SLOTS 512
+#define DB_QUERY_SHAPE_LEN 4096
+
+struct db_query_stats_table {
+  pthread_mutex_t lck;
+  uint64_t dropped;
+  int count;
+  uint16_t slots[DB_QUERY_STATS_SLOTS];
+  uint64_t hashes[DB_QUERY_STATS_MAX];
+  struct db_query_stats entries[DB_QUERY_STATS_MAX];
+};
+
+// Number of row changes per table, counted by the update hook of each
+// connection and added to the totals when the transaction commits
+struct db_table_changes_state {
+  pthread_mutex_t lck;
+  struct db_table_changes changes;
+};
+
+// Tools like bench-db run from the build tree and use the extension from there
+#ifndef DB_SQLEXT_PATH
+# define DB_SQLEXT_PATH PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so"
+#endif
+
+// Online backup, see db_backup(). A write to the db from another connection
+// makes SQLite restart the backup, after this many restarts it is completed
+// in one step.
+#define DB_BACKUP_RESTARTS_MAX 3
+
+struct db_backup_state {
+  pthread_mutex_t lck;
+  pthread_t tid;
+  bool joinable;
+  bool stop;
+  struct db_backup_status status;
+};
+
+// Ids of the files seen during a scan, see db_scan_seen_begin(). The lock
+// protects active and tid, the set itself is only used by the scan thread.
+struct db_scan_seen {
+  pthread_mutex_t lck;
+  bool active;
+  pthread_t tid;
+  uint64_t *bits;
+  int nwords;
+  int count;
+};
+
+// Cache of the item counts of smart (and special) playlists, keyed by the
+// playlist query. Entries are valid while their generation matches the cache
+// generation, which is bumped on library changes.
+#define DB_SMARTPL_CACHE_SIZE 64
+
+struct db_smartpl_count {
+  char *query;
+  uint32_t hash;
+  uint32_t items;
+  uint32_t streams;
+  unsigned int generation;
+};
+
+struct db_smartpl_cache {
+  pthread_mutex_t lck;
+  unsigned int generation;
+  unsigned int next_evict;
+  unsigned int hits;
+  unsigned int misses;
+  struct db_smartpl_count entries[DB_SMARTPL_CACHE_SIZE];
+};
+
+// Row of the library_counts table, which the trg_library_counts_* triggers keep
+// up to date with the enabled files and playlists
+struct db_library_counts {
+  uint32_t files;
+  uint32_t streams;
+  uint64_t song_length;
+  uint64_t file_size;
+  uint32_t artists;
+  uint32_t albums;
+  uint32_t playlists;
+};
+
 struct db_statements
 {
   sqlite3_stmt *files_insert;
   sqlite3_stmt *files_update;
   sqlite3_stmt *files_ping;
+  sqlite3_stmt *files_lookup_batch;
+  sqlite3_stmt *files_ping_batch;
+  sqlite3_stmt *files_seen_lookup;
 
   sqlite3_stmt *playlists_insert;
   sqlite3_stmt *playlists_update;
 
   sqlite3_stmt *queue_items_insert;
   sqlite3_stmt *queue_items_update;
+  sqlite3_stmt *queue_pos_update;
+  sqlite3_stmt *queue_shuffle_pos_update;
+};
+
+#define DB_STMT_CACHE_SIZE 32
+#define DB_STMT_CACHE_STATS_INTERVAL 1000
+
+// Number of times a statement is retried in WAL mode after the busy handler
+// gave up
+#define DB_BUSY_RETRIES 5
+
+// Number of times a statement is retried when the shared cache is locked
+#define DB_LOCKED_RETRIES 100
+
+struct db_stmt_cache_entry
+{
+  char *query;
+  uint32_t hash;
+  sqlite3_stmt *stmt;
+  bool in_use;
+  unsigned int last_used;
+};
+
+// Per-thread cache of prepared statements for db_query_start(). The key is the
+// query text, which doesn't contain id, persistentid, limit or offset, since
+// those are bound as parameters (see db_query_bind)
+struct db_stmt_cache
+{
+  struct db_stmt_cache_entry entries[DB_STMT_CACHE_SIZE];
+  unsigned int clock;
+  int generation;
+
+  unsigned int hits;
+  unsigned int misses;
+  unsigned int evictions;
 };
 
 struct col_type_map {
@@ -146,11 +282,32 @@ struct fixup_ctx
 };
 
 struct query_clause {
+  char *cols;
   char *where;
   char *group;
   char *having;
   char *order;
   char *index;
+  char *keyset_cols;
+  char *keyset;
+};
+
+#define KEYSET_KEYS_MAX 4
+
+struct keyset_clause {
+  const char *keys[KEYSET_KEYS_MAX];
+  bool desc;
+};
+
+struct keyset_cursor {
+  uint8_t *buf;
+  int nvalues;
+  struct {
+    int type;
+    int64_t intval;
+    const char *text;
+    int len;
+  } values[KEYSET_KEYS_MAX + 1];
 };
 
 struct browse_clause {
@@ -230,6 +387,11 @@ static const struct col_type_map mfi_cols_map[] =
     { "channels",           mfi_offsetof(channels),           DB_TYPE_INT },
     { "usermark",           mfi_offsetof(usermark),           DB_TYPE_INT },
     { "scan_kind",          mfi_offsetof(scan_kind),          DB_TYPE_INT },
+    { "title_sort_key",        mfi_offsetof(title_sort_key),        DB_TYPE_STRING, DB_FIXUP_TITLE_SORT_KEY },
+    { "artist_sort_key",       mfi_offsetof(artist_sort_key),       DB_TYPE_STRING, DB_FIXUP_ARTIST_SORT_KEY },
+    { "album_sort_key",        mfi_offsetof(album_sort_key),        DB_TYPE_STRING, DB_FIXUP_ALBUM_SORT_KEY },
+    { "album_artist_sort_key", mfi_offsetof(album_artist_sort_key), DB_TYPE_STRING, DB_FIXUP_ALBUM_ARTIST_SORT_KEY },
+    { "composer_sort_key",     mfi_offsetof(composer_sort_key),     DB_TYPE_STRING, DB_FIXUP_COMPOSER_SORT_KEY },
   };
 
 /* This list must be kept in sync with
@@ -371,6 +533,11 @@ static const ssize_t dbmfi_cols_map[] =
     dbmfi_offsetof(channels),
     dbmfi_offsetof(usermark),
     dbmfi_offsetof(scan_kind),
+    dbmfi_offsetof(title_sort_key),
+    dbmfi_offsetof(artist_sort_key),
+    dbmfi_offsetof(album_sort_key),
+    dbmfi_offsetof(album_artist_sort_key),
+    dbmfi_offsetof(composer_sort_key),
   };
 
 /* This list must be kept in sync with
@@ -499,21 +666,52 @@ static const struct col_type_map wi_cols_map[] =
 static const char *sort_clause[] =
   {
     "",
-    "f.title_sort",
-    "f.album_sort, f.disc, f.track",
-    "f.album_artist_sort, f.album_sort, f.disc, f.track",
+    "f.title_sort_key",
+    "f.album_sort_key, f.disc, f.track",
+    "f.album_artist_sort_key, f.album_sort_key, f.disc, f.track",
     "f.type, f.parent_id, f.special_id, f.title",
     "f.year",
     "f.genre",
-    "f.composer_sort",
+    "f.composer_sort_key",
     "f.disc",
     "f.track",
     "f.virtual_path COLLATE NOCASE",
     "pos",
     "shuffle_pos",
-    "f.date_released DESC, f.title_sort DESC",
+    "f.date_released DESC, f.title_sort_key DESC",
   };
 
+/* Keyset clauses, used instead of sort_clause for I_KEYSET. The id of the row
+ * is added as the last key, so that each row has a unique position. NULL keys
+ * sort first, like with ORDER BY.
+ * Keep in sync with enum sort_type and indices
+ */
+static const struct keyset_clause keyset_clause[] =
+  {
+    { { NULL } },
+    { { "f.title_sort_key" } },
+    { { "f.album_sort_key", "f.disc", "f.track" } },
+    { { "f.album_artist_sort_key", "f.album_sort_key", "f.disc", "f.track" } },
+    { { "f.type", "f.parent_id", "f.special_id", "f.title" } },
+    { { "f.year" } },
+    { { "f.genre" } },
+    { { "f.composer_sort_key" } },
+    { { "f.disc" } },
+    { { "f.track" } },
+    { { "f.virtual_path COLLATE NOCASE" } },
+    { { "f.pos" } },
+    { { "f.shuffle_pos" } },
+    { { "f.date_released", "f.title_sort_key" }, true },
+  };
+
+/* Keyset clauses for the group queries. Only the group's own sort key is used,
+ * which is the same for the files of a group, so that the condition can go in
+ * the WHERE and SQLite can skip to the first group with an index, instead of
+ * grouping all files and then filtering the groups with a HAVING.
+ */
+static const struct keyset_clause keyset_album_clause = { { "f.album_sort_key" } };
+static const struct keyset_clause keyset_artist_clause = { { "f.album_artist_sort_key" } };
+
 /* Browse clauses, used for SELECT, WHERE, GROUP BY and for default ORDER BY
  * Keep in sync with enum query_type and indices
  * Col 1: for SELECT, Col 2: for WHERE, Col 3: for GROUP BY/ORDER BY
@@ -521,10 +719,10 @@ static const char *sort_clause[] =
 static const struct browse_clause browse_clause[] =
   {
     { "",                                      "",                 "" },
-    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort, f.album_artist" },
-    { "f.album, f.album_sort",                 "f.album",          "f.album_sort, f.album" },
+    { "f.album_artist, f.album_artist_sort",   "f.album_artist",   "f.album_artist_sort_key, f.album_artist" },
+    { "f.album, f.album_sort",                 "f.album",          "f.album_sort_key, f.album" },
     { "f.genre, f.genre",                      "f.genre",          "f.genre" },
-    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort, f.composer" },
+    { "f.composer, f.composer_sort",           "f.composer",       "f.composer_sort_key, f.composer" },
     { "f.year, f.year",                        "f.year",           "f.year" },
     { "f.disc, f.disc",                        "f.disc",           "f.disc" },
     { "f.track, f.track",                      "f.track",          "f.track" },
@@ -651,9 +849,30 @@ struct rng_ctx shuffle_rng;
 
 static char *db_path;
 static bool db_rating_updates;
+static bool db_wal_mode;
+static int db_busy_timeout;
+static bool db_fts_enabled;
+
+static struct db_wait_stats db_wait_stats = { .lck = PTHREAD_MUTEX_INITIALIZER };
+static struct db_smartpl_cache db_smartpl_cache = { .lck = PTHREAD_MUTEX_INITIALIZER, .generation = 1 };
+static struct db_query_stats_table db_query_stats = { .lck = PTHREAD_MUTEX_INITIALIZER };
+static struct db_backup_state db_backup_state = { .lck = PTHREAD_MUTEX_INITIALIZER };
+static struct db_scan_seen db_scan_seen = { .lck = PTHREAD_MUTEX_INITIALIZER };
+static struct db_table_changes_state db_table_changes = { .lck = PTHREAD_MUTEX_INITIALIZER };
+
+// Version of the last committed queue change, lets other threads validate data
+// they cached from the queue without a db query
+static int db_queue_version_committed;
+static pthread_mutex_t db_queue_version_lck = PTHREAD_MUTEX_INITIALIZER;
 
 static __thread sqlite3 *hdl;
 static __thread struct db_statements db_statements;
+static __thread struct db_stmt_cache db_stmt_cache;
+static __thread struct db_table_changes db_table_changes_pending;
+
+// Bumped when the schema changes, so threads will flush their statement cache.
+// Read on every prepare, so it is accessed with atomics instead of a lock.
+static int db_schema_generation;
 
 
 /* Forward */
@@ -730,6 +949,120 @@ db_snprintf(char *s, int n, const char *fmt, ...)
   return 0;
 }
 
+
+/* Full-text search */
+
+// Columns in the files_fts table, see db_init_fts()
+static const char *db_fts_cols[] =
+  {
+    "title",
+    "artist",
+    "album",
+    "album_artist",
+    "composer",
+    "genre",
+  };
+
+static bool
+db_fts_col_valid(const char *col)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(db_fts_cols); i++)
+    {
+      if (strcmp(col, db_fts_cols[i]) == 0)
+	return true;
+    }
+
+  return false;
+}
+
+// Only words with a letter or digit are given to FTS5, anything else the
+// tokenizer would discard anyway and an empty phrase matches nothing
+static bool
+db_fts_word_valid(const char *word)
+{
+  const unsigned char *p;
+
+  for (p = (const unsigned char *)word; *p; p++)
+    {
+      if (isalnum(*p) || *p >= 0x80)
+	return true;
+    }
+
+  return false;
+}
+
+/*
+ * Returns a filter that matches files where every word of the search string is
+ * a (diacritic and case insensitive) prefix of a word in one of the columns.
+ * Columns are given like "f.title" or "title". Returns NULL if full-text search
+ * is not available, or if the search can't be done with it, in which case the
+ * caller should fall back to LIKE. Caller must free the result.
+ */
+char *
+db_fts_filter(const char **cols, int ncols, const char *search)
+{
+  char match[1024];
+  char colspec[128];
+  char *copy;
+  char *word;
+  char *ptr;
+  const char *col;
+  int colspec_len;
+  int match_len;
+  int nwords;
+  int ret;
+  int i;
+
+  if (!db_fts_enabled || !search || ncols <= 0)
+    return NULL;
+
+  colspec_len = 0;
+  for (i = 0; i < ncols; i++)
+    {
+      col = (strncmp(cols[i], "f.", 2) == 0) ? cols[i] + 2 : cols[i];
+      if (!db_fts_col_valid(col))
+	return NULL;
+
+      ret = snprintf(colspec + colspec_len, sizeof(colspec) - colspec_len, "%s%s", (i == 0) ? "" : " ", col);
+      if (ret < 0 || ret >= sizeof(colspec) - colspec_len)
+	return NULL;
+
+      colspec_len += ret;
+    }
+
+  CHECK_NULL(L_DB, copy = strdup(search));
+
+  match_len = 0;
+  nwords = 0;
+  for (word = strtok_r(copy, " \t", &ptr); word; word = strtok_r(NULL, " \t", &ptr))
+    {
+      if (!db_fts_word_valid(word))
+	continue;
+
+      // Each word becomes {cols} : "word"*, quotes in the word are dropped
+      // since the tokenizer ignores them anyway
+      safe_snreplace(word, strlen(word) + 1, "\"", "");
+      ret = snprintf(match + match_len, sizeof(match) - match_len, "%s{%s} : \"%s\"*", (nwords == 0) ? "" : " AND ", colspec, word);
+      if (ret < 0 || ret >= sizeof(match) - match_len)
+	{
+	  free(copy);
+	  return NULL;
+	}
+
+      match_len += ret;
+      nwords++;
+    }
+
+  free(copy);
+
+  if (nwords == 0)
+    return NULL;
+
+  return db_mprintf("f.id IN (SELECT rowid FROM files_fts WHERE files_fts MATCH '%q')", match);
+}
+
 void
 free_pi(struct pairing_info *pi, int content_only)
 {
@@ -777,6 +1110,11 @@ free_mfi(struct media_file_info *mfi, int content_only)
   free(mfi->composer_sort);
   free(mfi->album_artist_sort);
   free(mfi->virtual_path);
+  free(mfi->title_sort_key);
+  free(mfi->artist_sort_key);
+  free(mfi->album_sort_key);
+  free(mfi->album_artist_sort_key);
+  free(mfi->composer_sort_key);
 
   if (!content_only)
     free(mfi);
@@ -841,6 +1179,7 @@ free_query_params(struct query_params *qp, int content_only)
   free(qp->filter);
   free(qp->having);
   free(qp->order);
+  free(qp->next_cursor);
 
   if (!content_only)
     free(qp);
@@ -1087,6 +1426,56 @@ sort_tag_create(char **sort_tag, const char *src_tag)
   *sort_tag = (char *)u8_normalize(UNINORM_NFD, (uint8_t *)&out, u8_strlen(out) + 1, NULL, &len);
 }
 
+/*
+ * Returns a key that, compared with memcmp (i.e. the BINARY collation), sorts
+ * the same way as the DAAP collation in sqlext.c compares the sort tag itself:
+ * strings that don't start with a letter go to the tail, the rest are compared
+ * case-insensitively after NFD normalization. This way ORDER BY doesn't need to
+ * normalize and case fold for every comparison.
+ *
+ * The key is the case folded NFD string, prefixed with a byte for the class of
+ * the first char. Being UTF-8 without any zero bytes it can be stored as text.
+ */
+char *
+db_sort_key(const char *sort_tag)
+{
+  ucs4_t ch;
+  uint8_t *folded;
+  size_t len;
+  char *key;
+  int ret;
+
+  if (!sort_tag)
+    return NULL;
+
+  len = strlen(sort_tag);
+
+  ret = u8_mbtoucr(&ch, (const uint8_t *)sort_tag, len);
+  if (ret < 0)
+    ch = 0; // Empty or invalid, sorts with non-alpha
+
+  folded = u8_casefold((const uint8_t *)sort_tag, len, NULL, UNINORM_NFD, NULL, &len);
+  if (!folded)
+    return NULL;
+
+  CHECK_NULL(L_DB, key = malloc(len + 2));
+
+  key[0] = uc_is_alpha(ch) ? '1' : '2';
+  memcpy(key + 1, folded, len);
+  key[len + 1] = '\0';
+
+  free(folded);
+
+  return key;
+}
+
+static void
+sort_key_create(char **key, const char *sort_tag)
+{
+  free(*key);
+  *key = db_sort_key(sort_tag);
+}
+
 static void
 fixup_sanitize(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
 {
@@ -1298,6 +1687,32 @@ fixup_sort_tags(char **tag, enum fixup_type fixup, struct fixup_ctx *ctx)
 	  sort_tag_create(tag, ctx->mfi->composer);
 	break;
 
+      // The keys are after the sort tags in mfi_cols_map, so those are set now
+      case DB_FIXUP_TITLE_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->title_sort);
+	break;
+
+      case DB_FIXUP_ARTIST_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->artist_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->album_sort);
+	break;
+
+      case DB_FIXUP_ALBUM_ARTIST_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->album_artist_sort);
+	break;
+
+      case DB_FIXUP_COMPOSER_SORT_KEY:
+	if (ctx->mfi)
+	  sort_key_create(tag, ctx->mfi->composer_sort);
+	break;
+
       default:
 	break;
     }
@@ -1430,6 +1845,64 @@ bind_qi(sqlite3_stmt *stmt, struct db_queue_item *qi)
   return bind_generic(stmt, qi, qi_cols_map, ARRAY_SIZE(qi_cols_map), qi->id);
 }
 
+/* Wait statistics */
+static void
+db_wait_stats_add(unsigned int waits, uint64_t ms)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_wait_stats.lck));
+
+  db_wait_stats.waits += waits;
+  db_wait_stats.wait_ms += ms;
+  if (ms > db_wait_stats.max_ms)
+    db_wait_stats.max_ms = ms;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_wait_stats.lck));
+}
+
+static void
+db_wait_stats_log(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_wait_stats.lck));
+
+  DPRINTF(E_INFO, L_DB, "Database waits (%s mode): %u waits, %" PRIu64 " ms total, %" PRIu64 " ms max\n",
+    db_wal_mode ? "WAL" : "shared-cache", db_wait_stats.waits, db_wait_stats.wait_ms, db_wait_stats.max_ms);
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_wait_stats.lck));
+}
+
+/* WAL mode busy handler, same backoff as SQLite's default handler, but we want
+ * to know about the waits */
+static int
+db_busy_handler(void *arg, int count)
+{
+  static const uint8_t delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+  int waited;
+  int delay;
+  int i;
+
+  for (i = 0, waited = 0; (i < count) && (i < ARRAY_SIZE(delays)); i++)
+    waited += delays[i];
+  if (count > ARRAY_SIZE(delays))
+    waited += (count - ARRAY_SIZE(delays)) * delays[ARRAY_SIZE(delays) - 1];
+
+  delay = (count < ARRAY_SIZE(delays)) ? delays[count] : delays[ARRAY_SIZE(delays) - 1];
+  if (waited + delay > db_busy_timeout)
+    {
+      DPRINTF(E_WARN, L_DB, "Database still busy after %d ms, giving up\n", waited);
+      return 0;
+    }
+
+  if (count == 0)
+    DPRINTF(E_DBG, L_DB, "Database busy, waiting for other connection\n");
+
+  usleep(delay * 1000);
+
+  // The first delay counts as a new wait, the rest just add to the duration
+  db_wait_stats_add((count == 0) ? 1 : 0, delay);
+
+  return 1;
+}
+
 /* Unlock notification support */
 static void
 unlock_notify_cb(void **args, int nargs)
@@ -1454,6 +1927,8 @@ static int
 db_wait_unlock(void)
 {
   struct db_unlock u;
+  struct timespec start;
+  struct timespec end;
   int ret;
 
   u.proceed = 0;
@@ -1468,7 +1943,12 @@ db_wait_unlock(void)
       if (!u.proceed)
 	{
 	  DPRINTF(E_INFO, L_DB, "Waiting for database unlock\n");
+
+	  clock_gettime(CLOCK_MONOTONIC, &start);
 	  CHECK_ERR(L_DB, pthread_cond_wait(&u.cond, &u.lck));
+	  clock_gettime(CLOCK_MONOTONIC, &end);
+
+	  db_wait_stats_add(1, (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
 	}
 
       CHECK_ERR(L_DB, pthread_mutex_unlock(&u.lck));
@@ -1480,20 +1960,60 @@ db_wait_unlock(void)
   return ret;
 }
 
+/* Waits for the shared cache lock before a statement is retried. If the lock
+ * is released before we get to wait, the notification comes at once, so after
+ * the first retry there is also a short sleep, so that we don't spin.
+ */
+static int
+db_locked_wait(int retries)
+{
+  int ret;
+
+  if (retries >= DB_LOCKED_RETRIES)
+    {
+      DPRINTF(E_LOG, L_DB, "Database still locked after %d retries, giving up\n", retries);
+      return SQLITE_LOCKED;
+    }
+
+  ret = db_wait_unlock();
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
+      return ret;
+    }
+
+  if (retries > 0)
+    usleep(MIN(retries, 10) * 1000);
+
+  return SQLITE_OK;
+}
+
 static int
 db_blocking_step(sqlite3_stmt *stmt)
 {
+  int retries;
   int ret;
 
-  while ((ret = sqlite3_step(stmt)) == SQLITE_LOCKED)
+  // In WAL mode there is no unlock notification, instead the busy handler will
+  // have waited up to busy_timeout. We don't want to fail a write just because
+  // another thread has a long write transaction, so give it a few more tries.
+  if (db_wal_mode)
     {
-      ret = db_wait_unlock();
-      if (ret != SQLITE_OK)
+      for (retries = 0; ((ret = sqlite3_step(stmt)) == SQLITE_BUSY) && (retries < DB_BUSY_RETRIES); retries++)
 	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
+	  DPRINTF(E_WARN, L_DB, "Database busy, retrying (%d)\n", retries);
+	  sqlite3_reset(stmt);
 	}
 
+      return ret;
+    }
+
+  for (retries = 0; (ret = sqlite3_step(stmt)) == SQLITE_LOCKED; retries++)
+    {
+      ret = db_locked_wait(retries);
+      if (ret != SQLITE_OK)
+	break;
+
       sqlite3_reset(stmt);
     }
 
@@ -1503,64 +2023,232 @@ db_blocking_step(sqlite3_stmt *stmt)
 static int
 db_blocking_prepare_v2(const char *query, int len, sqlite3_stmt **stmt, const char **end)
 {
+  int retries;
   int ret;
 
-  while ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED)
+  if (db_wal_mode)
+    {
+      for (retries = 0; ((ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_BUSY) && (retries < DB_BUSY_RETRIES); retries++)
+	DPRINTF(E_WARN, L_DB, "Database busy, retrying prepare (%d)\n", retries);
+
+      return ret;
+    }
+
+  for (retries = 0; (ret = sqlite3_prepare_v2(hdl, query, len, stmt, end)) == SQLITE_LOCKED; retries++)
     {
-      ret = db_wait_unlock();
+      ret = db_locked_wait(retries);
       if (ret != SQLITE_OK)
-	{
-	  DPRINTF(E_LOG, L_DB, "Database deadlocked!\n");
-	  break;
-	}
+	break;
     }
 
   return ret;
 }
 
-static int
-db_statement_run(sqlite3_stmt *stmt, short update_events)
+
+/* Prepared statement cache */
+static void
+db_stmt_cache_stats_log(void)
 {
-  int ret;
-  int changes = 0;
+  struct db_stmt_cache *cache = &db_stmt_cache;
+  unsigned int lookups;
+  int entries;
+  int i;
 
-#ifdef HAVE_SQLITE3_EXPANDED_SQL
-  char *query;
-  if (logger_severity() >= E_DBG)
+  lookups = cache->hits + cache->misses;
+  if (lookups == 0)
+    return;
+
+  for (i = 0, entries = 0; i < DB_STMT_CACHE_SIZE; i++)
     {
-      query = sqlite3_expanded_sql(stmt);
-      DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
-      sqlite3_free(query);
+      if (cache->entries[i].query)
+	entries++;
     }
-#else
-  DPRINTF(E_DBG, L_DB, "Running query (prepared statement)\n");
-#endif
 
-  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
-    ; /* EMPTY */
+  DPRINTF(E_DBG, L_DB, "Statement cache: %u lookups, %u hits (%.1f%%), %u evictions, %d/%d entries\n",
+    lookups, cache->hits, 100.0 * cache->hits / lookups, cache->evictions, entries, DB_STMT_CACHE_SIZE);
+}
 
-  if (ret != SQLITE_DONE)
+// Statements that are in use when the cache is flushed are just forgotten, they
+// will then be finalized by db_stmt_cache_release()
+static void
+db_stmt_cache_flush(void)
+{
+  struct db_stmt_cache_entry *entry;
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
-    }
+      entry = &db_stmt_cache.entries[i];
+      if (!entry->query)
+	continue;
 
-  sqlite3_reset(stmt);
-  sqlite3_clear_bindings(stmt);
+      if (!entry->in_use)
+	sqlite3_finalize(entry->stmt);
 
-  changes = sqlite3_changes(hdl);
-  if (update_events && changes > 0)
-    library_update_trigger(update_events);
+      free(entry->query);
+      memset(entry, 0, sizeof(struct db_stmt_cache_entry));
+    }
+}
 
-  return (ret == SQLITE_DONE) ? changes : -1;
+static int
+db_schema_generation_get(void)
+{
+  return __atomic_load_n(&db_schema_generation, __ATOMIC_ACQUIRE);
 }
 
+static void
+db_stmt_cache_invalidate(void)
+{
+  db_stmt_cache.generation = __atomic_add_fetch(&db_schema_generation, 1, __ATOMIC_ACQ_REL);
+
+  db_stmt_cache_flush();
+}
 
-/* Modelled after sqlite3_exec() */
 static int
-db_exec(const char *query, char **errmsg)
+db_stmt_cache_prepare(sqlite3_stmt **stmt, const char *query)
 {
-  sqlite3_stmt *stmt;
-  int try;
+  struct db_stmt_cache *cache = &db_stmt_cache;
+  struct db_stmt_cache_entry *entry;
+  struct db_stmt_cache_entry *slot;
+  uint32_t hash;
+  int generation;
+  int ret;
+  int i;
+
+  generation = db_schema_generation_get();
+  if (cache->generation != generation)
+    {
+      DPRINTF(E_DBG, L_DB, "Schema changed, flushing statement cache\n");
+
+      db_stmt_cache_flush();
+      cache->generation = generation;
+    }
+
+  if ((cache->hits + cache->misses + 1) % DB_STMT_CACHE_STATS_INTERVAL == 0)
+    db_stmt_cache_stats_log();
+
+  hash = djb_hash(query, strlen(query));
+  cache->clock++;
+
+  slot = NULL;
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      entry = &cache->entries[i];
+
+      if (entry->query && !entry->in_use && entry->hash == hash && strcmp(entry->query, query) == 0)
+	{
+	  cache->hits++;
+
+	  entry->in_use = true;
+	  entry->last_used = cache->clock;
+	  *stmt = entry->stmt;
+	  return SQLITE_OK;
+	}
+
+      // Prefer an empty slot, otherwise the least recently used idle statement
+      if (entry->in_use || (slot && !slot->query))
+	continue;
+      if (!slot || !entry->query || entry->last_used < slot->last_used)
+	slot = entry;
+    }
+
+  cache->misses++;
+
+  ret = db_blocking_prepare_v2(query, -1, stmt, NULL);
+  if (ret != SQLITE_OK)
+    return ret;
+
+  // All statements in use (nested queries), so caller gets an uncached one
+  if (!slot)
+    return SQLITE_OK;
+
+  if (slot->query)
+    {
+      cache->evictions++;
+
+      sqlite3_finalize(slot->stmt);
+      free(slot->query);
+    }
+
+  slot->query = strdup(query);
+  if (!slot->query)
+    {
+      memset(slot, 0, sizeof(struct db_stmt_cache_entry));
+      return SQLITE_OK;
+    }
+
+  slot->hash = hash;
+  slot->stmt = *stmt;
+  slot->in_use = true;
+  slot->last_used = cache->clock;
+
+  return SQLITE_OK;
+}
+
+static void
+db_stmt_cache_release(sqlite3_stmt *stmt)
+{
+  struct db_stmt_cache_entry *entry;
+  int i;
+
+  for (i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    {
+      entry = &db_stmt_cache.entries[i];
+      if (entry->stmt != stmt || !entry->in_use)
+	continue;
+
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      entry->in_use = false;
+      return;
+    }
+
+  sqlite3_finalize(stmt);
+}
+
+static int
+db_statement_run(sqlite3_stmt *stmt, short update_events)
+{
+  int ret;
+  int changes = 0;
+
+#ifdef HAVE_SQLITE3_EXPANDED_SQL
+  char *query;
+  if (logger_severity() >= E_DBG)
+    {
+      query = sqlite3_expanded_sql(stmt);
+      DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+      sqlite3_free(query);
+    }
+#else
+  DPRINTF(E_DBG, L_DB, "Running query (prepared statement)\n");
+#endif
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    ; /* EMPTY */
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+    }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  changes = sqlite3_changes(hdl);
+  if (update_events && changes > 0)
+    library_update_trigger(update_events);
+
+  return (ret == SQLITE_DONE) ? changes : -1;
+}
+
+
+/* Modelled after sqlite3_exec() */
+static int
+db_exec(const char *query, char **errmsg)
+{
+  sqlite3_stmt *stmt;
+  int try;
   int ret;
 
   *errmsg = NULL;
@@ -1661,6 +2349,206 @@ db_set_cfg_names(void)
 #undef Q_TMPL
 }
 
+#define Q_LIBRARY_COUNTS_GET \
+  "SELECT files, streams, song_length, file_size, artists, albums, playlists FROM library_counts WHERE id = 1;"
+#define Q_LIBRARY_COUNTS_ACTUAL \
+  "SELECT COUNT(*), IFNULL(SUM(data_kind = 1), 0), IFNULL(SUM(song_length), 0), IFNULL(SUM(file_size), 0)," \
+  " COUNT(DISTINCT songartistid), COUNT(DISTINCT songalbumid)," \
+  " (SELECT COUNT(*) FROM playlists WHERE disabled = 0) FROM files WHERE disabled = 0;"
+#define Q_LIBRARY_COUNTS_SET \
+  "INSERT OR REPLACE INTO library_counts (id, files, streams, song_length, file_size, artists, albums, playlists)" \
+  " VALUES (1, %u, %u, %" PRIu64 ", %" PRIu64 ", %u, %u, %u);"
+
+// Runs Q_LIBRARY_COUNTS_GET (constant time) or Q_LIBRARY_COUNTS_ACTUAL (full scan)
+static int
+library_counts_get(struct db_library_counts *lc, const char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  memset(lc, 0, sizeof(struct db_library_counts));
+
+  ret = db_stmt_cache_prepare(&stmt, query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+      db_stmt_cache_release(stmt);
+      return -1;
+    }
+
+  lc->files       = sqlite3_column_int(stmt, 0);
+  lc->streams     = sqlite3_column_int(stmt, 1);
+  lc->song_length = sqlite3_column_int64(stmt, 2);
+  lc->file_size   = sqlite3_column_int64(stmt, 3);
+  lc->artists     = sqlite3_column_int(stmt, 4);
+  lc->albums      = sqlite3_column_int(stmt, 5);
+  lc->playlists   = sqlite3_column_int(stmt, 6);
+
+  db_stmt_cache_release(stmt);
+  return 0;
+}
+
+// Compares the counters with the actual library and rebuilds them if they have
+// drifted, which should only happen if the db was modified by something else
+static void
+library_counts_verify(void)
+{
+  struct db_library_counts stored;
+  struct db_library_counts actual;
+  char *query;
+  int ret;
+
+  // A read transaction, even if it may write in the end. That is rare, and the
+  // write is just retried on the next startup if it fails.
+  ret = db_transaction_begin();
+  if (ret < 0)
+    return;
+
+  ret = library_counts_get(&stored, Q_LIBRARY_COUNTS_GET);
+  if (ret < 0)
+    memset(&stored, 0xff, sizeof(struct db_library_counts)); // Missing row, force rebuild
+
+  ret = library_counts_get(&actual, Q_LIBRARY_COUNTS_ACTUAL);
+  if (ret < 0 || memcmp(&stored, &actual, sizeof(struct db_library_counts)) == 0)
+    {
+      db_transaction_end();
+      return;
+    }
+
+  DPRINTF(E_LOG, L_DB, "Library counters out of sync (files %u/%u, artists %u/%u, albums %u/%u, playlists %u/%u), rebuilding\n",
+	  stored.files, actual.files, stored.artists, actual.artists, stored.albums, actual.albums, stored.playlists, actual.playlists);
+
+  query = sqlite3_mprintf(Q_LIBRARY_COUNTS_SET, actual.files, actual.streams, actual.song_length, actual.file_size,
+			  actual.artists, actual.albums, actual.playlists);
+  db_query_run(query, 1, 0);
+
+  db_transaction_end();
+}
+
+static void
+smartpl_cache_invalidate(void)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+  db_smartpl_cache.generation++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+}
+
+static void
+smartpl_cache_listener_cb(short event_mask)
+{
+  smartpl_cache_invalidate();
+}
+
+static void
+smartpl_cache_clear(void)
+{
+  int i;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+  DPRINTF(E_DBG, L_DB, "Smart playlist count cache: %u hits, %u misses\n", db_smartpl_cache.hits, db_smartpl_cache.misses);
+
+  for (i = 0; i < DB_SMARTPL_CACHE_SIZE; i++)
+    {
+      free(db_smartpl_cache.entries[i].query);
+      memset(&db_smartpl_cache.entries[i], 0, sizeof(struct db_smartpl_count));
+    }
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+}
+
+// Gets the item and stream count of a smart playlist query, if possible from
+// the cache. The count query runs without holding the lock, and the result is
+// stored with the generation from before the query, so a concurrent library
+// change leaves it stale.
+static int
+smartpl_count_get(uint32_t *nitems, uint32_t *nstreams, const char *query)
+{
+  struct db_smartpl_count *entry;
+  struct db_smartpl_count *slot;
+  unsigned int generation;
+  uint32_t hash;
+  uint32_t items;
+  uint32_t streams;
+  int ret;
+  int i;
+
+  if (!query)
+    return db_files_get_count(nitems, nstreams, NULL);
+
+  // Relative dates like "in the last 2 weeks" are compiled to datetime('now',
+  // ...), so the count also changes with time and can't be cached until the
+  // library changes
+  if (strstr(query, "'now'"))
+    return db_files_get_count(nitems, nstreams, query);
+
+  hash = djb_hash(query, strlen(query));
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+  generation = db_smartpl_cache.generation;
+  for (i = 0; i < DB_SMARTPL_CACHE_SIZE; i++)
+    {
+      entry = &db_smartpl_cache.entries[i];
+      if (entry->generation == generation && entry->hash == hash && strcmp(entry->query, query) == 0)
+	{
+	  *nitems = entry->items;
+	  *nstreams = entry->streams;
+	  db_smartpl_cache.hits++;
+	  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+	  return 0;
+	}
+    }
+  db_smartpl_cache.misses++;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+
+  ret = db_files_get_count(&items, &streams, query);
+  if (ret < 0)
+    return -1;
+
+  *nitems = items;
+  *nstreams = streams;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_smartpl_cache.lck));
+  // Reuse the entry for the same query, or a stale one, or evict round-robin
+  slot = NULL;
+  for (i = 0; i < DB_SMARTPL_CACHE_SIZE; i++)
+    {
+      entry = &db_smartpl_cache.entries[i];
+      if (entry->query && entry->hash == hash && strcmp(entry->query, query) == 0)
+	{
+	  slot = entry;
+	  break;
+	}
+      if (!slot && entry->generation != db_smartpl_cache.generation)
+	slot = entry;
+    }
+
+  if (!slot)
+    {
+      slot = &db_smartpl_cache.entries[db_smartpl_cache.next_evict];
+      db_smartpl_cache.next_evict = (db_smartpl_cache.next_evict + 1) % DB_SMARTPL_CACHE_SIZE;
+    }
+
+  if (!slot->query || slot->hash != hash || strcmp(slot->query, query) != 0)
+    {
+      free(slot->query);
+      slot->query = strdup(query);
+      slot->hash = hash;
+    }
+
+  slot->items = items;
+  slot->streams = streams;
+  slot->generation = slot->query ? generation : 0;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_smartpl_cache.lck));
+
+  return 0;
+}
+
 void
 db_hook_post_scan(void)
 {
@@ -1668,6 +2556,10 @@ db_hook_post_scan(void)
 
   db_pragma_optimize();
 
+  library_counts_verify();
+
+  db_wait_stats_log();
+
   DPRINTF(E_DBG, L_DB, "Done with post-scan DB maintenance\n");
 }
 
@@ -1681,12 +2573,14 @@ db_purge_cruft(time_t ref)
   char *queries_tmpl[4] =
     {
       "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 ");",
-      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 ");",
+      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND NOT scan_seen(f.id));",
       "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 ";",
-      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 ";",
+      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND NOT scan_seen(id);",
     };
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    return;
 
   for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
     {
@@ -1734,12 +2628,14 @@ db_purge_cruft_bysource(time_t ref, enum scan_kind scan_kind)
   char *queries_tmpl[4] =
     {
       "DELETE FROM playlistitems WHERE playlistid IN (SELECT p.id FROM playlists p WHERE p.type <> %d AND p.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
-      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND scan_kind = %d);",
+      "DELETE FROM playlistitems WHERE filepath IN (SELECT f.path FROM files f WHERE -1 <> %d AND f.db_timestamp < %" PRIi64 " AND scan_kind = %d AND NOT scan_seen(f.id));",
       "DELETE FROM playlists WHERE type <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
-      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d;",
+      "DELETE FROM files WHERE -1 <> %d AND db_timestamp < %" PRIi64 " AND scan_kind = %d AND NOT scan_seen(id);",
     };
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    return;
 
   for (i = 0; i < (sizeof(queries_tmpl) / sizeof(queries_tmpl[0])); i++)
     {
@@ -1782,12 +2678,13 @@ db_purge_all(void)
 {
 #define Q_TMPL_PL "DELETE FROM playlists WHERE type <> %d;"
 #define Q_TMPL_DIR "DELETE FROM directories WHERE id >= %d;"
-  char *queries[4] =
+  char *queries[5] =
     {
       "DELETE FROM inotify;",
       "DELETE FROM playlistitems;",
       "DELETE FROM files;",
       "DELETE FROM groups;",
+      "DELETE FROM group_stats;",
     };
   char *errmsg;
   char *query;
@@ -1898,10 +2795,9 @@ db_get_one_int(const char *query)
 
 
 /* Transactions */
-void
-db_transaction_begin(void)
+static int
+transaction_begin(const char *query)
 {
-  char *query = "BEGIN TRANSACTION;";
   char *errmsg;
   int ret;
 
@@ -1913,7 +2809,26 @@ db_transaction_begin(void)
       DPRINTF(E_LOG, L_DB, "SQL error running '%s': %s\n", query, errmsg);
 
       sqlite3_free(errmsg);
+      return -1;
     }
+
+  return 0;
+}
+
+int
+db_transaction_begin(void)
+{
+  return transaction_begin("BEGIN TRANSACTION;");
+}
+
+int
+db_transaction_begin_write(void)
+{
+  // In WAL mode, take the write lock up front. Upgrading a read transaction to
+  // a write transaction can fail with SQLITE_BUSY without the busy handler
+  // being called, since that could deadlock. Readers should not do this, since
+  // they would then wait for writers, which WAL otherwise lets them avoid.
+  return transaction_begin(db_wal_mode ? "BEGIN IMMEDIATE TRANSACTION;" : "BEGIN TRANSACTION;");
 }
 
 void
@@ -1958,14 +2873,453 @@ db_free_query_clause(struct query_clause *qc)
   if (!qc)
     return;
 
+  sqlite3_free(qc->cols);
   sqlite3_free(qc->where);
   sqlite3_free(qc->group);
   sqlite3_free(qc->having);
   sqlite3_free(qc->order);
   sqlite3_free(qc->index);
+  sqlite3_free(qc->keyset_cols);
+  sqlite3_free(qc->keyset);
   free(qc);
 }
 
+static inline bool
+db_query_has_cols(struct query_params *qp)
+{
+  return (qp->cols[0] || qp->cols[1]);
+}
+
+static inline bool
+db_query_col_wanted(struct query_params *qp, int col)
+{
+  if (!db_query_has_cols(qp))
+    return true;
+
+  return (qp->cols[col / 64] & ((uint64_t)1 << (col % 64)));
+}
+
+int
+db_query_add_col(struct query_params *qp, ssize_t mfi_offset)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (mfi_cols_map[i].offset != mfi_offset)
+	continue;
+
+      qp->cols[i / 64] |= ((uint64_t)1 << (i % 64));
+      return 0;
+    }
+
+  DPRINTF(E_LOG, L_DB, "BUG: Unknown mfi offset %zd in db_query_add_col()\n", mfi_offset);
+  return -1;
+}
+
+// Columns not wanted are selected as NULL, so that the position of the columns
+// still matches the column maps
+static char *
+db_build_query_cols(struct query_params *qp)
+{
+  char *cols;
+  char *next;
+  int i;
+
+  if (!db_query_has_cols(qp))
+    return sqlite3_mprintf("f.*");
+
+  cols = NULL;
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (db_query_col_wanted(qp, i))
+	next = sqlite3_mprintf("%z%sf.%s", cols, cols ? ", " : "", mfi_cols_map[i].name);
+      else
+	next = sqlite3_mprintf("%z%sNULL", cols, cols ? ", " : "");
+
+      if (!next)
+	return NULL;
+
+      cols = next;
+    }
+
+  return cols;
+}
+
+static const struct keyset_clause *
+keyset_clause_get(struct query_params *qp)
+{
+  if (qp->type == Q_GROUP_ALBUMS && qp->sort == S_ALBUM)
+    return &keyset_album_clause;
+  else if (qp->type == Q_GROUP_ARTISTS && qp->sort == S_ARTIST)
+    return &keyset_artist_clause;
+  else if (qp->type == Q_GROUP_ALBUMS || qp->type == Q_GROUP_ARTISTS)
+    return NULL;
+
+  return &keyset_clause[qp->sort];
+}
+
+static int
+keyset_nkeys(const struct keyset_clause *ksc)
+{
+  int n;
+
+  for (n = 0; n < KEYSET_KEYS_MAX && ksc->keys[n]; n++)
+    ; /* EMPTY */
+
+  return n;
+}
+
+static void
+keyset_cursor_free(struct keyset_cursor *kc)
+{
+  free(kc->buf);
+  kc->buf = NULL;
+}
+
+// A cursor is the sort type followed by the keys and id of a row, encoded as
+// "n;" for NULL, "i<int>;" for integers and "t<length>:<text>" for text. It is
+// base64url encoded, so that it can be passed as a query parameter.
+static char *
+keyset_cursor_encode(sqlite3_stmt *stmt, const struct keyset_clause *ksc, enum sort_type sort)
+{
+  const char *text;
+  char *raw;
+  char *cursor;
+  int nvalues;
+  int col;
+  int i;
+
+  nvalues = keyset_nkeys(ksc) + 1;
+  col = sqlite3_column_count(stmt) - nvalues;
+  if (col < 0)
+    return NULL;
+
+  raw = sqlite3_mprintf("%d;", sort);
+  for (i = 0; raw && i < nvalues; i++, col++)
+    {
+      switch (sqlite3_column_type(stmt, col))
+	{
+	  case SQLITE_NULL:
+	    raw = sqlite3_mprintf("%zn;", raw);
+	    break;
+
+	  case SQLITE_INTEGER:
+	    raw = sqlite3_mprintf("%zi%lld;", raw, (long long)sqlite3_column_int64(stmt, col));
+	    break;
+
+	  case SQLITE_TEXT:
+	    text = (const char *)sqlite3_column_text(stmt, col);
+	    raw = sqlite3_mprintf("%zt%d:%s", raw, sqlite3_column_bytes(stmt, col), text);
+	    break;
+
+	  default:
+	    DPRINTF(E_LOG, L_DB, "BUG: Unsupported column type for keyset cursor (sort %d)\n", sort);
+	    sqlite3_free(raw);
+	    return NULL;
+	}
+    }
+
+  if (!raw)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for keyset cursor\n");
+      return NULL;
+    }
+
+  cursor = b64_encode((uint8_t *)raw, strlen(raw));
+  sqlite3_free(raw);
+  if (!cursor)
+    return NULL;
+
+  for (i = 0; cursor[i]; i++)
+    {
+      if (cursor[i] == '+')
+	cursor[i] = '-';
+      else if (cursor[i] == '/')
+	cursor[i] = '_';
+      else if (cursor[i] == '=')
+	cursor[i] = '\0';
+    }
+
+  return cursor;
+}
+
+static int
+keyset_cursor_decode(struct keyset_cursor *kc, const char *cursor, const struct keyset_clause *ksc, enum sort_type sort)
+{
+  char *b64;
+  char *p;
+  char *end;
+  int len;
+  int i;
+
+  memset(kc, 0, sizeof(struct keyset_cursor));
+
+  len = strlen(cursor);
+  CHECK_NULL(L_DB, b64 = calloc(1, len + 4));
+
+  for (i = 0; i < len; i++)
+    {
+      if (cursor[i] == '-')
+	b64[i] = '+';
+      else if (cursor[i] == '_')
+	b64[i] = '/';
+      else
+	b64[i] = cursor[i];
+    }
+  for (; i % 4; i++)
+    b64[i] = '=';
+
+  kc->buf = b64_decode(&len, b64);
+  free(b64);
+  if (!kc->buf)
+    goto invalid;
+
+  p = (char *)kc->buf;
+  end = p + len;
+
+  if (strtol(p, &p, 10) != sort || *p != ';')
+    goto invalid;
+  p++;
+
+  kc->nvalues = keyset_nkeys(ksc) + 1;
+  for (i = 0; i < kc->nvalues; i++)
+    {
+      if (p >= end)
+	goto invalid;
+
+      switch (*p++)
+	{
+	  case 'n':
+	    kc->values[i].type = SQLITE_NULL;
+	    break;
+
+	  case 'i':
+	    kc->values[i].type = SQLITE_INTEGER;
+	    kc->values[i].intval = strtoll(p, &p, 10);
+	    break;
+
+	  case 't':
+	    kc->values[i].type = SQLITE_TEXT;
+	    kc->values[i].len = strtol(p, &p, 10);
+	    if (*p != ':' || kc->values[i].len < 0 || kc->values[i].len > end - p - 1)
+	      goto invalid;
+
+	    kc->values[i].text = ++p;
+	    p += kc->values[i].len;
+	    continue;
+
+	  default:
+	    goto invalid;
+	}
+
+      // b64_decode() zero terminates, so this can't read past the end
+      if (*p != ';')
+	goto invalid;
+      p++;
+    }
+
+  // The id is never NULL
+  if (p != end || kc->values[kc->nvalues - 1].type != SQLITE_INTEGER)
+    goto invalid;
+
+  return 0;
+
+ invalid:
+  DPRINTF(E_LOG, L_DB, "Invalid cursor '%s' for sort type %d\n", cursor, sort);
+  keyset_cursor_free(kc);
+  return -1;
+}
+
+// Builds the extra columns, the condition and the ORDER BY for reading a page
+// with I_KEYSET. The condition means (keys, id) > (cursor keys, cursor id), but
+// is written out so that NULL keys compare like they sort, and so that SQLite
+// can seek to the first key with an index.
+static int
+db_build_query_keyset(struct query_clause *qc, struct query_params *qp, const char *id_col)
+{
+  const struct keyset_clause *ksc;
+  struct keyset_cursor kc;
+  const char *key;
+  char *cond;
+  int nkeys;
+  int i;
+
+  if (qp->order || qp->group)
+    {
+      DPRINTF(E_LOG, L_DB, "Keyset pagination is not supported with a custom order or group\n");
+      return -1;
+    }
+
+  ksc = keyset_clause_get(qp);
+  if (!ksc)
+    {
+      DPRINTF(E_LOG, L_DB, "Keyset pagination is not supported for query type %d with sort type %d\n", qp->type, qp->sort);
+      return -1;
+    }
+
+  nkeys = keyset_nkeys(ksc);
+
+  sqlite3_free(qc->order);
+
+  qc->keyset_cols = sqlite3_mprintf("");
+  qc->order = sqlite3_mprintf("ORDER BY");
+  for (i = 0; i < nkeys; i++)
+    {
+      qc->keyset_cols = sqlite3_mprintf("%z, %s", qc->keyset_cols, ksc->keys[i]);
+      qc->order = sqlite3_mprintf("%z %s%s,", qc->order, ksc->keys[i], ksc->desc ? " DESC" : "");
+    }
+  qc->keyset_cols = sqlite3_mprintf("%z, %s", qc->keyset_cols, id_col);
+  qc->order = sqlite3_mprintf("%z %s%s", qc->order, id_col, ksc->desc ? " DESC" : "");
+
+  if (!qp->cursor || !*qp->cursor)
+    {
+      qc->keyset = sqlite3_mprintf("");
+      goto out;
+    }
+
+  if (keyset_cursor_decode(&kc, qp->cursor, ksc, qp->sort) < 0)
+    return -1;
+
+  cond = sqlite3_mprintf("%s %s :k%d", id_col, ksc->desc ? "<" : ">", nkeys);
+  for (i = nkeys - 1; i >= 0; i--)
+    {
+      key = ksc->keys[i];
+
+      if (kc.values[i].type == SQLITE_NULL && ksc->desc)
+	cond = sqlite3_mprintf("(%s IS NULL AND %z)", key, cond);
+      else if (kc.values[i].type == SQLITE_NULL)
+	cond = sqlite3_mprintf("(%s IS NOT NULL OR (%s IS NULL AND %z))", key, key, cond);
+      else if (ksc->desc)
+	cond = sqlite3_mprintf("(%s < :k%d OR %s IS NULL OR (%s = :k%d AND %z))", key, i, key, key, i, cond);
+      else
+	cond = sqlite3_mprintf("(%s > :k%d OR (%s = :k%d AND %z))", key, i, key, i, cond);
+    }
+
+  if (nkeys > 0 && kc.values[0].type != SQLITE_NULL && ksc->desc)
+    qc->keyset = sqlite3_mprintf("AND (%s <= :k0 OR %s IS NULL) AND %z", ksc->keys[0], ksc->keys[0], cond);
+  else if (nkeys > 0 && kc.values[0].type != SQLITE_NULL)
+    qc->keyset = sqlite3_mprintf("AND %s >= :k0 AND %z", ksc->keys[0], cond);
+  else
+    qc->keyset = sqlite3_mprintf("AND %z", cond);
+
+  keyset_cursor_free(&kc);
+
+ out:
+  if (!qc->keyset_cols || !qc->order || !qc->keyset)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for keyset clause\n");
+      return -1;
+    }
+
+  return 0;
+}
+
+static void
+db_query_keyset_reset(struct query_params *qp)
+{
+  if (qp->idx_type != I_KEYSET)
+    return;
+
+  free(qp->next_cursor);
+  qp->next_cursor = NULL;
+  qp->keyset_rows = 0;
+}
+
+// Only the last row of a full page is needed for the cursor of the next page
+static void
+db_query_keyset_update(struct query_params *qp)
+{
+  if (qp->idx_type != I_KEYSET)
+    return;
+
+  qp->keyset_rows++;
+  if (qp->limit > 0 && qp->keyset_rows == qp->limit)
+    qp->next_cursor = keyset_cursor_encode(qp->stmt, keyset_clause_get(qp), qp->sort);
+}
+
+bool
+db_query_cursor_valid(struct query_params *qp)
+{
+  const struct keyset_clause *ksc;
+  struct keyset_cursor kc;
+
+  if (!qp->cursor || !*qp->cursor)
+    return true;
+
+  ksc = keyset_clause_get(qp);
+  if (!ksc || keyset_cursor_decode(&kc, qp->cursor, ksc, qp->sort) < 0)
+    return false;
+
+  keyset_cursor_free(&kc);
+  return true;
+}
+
+static void
+db_query_bind_keyset(sqlite3_stmt *stmt, struct query_params *qp)
+{
+  struct keyset_cursor kc;
+  char name[8];
+  int idx;
+  int i;
+
+  // Already validated when the query was built
+  if (keyset_cursor_decode(&kc, qp->cursor, keyset_clause_get(qp), qp->sort) < 0)
+    return;
+
+  for (i = 0; i < kc.nvalues; i++)
+    {
+      snprintf(name, sizeof(name), ":k%d", i);
+
+      idx = sqlite3_bind_parameter_index(stmt, name);
+      if (idx <= 0)
+	continue;
+
+      if (kc.values[i].type == SQLITE_INTEGER)
+	sqlite3_bind_int64(stmt, idx, kc.values[i].intval);
+      else if (kc.values[i].type == SQLITE_TEXT)
+	sqlite3_bind_text(stmt, idx, kc.values[i].text, kc.values[i].len, SQLITE_TRANSIENT);
+    }
+
+  keyset_cursor_free(&kc);
+}
+
+// The keyset condition goes in the WHERE, which is made non-empty
+static int
+db_build_query_keyset_clause(struct query_clause *qc, struct query_params *qp)
+{
+  const char *id_col;
+
+  switch (qp->type)
+    {
+      case Q_ITEMS:
+      case Q_PL:
+      case Q_FIND_PL:
+	id_col = "f.id";
+	break;
+
+      case Q_GROUP_ALBUMS:
+      case Q_GROUP_ARTISTS:
+	id_col = "g.id";
+	break;
+
+      default:
+	DPRINTF(E_LOG, L_DB, "Keyset pagination is not supported for query type %d\n", qp->type);
+	return -1;
+    }
+
+  if (db_build_query_keyset(qc, qp, id_col) < 0)
+    return -1;
+
+  if (qc->where && qc->where[0] == '\0')
+    {
+      sqlite3_free(qc->where);
+      qc->where = sqlite3_mprintf("WHERE 1 = 1");
+    }
+
+  return 0;
+}
+
 static struct query_clause *
 db_build_query_clause(struct query_params *qp)
 {
@@ -1975,6 +3329,8 @@ db_build_query_clause(struct query_params *qp)
   if (!qc)
     goto error;
 
+  qc->cols = db_build_query_cols(qp);
+
   if (qp->type & Q_F_BROWSE)
     qc->group = sqlite3_mprintf("GROUP BY %s", browse_clause[qp->type & ~Q_F_BROWSE].group);
   else if (qp->group)
@@ -1991,6 +3347,9 @@ db_build_query_clause(struct query_params *qp)
   else
     qc->where = sqlite3_mprintf("");
 
+  if (qp->media_kind)
+    qc->where = sqlite3_mprintf("%z %s f.media_kind = %d", qc->where, (qc->where && qc->where[0]) ? "AND" : "WHERE", qp->media_kind);
+
   if (qp->having && (qp->type & (Q_GROUP_ALBUMS | Q_GROUP_ARTISTS)))
     qc->having = sqlite3_mprintf("HAVING %s", qp->having);
   else
@@ -2009,20 +3368,27 @@ db_build_query_clause(struct query_params *qp)
     {
       case I_FIRST:
 	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d", qp->limit);
+	  qc->index = sqlite3_mprintf("LIMIT :limit");
 	else
 	  qc->index = sqlite3_mprintf("");
 	break;
 
       case I_LAST:
-	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->results - qp->limit);
+	qc->index = sqlite3_mprintf("LIMIT -1 OFFSET :offset");
 	break;
 
       case I_SUB:
 	if (qp->limit)
-	  qc->index = sqlite3_mprintf("LIMIT %d OFFSET %d", qp->limit, qp->offset);
+	  qc->index = sqlite3_mprintf("LIMIT :limit OFFSET :offset");
+	else
+	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET :offset");
+	break;
+
+      case I_KEYSET:
+	if (qp->limit > 0)
+	  qc->index = sqlite3_mprintf("LIMIT :limit");
 	else
-	  qc->index = sqlite3_mprintf("LIMIT -1 OFFSET %d", qp->offset);
+	  qc->index = sqlite3_mprintf("");
 	break;
 
       case I_NONE:
@@ -2030,15 +3396,94 @@ db_build_query_clause(struct query_params *qp)
 	break;
     }
 
-  if (!qc->where || !qc->index)
-    goto error;
+  if (qp->idx_type == I_KEYSET)
+    {
+      if (db_build_query_keyset_clause(qc, qp) < 0)
+	goto error;
+    }
+  else
+    {
+      qc->keyset_cols = sqlite3_mprintf("");
+      qc->keyset = sqlite3_mprintf("");
+    }
+
+  if (!qc->cols || !qc->where || !qc->index || !qc->keyset_cols || !qc->keyset)
+    goto error;
+
+  return qc;
+
+ error:
+  DPRINTF(E_LOG, L_DB, "Error building query clause\n");
+  db_free_query_clause(qc);
+  return NULL;
+}
+
+// Binds the query parameters that the query builders don't print into the query
+// text, so that the statement can be reused from the statement cache
+static void
+db_query_bind(sqlite3_stmt *stmt, struct query_params *qp)
+{
+  int idx;
+
+  idx = sqlite3_bind_parameter_index(stmt, ":id");
+  if (idx > 0)
+    sqlite3_bind_int(stmt, idx, qp->id);
+
+  idx = sqlite3_bind_parameter_index(stmt, ":persistentid");
+  if (idx > 0)
+    sqlite3_bind_int64(stmt, idx, qp->persistentid);
+
+  idx = sqlite3_bind_parameter_index(stmt, ":limit");
+  if (idx > 0)
+    sqlite3_bind_int(stmt, idx, qp->limit);
+
+  idx = sqlite3_bind_parameter_index(stmt, ":offset");
+  if (idx > 0)
+    sqlite3_bind_int(stmt, idx, (qp->idx_type == I_LAST) ? qp->results - qp->limit : qp->offset);
+
+  if (qp->idx_type == I_KEYSET && qp->cursor && *qp->cursor)
+    db_query_bind_keyset(stmt, qp);
+}
+
+static int
+db_query_get_count(struct query_params *qp, const char *query)
+{
+  sqlite3_stmt *stmt;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_stmt_cache_prepare(&stmt, query);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  db_query_bind(stmt, qp);
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      if (ret == SQLITE_DONE)
+	DPRINTF(E_INFO, L_DB, "No matching row found for query: %s\n", query);
+      else
+	DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+
+      db_stmt_cache_release(stmt);
+      return -1;
+    }
+
+  ret = sqlite3_column_int(stmt, 0);
+
+#ifdef DB_PROFILE
+  while (db_blocking_step(stmt) == SQLITE_ROW)
+    ; /* EMPTY */
+#endif
 
-  return qc;
+  db_stmt_cache_release(stmt);
 
- error:
-  DPRINTF(E_LOG, L_DB, "Error building query clause\n");
-  db_free_query_clause(qc);
-  return NULL;
+  return ret;
 }
 
 static char *
@@ -2050,7 +3495,7 @@ db_build_query_check(struct query_params *qp, char *count, char *query)
       goto failed;
     }
 
-  qp->results = db_get_one_int(count);
+  qp->results = db_query_get_count(qp, count);
   if (qp->results < 0)
     {
       DPRINTF(E_LOG, L_DB, "No results for count\n");
@@ -2074,7 +3519,7 @@ db_build_query_items(struct query_params *qp, struct query_clause *qc)
   char *query;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s;", qc->where);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s %s %s %s;", qc->where, qc->group, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT %s%s FROM files f %s %s %s %s %s;", qc->cols, qc->keyset_cols, qc->where, qc->keyset, qc->group, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2086,7 +3531,7 @@ db_build_query_pls(struct query_params *qp, struct query_clause *qc)
   char *query;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM playlists f %s;", qc->where);
-  query = sqlite3_mprintf(Q_PL_SELECT " %s GROUP BY f.id %s %s;", qc->where, qc->order, qc->index);
+  query = sqlite3_mprintf(Q_PL_COLS "%s" Q_PL_FROM " %s %s GROUP BY f.id %s %s;", qc->keyset_cols, qc->where, qc->keyset, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2113,8 +3558,8 @@ db_build_query_plitems_plain(struct query_params *qp, struct query_clause *qc)
   char *count;
   char *query;
 
-  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d;", qc->where, qp->id);
-  query = sqlite3_mprintf("SELECT f.* FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = %d ORDER BY pi.id ASC %s;", qc->where, qp->id, qc->index);
+  count = sqlite3_mprintf("SELECT COUNT(*) FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = :id;", qc->where);
+  query = sqlite3_mprintf("SELECT %s FROM files f JOIN playlistitems pi ON f.path = pi.filepath %s AND pi.playlistid = :id ORDER BY pi.id ASC %s;", qc->cols, qc->where, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2167,7 +3612,7 @@ db_build_query_plitems_smart(struct query_params *qp, struct playlist_info *pli)
     return NULL;
 
   count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND %s LIMIT %d;", qc->where, pli->query, pli->query_limit ? pli->query_limit : -1);
-  query = sqlite3_mprintf("SELECT f.* FROM files f %s AND %s %s %s;", qc->where, pli->query, qc->order, qc->index);
+  query = sqlite3_mprintf("SELECT %s FROM files f %s AND %s %s %s;", qc->cols, qc->where, pli->query, qc->order, qc->index);
 
   db_free_query_clause(qc);
 
@@ -2214,21 +3659,80 @@ db_build_query_plitems(struct query_params *qp, struct query_clause *qc)
   return query;
 }
 
+// The aggregates in group_stats are for all enabled files of a group, so they
+// can only replace the GROUP BY when the caller doesn't filter the files. The
+// exception is a media kind, if no group of the type mixes that kind with
+// others, since then a group's files are either all or none of that kind.
+static bool
+db_group_stats_usable(struct query_params *qp, enum group_type type)
+{
+#define Q_TMPL "SELECT EXISTS (SELECT 1 FROM group_stats WHERE type = %d AND track_count > 0 AND (media_kind_mask & %d) <> 0 AND media_kind_mask <> %d);"
+  char *query;
+  int ret;
+
+  if (qp->filter || qp->having || qp->order || qp->with_disabled)
+    return false;
+
+  if (!qp->media_kind)
+    return true;
+
+  query = sqlite3_mprintf(Q_TMPL, type, qp->media_kind, qp->media_kind);
+  if (!query)
+    return false;
+
+  ret = db_get_one_int(query);
+  sqlite3_free(query);
+
+  return (ret == 0);
+#undef Q_TMPL
+}
+
+// Condition for the group_stats rows of groups with files of the media kind
+// asked for, see db_group_stats_usable()
+static char *
+db_group_stats_media_kind(struct query_params *qp)
+{
+  if (!qp->media_kind)
+    return sqlite3_mprintf("");
+
+  return sqlite3_mprintf("AND s.media_kind_mask = %d", qp->media_kind);
+}
+
 static char *
 db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 {
+  char *media_kind;
   char *count;
   char *query;
 
+  if (db_group_stats_usable(qp, G_ALBUMS))
+    {
+      media_kind = db_group_stats_media_kind(qp);
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM group_stats s JOIN groups g ON g.type = s.type AND g.persistentid = s.persistentid " \
+			      "WHERE s.type = %d AND s.track_count > 0 %s;", G_ALBUMS, media_kind);
+      query = sqlite3_mprintf("SELECT" \
+			      " g.id, g.persistentid, f.album, f.album_sort, s.track_count," \
+			      " 1 AS album_count, f.album_artist, f.songartistid," \
+			      " s.song_length, s.data_kind, s.media_kind," \
+			      " s.year, s.date_released," \
+			      " s.time_added, s.time_played, s.seek%s " \
+			      "FROM group_stats s JOIN groups g ON g.type = s.type AND g.persistentid = s.persistentid " \
+			      "JOIN files f ON f.id = s.file_id " \
+			      "WHERE s.type = %d AND s.track_count > 0 %s %s %s %s;", qc->keyset_cols, G_ALBUMS, media_kind, qc->keyset, qc->order, qc->index);
+      sqlite3_free(media_kind);
+
+      return db_build_query_check(qp, count, query);
+    }
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songalbumid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album, f.album_sort, COUNT(f.id) AS track_count," \
 			  " 1 AS album_count, f.album_artist, f.songartistid," \
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
-			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s " \
-			  "GROUP BY f.songalbumid %s %s %s;", qc->where, qc->having, qc->order, qc->index);
+			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek%s " \
+			  "FROM files f JOIN groups g ON f.songalbumid = g.persistentid %s %s " \
+			  "GROUP BY f.songalbumid %s %s %s;", qc->keyset_cols, qc->where, qc->keyset, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2236,19 +3740,39 @@ db_build_query_group_albums(struct query_params *qp, struct query_clause *qc)
 static char *
 db_build_query_group_artists(struct query_params *qp, struct query_clause *qc)
 {
+  char *media_kind;
   char *count;
   char *query;
 
+  if (db_group_stats_usable(qp, G_ARTISTS))
+    {
+      media_kind = db_group_stats_media_kind(qp);
+      count = sqlite3_mprintf("SELECT COUNT(*) FROM group_stats s JOIN groups g ON g.type = s.type AND g.persistentid = s.persistentid " \
+			      "WHERE s.type = %d AND s.track_count > 0 %s;", G_ARTISTS, media_kind);
+      query = sqlite3_mprintf("SELECT" \
+			      " g.id, g.persistentid, f.album_artist, f.album_artist_sort, s.track_count," \
+			      " s.album_count, f.album_artist, f.songartistid," \
+			      " s.song_length, s.data_kind, s.media_kind," \
+			      " s.year, s.date_released," \
+			      " s.time_added, s.time_played, s.seek%s " \
+			      "FROM group_stats s JOIN groups g ON g.type = s.type AND g.persistentid = s.persistentid " \
+			      "JOIN files f ON f.id = s.file_id " \
+			      "WHERE s.type = %d AND s.track_count > 0 %s %s %s %s;", qc->keyset_cols, G_ARTISTS, media_kind, qc->keyset, qc->order, qc->index);
+      sqlite3_free(media_kind);
+
+      return db_build_query_check(qp, count, query);
+    }
+
   count = sqlite3_mprintf("SELECT COUNT(DISTINCT f.songartistid) FROM files f %s;", qc->where);
   query = sqlite3_mprintf("SELECT" \
 			  " g.id, g.persistentid, f.album_artist, f.album_artist_sort, COUNT(f.id) AS track_count," \
 			  " COUNT(DISTINCT f.songalbumid) AS album_count, f.album_artist, f.songartistid," \
 			  " SUM(f.song_length) AS song_length, MIN(f.data_kind) AS data_kind, MIN(f.media_kind) AS media_kind," \
 			  " MAX(f.year) AS year, MAX(f.date_released) AS date_released," \
-			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek " \
-			  "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s " \
+			  " MAX(f.time_added) AS time_added, MAX(f.time_played) AS time_played, MAX(f.seek) AS seek%s " \
+			  "FROM files f JOIN groups g ON f.songartistid = g.persistentid %s %s " \
 			  "GROUP BY f.songartistid %s %s %s;",
-			  qc->where, qc->having, qc->order, qc->index);
+			  qc->keyset_cols, qc->where, qc->keyset, qc->having, qc->order, qc->index);
 
   return db_build_query_check(qp, count, query);
 }
@@ -2265,13 +3789,13 @@ db_build_query_group_items(struct query_params *qp, struct query_clause *qc)
   switch (gt)
     {
       case G_ALBUMS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songalbumid = :persistentid;", qc->where);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songalbumid = :persistentid %s %s;", qc->cols, qc->where, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
-	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
-	query = sqlite3_mprintf("SELECT f.* FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+	count = sqlite3_mprintf("SELECT COUNT(*) FROM files f %s AND f.songartistid = :persistentid;", qc->where);
+	query = sqlite3_mprintf("SELECT %s FROM files f %s AND f.songartistid = :persistentid %s %s;", qc->cols, qc->where, qc->order, qc->index);
 	break;
 
       default:
@@ -2295,16 +3819,16 @@ db_build_query_group_dirs(struct query_params *qp, struct query_clause *qc)
     {
       case G_ALBUMS:
 	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
-				" FROM files f %s AND f.songalbumid = %" PRIi64 ";", qc->where, qp->persistentid);
+				" FROM files f %s AND f.songalbumid = :persistentid;", qc->where);
 	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
-				" FROM files f %s AND f.songalbumid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+				" FROM files f %s AND f.songalbumid = :persistentid %s %s;", qc->where, qc->order, qc->index);
 	break;
 
       case G_ARTISTS:
 	count = sqlite3_mprintf("SELECT COUNT(DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1)))"
-				" FROM files f %s AND f.songartistid = %" PRIi64 ";", qc->where, qp->persistentid);
+				" FROM files f %s AND f.songartistid = :persistentid;", qc->where);
 	query = sqlite3_mprintf("SELECT DISTINCT(SUBSTR(f.path, 1, LENGTH(f.path) - LENGTH(f.fname) - 1))"
-				" FROM files f %s AND f.songartistid = %" PRIi64 " %s %s;", qc->where, qp->persistentid, qc->order, qc->index);
+				" FROM files f %s AND f.songartistid = :persistentid %s %s;", qc->where, qc->order, qc->index);
 	break;
 
       default:
@@ -2362,6 +3886,8 @@ db_query_start(struct query_params *qp)
   qp->stmt = NULL;
   qp->results = -1;
 
+  db_query_keyset_reset(qp);
+
   qc = db_build_query_clause(qp);
   if (!qc)
     return -1;
@@ -2421,7 +3947,7 @@ db_query_start(struct query_params *qp)
 
   DPRINTF(E_DBG, L_DB, "Starting query '%s'\n", query);
 
-  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  ret = db_stmt_cache_prepare(&stmt, query);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
@@ -2432,6 +3958,8 @@ db_query_start(struct query_params *qp)
 
   sqlite3_free(query);
 
+  db_query_bind(stmt, qp);
+
   qp->stmt = stmt;
 
   return 0;
@@ -2443,7 +3971,7 @@ db_query_end(struct query_params *qp)
   if (!qp->stmt)
     return;
 
-  sqlite3_finalize(qp->stmt);
+  db_stmt_cache_release(qp->stmt);
   qp->stmt = NULL;
 }
 
@@ -2518,6 +4046,8 @@ db_query_fetch(void *item, struct query_params *qp, const ssize_t cols_map[], in
       return -1;
     }
 
+  db_query_keyset_update(qp);
+
   ncols = sqlite3_column_count(qp->stmt);
 
   // We allow more cols in db than in map because the db may be a future schema
@@ -2557,6 +4087,61 @@ db_query_fetch_file(struct db_media_file_info *dbmfi, struct query_params *qp)
   return ret;
 }
 
+int
+db_query_fetch_file_row(struct media_file_info *mfi, struct query_params *qp)
+{
+  int ncols;
+  int i;
+  int ret;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  if ((qp->type != Q_ITEMS) && (qp->type != Q_PLITEMS) && (qp->type != Q_GROUP_ITEMS))
+    {
+      DPRINTF(E_LOG, L_DB, "Not an items, playlist or group items query!\n");
+      return -1;
+    }
+
+  if (!qp->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Query not started!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(qp->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_DBG, L_DB, "End of query results\n");
+      return 1;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  db_query_keyset_update(qp);
+
+  ncols = sqlite3_column_count(qp->stmt);
+
+  // We allow more cols in db than in map because the db may be a future schema
+  if (ncols < ARRAY_SIZE(mfi_cols_map))
+    {
+      DPRINTF(E_LOG, L_DB, "BUG: database has fewer columns (%d) than mfi column map (%u)\n", ncols, ARRAY_SIZE(mfi_cols_map));
+      return -1;
+    }
+
+  for (i = 0; i < ARRAY_SIZE(mfi_cols_map); i++)
+    {
+      if (!db_query_col_wanted(qp, i))
+	continue;
+
+      struct_field_from_statement(mfi, mfi_cols_map[i].offset, mfi_cols_map[i].type, qp->stmt, i, false, false);
+    }
+
+  return 0;
+}
+
 int
 db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
 {
@@ -2595,6 +4180,8 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
       return -1;
     }
 
+  db_query_keyset_update(qp);
+
   ncols = sqlite3_column_count(qp->stmt);
 
   // We allow more cols in db than in map because the db may be a future schema
@@ -2614,7 +4201,7 @@ db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp)
   type = sqlite3_column_int(qp->stmt, 2);
   if (type == PL_SPECIAL || type == PL_SMART)
     {
-      db_files_get_count(&nitems, &nstreams, dbpli->query);
+      smartpl_count_get(&nitems, &nstreams, dbpli->query);
       snprintf(qp->buf1, sizeof(qp->buf1), "%d", (int)nitems);
       snprintf(qp->buf2, sizeof(qp->buf2), "%d", (int)nstreams);
       dbpli->items = qp->buf1;
@@ -2707,8 +4294,25 @@ db_query_fetch_count(struct filecount_info *fci, struct query_params *qp)
 int
 db_filecount_get(struct filecount_info *fci, struct query_params *qp)
 {
+  struct db_library_counts lc;
   int ret;
 
+  // Counts of the whole library are maintained by triggers
+  if (qp->type == Q_COUNT_ITEMS && !qp->filter && !qp->media_kind && !qp->with_disabled)
+    {
+      ret = library_counts_get(&lc, Q_LIBRARY_COUNTS_GET);
+      if (ret < 0)
+	return -1;
+
+      memset(fci, 0, sizeof(struct filecount_info));
+      fci->count = lc.files;
+      fci->length = lc.song_length;
+      fci->artist_count = lc.artists;
+      fci->album_count = lc.albums;
+      fci->file_size = lc.file_size;
+      return 0;
+    }
+
   ret = db_query_start(qp);
   if (ret < 0)
     {
@@ -2803,15 +4407,25 @@ db_query_fetch_string_sort(char **string, char **sortstring, struct query_params
 int
 db_files_get_count(uint32_t *nitems, uint32_t *nstreams, const char *filter)
 {
+  struct db_library_counts lc;
   sqlite3_stmt *stmt = NULL;
   char *query = NULL;
   int ret;
 
-  if (!filter && !nstreams)
-    query = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0;");
-  else if (!filter)
-    query = sqlite3_mprintf("SELECT COUNT(*), SUM(data_kind = %d) FROM files f WHERE f.disabled = 0;", DATA_KIND_HTTP);
-  else if (!nstreams)
+  if (!filter)
+    {
+      ret = library_counts_get(&lc, Q_LIBRARY_COUNTS_GET);
+      if (ret < 0)
+	return -1;
+
+      if (nitems)
+	*nitems = lc.files;
+      if (nstreams)
+	*nstreams = lc.streams;
+      return 0;
+    }
+
+  if (!nstreams)
     query = sqlite3_mprintf("SELECT COUNT(*) FROM files f WHERE f.disabled = 0 AND %s;", filter);
   else
     query = sqlite3_mprintf("SELECT COUNT(*), SUM(data_kind = %d) FROM files f WHERE f.disabled = 0 AND %s;", DATA_KIND_HTTP, filter);
@@ -2905,7 +4519,10 @@ db_file_inc_playcount_byfilter(const char *filter)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    {
+      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
+    }
 #undef Q_TMPL
 #undef Q_TMPL_WITH_RATING
 }
@@ -2971,7 +4588,10 @@ db_file_inc_skipcount(int id)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    {
+      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
+    }
 #undef Q_TMPL
 #undef Q_TMPL_WITH_RATING
 }
@@ -2993,7 +4613,10 @@ db_file_reset_playskip_count(int id)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    {
+      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
+    }
 #undef Q_TMPL
 }
 
@@ -3009,9 +4632,148 @@ db_file_ping(int id)
 #undef Q_TMPL
 }
 
+/* Set of files seen during a scan. Instead of pinging unchanged files one by
+ * one, the scan records their ids in a bitmap. The purge then skips the seen
+ * files, so unchanged files are not written at all, and db_scan_seen_end() only
+ * re-enables those of them that were disabled. Only the thread that started the
+ * scan uses the set, pings from other threads are unaffected.
+ */
+static bool
+db_scan_seen_is_active(void)
+{
+  bool active;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_scan_seen.lck));
+  active = db_scan_seen.active && pthread_equal(db_scan_seen.tid, pthread_self());
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_scan_seen.lck));
+
+  return active;
+}
+
+static void
+db_scan_seen_add(int id)
+{
+  uint64_t bit;
+  int word;
+  int nwords;
+
+  if (id <= 0)
+    return;
+
+  word = id / 64;
+  if (word >= db_scan_seen.nwords)
+    {
+      nwords = 2 * db_scan_seen.nwords;
+      if (nwords <= word)
+	nwords = word + 1;
+      CHECK_NULL(L_DB, db_scan_seen.bits = realloc(db_scan_seen.bits, nwords * sizeof(uint64_t)));
+      memset(db_scan_seen.bits + db_scan_seen.nwords, 0, (nwords - db_scan_seen.nwords) * sizeof(uint64_t));
+      db_scan_seen.nwords = nwords;
+    }
+
+  bit = (uint64_t)1 << (id % 64);
+  if (db_scan_seen.bits[word] & bit)
+    return;
+
+  db_scan_seen.bits[word] |= bit;
+  db_scan_seen.count++;
+}
+
+// SQL function scan_seen(id), returns 1 if the file id is in the seen set. Only
+// used by the scan thread, other threads get 0 since the set is empty then.
+static void
+db_scan_seen_xfunc(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  int64_t id;
+  int seen;
+
+  id = sqlite3_value_int64(argv[0]);
+
+  seen = (id > 0) && (id / 64 < db_scan_seen.nwords) && (db_scan_seen.bits[id / 64] & ((uint64_t)1 << (id % 64)));
+
+  sqlite3_result_int(context, seen);
+}
+
+void
+db_scan_seen_begin(void)
+{
+  int max_id;
+
+  free(db_scan_seen.bits);
+
+  // Start with room for the current max id, so we don't have to grow much
+  max_id = db_get_one_int("SELECT MAX(id) FROM files;");
+  db_scan_seen.nwords = (max_id > 0) ? (max_id / 64 + 1) : 1;
+  CHECK_NULL(L_DB, db_scan_seen.bits = calloc(db_scan_seen.nwords, sizeof(uint64_t)));
+  db_scan_seen.count = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_scan_seen.lck));
+  db_scan_seen.tid = pthread_self();
+  db_scan_seen.active = true;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_scan_seen.lck));
+}
+
+int
+db_scan_seen_end(void)
+{
+#define Q_TMPL "UPDATE files SET db_timestamp = %" PRIi64 ", disabled = 0 WHERE disabled <> 0 AND scan_seen(id);"
+  char *query;
+  int ret;
+
+  if (!db_scan_seen_is_active())
+    return 0;
+
+  DPRINTF(E_DBG, L_DB, "Scan saw %d unchanged files\n", db_scan_seen.count);
+
+  ret = 0;
+  if (db_scan_seen.count > 0)
+    {
+      query = sqlite3_mprintf(Q_TMPL, (int64_t)time(NULL));
+      ret = db_query_run(query, 1, 0);
+    }
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_scan_seen.lck));
+  db_scan_seen.active = false;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_scan_seen.lck));
+
+  free(db_scan_seen.bits);
+  db_scan_seen.bits = NULL;
+  db_scan_seen.nwords = 0;
+  db_scan_seen.count = 0;
+
+  return ret;
+#undef Q_TMPL
+}
+
+// While a scan is tracking seen files, this just looks up the file and records
+// it as seen if it is unchanged. The return value is the same in both cases.
+static int
+db_file_seen_bypath(const char *path, time_t mtime_max)
+{
+  sqlite3_stmt *stmt = db_statements.files_seen_lookup;
+  int ret;
+
+  sqlite3_bind_int64(stmt, 1, (int64_t)mtime_max);
+  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+
+  ret = db_blocking_step(stmt);
+  if (ret == SQLITE_ROW)
+    db_scan_seen_add(sqlite3_column_int(stmt, 0));
+  else if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  return (ret == SQLITE_ROW) ? 1 : 0;
+}
+
 int
 db_file_ping_bypath(const char *path, time_t mtime_max)
 {
+  if (db_scan_seen_is_active())
+    return db_file_seen_bypath(path, mtime_max);
+
   sqlite3_bind_int64(db_statements.files_ping, 1, (int64_t)time(NULL));
   sqlite3_bind_text(db_statements.files_ping, 2, path, -1, SQLITE_STATIC);
   sqlite3_bind_int64(db_statements.files_ping, 3, (int64_t)mtime_max);
@@ -3019,6 +4781,101 @@ db_file_ping_bypath(const char *path, time_t mtime_max)
   return db_statement_run(db_statements.files_ping, 0);
 }
 
+// Batch version of db_file_ping_bypath() + db_file_id_bypath(). Looks up all
+// the paths with one query, sets the ids and, if ping is true, pings all the
+// files that are unchanged with one more query.
+int
+db_file_ping_bypath_batch(struct db_file_batch_item *items, int nitems, bool ping)
+{
+  sqlite3_stmt *stmt;
+  const char *path;
+  int64_t db_timestamp;
+  int npinged;
+  int i;
+  int ret;
+
+  if (nitems > DB_FILE_BATCH_SIZE)
+    {
+      DPRINTF(E_LOG, L_DB, "Bug! Batch of %d files exceeds max batch size\n", nitems);
+      return -1;
+    }
+
+  for (i = 0; i < nitems; i++)
+    {
+      items[i].id = 0;
+      items[i].pinged = false;
+    }
+
+  // Unused parameters are left as NULL, which will not match anything
+  stmt = db_statements.files_lookup_batch;
+  for (i = 0; i < nitems; i++)
+    sqlite3_bind_text(stmt, i + 1, items[i].path, -1, SQLITE_STATIC);
+
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      path = (const char *)sqlite3_column_text(stmt, 1);
+      if (!path)
+	continue;
+
+      for (i = 0; i < nitems; i++)
+	{
+	  if (items[i].id == 0 && strcmp(items[i].path, path) == 0)
+	    break;
+	}
+
+      if (i == nitems)
+	continue;
+
+      items[i].id = sqlite3_column_int(stmt, 0);
+
+      db_timestamp = sqlite3_column_int64(stmt, 2);
+      items[i].pinged = ping && (db_timestamp >= (int64_t)items[i].mtime);
+    }
+
+  if (ret != SQLITE_DONE)
+    DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  if (ret != SQLITE_DONE)
+    return -1;
+
+  if (db_scan_seen_is_active())
+    {
+      for (i = 0, npinged = 0; i < nitems; i++)
+	{
+	  if (!items[i].pinged)
+	    continue;
+
+	  db_scan_seen_add(items[i].id);
+	  npinged++;
+	}
+
+      return npinged;
+    }
+
+  stmt = db_statements.files_ping_batch;
+  sqlite3_bind_int64(stmt, 1, (int64_t)time(NULL));
+  for (i = 0, npinged = 0; i < nitems; i++)
+    {
+      if (items[i].pinged)
+	sqlite3_bind_int(stmt, 2 + npinged++, items[i].id);
+    }
+
+  if (npinged == 0)
+    {
+      sqlite3_clear_bindings(stmt);
+      return 0;
+    }
+
+  ret = db_statement_run(stmt, 0);
+  if (ret < 0)
+    return -1;
+
+  return npinged;
+}
+
 void
 db_file_ping_bymatch(const char *path, int isdir)
 {
@@ -3412,6 +5269,46 @@ db_file_update(struct media_file_info *mfi)
   return 0;
 }
 
+// Same as calling db_file_add() or db_file_update() for each file, but only
+// triggers one update event. Returns the number of files saved.
+int
+db_file_save_batch(struct media_file_info **mfis, int nmfis)
+{
+  sqlite3_stmt *stmt;
+  uint64_t now;
+  int nsaved;
+  int i;
+  int ret;
+
+  now = (uint64_t)time(NULL);
+
+  for (i = 0, nsaved = 0; i < nmfis; i++)
+    {
+      mfis[i]->db_timestamp = now;
+      if (mfis[i]->id == 0 && mfis[i]->time_added == 0)
+	mfis[i]->time_added = now;
+
+      fixup_tags_mfi(mfis[i]);
+
+      stmt = (mfis[i]->id == 0) ? db_statements.files_insert : db_statements.files_update;
+
+      ret = bind_mfi(stmt, mfis[i]);
+      if (ret < 0)
+	continue;
+
+      ret = db_statement_run(stmt, 0);
+      if (ret < 0)
+	continue;
+
+      nsaved++;
+    }
+
+  if (nsaved > 0)
+    library_update_trigger(LISTENER_DATABASE);
+
+  return nsaved;
+}
+
 void
 db_file_seek_update(int id, uint32_t seek)
 {
@@ -3432,7 +5329,10 @@ db_file_seek_update(int id, uint32_t seek)
 
   ret = db_query_run(query, 1, 0);
   if (ret == 0)
-    db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+    {
+      db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
+    }
 #undef Q_TMPL
 }
 
@@ -3446,6 +5346,7 @@ db_file_rating_update(char *query)
   if (ret == 0)
     {
       db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
       listener_notify(LISTENER_RATING);
     }
 
@@ -3490,6 +5391,7 @@ db_file_usermark_update_byid(uint32_t id, uint32_t usermark)
   if (ret == 0)
     {
       db_admin_setint64(DB_ADMIN_DB_MODIFIED, (int64_t) time(NULL));
+      smartpl_cache_invalidate();
       listener_notify(LISTENER_UPDATE);
     }
 
@@ -3593,12 +5495,14 @@ db_file_update_directoryid(const char *path, int dir_id)
 int
 db_pl_get_count(uint32_t *nitems)
 {
-  int ret = db_get_one_int("SELECT COUNT(*) FROM playlists p WHERE p.disabled = 0;");
+  struct db_library_counts lc;
+  int ret;
 
+  ret = library_counts_get(&lc, Q_LIBRARY_COUNTS_GET);
   if (ret < 0)
     return -1;
 
-  *nitems = (uint32_t)ret;
+  *nitems = lc.playlists;
 
   return 0;
 }
@@ -3739,7 +5643,7 @@ db_pl_fetch_byquery(const char *query)
     }
 
   if (pli->type == PL_SPECIAL || pli->type == PL_SMART)
-    db_files_get_count(&pli->items, &pli->streams, pli->query);
+    smartpl_count_get(&pli->items, &pli->streams, pli->query);
 
   return pli;
 }
@@ -3935,7 +5839,9 @@ db_pl_delete(int id)
   if (id == 1)
     return;
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    return;
 
   query = sqlite3_mprintf(Q_TMPL, id);
 
@@ -4066,9 +5972,12 @@ db_groups_cleanup()
 {
 #define Q_TMPL_ALBUM "DELETE FROM groups WHERE type = 1 AND NOT persistentid IN (SELECT songalbumid from files WHERE disabled = 0);"
 #define Q_TMPL_ARTIST "DELETE FROM groups WHERE type = 2 AND NOT persistentid IN (SELECT songartistid from files WHERE disabled = 0);"
+#define Q_TMPL_STATS "DELETE FROM group_stats WHERE track_count = 0;"
   int ret;
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    return -1;
 
   ret = db_query_run(Q_TMPL_ALBUM, 0, LISTENER_DATABASE);
   if (ret < 0)
@@ -4087,12 +5996,22 @@ db_groups_cleanup()
     }
 
   DPRINTF(E_DBG, L_DB, "Removed artist group-entries: %d\n", sqlite3_changes(hdl));
+
+  ret = db_query_run(Q_TMPL_STATS, 0, 0);
+  if (ret < 0)
+    {
+      db_transaction_rollback();
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Removed empty group_stats entries: %d\n", sqlite3_changes(hdl));
   db_transaction_end();
 
   return 0;
 
 #undef Q_TMPL_ALBUM
 #undef Q_TMPL_ARTIST
+#undef Q_TMPL_STATS
 }
 
 static enum group_type
@@ -4205,6 +6124,62 @@ db_group_persistentid_byid(int id, int64_t *persistentid)
 #undef Q_TMPL
 }
 
+int
+db_group_files_state_get(time_t *mtime, int *nitems, int64_t persistentid)
+{
+#define Q_TMPL "SELECT MAX(f.time_modified), COUNT(*) FROM files f WHERE f.disabled = 0 AND f.%s = %" PRIi64 ";"
+  enum group_type gt;
+  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  gt = db_group_type_bypersistentid(persistentid);
+  if (gt == G_ALBUMS)
+    query = sqlite3_mprintf(Q_TMPL, "songalbumid", persistentid);
+  else if (gt == G_ARTISTS)
+    query = sqlite3_mprintf(Q_TMPL, "songartistid", persistentid);
+  else
+    return -1;
+
+  if (!query)
+    {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
+
+      return -1;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_free(query);
+      return -1;
+    }
+
+  ret = db_blocking_step(stmt);
+  if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      return -1;
+    }
+
+  *mtime = sqlite3_column_int64(stmt, 0);
+  *nitems = sqlite3_column_int(stmt, 1);
+
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+
+  return 0;
+
+#undef Q_TMPL
+}
+
 
 /* Directories */
 int
@@ -4861,8 +6836,11 @@ static int
 queue_transaction_begin()
 {
   int queue_version = 0;
+  int ret;
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    return -1;
 
   db_admin_getint(&queue_version, DB_ADMIN_QUEUE_VERSION);
   queue_version++;
@@ -4893,6 +6871,11 @@ queue_transaction_end(int retval, int queue_version)
     goto error;
 
   db_transaction_end();
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_version_lck));
+  db_queue_version_committed = queue_version;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_version_lck));
+
   listener_notify(LISTENER_QUEUE);
   return;
 
@@ -5028,6 +7011,8 @@ db_queue_item_update(struct db_queue_item *qi)
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   qi->queue_version = queue_version;
 
@@ -5080,6 +7065,8 @@ db_queue_add_start(struct db_queue_add_info *queue_add_info, int pos)
 
   memset(queue_add_info, 0, sizeof(struct db_queue_add_info));
   queue_add_info->queue_version = queue_transaction_begin();
+  if (queue_add_info->queue_version < 0)
+    return -1;
 
   ret = db_queue_get_count(&queue_count);
   if (ret < 0)
@@ -5182,6 +7169,8 @@ db_queue_add_by_query(struct query_params *qp, char reshuffle, uint32_t item_id,
     *count = 0;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   ret = db_queue_get_count(&queue_count);
   if (ret < 0)
@@ -5327,6 +7316,33 @@ db_queue_add_by_fileid(int id, char reshuffle, uint32_t item_id, int position, i
   return ret;
 }
 
+static char *
+queue_enum_query_keyset(struct query_params *qp)
+{
+#define Q_TMPL "SELECT *%s FROM queue f WHERE %s %s %s %s;"
+  struct query_clause *qc;
+  char *query = NULL;
+
+  CHECK_NULL(L_DB, qc = calloc(1, sizeof(struct query_clause)));
+
+  if (db_build_query_keyset(qc, qp, "f.id") < 0)
+    goto out;
+
+  if (qp->limit > 0)
+    qc->index = sqlite3_mprintf("LIMIT :limit");
+  else
+    qc->index = sqlite3_mprintf("");
+
+  if (qc->index)
+    query = sqlite3_mprintf(Q_TMPL, qc->keyset_cols, qp->filter ? qp->filter : "1=1", qc->keyset, qc->order, qc->index);
+
+ out:
+  db_free_query_clause(qc);
+  return query;
+
+#undef Q_TMPL
+}
+
 static int
 queue_enum_start(struct query_params *qp)
 {
@@ -5338,12 +7354,16 @@ queue_enum_start(struct query_params *qp)
 
   qp->stmt = NULL;
 
+  db_query_keyset_reset(qp);
+
   if (qp->sort)
     orderby = sort_clause[qp->sort];
   else
     orderby = sort_clause[S_POS];
 
-  if (qp->filter)
+  if (qp->idx_type == I_KEYSET)
+    query = queue_enum_query_keyset(qp);
+  else if (qp->filter)
     query = sqlite3_mprintf(Q_TMPL, qp->filter, orderby);
   else
     query = sqlite3_mprintf(Q_TMPL, "1=1", orderby);
@@ -5368,6 +7388,8 @@ queue_enum_start(struct query_params *qp)
 
   sqlite3_free(query);
 
+  db_query_bind(stmt, qp);
+
   qp->stmt = stmt;
 
   return 0;
@@ -5401,6 +7423,8 @@ queue_enum_fetch(struct query_params *qp, struct db_queue_item *qi, int must_str
       return -1;
     }
 
+  db_query_keyset_update(qp);
+
   for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
     {
       struct_field_from_statement(qi, qi_cols_map[i].offset, qi_cols_map[i].type, qp->stmt, i, must_strdup, false);
@@ -5414,7 +7438,9 @@ db_queue_enum_start(struct query_params *qp)
 {
   int ret;
 
-  db_transaction_begin();
+  ret = db_transaction_begin();
+  if (ret < 0)
+    return -1;
 
   ret = queue_enum_start(qp);
 
@@ -5496,9 +7522,12 @@ db_queue_fetch_byitemid(uint32_t item_id)
       return NULL;
     }
 
-  db_transaction_begin();
-  ret = queue_fetch_byitemid(item_id, qi, 1);
-  db_transaction_end();
+  ret = db_transaction_begin();
+  if (ret == 0)
+    {
+      ret = queue_fetch_byitemid(item_id, qi, 1);
+      db_transaction_end();
+    }
 
   if (ret < 0)
     {
@@ -5531,7 +7560,12 @@ db_queue_fetch_byfileid(uint32_t file_id)
       return NULL;
     }
 
-  db_transaction_begin();
+  ret = db_transaction_begin();
+  if (ret < 0)
+    {
+      free_queue_item(qi, 0);
+      return NULL;
+    }
 
   qp.filter = sqlite3_mprintf("file_id = %d", file_id);
 
@@ -5604,9 +7638,12 @@ db_queue_fetch_bypos(uint32_t pos, char shuffle)
       return NULL;
     }
 
-  db_transaction_begin();
-  ret = queue_fetch_bypos(pos, shuffle, qi, 1);
-  db_transaction_end();
+  ret = db_transaction_begin();
+  if (ret == 0)
+    {
+      ret = queue_fetch_bypos(pos, shuffle, qi, 1);
+      db_transaction_end();
+    }
 
   if (ret < 0)
     {
@@ -5667,11 +7704,12 @@ db_queue_fetch_byposrelativetoitem(int pos, uint32_t item_id, char shuffle)
       return NULL;
     }
 
-  db_transaction_begin();
-
-  ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, qi, 1);
-
-  db_transaction_end();
+  ret = db_transaction_begin();
+  if (ret == 0)
+    {
+      ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, qi, 1);
+      db_transaction_end();
+    }
 
   if (ret < 0)
     {
@@ -5703,51 +7741,162 @@ db_queue_fetch_prev(uint32_t item_id, char shuffle)
   return db_queue_fetch_byposrelativetoitem(-1, item_id, shuffle);
 }
 
-static int
-queue_fix_pos(enum sort_type sort, int queue_version)
+/*
+ * In-memory image of (part of) the queue order. Renumbering the queue is done on
+ * this image, and only the rows whose position actually changed are written back,
+ * reusing a single prepared statement within the caller's transaction.
+ */
+struct queue_order
 {
-#define Q_TMPL "UPDATE queue SET %q = %d, queue_version = %d WHERE id = %d and %q <> %d;"
+  uint32_t *ids;
+  int *pos;         // Positions as currently stored in the db
+  int *shuffle_pos;
+  int count;
+  int size;
+};
 
-  struct query_params qp;
-  struct db_queue_item queue_item;
+static void
+queue_order_free(struct queue_order *order)
+{
+  free(order->ids);
+  free(order->pos);
+  free(order->shuffle_pos);
+  memset(order, 0, sizeof(struct queue_order));
+}
+
+// Loads id and positions of all items with a position of the given sort type
+// >= from_pos, sorted by that position
+static int
+queue_order_load(struct queue_order *order, enum sort_type sort, int from_pos)
+{
+  const char *col;
   char *query;
-  int pos;
+  sqlite3_stmt *stmt;
   int ret;
 
-  memset(&qp, 0, sizeof(struct query_params));
-  qp.sort = sort;
+  memset(order, 0, sizeof(struct queue_order));
 
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
+  col = (sort == S_SHUFFLE_POS) ? "shuffle_pos" : "pos";
+
+  query = sqlite3_mprintf("SELECT id, pos, shuffle_pos FROM queue WHERE %s >= %d ORDER BY %s;", col, from_pos, col);
+  if (!query)
     {
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  pos = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0))
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", query);
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
     {
-      if (queue_item.pos != pos)
-        {
-	  if (sort == S_SHUFFLE_POS)
-	    query = sqlite3_mprintf(Q_TMPL, "shuffle_pos", pos, queue_version, queue_item.id, "shuffle_pos", pos);
-	  else
-	    query = sqlite3_mprintf(Q_TMPL, "pos", pos, queue_version, queue_item.id, "pos", pos);
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(query);
+      return -1;
+    }
 
-	  ret = db_query_run(query, 1, 0);
-	  if (ret < 0)
-	    {
-	      DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", queue_item.id);
-	      break;
-	    }
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      if (order->count == order->size)
+	{
+	  order->size = order->size ? 2 * order->size : 256;
+	  CHECK_NULL(L_DB, order->ids = realloc(order->ids, order->size * sizeof(uint32_t)));
+	  CHECK_NULL(L_DB, order->pos = realloc(order->pos, order->size * sizeof(int)));
+	  CHECK_NULL(L_DB, order->shuffle_pos = realloc(order->shuffle_pos, order->size * sizeof(int)));
 	}
 
-      pos++;
+      order->ids[order->count] = sqlite3_column_int(stmt, 0);
+      order->pos[order->count] = sqlite3_column_int(stmt, 1);
+      order->shuffle_pos[order->count] = sqlite3_column_int(stmt, 2);
+      order->count++;
     }
 
-  db_query_end(&qp);
-  return ret;
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s (%s)\n", sqlite3_errmsg(hdl), query);
+      sqlite3_finalize(stmt);
+      sqlite3_free(query);
+      queue_order_free(order);
+      return -1;
+    }
 
-#undef Q_TMPL
+  sqlite3_finalize(stmt);
+  sqlite3_free(query);
+  return 0;
+}
+
+// Writes new_pos[i] as the position of order->ids[i], skipping unchanged rows
+static int
+queue_order_save(struct queue_order *order, const int *new_pos, enum sort_type sort, int queue_version)
+{
+  sqlite3_stmt *stmt;
+  int *cur_pos;
+  int changes;
+  int i;
+  int ret;
+
+  if (sort == S_SHUFFLE_POS)
+    {
+      stmt = db_statements.queue_shuffle_pos_update;
+      cur_pos = order->shuffle_pos;
+    }
+  else
+    {
+      stmt = db_statements.queue_pos_update;
+      cur_pos = order->pos;
+    }
+
+  changes = 0;
+  for (i = 0; i < order->count; i++)
+    {
+      if (cur_pos[i] == new_pos[i])
+	continue;
+
+      sqlite3_bind_int(stmt, 1, new_pos[i]);
+      sqlite3_bind_int(stmt, 2, queue_version);
+      sqlite3_bind_int(stmt, 3, order->ids[i]);
+
+      ret = db_statement_run(stmt, 0);
+      if (ret < 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Failed to update item with item-id: %d\n", order->ids[i]);
+	  return -1;
+	}
+
+      cur_pos[i] = new_pos[i];
+      changes++;
+    }
+
+  DPRINTF(E_DBG, L_DB, "Updated position of %d out of %d queue items\n", changes, order->count);
+
+  return 0;
+}
+
+// Closes gaps in the given queue order after items have been removed
+static int
+queue_fix_pos(enum sort_type sort, int queue_version)
+{
+  struct queue_order order;
+  int *new_pos;
+  int i;
+  int ret;
+
+  ret = queue_order_load(&order, sort, 0);
+  if (ret < 0)
+    return -1;
+
+  if (order.count == 0)
+    return 0;
+
+  CHECK_NULL(L_DB, new_pos = malloc(order.count * sizeof(int)));
+  for (i = 0; i < order.count; i++)
+    new_pos[i] = i;
+
+  ret = queue_order_save(&order, new_pos, sort, queue_version);
+
+  free(new_pos);
+  queue_order_free(&order);
+  return ret;
 }
 
 /*
@@ -5764,6 +7913,8 @@ db_queue_cleanup()
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   ret = db_query_run(Q_TMPL, 0, 0);
   if (ret < 0)
@@ -5806,6 +7957,8 @@ db_queue_clear(uint32_t keep_item_id)
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   query = sqlite3_mprintf("DELETE FROM queue where id <> %d;", keep_item_id);
   ret = db_query_run(query, 1, 0);
@@ -5862,6 +8015,8 @@ db_queue_delete_byitemid(uint32_t item_id)
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   ret = queue_fetch_byitemid(item_id, &queue_item, 0);
 
@@ -5891,6 +8046,8 @@ db_queue_delete_bypos(uint32_t pos, int count)
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   // Remove item with the given item_id
   to_pos = pos + count;
@@ -5919,6 +8076,8 @@ db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   ret = queue_fetch_byposrelativetoitem(pos, item_id, shuffle, &queue_item, 0);
   if (ret < 0)
@@ -5939,6 +8098,40 @@ db_queue_delete_byposrelativetoitem(uint32_t pos, uint32_t item_id, char shuffle
   return ret;
 }
 
+/*
+ * Moves the item with the given id from pos_from to pos_to in the normal or shuffle
+ * order. Only the items between the two positions are shifted, so the number of
+ * rows written (and flagged with the new queue_version) is bounded by the distance
+ * of the move, not by the length of the queue.
+ */
+static int
+queue_move_pos(uint32_t item_id, int pos_from, int pos_to, char shuffle, int queue_version)
+{
+  const char *col;
+  char *query;
+  int ret;
+
+  if (pos_from == pos_to)
+    return 0;
+
+  col = shuffle ? "shuffle_pos" : "pos";
+
+  if (pos_from < pos_to)
+    query = sqlite3_mprintf("UPDATE queue SET %s = %s - 1, queue_version = %d WHERE %s > %d AND %s <= %d;",
+			    col, col, queue_version, col, pos_from, col, pos_to);
+  else
+    query = sqlite3_mprintf("UPDATE queue SET %s = %s + 1, queue_version = %d WHERE %s >= %d AND %s < %d;",
+			    col, col, queue_version, col, pos_to, col, pos_from);
+
+  ret = db_query_run(query, 1, 0);
+  if (ret < 0)
+    return -1;
+
+  query = sqlite3_mprintf("UPDATE queue SET %s = %d, queue_version = %d WHERE id = %d;", col, pos_to, queue_version, item_id);
+
+  return db_query_run(query, 1, 0);
+}
+
 /*
  * Moves the queue item with the given id to the given position (zero-based).
  *
@@ -5951,47 +8144,22 @@ int
 db_queue_move_byitemid(uint32_t item_id, int pos_to, char shuffle)
 {
   int queue_version;
-  char *query;
   int pos_from;
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   // Find item with the given item_id
-  pos_from = db_queue_get_pos(item_id, shuffle);
-  if (pos_from < 0)
-    {
-      ret = -1;
-      goto end_transaction;
-    }
-
-  // Update pos for all items after the item with given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, pos_from);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, pos_from);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, item_id);
+  pos_from = db_queue_get_pos(item_id, shuffle);
+  if (pos_from < 0)
+    {
+      ret = -1;
+      goto end_transaction;
+    }
 
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_pos(item_id, pos_from, pos_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -6011,10 +8179,11 @@ db_queue_move_bypos(int pos_from, int pos_to)
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   // Find item to move
   ret = queue_fetch_bypos(pos_from, 0, &queue_item, 0);
@@ -6027,21 +8196,7 @@ db_queue_move_bypos(int pos_from, int pos_to)
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_to);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_to, queue_version, queue_item.id);
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_pos(queue_item.id, queue_item.pos, pos_to, 0, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -6063,12 +8218,13 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
 {
   int queue_version;
   struct db_queue_item queue_item;
-  char *query;
   int pos_move_from;
   int pos_move_to;
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   DPRINTF(E_DBG, L_DB, "Move by pos: from %d offset %d relative to item (%d)\n", from_pos, to_offset, item_id);
 
@@ -6120,33 +8276,7 @@ db_queue_move_byposrelativetoitem(uint32_t from_pos, uint32_t to_offset, uint32_
       return 0;
     }
 
-  // Update pos for all items after the item with given position
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos - 1, queue_version = %d WHERE shuffle_pos > %d;", queue_version, queue_item.shuffle_pos);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos - 1, queue_version = %d WHERE pos > %d;", queue_version, queue_item.pos);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update pos for all items from the given pos_to
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = shuffle_pos + 1, queue_version = %d WHERE shuffle_pos >= %d;", queue_version, pos_move_to);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = pos + 1, queue_version = %d WHERE pos >= %d;", queue_version, pos_move_to);
-
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto end_transaction;
-
-  // Update item with the given item_id
-  if (shuffle)
-    query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-  else
-    query = sqlite3_mprintf("UPDATE queue SET pos = %d, queue_version = %d where id = %d;", pos_move_to, queue_version, queue_item.id);
-
-  ret = db_query_run(query, 1, 0);
+  ret = queue_move_pos(queue_item.id, pos_move_from, pos_move_to, shuffle, queue_version);
 
  end_transaction:
   queue_transaction_end(ret, queue_version);
@@ -6168,22 +8298,13 @@ queue_reshuffle(uint32_t item_id, int queue_version)
 {
   char *query;
   int pos;
-  uint32_t count;
-  struct db_queue_item queue_item;
+  struct queue_order order = { 0 };
   int *shuffle_pos = NULL;
-  int len;
   int i;
-  struct query_params qp = { 0 };
   int ret;
 
   DPRINTF(E_DBG, L_DB, "Reshuffle queue after item with item-id: %d\n", item_id);
 
-  // Reset the shuffled order and mark all items as changed
-  query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d;", queue_version);
-  ret = db_query_run(query, 1, 0);
-  if (ret < 0)
-    goto error;
-
   pos = 0;
   if (item_id > 0)
     {
@@ -6192,55 +8313,43 @@ queue_reshuffle(uint32_t item_id, int queue_version)
 	goto error;
 
       pos++; // Do not reshuffle the base item
+
+      // Up to and including the base item the shuffled order is the play order
+      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = pos, queue_version = %d WHERE pos < %d AND shuffle_pos <> pos;", queue_version, pos);
+      ret = db_query_run(query, 1, 0);
+      if (ret < 0)
+	goto error;
     }
 
-  ret = db_queue_get_count(&count);
+  // The items after the base item get their play positions in random order,
+  // only the rows where that changes the shuffle_pos are written
+  ret = queue_order_load(&order, S_POS, pos);
   if (ret < 0)
     goto error;
 
-  len = count - pos;
+  DPRINTF(E_DBG, L_DB, "Reshuffle %d items, starting from pos %d\n", order.count, pos);
 
-  DPRINTF(E_DBG, L_DB, "Reshuffle %d items off %" PRIu32 " total items, starting from pos %d\n", len, count, pos);
-
-  CHECK_NULL(L_DB, shuffle_pos = malloc(len * sizeof(int)));
-  for (i = 0; i < len; i++)
-    {
-      shuffle_pos[i] = i + pos;
-    }
-
-  rng_shuffle_int(&shuffle_rng, shuffle_pos, len);
-
-  qp.filter = sqlite3_mprintf("pos >= %d", pos);
-
-  ret = queue_enum_start(&qp);
-  if (ret < 0)
-    goto error;
+  if (order.count == 0)
+    return 0;
 
-  i = 0;
-  while ((ret = queue_enum_fetch(&qp, &queue_item, 0)) == 0 && (queue_item.id > 0) && (i < len))
+  CHECK_NULL(L_DB, shuffle_pos = malloc(order.count * sizeof(int)));
+  for (i = 0; i < order.count; i++)
     {
-      query = sqlite3_mprintf("UPDATE queue SET shuffle_pos = %d where id = %d;", shuffle_pos[i], queue_item.id);
-      ret = db_query_run(query, 1, 0);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_DB, "Failed to delete item with item-id: %d\n", queue_item.id);
-	  break;
-	}
-
-      i++;
+      shuffle_pos[i] = order.pos[i];
     }
 
-  db_query_end(&qp);
+  rng_shuffle_int(&shuffle_rng, shuffle_pos, order.count);
 
+  ret = queue_order_save(&order, shuffle_pos, S_SHUFFLE_POS, queue_version);
   if (ret < 0)
     goto error;
 
-  sqlite3_free(qp.filter);
+  queue_order_free(&order);
   free(shuffle_pos);
   return 0;
 
  error:
-  sqlite3_free(qp.filter);
+  queue_order_free(&order);
   free(shuffle_pos);
   return -1;
 }
@@ -6261,6 +8370,8 @@ db_queue_reshuffle(uint32_t item_id)
   int ret;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
 
   ret = queue_reshuffle(item_id, queue_version);
 
@@ -6278,11 +8389,107 @@ db_queue_inc_version()
   int queue_version;
 
   queue_version = queue_transaction_begin();
+  if (queue_version < 0)
+    return -1;
   queue_transaction_end(0, queue_version);
 
   return 0;
 }
 
+int
+db_queue_version_get(void)
+{
+  int queue_version;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_queue_version_lck));
+  queue_version = db_queue_version_committed;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_queue_version_lck));
+
+  return queue_version;
+}
+
+int
+db_queue_get_ids(uint32_t **ids, uint32_t **shuffle_ids, int *count, int *queue_version)
+{
+#define Q_TMPL "SELECT id, pos, shuffle_pos FROM queue ORDER BY pos;"
+  sqlite3_stmt *stmt;
+  uint32_t *by_pos = NULL;
+  uint32_t *by_shuffle_pos = NULL;
+  uint32_t nitems;
+  int pos;
+  int shuffle_pos;
+  int i;
+  int ret;
+
+  // Read before the queue, so the result is at worst considered outdated
+  *queue_version = db_queue_version_get();
+
+  ret = db_transaction_begin();
+  if (ret < 0)
+    return -1;
+
+  ret = db_queue_get_count(&nitems);
+  if (ret < 0)
+    goto error;
+
+  if (nitems > 0)
+    {
+      CHECK_NULL(L_DB, by_pos = calloc(nitems, sizeof(uint32_t)));
+      CHECK_NULL(L_DB, by_shuffle_pos = calloc(nitems, sizeof(uint32_t)));
+    }
+
+  DPRINTF(E_DBG, L_DB, "Running query '%s'\n", Q_TMPL);
+
+  ret = db_blocking_prepare_v2(Q_TMPL, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not prepare statement: %s\n", sqlite3_errmsg(hdl));
+      goto error;
+    }
+
+  i = 0;
+  while ((ret = db_blocking_step(stmt)) == SQLITE_ROW)
+    {
+      pos = sqlite3_column_int(stmt, 1);
+      shuffle_pos = sqlite3_column_int(stmt, 2);
+
+      // Positions must be contiguous, otherwise the caller can't index by them
+      if (i >= nitems || pos != i || shuffle_pos < 0 || shuffle_pos >= nitems || by_shuffle_pos[shuffle_pos] != 0)
+	{
+	  DPRINTF(E_LOG, L_DB, "Queue positions are not contiguous (item-id=%d, pos=%d, shuffle_pos=%d)\n",
+		  sqlite3_column_int(stmt, 0), pos, shuffle_pos);
+	  sqlite3_finalize(stmt);
+	  goto error;
+	}
+
+      by_pos[i] = sqlite3_column_int(stmt, 0);
+      by_shuffle_pos[shuffle_pos] = by_pos[i];
+      i++;
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (ret != SQLITE_DONE || i != nitems)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not read queue item ids: %s\n", sqlite3_errmsg(hdl));
+      goto error;
+    }
+
+  db_transaction_end();
+
+  *ids = by_pos;
+  *shuffle_ids = by_shuffle_pos;
+  *count = nitems;
+  return 0;
+
+ error:
+  db_transaction_end();
+  free(by_pos);
+  free(by_shuffle_pos);
+  return -1;
+#undef Q_TMPL
+}
+
 int
 db_queue_get_count(uint32_t *nitems)
 {
@@ -6592,45 +8799,328 @@ db_watch_enum_start(struct watch_enum *we)
 void
 db_watch_enum_end(struct watch_enum *we)
 {
-  if (!we->stmt)
-    return;
+  if (!we->stmt)
+    return;
+
+  sqlite3_finalize(we->stmt);
+  we->stmt = NULL;
+}
+
+int
+db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+{
+  int ret;
+
+  *wd = 0;
+
+  if (!we->stmt)
+    {
+      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
+      return -1;
+    }
+
+  ret = db_blocking_step(we->stmt);
+  if (ret == SQLITE_DONE)
+    {
+      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
+      return 0;
+    }
+  else if (ret != SQLITE_ROW)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      return -1;
+    }
+
+  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+
+  return 0;
+}
+
+
+/* Query statistics */
+
+// Appends a ? for a literal to the shape, merging lists like "?, ?, ?" into a
+// single ? so that IN (...) lists of any length give the same shape
+static size_t
+query_shape_placeholder(char *shape, size_t len)
+{
+  size_t i = len;
+
+  while (i > 0 && shape[i - 1] == ' ')
+    i--;
+  if (i > 0 && shape[i - 1] == ',')
+    {
+      i--;
+      while (i > 0 && shape[i - 1] == ' ')
+	i--;
+      if (i > 0 && shape[i - 1] == '?')
+	return i;
+    }
+
+  shape[len] = '?';
+  return len + 1;
+}
+
+// Replaces the literals in a query with ?, so that queries that only differ in
+// ids or strings are counted as one shape. Returns the length of the shape.
+static size_t
+query_shape_normalize(char *shape, size_t size, const char *query)
+{
+  const char *p;
+  size_t len;
+  char prev;
+
+  for (p = query, len = 0, prev = ' '; *p && len < size - 1; prev = *(p - 1))
+    {
+      if (*p == '\'')
+	{
+	  // String literal, where '' is an escaped quote
+	  for (p++; *p; p++)
+	    {
+	      if (*p != '\'')
+		continue;
+	      if (*(p + 1) != '\'')
+		break;
+	      p++;
+	    }
+	  if (*p)
+	    p++;
+
+	  len = query_shape_placeholder(shape, len);
+	}
+      else if (isdigit((unsigned char)*p) && !isalnum((unsigned char)prev) && prev != '_')
+	{
+	  while (isalnum((unsigned char)*p) || *p == '.')
+	    p++;
+
+	  len = query_shape_placeholder(shape, len);
+	}
+      else
+	shape[len++] = *p++;
+    }
+
+  shape[len] = '\0';
+
+  return len;
+}
+
+static void
+db_query_stats_add(sqlite3_stmt *stmt, int64_t ns)
+{
+  char shape[DB_QUERY_SHAPE_LEN];
+  struct db_query_stats *qs;
+  const char *query;
+  uint64_t hash;
+  uint64_t us;
+  uint64_t limit;
+  size_t len;
+  int bucket;
+  int slot;
+  int idx;
+
+  query = sqlite3_sql(stmt);
+  if (!query || strncmp(query, "EXPLAIN", 7) == 0)
+    return;
+
+  len = query_shape_normalize(shape, sizeof(shape), query);
+  hash = murmur_hash64(shape, len, 0);
+
+  us = ns / 1000;
+  for (bucket = 0, limit = 100; bucket < DB_QUERY_STATS_BUCKETS - 1 && us >= limit; bucket++)
+    limit *= 10;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats.lck));
+
+  slot = hash & (DB_QUERY_STATS_SLOTS - 1);
+  while ((idx = db_query_stats.slots[slot]) > 0 && db_query_stats.hashes[idx - 1] != hash)
+    slot = (slot + 1) & (DB_QUERY_STATS_SLOTS - 1);
+
+  if (idx == 0)
+    {
+      if (db_query_stats.count == DB_QUERY_STATS_MAX)
+	{
+	  db_query_stats.dropped++;
+	  goto out;
+	}
+
+      idx = ++db_query_stats.count;
+      db_query_stats.slots[slot] = idx;
+      db_query_stats.hashes[idx - 1] = hash;
+      db_query_stats.entries[idx - 1].query = strdup(shape);
+    }
+
+  qs = &db_query_stats.entries[idx - 1];
+
+  qs->count++;
+  qs->total_us += us;
+  qs->histogram[bucket]++;
+  qs->fullscan_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  qs->vm_steps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+  qs->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+  qs->autoindexes += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_AUTOINDEX, 1);
+
+  if (!qs->example || us > qs->max_us)
+    {
+      qs->max_us = us;
+      free(qs->example);
+      qs->example = strdup(query);
+    }
+
+ out:
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats.lck));
+}
+
+static int
+db_query_stats_cmp(const void *a, const void *b)
+{
+  const struct db_query_stats *qa = a;
+  const struct db_query_stats *qb = b;
+
+  if (qa->total_us == qb->total_us)
+    return 0;
+
+  return (qa->total_us < qb->total_us) ? 1 : -1;
+}
+
+// Returns a copy of the statistics, with the query shapes that took the most
+// time in total first
+int
+db_query_stats_get(struct db_query_stats **stats, int *nstats, uint64_t *dropped)
+{
+  struct db_query_stats *copy;
+  int i;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats.lck));
+
+  CHECK_NULL(L_DB, copy = calloc(db_query_stats.count + 1, sizeof(struct db_query_stats)));
+
+  for (i = 0; i < db_query_stats.count; i++)
+    {
+      copy[i] = db_query_stats.entries[i];
+      copy[i].query = safe_strdup(db_query_stats.entries[i].query);
+      copy[i].example = safe_strdup(db_query_stats.entries[i].example);
+    }
+
+  *nstats = db_query_stats.count;
+  if (dropped)
+    *dropped = db_query_stats.dropped;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats.lck));
+
+  qsort(copy, *nstats, sizeof(struct db_query_stats), db_query_stats_cmp);
+
+  *stats = copy;
+
+  return 0;
+}
+
+void
+db_query_stats_free(struct db_query_stats *stats, int nstats)
+{
+  int i;
+
+  if (!stats)
+    return;
+
+  for (i = 0; i < nstats; i++)
+    {
+      free(stats[i].query);
+      free(stats[i].example);
+    }
+
+  free(stats);
+}
+
+void
+db_query_stats_reset(void)
+{
+  int i;
 
-  sqlite3_finalize(we->stmt);
-  we->stmt = NULL;
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_query_stats.lck));
+
+  for (i = 0; i < db_query_stats.count; i++)
+    {
+      free(db_query_stats.entries[i].query);
+      free(db_query_stats.entries[i].example);
+    }
+
+  memset(db_query_stats.slots, 0, sizeof(db_query_stats.slots));
+  memset(db_query_stats.hashes, 0, sizeof(db_query_stats.hashes));
+  memset(db_query_stats.entries, 0, sizeof(db_query_stats.entries));
+  db_query_stats.count = 0;
+  db_query_stats.dropped = 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_query_stats.lck));
 }
 
+// Returns the plan of the query as reported by EXPLAIN QUERY PLAN, one step per
+// line. full_scan is set if a table is scanned without an index.
 int
-db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd)
+db_query_plan_get(char **plan, bool *full_scan, const char *query)
 {
+  sqlite3_stmt *stmt;
+  const char *detail;
+  char *explain;
+  char *lines;
   int ret;
 
-  *wd = 0;
+  *plan = NULL;
+  *full_scan = false;
 
-  if (!we->stmt)
+  if ((strncmp(query, "SELECT", 6) != 0) && (strncmp(query, "UPDATE", 6) != 0)
+      && (strncmp(query, "DELETE", 6) != 0) && (strncmp(query, "INSERT", 6) != 0))
+    return -1;
+
+  explain = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", query);
+  if (!explain)
     {
-      DPRINTF(E_LOG, L_DB, "Watch enum not started!\n");
+      DPRINTF(E_LOG, L_DB, "Out of memory for query string\n");
       return -1;
     }
 
-  ret = db_blocking_step(we->stmt);
-  if (ret == SQLITE_DONE)
+  ret = db_blocking_prepare_v2(explain, -1, &stmt, NULL);
+  sqlite3_free(explain);
+  if (ret != SQLITE_OK)
     {
-      DPRINTF(E_INFO, L_DB, "End of watch enum results\n");
-      return 0;
+      DPRINTF(E_WARN, L_DB, "Could not prepare query plan statement: %s\n", sqlite3_errmsg(hdl));
+      return -1;
     }
-  else if (ret != SQLITE_ROW)
+
+  lines = sqlite3_mprintf("");
+  while (lines && (ret = db_blocking_step(stmt)) == SQLITE_ROW)
     {
-      DPRINTF(E_LOG, L_DB, "Could not step: %s\n", sqlite3_errmsg(hdl));	
+      detail = (const char *)sqlite3_column_text(stmt, 3);
+      if (!detail)
+	continue;
+
+      lines = sqlite3_mprintf("%z%s%s", lines, lines[0] ? "\n" : "", detail);
+
+      // "SCAN f" or "SCAN TABLE files AS f" in older versions, with an index
+      // there is a "USING", and subqueries and constant rows aren't tables
+      if (strncmp(detail, "SCAN ", 5) == 0 && !strstr(detail, " USING ") && !strstr(detail, "SUBQUERY")
+	  && !strstr(detail, "(subquery") && !strstr(detail, "CONSTANT ROW"))
+	*full_scan = true;
+    }
+
+  sqlite3_finalize(stmt);
+
+  if (!lines || ret != SQLITE_DONE)
+    {
+      DPRINTF(E_WARN, L_DB, "Could not get query plan: %s\n", sqlite3_errmsg(hdl));
+      sqlite3_free(lines);
       return -1;
     }
 
-  *wd = (uint32_t)sqlite3_column_int(we->stmt, 0);
+  *plan = strdup(lines);
+  sqlite3_free(lines);
 
   return 0;
 }
 
-
 #ifdef DB_PROFILE
+static int
+db_xtrace(unsigned int trace_type, void *notused, void *ptr, void *ptr_data);
+
 static int
 db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
 {
@@ -6705,12 +9195,77 @@ db_xprofile(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
 
  out:
   /* Reenable profiling callback */
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
+  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xtrace, NULL);
 
   return 0;
 }
 #endif
 
+// Note that SQLite doesn't call this for a DELETE without a WHERE clause on a
+// table without triggers, e.g. "DELETE FROM playlistitems;"
+static void
+db_xupdate(void *notused, int op, const char *dbname, const char *table, sqlite3_int64 rowid)
+{
+  if (strcmp(table, "files") == 0)
+    db_table_changes_pending.files++;
+  else if (strcmp(table, "playlists") == 0)
+    db_table_changes_pending.playlists++;
+  else if (strcmp(table, "playlistitems") == 0)
+    db_table_changes_pending.playlistitems++;
+}
+
+// The changes of a transaction are added to the totals in one go, so that the
+// update hook doesn't need the lock for every row of e.g. a scan
+static int
+db_xcommit(void *notused)
+{
+  struct db_table_changes *pending = &db_table_changes_pending;
+
+  if (pending->files == 0 && pending->playlists == 0 && pending->playlistitems == 0)
+    return 0;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_table_changes.lck));
+  db_table_changes.changes.files += pending->files;
+  db_table_changes.changes.playlists += pending->playlists;
+  db_table_changes.changes.playlistitems += pending->playlistitems;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_table_changes.lck));
+
+  memset(pending, 0, sizeof(struct db_table_changes));
+
+  return 0; // Go ahead with the commit
+}
+
+static void
+db_xrollback(void *notused)
+{
+  memset(&db_table_changes_pending, 0, sizeof(struct db_table_changes));
+}
+
+// Lets caches of data from the library find out if a table has changed since
+// they were built, by comparing with the counters they got at that time
+void
+db_table_changes_get(struct db_table_changes *changes)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_table_changes.lck));
+  *changes = db_table_changes.changes;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_table_changes.lck));
+}
+
+static int
+db_xtrace(unsigned int trace_type, void *notused, void *ptr, void *ptr_data)
+{
+  if (trace_type != SQLITE_TRACE_PROFILE)
+    return 0;
+
+  db_query_stats_add(ptr, *((int64_t *) ptr_data));
+
+#ifdef DB_PROFILE
+  db_xprofile(trace_type, notused, ptr, ptr_data);
+#endif
+
+  return 0;
+}
+
 static int
 db_pragma_get_cache_size()
 {
@@ -6964,7 +9519,7 @@ db_open(void)
       return -1;
     }
 
-  ret = sqlite3_load_extension(hdl, PKGLIBDIR "/" PACKAGE_NAME "-sqlext.so", NULL, &errmsg);
+  ret = sqlite3_load_extension(hdl, DB_SQLEXT_PATH, NULL, &errmsg);
   if (ret != SQLITE_OK)
     {
       DPRINTF(E_LOG, L_DB, "Could not load SQLite extension: %s\n", errmsg);
@@ -6983,9 +9538,22 @@ db_open(void)
       return -1;
     }
 
-#ifdef DB_PROFILE
-  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xprofile, NULL);
-#endif
+  ret = sqlite3_create_function(hdl, "scan_seen", 1, SQLITE_UTF8, NULL, db_scan_seen_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create scan_seen function: %s\n", sqlite3_errmsg(hdl));
+
+      sqlite3_close(hdl);
+      return -1;
+    }
+
+  sqlite3_trace_v2(hdl, SQLITE_TRACE_PROFILE, db_xtrace, NULL);
+  sqlite3_update_hook(hdl, db_xupdate, NULL);
+  sqlite3_commit_hook(hdl, db_xcommit, NULL);
+  sqlite3_rollback_hook(hdl, db_xrollback, NULL);
+
+  if (db_wal_mode)
+    sqlite3_busy_handler(hdl, db_busy_handler, NULL);
 
   cache_size = cfg_getint(cfg_getsec(cfg, "sqlite"), "pragma_cache_size_library");
   if (cache_size > -1)
@@ -6995,7 +9563,12 @@ db_open(void)
       DPRINTF(E_DBG, L_DB, "Database cache size in pages: %d\n", cache_size);
     }
 
-  journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
+  // WAL is a persistent property of the database file, but we set it on every
+  // connection anyway so that a configured pragma_journal_mode can't undo it
+  if (db_wal_mode)
+    journal_mode = "WAL";
+  else
+    journal_mode = cfg_getstr(cfg_getsec(cfg, "sqlite"), "pragma_journal_mode");
   if (journal_mode)
     {
       journal_mode = db_pragma_set_journal_mode(journal_mode);
@@ -7122,6 +9695,63 @@ db_statements_prepare_ping(const char *table)
   return stmt;
 }
 
+static sqlite3_stmt *
+db_statements_prepare_queue_pos(const char *col)
+{
+  char *query;
+  sqlite3_stmt *stmt;
+  int ret;
+
+  CHECK_NULL(L_DB, query = db_mprintf("UPDATE queue SET %s = ?, queue_version = ? WHERE id = ?;", col));
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      free(query);
+      return NULL;
+    }
+
+  free(query);
+
+  return stmt;
+}
+
+// Prepares "<query_head> (?,?,...);" with nvars variables in the list
+static sqlite3_stmt *
+db_statements_prepare_batch(const char *query_head, int nvars)
+{
+  char *query;
+  char varstr[2 * DB_FILE_BATCH_SIZE];
+  sqlite3_stmt *stmt;
+  int ret;
+  int i;
+
+  if (nvars <= 0 || nvars > DB_FILE_BATCH_SIZE)
+    return NULL;
+
+  for (i = 0; i < nvars; i++)
+    {
+      varstr[2 * i] = '?';
+      varstr[2 * i + 1] = ',';
+    }
+  varstr[2 * nvars - 1] = '\0';
+
+  CHECK_NULL(L_DB, query = db_mprintf("%s (%s);", query_head, varstr));
+
+  ret = db_blocking_prepare_v2(query, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_FATAL, L_DB, "Could not prepare statement '%s': %s\n", query, sqlite3_errmsg(hdl));
+      free(query);
+      return NULL;
+    }
+
+  free(query);
+
+  return stmt;
+}
+
 static int
 db_statements_prepare(void)
 {
@@ -7129,31 +9759,190 @@ db_statements_prepare(void)
   db_statements.files_update = db_statements_prepare_update(mfi_cols_map, ARRAY_SIZE(mfi_cols_map), "files");
   db_statements.files_ping   = db_statements_prepare_ping("files");
 
+  db_statements.files_lookup_batch = db_statements_prepare_batch("SELECT f.id, f.path, f.db_timestamp FROM files f WHERE f.path IN", DB_FILE_BATCH_SIZE);
+  db_statements.files_ping_batch   = db_statements_prepare_batch("UPDATE files SET db_timestamp = ?, disabled = 0 WHERE id IN", DB_FILE_BATCH_SIZE);
+  db_statements.files_seen_lookup  = db_statements_prepare_batch("SELECT f.id FROM files f WHERE f.db_timestamp >= ? AND f.path IN", 1);
+
   db_statements.playlists_insert = db_statements_prepare_insert(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
   db_statements.playlists_update = db_statements_prepare_update(pli_cols_map, ARRAY_SIZE(pli_cols_map), "playlists");
 
   db_statements.queue_items_insert = db_statements_prepare_insert(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
   db_statements.queue_items_update = db_statements_prepare_update(qi_cols_map, ARRAY_SIZE(qi_cols_map), "queue");
+  db_statements.queue_pos_update   = db_statements_prepare_queue_pos("pos");
+  db_statements.queue_shuffle_pos_update = db_statements_prepare_queue_pos("shuffle_pos");
 
   if ( !db_statements.files_insert || !db_statements.files_update || !db_statements.files_ping
+       || !db_statements.files_lookup_batch || !db_statements.files_ping_batch || !db_statements.files_seen_lookup
        || !db_statements.playlists_insert || !db_statements.playlists_update
        || !db_statements.queue_items_insert || !db_statements.queue_items_update
+       || !db_statements.queue_pos_update || !db_statements.queue_shuffle_pos_update
      )
     return -1;
 
   return 0;
 }
 
-int
-db_backup()
+/* Online backup, copies the db in small steps from its own thread, so that the
+ * source db is only locked briefly at a time */
+static void
+db_backup_progress_set(int pages_total, int pages_remaining)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+  db_backup_state.status.pages_total = pages_total;
+  db_backup_state.status.pages_remaining = pages_remaining;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+}
+
+static bool
+db_backup_stop_requested(void)
+{
+  bool stop;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+  stop = db_backup_state.stop;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+
+  return stop;
+}
+
+static int
+db_backup_run(const char *backup_path)
 {
-  int ret;
   sqlite3 *backup_hdl;
   sqlite3_backup *backup;
-  const char *backup_path;
+  int pages_per_step;
+  int step_delay;
+  int remaining;
+  int remaining_prev;
+  int restarts;
+  int ret;
+
+  pages_per_step = cfg_getint(cfg_getsec(cfg, "general"), "db_backup_pages_per_step");
+  step_delay = cfg_getint(cfg_getsec(cfg, "general"), "db_backup_step_delay");
+  if (pages_per_step <= 0)
+    pages_per_step = -1;
+
+  ret = sqlite3_open(backup_path, &backup_hdl);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
+      sqlite3_close(backup_hdl);
+      return -1;
+    }
+
+  backup = sqlite3_backup_init(backup_hdl, "main", hdl, "main");
+  if (!backup)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
+      sqlite3_close(backup_hdl);
+      return -1;
+    }
+
+  remaining_prev = INT_MAX;
+  restarts = 0;
+  do
+    {
+      // A write from another connection restarts the backup from the first
+      // page. If the library keeps changing, copy the rest in one go.
+      if (restarts > DB_BACKUP_RESTARTS_MAX && pages_per_step > 0)
+	{
+	  DPRINTF(E_INFO, L_DB, "Backup restarted %d times by db writes, copying the rest in one step\n", restarts);
+	  pages_per_step = -1;
+	}
+
+      ret = sqlite3_backup_step(backup, pages_per_step);
+
+      remaining = sqlite3_backup_remaining(backup);
+      if (remaining > remaining_prev)
+	restarts++;
+      remaining_prev = remaining;
+
+      db_backup_progress_set(sqlite3_backup_pagecount(backup), remaining);
+
+      if (db_backup_stop_requested())
+	{
+	  DPRINTF(E_INFO, L_DB, "Backup to '%s' cancelled\n", backup_path);
+	  ret = SQLITE_INTERRUPT;
+	  break;
+	}
+
+      if (ret != SQLITE_DONE && step_delay > 0)
+	sqlite3_sleep(step_delay);
+    }
+  while (ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+
+  sqlite3_backup_finish(backup);
+  sqlite3_close(backup_hdl);
+
+  if (ret != SQLITE_DONE)
+    {
+      DPRINTF(E_WARN, L_DB, "Failed to complete backup '%s': %s (%d)\n", backup_path, sqlite3_errstr(ret), ret);
+      return -1;
+    }
+
+  DPRINTF(E_INFO, L_DB, "Backup complete to '%s'\n", backup_path);
+
+  return 0;
+}
+
+static void *
+db_backup_thread(void *arg)
+{
+  char *backup_path = arg;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret == 0)
+    {
+      ret = db_backup_run(backup_path);
+      db_perthread_deinit();
+    }
+  else
+    DPRINTF(E_LOG, L_DB, "Error: DB init failed (backup thread)\n");
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+  db_backup_state.status.running = false;
+  db_backup_state.status.result = ret;
+  db_backup_state.status.end = time(NULL);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+
+  free(backup_path);
+
+  pthread_exit(NULL);
+}
+
+// Stops a running backup and joins the thread of the last backup
+static void
+db_backup_join(void)
+{
+  bool joinable;
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+  db_backup_state.stop = true;
+  joinable = db_backup_state.joinable;
+  db_backup_state.joinable = false;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+
+  if (joinable)
+    CHECK_ERR(L_DB, pthread_join(db_backup_state.tid, NULL));
+}
 
+/*
+ * Starts a backup of the library db to the configured db_backup_path. The
+ * backup runs in the background, see db_backup_status_get() for its progress.
+ *
+ * @return 0 if the backup was started or is already running, -2 if backups are
+ *         not enabled, -1 on error
+ */
+int
+db_backup(void)
+{
+  const char *backup_path;
+  char *path;
   char resolved_bp[PATH_MAX];
   char resolved_dbp[PATH_MAX];
+  bool joinable;
+  int ret;
 
   backup_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_backup_path");
   if (!backup_path)
@@ -7165,7 +9954,7 @@ db_backup()
   if (realpath(db_path, resolved_dbp) == NULL || realpath(backup_path, resolved_bp) == NULL)
     {
       DPRINTF(E_LOG, L_DB, "Failed to resolve real path of db/backup path: %s\n", strerror(errno));
-      goto error;
+      return -1;
     }
 
   if (strcmp(resolved_bp, resolved_dbp) == 0)
@@ -7174,35 +9963,67 @@ db_backup()
       return -2;
     }
 
-  DPRINTF(E_INFO, L_DB, "Backup starting...\n");
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
 
-  ret = sqlite3_open(backup_path, &backup_hdl);
-  if (ret != SQLITE_OK)
+  if (db_backup_state.status.running)
     {
-      DPRINTF(E_WARN, L_DB, "Failed to create backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      goto error;
+      CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+      DPRINTF(E_INFO, L_DB, "Backup already in progress\n");
+      return 0;
     }
 
-  backup = sqlite3_backup_init(backup_hdl, "main", hdl, "main");
-  if (!backup)
+  joinable = db_backup_state.joinable;
+  db_backup_state.joinable = false;
+  db_backup_state.stop = false;
+
+  memset(&db_backup_state.status, 0, sizeof(struct db_backup_status));
+  db_backup_state.status.running = true;
+  db_backup_state.status.start = time(NULL);
+
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
+
+  // The thread of the previous backup has ended, but was not joined yet
+  if (joinable)
+    CHECK_ERR(L_DB, pthread_join(db_backup_state.tid, NULL));
+
+  DPRINTF(E_INFO, L_DB, "Backup starting...\n");
+
+  CHECK_NULL(L_DB, path = strdup(backup_path));
+
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+
+  ret = pthread_create(&db_backup_state.tid, NULL, db_backup_thread, path);
+  if (ret == 0)
     {
-      DPRINTF(E_WARN, L_DB, "Failed to initiate backup '%s': %s\n", backup_path, sqlite3_errmsg(backup_hdl));
-      goto error;
+      db_backup_state.joinable = true;
+    }
+  else
+    {
+      db_backup_state.status.running = false;
+      db_backup_state.status.result = -1;
+      db_backup_state.status.end = time(NULL);
     }
 
-  ret = sqlite3_backup_step(backup, -1);
-  sqlite3_backup_finish(backup);
-  sqlite3_close(backup_hdl);
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
 
-  if (ret == SQLITE_DONE || ret == SQLITE_OK)
-    DPRINTF(E_INFO, L_DB, "Backup complete to '%s'\n", backup_path);
-  else
-    DPRINTF(E_WARN, L_DB, "Failed to complete backup '%s': %s (%d)\n", backup_path, sqlite3_errstr(ret), ret);
+  if (ret != 0)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not spawn backup thread: %s\n", strerror(ret));
+      free(path);
+      return -1;
+    }
 
-  return ret;
+  thread_setname(db_backup_state.tid, "db_backup");
 
-error:
-  return -1;
+  return 0;
+}
+
+void
+db_backup_status_get(struct db_backup_status *status)
+{
+  CHECK_ERR(L_DB, pthread_mutex_lock(&db_backup_state.lck));
+  *status = db_backup_state.status;
+  CHECK_ERR(L_DB, pthread_mutex_unlock(&db_backup_state.lck));
 }
 
 int
@@ -7234,6 +10055,10 @@ db_perthread_deinit(void)
   if (!hdl)
     return;
 
+  db_stmt_cache_stats_log();
+  db_stmt_cache_flush();
+  memset(&db_stmt_cache, 0, sizeof(struct db_stmt_cache));
+
   /* Tear down anything that's in flight */
   while ((stmt = sqlite3_next_stmt(hdl, 0)))
     sqlite3_finalize(stmt);
@@ -7349,6 +10174,8 @@ db_check_version(void)
 
       DPRINTF(E_LOG, L_DB, "Upgrading schema to v%d.%d completed\n", SCHEMA_VERSION_MAJOR, SCHEMA_VERSION_MINOR);
 
+      db_stmt_cache_invalidate();
+
       vacuum = 1;
     }
   else if (db_ver_minor > SCHEMA_VERSION_MINOR)
@@ -7386,6 +10213,7 @@ db_init(void)
   static_assert(ARRAY_SIZE(dbmfi_cols_map) == ARRAY_SIZE(mfi_cols_map), "mfi column maps are not in sync");
   static_assert(ARRAY_SIZE(dbpli_cols_map) == ARRAY_SIZE(pli_cols_map), "pli column maps are not in sync");
   static_assert(ARRAY_SIZE(qi_cols_map) == ARRAY_SIZE(qi_mfi_map), "queue_item column maps are not in sync");
+  static_assert(ARRAY_SIZE(mfi_cols_map) <= 8 * sizeof(((struct query_params *)0)->cols), "query_params cols mask too small");
 
   for (i = 0; i < ARRAY_SIZE(qi_cols_map); i++)
     {
@@ -7394,8 +10222,10 @@ db_init(void)
 
   db_path = cfg_getstr(cfg_getsec(cfg, "general"), "db_path");
   db_rating_updates = cfg_getbool(cfg_getsec(cfg, "library"), "rating_updates");
+  db_wal_mode = cfg_getbool(cfg_getsec(cfg, "sqlite"), "wal_mode");
+  db_busy_timeout = cfg_getint(cfg_getsec(cfg, "sqlite"), "busy_timeout");
 
-  DPRINTF(E_LOG, L_DB, "Configured to use database file '%s'\n", db_path);
+  DPRINTF(E_LOG, L_DB, "Configured to use database file '%s' (%s mode)\n", db_path, db_wal_mode ? "WAL" : "shared-cache");
 
   ret = sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
   if (ret != SQLITE_OK)
@@ -7405,10 +10235,12 @@ db_init(void)
       return -1;
     }
 
-  ret = sqlite3_enable_shared_cache(1);
+  // In WAL mode each thread gets a private connection and page cache, readers
+  // don't block the writer and vice versa, so no need for shared-cache mode
+  ret = sqlite3_enable_shared_cache(!db_wal_mode);
   if (ret != SQLITE_OK)
     {
-      DPRINTF(E_FATAL, L_DB, "Could not enable SQLite3 shared-cache mode\n");
+      DPRINTF(E_FATAL, L_DB, "Could not set SQLite3 shared-cache mode\n");
       return -1;
     }
 
@@ -7445,8 +10277,14 @@ db_init(void)
 	  db_perthread_deinit();
 	  return -1;
 	}
+
+      db_stmt_cache_invalidate();
     }
 
+  ret = db_init_fts(hdl);
+  db_fts_enabled = (ret == 0);
+  DPRINTF(E_INFO, L_DB, "Full-text search is %s\n", db_fts_enabled ? "enabled" : "disabled");
+
   db_set_cfg_names();
 
   CHECK_ERR(L_DB, db_files_get_count(&files, NULL, NULL));
@@ -7460,11 +10298,21 @@ db_init(void)
 
   rng_init(&shuffle_rng);
 
+  listener_add(smartpl_cache_listener_cb, LISTENER_DATABASE);
+
   return 0;
 }
 
 void
 db_deinit(void)
 {
+  db_backup_join();
+
+  listener_remove(smartpl_cache_listener_cb);
+  smartpl_cache_clear();
+
+  db_wait_stats_log();
+  db_query_stats_reset();
+
   sqlite3_shutdown();
 }
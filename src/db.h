@@ -9,11 +9,19 @@
 
 #include "outputs.h"
 
+// Storage type of a struct field, e.g. in struct media_file_info
+enum field_type {
+  DB_TYPE_INT,
+  DB_TYPE_INT64,
+  DB_TYPE_STRING,
+};
+
 enum index_type {
   I_NONE,
   I_FIRST,
   I_LAST,
-  I_SUB
+  I_SUB,
+  I_KEYSET
 };
 
 // Keep in sync with sort_clause[]
@@ -89,6 +97,10 @@ struct query_params {
   int offset;
   int limit;
 
+  /* With I_KEYSET: the next_cursor of the previous page, NULL or empty for the
+   * first page. The page is read with an indexed seek instead of an OFFSET. */
+  const char *cursor;
+
   char *having;
   char *order;
   char *group;
@@ -97,15 +109,64 @@ struct query_params {
 
   int with_disabled;
 
+  /* Only files of this media kind (enum media_kind), 0 for all. The same as a
+   * filter on f.media_kind, but lets group queries use group_stats. */
+  int media_kind;
+
+  /* Columns to fetch in file queries, set with db_query_add_col(). If none are
+   * set, all columns are fetched. */
+  uint64_t cols[2];
+
   /* Query results, filled in by query_start */
   int results;
 
+  /* With I_KEYSET: cursor for the page after the last fetched row, NULL if
+   * the page wasn't full. Freed by free_query_params() */
+  char *next_cursor;
+
   /* Private query context, keep out */
   void *stmt;
+  int keyset_rows;
   char buf1[32];
   char buf2[32];
 };
 
+/* Progress of the last online backup, see db_backup() */
+struct db_backup_status {
+  bool running;
+  int pages_total;
+  int pages_remaining;
+  time_t start;
+  time_t end;
+  int result;     /* 0 if the backup completed, -1 if it failed */
+};
+
+/* Number of buckets in the latency histogram of db_query_stats. The upper
+ * bounds are 0.1, 1, 10, 100 and 1000 ms, the last bucket has the rest. */
+#define DB_QUERY_STATS_BUCKETS 6
+
+/* Run time statistics of a query shape, i.e. of all the queries that only
+ * differ in their literal values */
+struct db_query_stats {
+  char *query;    /* Query with the literals replaced by ? */
+  char *example;  /* The slowest query of this shape */
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t histogram[DB_QUERY_STATS_BUCKETS];
+  uint64_t fullscan_steps; /* Rows stepped through in full table scans */
+  uint64_t vm_steps;
+  uint64_t sorts;
+  uint64_t autoindexes;
+};
+
+/* Number of rows inserted, updated or deleted per table since startup */
+struct db_table_changes {
+  uint64_t files;
+  uint64_t playlists;
+  uint64_t playlistitems;
+};
+
 struct pairing_info {
   char *remote_id;
   char *name;
@@ -248,10 +309,27 @@ struct media_file_info {
   char *composer_sort;
 
   uint32_t scan_kind; /* Identifies the library_source that created/updates this item */
+
+  /* Binary sort keys for the *_sort fields, see db_sort_key() */
+  char *title_sort_key;
+  char *artist_sort_key;
+  char *album_sort_key;
+  char *album_artist_sort_key;
+  char *composer_sort_key;
 };
 
 #define mfi_offsetof(field) offsetof(struct media_file_info, field)
 
+/* Max number of files in a db_file_ping_bypath_batch() */
+#define DB_FILE_BATCH_SIZE 200
+
+struct db_file_batch_item {
+  const char *path;  /* In: path of the file */
+  time_t mtime;      /* In: file mtime, see db_file_ping_bypath() */
+  int id;            /* Out: file id, 0 if the file is not in the library */
+  bool pinged;       /* Out: file is unchanged and was pinged */
+};
+
 /* Keep in sync with pl_type_label[] */
 /* PL_SPECIAL value must be in sync with type value in Q_PL* in db_init.c */
 enum pl_type {
@@ -422,6 +500,11 @@ struct db_media_file_info {
   char *channels;
   char *usermark;
   char *scan_kind;
+  char *title_sort_key;
+  char *artist_sort_key;
+  char *album_sort_key;
+  char *album_artist_sort_key;
+  char *composer_sort_key;
 };
 
 #define dbmfi_offsetof(field) offsetof(struct db_media_file_info, field)
@@ -577,6 +660,12 @@ db_escape_string(const char *str); // TODO Remove this, use db_mprintf instead
 char *
 db_mprintf(const char *fmt, ...);
 
+char *
+db_fts_filter(const char **cols, int ncols, const char *search);
+
+char *
+db_sort_key(const char *sort_tag);
+
 int
 db_snprintf(char *s, int n, const char *fmt, ...);
 
@@ -615,9 +704,15 @@ void
 db_purge_all(void);
 
 /* Transactions */
-void
+
+// For transactions that only read
+int
 db_transaction_begin(void);
 
+// For transactions that write (or read and then write)
+int
+db_transaction_begin_write(void);
+
 void
 db_transaction_end(void);
 
@@ -625,15 +720,32 @@ void
 db_transaction_rollback(void);
 
 /* Queries */
+int
+db_query_add_col(struct query_params *qp, ssize_t mfi_offset);
+
 int
 db_query_start(struct query_params *qp);
 
 void
 db_query_end(struct query_params *qp);
 
+/* Checks that qp->cursor is a cursor from a query of the same type and sort,
+ * so that callers can tell a bad cursor from a query error. Returns true if
+ * there is no cursor.
+ */
+bool
+db_query_cursor_valid(struct query_params *qp);
+
 int
 db_query_fetch_file(struct db_media_file_info *dbmfi, struct query_params *qp);
 
+/* Like db_query_fetch_file(), but the row is returned with native integers
+ * instead of text. The strings in mfi are owned by SQLite and are only valid
+ * until the next fetch, so they must not be freed (don't use free_mfi()).
+ */
+int
+db_query_fetch_file_row(struct media_file_info *mfi, struct query_params *qp);
+
 int
 db_query_fetch_pl(struct db_playlist_info *dbpli, struct query_params *qp);
 
@@ -677,6 +789,22 @@ db_file_ping(int id);
 int
 db_file_ping_bypath(const char *path, time_t mtime_max);
 
+int
+db_file_ping_bypath_batch(struct db_file_batch_item *items, int nitems, bool ping);
+
+/*
+ * Makes db_file_ping_bypath() and db_file_ping_bypath_batch() only record the
+ * unchanged files in memory, instead of writing a ping for each one. Only
+ * applies to the calling thread. Until db_scan_seen_end() the purge functions
+ * keep the recorded files, which must be called after purging. It re-enables
+ * the recorded files that were disabled, the others are left untouched.
+ */
+void
+db_scan_seen_begin(void);
+
+int
+db_scan_seen_end(void);
+
 void
 db_file_ping_bymatch(const char *path, int isdir);
 
@@ -707,6 +835,9 @@ db_file_add(struct media_file_info *mfi);
 int
 db_file_update(struct media_file_info *mfi);
 
+int
+db_file_save_batch(struct media_file_info **mfis, int nmfis);
+
 void
 db_file_seek_update(int id, uint32_t seek);
 
@@ -802,6 +933,12 @@ db_groups_cleanup();
 int
 db_group_persistentid_byid(int id, int64_t *persistentid);
 
+/* Gets the newest time_modified and the number of the enabled files of a group
+ * (an album or an artist), which together change if the group's files do
+ */
+int
+db_group_files_state_get(time_t *mtime, int *nitems, int64_t persistentid);
+
 
 /* Directories */
 int
@@ -977,6 +1114,16 @@ db_queue_get_count(uint32_t *nitems);
 int
 db_queue_get_pos(uint32_t item_id, char shuffle);
 
+// Version of the last queue change committed by this process (cheap, no query)
+int
+db_queue_version_get(void);
+
+// Item ids of the queue indexed by pos and by shuffle_pos, caller must free
+// ids and shuffle_ids. queue_version is set to db_queue_version_get() as of
+// before the queue was read.
+int
+db_queue_get_ids(uint32_t **ids, uint32_t **shuffle_ids, int *count, int *queue_version);
+
 /* Inotify */
 int
 db_watch_clear(void);
@@ -1024,7 +1171,26 @@ int
 db_watch_enum_fetchwd(struct watch_enum *we, uint32_t *wd);
 
 int
-db_backup();
+db_backup(void);
+
+void
+db_backup_status_get(struct db_backup_status *status);
+
+/* Query statistics */
+int
+db_query_stats_get(struct db_query_stats **stats, int *nstats, uint64_t *dropped);
+
+void
+db_query_stats_free(struct db_query_stats *stats, int nstats);
+
+void
+db_query_stats_reset(void);
+
+int
+db_query_plan_get(char **plan, bool *full_scan, const char *query);
+
+void
+db_table_changes_get(struct db_table_changes *changes);
 
 int
 db_perthread_init(void);
@@ -98,7 +98,12 @@
   "   composer_sort      VARCHAR(1024) DEFAULT NULL COLLATE DAAP,"	\
   "   channels           INTEGER DEFAULT 0,"		\
   "   usermark           INTEGER DEFAULT 0,"		\
-  "   scan_kind          INTEGER DEFAULT 0"		\
+  "   scan_kind          INTEGER DEFAULT 0,"		\
+  "   title_sort_key        VARCHAR(1024) DEFAULT NULL,"	\
+  "   artist_sort_key       VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_sort_key        VARCHAR(1024) DEFAULT NULL,"	\
+  "   album_artist_sort_key VARCHAR(1024) DEFAULT NULL,"	\
+  "   composer_sort_key     VARCHAR(1024) DEFAULT NULL"	\
   ");"
 
 #define T_PL					\
@@ -138,6 +143,44 @@
   "CONSTRAINT groups_type_unique_persistentid UNIQUE (type, persistentid)" \
   ");"
 
+/* Aggregates of the enabled files in each album/artist group, maintained by the
+ * trg_group_stats_* triggers so that listing groups doesn't require a GROUP BY
+ * over the files table
+ */
+#define T_GROUP_STATS							\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   type           INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "   track_count    INTEGER DEFAULT 0,"				\
+  "   album_count    INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   data_kind      INTEGER DEFAULT 0,"				\
+  "   media_kind     INTEGER DEFAULT 0,"				\
+  "   media_kind_mask INTEGER DEFAULT 0,"				\
+  "   year           INTEGER DEFAULT 0,"				\
+  "   date_released  INTEGER DEFAULT 0,"				\
+  "   time_added     INTEGER DEFAULT 0,"				\
+  "   time_played    INTEGER DEFAULT 0,"				\
+  "   seek           INTEGER DEFAULT 0,"				\
+  "   file_id        INTEGER DEFAULT 0,"				\
+  "PRIMARY KEY (type, persistentid)"					\
+  ");"
+
+/* Single row with counters of enabled files and playlists, maintained by the
+ * trg_library_counts_* triggers
+ */
+#define T_LIBRARY_COUNTS						\
+  "CREATE TABLE IF NOT EXISTS library_counts ("				\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   files          INTEGER DEFAULT 0,"				\
+  "   streams        INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   file_size      INTEGER DEFAULT 0,"				\
+  "   artists        INTEGER DEFAULT 0,"				\
+  "   albums         INTEGER DEFAULT 0,"				\
+  "   playlists      INTEGER DEFAULT 0"					\
+  ");"
+
 #define T_PAIRINGS					\
   "CREATE TABLE IF NOT EXISTS pairings("		\
   "   remote         VARCHAR(64) PRIMARY KEY NOT NULL,"	\
@@ -253,6 +296,13 @@
 #define Q_QUEUE_VERSION			\
   "INSERT INTO admin (key, value) VALUES ('queue_version', '0');"
 
+#define Q_LIBRARY_COUNTS						\
+  "INSERT OR REPLACE INTO library_counts (id, files, streams, song_length, file_size, artists, albums, playlists)" \
+  " SELECT 1, COUNT(*), IFNULL(SUM(data_kind = 1), 0), IFNULL(SUM(song_length), 0), IFNULL(SUM(file_size), 0)," \
+  "   COUNT(DISTINCT songartistid), COUNT(DISTINCT songalbumid),"	\
+  "   (SELECT COUNT(*) FROM playlists WHERE disabled = 0)"		\
+  " FROM files WHERE disabled = 0;"
+
 #define Q_SCVER_MAJOR					\
   "INSERT INTO admin (key, value) VALUES ('schema_version_major', '%d');"
 #define Q_SCVER_MINOR					\
@@ -270,6 +320,8 @@ static const struct db_init_query db_init_table_queries[] =
     { T_PL,        "create table playlists" },
     { T_PLITEMS,   "create table playlistitems" },
     { T_GROUPS,    "create table groups" },
+    { T_GROUP_STATS, "create table group_stats" },
+    { T_LIBRARY_COUNTS, "create table library_counts" },
     { T_PAIRINGS,  "create table pairings" },
     { T_SPEAKERS,  "create table speakers" },
     { T_INOTIFY,   "create table inotify" },
@@ -289,6 +341,7 @@ static const struct db_init_query db_init_table_queries[] =
     { Q_DIR4,      "create default base directory '/spotify:'" },
 
     { Q_QUEUE_VERSION, "initialize queue version" },
+    { Q_LIBRARY_COUNTS, "initialize library counts" },
   };
 
 
@@ -305,7 +358,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_GROUP_ALBUMS */
 #define I_SONGALBUMID				\
-  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort, disc, track);"
+  "CREATE INDEX IF NOT EXISTS idx_sali ON files(songalbumid, disabled, media_kind, album_sort_key, disc, track);"
 
 /* Used by Q_GROUP_ARTISTS */
 #define I_STATEMKINDSARI				\
@@ -316,15 +369,15 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_BROWSE_ALBUM */
 #define I_ALBUM					\
-  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort, album, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_album ON files(disabled, album_sort_key, album, media_kind);"
 
 /* Used by Q_BROWSE_ARTIST */
 #define I_ALBUMARTIST				\
-  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort, album_artist, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_albumartist ON files(disabled, album_artist_sort_key, album_artist, media_kind);"
 
 /* Used by Q_BROWSE_COMPOSERS */
 #define I_COMPOSER				\
-  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort, composer, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_composer ON files(disabled, composer_sort_key, composer, media_kind);"
 
 /* Used by Q_BROWSE_GENRES */
 #define I_GENRE					\
@@ -332,7 +385,7 @@ static const struct db_init_query db_init_table_queries[] =
 
 /* Used by Q_PLITEMS for smart playlists */
 #define I_TITLE					\
-  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort, media_kind);"
+  "CREATE INDEX IF NOT EXISTS idx_title ON files(disabled, title_sort_key, media_kind);"
 
 #define I_FILELIST					\
   "CREATE INDEX IF NOT EXISTS idx_filelist ON files(disabled, virtual_path, time_modified);"
@@ -429,10 +482,203 @@ static const struct db_init_query db_init_index_queries[] =
   "   INSERT OR IGNORE INTO groups (type, name, persistentid) VALUES (2, NEW.album_artist, NEW.songartistid);"	\
   " END;"
 
+/* Maintenance of group_stats. Adding an enabled file only increments the
+ * aggregates of its groups. Other changes recompute the affected groups, which
+ * is an indexed scan of the files in the group. media_kind values are single
+ * bits, so SUM(DISTINCT media_kind) is their bitwise or.
+ */
+
+#define Q_GROUP_STATS_ADD(type, col)										\
+  "   INSERT OR IGNORE INTO group_stats (type, persistentid) VALUES (" type ", NEW." col ");"			\
+  "   UPDATE group_stats SET"											\
+  "     album_count = album_count + NOT EXISTS (SELECT 1 FROM files WHERE songalbumid = NEW.songalbumid"	\
+  "       AND songartistid = NEW.songartistid AND disabled = 0 AND id <> NEW.id),"				\
+  "     data_kind = CASE WHEN track_count = 0 THEN NEW.data_kind ELSE MIN(data_kind, NEW.data_kind) END,"	\
+  "     media_kind = CASE WHEN track_count = 0 THEN NEW.media_kind ELSE MIN(media_kind, NEW.media_kind) END," \
+  "     file_id = CASE WHEN track_count = 0 THEN NEW.id ELSE MIN(file_id, NEW.id) END,"			\
+  "     track_count = track_count + 1, song_length = song_length + NEW.song_length,"				\
+  "     media_kind_mask = media_kind_mask | NEW.media_kind, year = MAX(year, NEW.year),"			\
+  "     date_released = MAX(date_released, NEW.date_released), time_added = MAX(time_added, NEW.time_added),"	\
+  "     time_played = MAX(time_played, NEW.time_played), seek = MAX(seek, NEW.seek)"				\
+  "   WHERE type = " type " AND persistentid = NEW." col ";"
+
+// Without a GROUP BY this always produces a row, so an emptied group gets zeros
+#define Q_GROUP_STATS_RECOMPUTE(type, col, pid)								\
+  "   REPLACE INTO group_stats (type, persistentid, track_count, album_count, song_length, data_kind,"	\
+  "     media_kind, media_kind_mask, year, date_released, time_added, time_played, seek, file_id)"	\
+  "   SELECT " type ", " pid ", COUNT(*), COUNT(DISTINCT songalbumid), IFNULL(SUM(song_length), 0),"	\
+  "     IFNULL(MIN(data_kind), 0), IFNULL(MIN(media_kind), 0), IFNULL(SUM(DISTINCT media_kind), 0),"	\
+  "     IFNULL(MAX(year), 0), IFNULL(MAX(date_released), 0), IFNULL(MAX(time_added), 0),"		\
+  "     IFNULL(MAX(time_played), 0), IFNULL(MAX(seek), 0), IFNULL(MIN(id), 0)"				\
+  "   FROM files WHERE " col " = " pid " AND disabled = 0"
+
+#define TRG_GROUP_STATS_INSERT										\
+  "CREATE TRIGGER trg_group_stats_insert AFTER INSERT ON files FOR EACH ROW WHEN NEW.disabled = 0"	\
+  " BEGIN"												\
+  Q_GROUP_STATS_ADD("1", "songalbumid")									\
+  Q_GROUP_STATS_ADD("2", "songartistid")								\
+  " END;"
+
+#define TRG_GROUP_STATS_UPDATE										\
+  "CREATE TRIGGER trg_group_stats_update AFTER UPDATE ON files FOR EACH ROW"				\
+  " WHEN OLD.disabled <> NEW.disabled OR OLD.songalbumid <> NEW.songalbumid"				\
+  "   OR OLD.songartistid <> NEW.songartistid OR OLD.song_length <> NEW.song_length"			\
+  "   OR OLD.data_kind <> NEW.data_kind OR OLD.media_kind <> NEW.media_kind OR OLD.year <> NEW.year"	\
+  "   OR OLD.date_released <> NEW.date_released OR OLD.time_added <> NEW.time_added"			\
+  "   OR OLD.time_played <> NEW.time_played OR OLD.seek <> NEW.seek"					\
+  " BEGIN"												\
+  Q_GROUP_STATS_RECOMPUTE("1", "songalbumid", "OLD.songalbumid") ";"					\
+  Q_GROUP_STATS_RECOMPUTE("2", "songartistid", "OLD.songartistid") ";"					\
+  Q_GROUP_STATS_RECOMPUTE("1", "songalbumid", "NEW.songalbumid")					\
+  "     AND NEW.songalbumid <> OLD.songalbumid GROUP BY songalbumid;"					\
+  Q_GROUP_STATS_RECOMPUTE("2", "songartistid", "NEW.songartistid")					\
+  "     AND NEW.songartistid <> OLD.songartistid GROUP BY songartistid;"				\
+  " END;"
+
+#define TRG_GROUP_STATS_DELETE										\
+  "CREATE TRIGGER trg_group_stats_delete AFTER DELETE ON files FOR EACH ROW WHEN OLD.disabled = 0"	\
+  " BEGIN"												\
+  Q_GROUP_STATS_RECOMPUTE("1", "songalbumid", "OLD.songalbumid") ";"					\
+  Q_GROUP_STATS_RECOMPUTE("2", "songartistid", "OLD.songartistid") ";"					\
+  " END;"
+
+/* Maintenance of library_counts. An artist or album is counted while it has at
+ * least one enabled file, so the triggers check for other enabled files in the
+ * group of the changed file. Streams are files with data_kind = 1 (DATA_KIND_HTTP).
+ */
+
+#define TRG_LIBRARY_COUNTS_FILES_INSERT										\
+  "CREATE TRIGGER trg_library_counts_files_insert AFTER INSERT ON files FOR EACH ROW WHEN NEW.disabled = 0"	\
+  " BEGIN"													\
+  "   UPDATE library_counts SET files = files + 1, streams = streams + (NEW.data_kind = 1),"			\
+  "     song_length = song_length + NEW.song_length, file_size = file_size + NEW.file_size,"			\
+  "     artists = artists + NOT EXISTS (SELECT 1 FROM files WHERE songartistid = NEW.songartistid"		\
+  "       AND disabled = 0 AND id <> NEW.id),"									\
+  "     albums = albums + NOT EXISTS (SELECT 1 FROM files WHERE songalbumid = NEW.songalbumid"			\
+  "       AND disabled = 0 AND id <> NEW.id)"									\
+  "   WHERE id = 1;"												\
+  " END;"
+
+#define TRG_LIBRARY_COUNTS_FILES_DELETE										\
+  "CREATE TRIGGER trg_library_counts_files_delete AFTER DELETE ON files FOR EACH ROW WHEN OLD.disabled = 0"	\
+  " BEGIN"													\
+  "   UPDATE library_counts SET files = files - 1, streams = streams - (OLD.data_kind = 1),"			\
+  "     song_length = song_length - OLD.song_length, file_size = file_size - OLD.file_size,"			\
+  "     artists = artists - NOT EXISTS (SELECT 1 FROM files WHERE songartistid = OLD.songartistid"		\
+  "       AND disabled = 0),"											\
+  "     albums = albums - NOT EXISTS (SELECT 1 FROM files WHERE songalbumid = OLD.songalbumid"			\
+  "       AND disabled = 0)"											\
+  "   WHERE id = 1;"												\
+  " END;"
+
+// Removes the contribution of OLD and adds the one of NEW
+#define TRG_LIBRARY_COUNTS_FILES_UPDATE										\
+  "CREATE TRIGGER trg_library_counts_files_update AFTER UPDATE ON files FOR EACH ROW"				\
+  " WHEN (OLD.disabled = 0 OR NEW.disabled = 0) AND (OLD.disabled <> NEW.disabled"				\
+  "   OR OLD.data_kind <> NEW.data_kind OR OLD.song_length <> NEW.song_length"					\
+  "   OR OLD.file_size <> NEW.file_size OR OLD.songartistid <> NEW.songartistid"				\
+  "   OR OLD.songalbumid <> NEW.songalbumid)"									\
+  " BEGIN"													\
+  "   UPDATE library_counts SET"										\
+  "     files = files - (OLD.disabled = 0) + (NEW.disabled = 0),"						\
+  "     streams = streams - (OLD.disabled = 0 AND OLD.data_kind = 1) + (NEW.disabled = 0 AND NEW.data_kind = 1)," \
+  "     song_length = song_length - (OLD.disabled = 0) * OLD.song_length + (NEW.disabled = 0) * NEW.song_length," \
+  "     file_size = file_size - (OLD.disabled = 0) * OLD.file_size + (NEW.disabled = 0) * NEW.file_size,"	\
+  "     artists = artists"											\
+  "       - (OLD.disabled = 0 AND NOT EXISTS (SELECT 1 FROM files WHERE songartistid = OLD.songartistid"	\
+  "           AND disabled = 0 AND id <> OLD.id))"								\
+  "       + (NEW.disabled = 0 AND NOT EXISTS (SELECT 1 FROM files WHERE songartistid = NEW.songartistid"	\
+  "           AND disabled = 0 AND id <> NEW.id)),"								\
+  "     albums = albums"											\
+  "       - (OLD.disabled = 0 AND NOT EXISTS (SELECT 1 FROM files WHERE songalbumid = OLD.songalbumid"		\
+  "           AND disabled = 0 AND id <> OLD.id))"								\
+  "       + (NEW.disabled = 0 AND NOT EXISTS (SELECT 1 FROM files WHERE songalbumid = NEW.songalbumid"		\
+  "           AND disabled = 0 AND id <> NEW.id))"								\
+  "   WHERE id = 1;"												\
+  " END;"
+
+#define TRG_LIBRARY_COUNTS_PL_INSERT										\
+  "CREATE TRIGGER trg_library_counts_pl_insert AFTER INSERT ON playlists FOR EACH ROW WHEN NEW.disabled = 0"	\
+  " BEGIN"													\
+  "   UPDATE library_counts SET playlists = playlists + 1 WHERE id = 1;"					\
+  " END;"
+
+#define TRG_LIBRARY_COUNTS_PL_DELETE										\
+  "CREATE TRIGGER trg_library_counts_pl_delete AFTER DELETE ON playlists FOR EACH ROW WHEN OLD.disabled = 0"	\
+  " BEGIN"													\
+  "   UPDATE library_counts SET playlists = playlists - 1 WHERE id = 1;"					\
+  " END;"
+
+#define TRG_LIBRARY_COUNTS_PL_UPDATE										\
+  "CREATE TRIGGER trg_library_counts_pl_update AFTER UPDATE OF disabled ON playlists FOR EACH ROW"		\
+  " WHEN (OLD.disabled = 0) <> (NEW.disabled = 0)"								\
+  " BEGIN"													\
+  "   UPDATE library_counts SET playlists = playlists - (OLD.disabled = 0) + (NEW.disabled = 0) WHERE id = 1;"	\
+  " END;"
+
 static const struct db_init_query db_init_trigger_queries[] =
   {
     { TRG_GROUPS_INSERT,           "create trigger trg_groups_insert" },
     { TRG_GROUPS_UPDATE,           "create trigger trg_groups_update" },
+    { TRG_GROUP_STATS_INSERT,      "create trigger trg_group_stats_insert" },
+    { TRG_GROUP_STATS_UPDATE,      "create trigger trg_group_stats_update" },
+    { TRG_GROUP_STATS_DELETE,      "create trigger trg_group_stats_delete" },
+    { TRG_LIBRARY_COUNTS_FILES_INSERT, "create trigger trg_library_counts_files_insert" },
+    { TRG_LIBRARY_COUNTS_FILES_DELETE, "create trigger trg_library_counts_files_delete" },
+    { TRG_LIBRARY_COUNTS_FILES_UPDATE, "create trigger trg_library_counts_files_update" },
+    { TRG_LIBRARY_COUNTS_PL_INSERT, "create trigger trg_library_counts_pl_insert" },
+    { TRG_LIBRARY_COUNTS_PL_DELETE, "create trigger trg_library_counts_pl_delete" },
+    { TRG_LIBRARY_COUNTS_PL_UPDATE, "create trigger trg_library_counts_pl_update" },
+  };
+
+
+/* Full-text index of the files table. This is not part of the schema version,
+ * since SQLite may be built without FTS5. The triggers keep the index in sync,
+ * and since they are dropped by schema upgrades, the index is rebuilt whenever
+ * they are missing.
+ */
+
+#define T_FILES_FTS									\
+  "CREATE VIRTUAL TABLE IF NOT EXISTS files_fts USING fts5("			\
+  "   title, artist, album, album_artist, composer, genre,"			\
+  "   content = 'files', content_rowid = 'id',"					\
+  "   prefix = '2 3', tokenize = 'unicode61 remove_diacritics 2'"		\
+  ");"
+
+#define Q_FTS_TRIGGER_COUNT								\
+  "SELECT COUNT(*) FROM sqlite_master WHERE type = 'trigger' AND name GLOB 'trg_files_fts_*';"
+
+#define Q_FTS_REBUILD									\
+  "INSERT INTO files_fts (files_fts) VALUES ('rebuild');"
+
+#define TRG_FILES_FTS_INSERT								\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_insert AFTER INSERT ON files FOR EACH ROW"	\
+  " BEGIN"										\
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre);" \
+  " END;"
+
+#define TRG_FILES_FTS_DELETE								\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_delete AFTER DELETE ON files FOR EACH ROW"	\
+  " BEGIN"										\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)" \
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre);" \
+  " END;"
+
+#define TRG_FILES_FTS_UPDATE								\
+  "CREATE TRIGGER IF NOT EXISTS trg_files_fts_update AFTER UPDATE OF title, artist, album, album_artist, composer, genre ON files FOR EACH ROW" \
+  " BEGIN"										\
+  "   INSERT INTO files_fts (files_fts, rowid, title, artist, album, album_artist, composer, genre)" \
+  "     VALUES ('delete', OLD.id, OLD.title, OLD.artist, OLD.album, OLD.album_artist, OLD.composer, OLD.genre);" \
+  "   INSERT INTO files_fts (rowid, title, artist, album, album_artist, composer, genre)"	\
+  "     VALUES (NEW.id, NEW.title, NEW.artist, NEW.album, NEW.album_artist, NEW.composer, NEW.genre);" \
+  " END;"
+
+static const struct db_init_query db_init_fts_trigger_queries[] =
+  {
+    { TRG_FILES_FTS_INSERT,        "create trigger trg_files_fts_insert" },
+    { TRG_FILES_FTS_DELETE,        "create trigger trg_files_fts_delete" },
+    { TRG_FILES_FTS_UPDATE,        "create trigger trg_files_fts_update" },
   };
 
 
@@ -484,6 +730,67 @@ db_init_triggers(sqlite3 *hdl)
   return 0;
 }
 
+int
+db_init_fts(sqlite3 *hdl)
+{
+  sqlite3_stmt *stmt;
+  char *errmsg;
+  int ntriggers;
+  int i;
+  int ret;
+
+  DPRINTF(E_DBG, L_DB, "DB init fts query: create table files_fts\n");
+
+  ret = sqlite3_exec(hdl, T_FILES_FTS, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_INFO, L_DB, "Full-text search not available: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  ret = sqlite3_prepare_v2(hdl, Q_FTS_TRIGGER_COUNT, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "DB init error: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ntriggers = (sqlite3_step(stmt) == SQLITE_ROW) ? sqlite3_column_int(stmt, 0) : 0;
+  sqlite3_finalize(stmt);
+
+  if (ntriggers == (sizeof(db_init_fts_trigger_queries) / sizeof(db_init_fts_trigger_queries[0])))
+    return 0;
+
+  DPRINTF(E_LOG, L_DB, "Building full-text search index, this may take a while...\n");
+
+  for (i = 0; i < (sizeof(db_init_fts_trigger_queries) / sizeof(db_init_fts_trigger_queries[0])); i++)
+    {
+      DPRINTF(E_DBG, L_DB, "DB init fts query: %s\n", db_init_fts_trigger_queries[i].desc);
+
+      ret = sqlite3_exec(hdl, db_init_fts_trigger_queries[i].query, NULL, NULL, &errmsg);
+      if (ret != SQLITE_OK)
+	{
+	  DPRINTF(E_LOG, L_DB, "DB init error: %s\n", errmsg);
+
+	  sqlite3_free(errmsg);
+	  return -1;
+	}
+    }
+
+  ret = sqlite3_exec(hdl, Q_FTS_REBUILD, NULL, NULL, &errmsg);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "DB init error: %s\n", errmsg);
+
+      sqlite3_free(errmsg);
+      return -1;
+    }
+
+  return 0;
+}
+
 int
 db_init_tables(sqlite3 *hdl)
 {
@@ -25,8 +25,8 @@
  * version of the database? If yes, then it is a minor upgrade, if no, then it
  * is a major upgrade. In other words minor version upgrades permit downgrading
  * the server after the database was upgraded. */
-#define SCHEMA_VERSION_MAJOR 22
-#define SCHEMA_VERSION_MINOR 0
+#define SCHEMA_VERSION_MAJOR 23
+#define SCHEMA_VERSION_MINOR 2
 
 int
 db_init_indices(sqlite3 *hdl);
@@ -37,4 +37,7 @@ db_init_triggers(sqlite3 *hdl);
 int
 db_init_tables(sqlite3 *hdl);
 
+int
+db_init_fts(sqlite3 *hdl);
+
 #endif /* SRC_DB_INIT_H_ */
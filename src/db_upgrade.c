@@ -31,6 +31,7 @@
 
 #include "logger.h"
 #include "misc.h"
+#include "db.h"
 
 
 struct db_upgrade_query {
@@ -1227,6 +1228,155 @@ static const struct db_upgrade_query db_upgrade_v2200_queries[] =
     { U_v2200_SCVER_MINOR,    "set schema_version_minor to 00" },
   };
 
+
+/* ---------------------------- 22.00 -> 23.00 ------------------------------ */
+
+#define U_v2300_ALTER_FILES_ADD_TITLE_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN title_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2300_ALTER_FILES_ADD_ARTIST_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN artist_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2300_ALTER_FILES_ADD_ALBUM_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2300_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN album_artist_sort_key VARCHAR(1024) DEFAULT NULL;"
+#define U_v2300_ALTER_FILES_ADD_COMPOSER_SORT_KEY \
+  "ALTER TABLE files ADD COLUMN composer_sort_key VARCHAR(1024) DEFAULT NULL;"
+
+// sort_key() is registered by db_upgrade_v2300()
+#define U_v2300_FILES_SET_SORT_KEYS \
+  "UPDATE files SET title_sort_key = sort_key(title_sort), artist_sort_key = sort_key(artist_sort)," \
+  " album_sort_key = sort_key(album_sort), album_artist_sort_key = sort_key(album_artist_sort)," \
+  " composer_sort_key = sort_key(composer_sort);"
+
+#define U_v2300_SCVER_MAJOR                    \
+  "UPDATE admin SET value = '23' WHERE key = 'schema_version_major';"
+#define U_v2300_SCVER_MINOR                    \
+  "UPDATE admin SET value = '00' WHERE key = 'schema_version_minor';"
+
+// Major upgrade, since an older server wouldn't set the keys for new files
+static const struct db_upgrade_query db_upgrade_v2300_queries[] =
+  {
+    { U_v2300_ALTER_FILES_ADD_TITLE_SORT_KEY, "alter table files add column title_sort_key" },
+    { U_v2300_ALTER_FILES_ADD_ARTIST_SORT_KEY, "alter table files add column artist_sort_key" },
+    { U_v2300_ALTER_FILES_ADD_ALBUM_SORT_KEY, "alter table files add column album_sort_key" },
+    { U_v2300_ALTER_FILES_ADD_ALBUM_ARTIST_SORT_KEY, "alter table files add column album_artist_sort_key" },
+    { U_v2300_ALTER_FILES_ADD_COMPOSER_SORT_KEY, "alter table files add column composer_sort_key" },
+    { U_v2300_FILES_SET_SORT_KEYS, "update table files set sort keys" },
+
+    { U_v2300_SCVER_MAJOR,    "set schema_version_major to 23" },
+    { U_v2300_SCVER_MINOR,    "set schema_version_minor to 00" },
+  };
+
+static void
+sort_key_xfunc(sqlite3_context *pv, int n, sqlite3_value **ppv)
+{
+  char *key;
+
+  key = db_sort_key((const char *)sqlite3_value_text(ppv[0]));
+  if (!key)
+    {
+      sqlite3_result_null(pv);
+      return;
+    }
+
+  sqlite3_result_text(pv, key, -1, free);
+}
+
+static int
+db_upgrade_v2300(sqlite3 *hdl)
+{
+  int ret;
+
+  // The keys are computed by the same function that sets them for new files
+  ret = sqlite3_create_function(hdl, "sort_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sort_key_xfunc, NULL, NULL);
+  if (ret != SQLITE_OK)
+    {
+      DPRINTF(E_LOG, L_DB, "Could not create sort_key function: %s\n", sqlite3_errmsg(hdl));
+      return -1;
+    }
+
+  ret = db_generic_upgrade(hdl, db_upgrade_v2300_queries, ARRAY_SIZE(db_upgrade_v2300_queries));
+
+  sqlite3_create_function(hdl, "sort_key", 1, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+
+  return ret;
+}
+
+/* ---------------------------- 23.00 -> 23.01 ------------------------------ */
+
+#define U_v2301_CREATE_TABLE_GROUP_STATS				\
+  "CREATE TABLE IF NOT EXISTS group_stats ("				\
+  "   type           INTEGER NOT NULL,"					\
+  "   persistentid   INTEGER NOT NULL,"					\
+  "   track_count    INTEGER DEFAULT 0,"				\
+  "   album_count    INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   data_kind      INTEGER DEFAULT 0,"				\
+  "   media_kind     INTEGER DEFAULT 0,"				\
+  "   media_kind_mask INTEGER DEFAULT 0,"				\
+  "   year           INTEGER DEFAULT 0,"				\
+  "   date_released  INTEGER DEFAULT 0,"				\
+  "   time_added     INTEGER DEFAULT 0,"				\
+  "   time_played    INTEGER DEFAULT 0,"				\
+  "   seek           INTEGER DEFAULT 0,"				\
+  "   file_id        INTEGER DEFAULT 0,"				\
+  "PRIMARY KEY (type, persistentid)"					\
+  ");"
+
+#define U_v2301_GROUP_STATS_FILL(type, col)				\
+  "INSERT INTO group_stats (type, persistentid, track_count, album_count, song_length, data_kind," \
+  "   media_kind, media_kind_mask, year, date_released, time_added, time_played, seek, file_id)" \
+  " SELECT " type ", " col ", COUNT(*), COUNT(DISTINCT songalbumid), SUM(song_length)," \
+  "   MIN(data_kind), MIN(media_kind), SUM(DISTINCT media_kind), MAX(year), MAX(date_released)," \
+  "   MAX(time_added), MAX(time_played), MAX(seek), MIN(id)"		\
+  " FROM files WHERE disabled = 0 GROUP BY " col ";"
+
+#define U_v2301_SCVER_MINOR                    \
+  "UPDATE admin SET value = '01' WHERE key = 'schema_version_minor';"
+
+// The triggers that maintain group_stats are created by db_init_triggers()
+static const struct db_upgrade_query db_upgrade_v2301_queries[] =
+  {
+    { U_v2301_CREATE_TABLE_GROUP_STATS, "create table group_stats" },
+    { U_v2301_GROUP_STATS_FILL("1", "songalbumid"), "fill group_stats for albums" },
+    { U_v2301_GROUP_STATS_FILL("2", "songartistid"), "fill group_stats for artists" },
+
+    { U_v2301_SCVER_MINOR,    "set schema_version_minor to 01" },
+  };
+
+/* ---------------------------- 23.01 -> 23.02 ------------------------------ */
+
+#define U_v2302_CREATE_TABLE_LIBRARY_COUNTS				\
+  "CREATE TABLE IF NOT EXISTS library_counts ("				\
+  "   id             INTEGER PRIMARY KEY NOT NULL,"			\
+  "   files          INTEGER DEFAULT 0,"				\
+  "   streams        INTEGER DEFAULT 0,"				\
+  "   song_length    INTEGER DEFAULT 0,"				\
+  "   file_size      INTEGER DEFAULT 0,"				\
+  "   artists        INTEGER DEFAULT 0,"				\
+  "   albums         INTEGER DEFAULT 0,"				\
+  "   playlists      INTEGER DEFAULT 0"					\
+  ");"
+
+#define U_v2302_LIBRARY_COUNTS_FILL					\
+  "INSERT OR REPLACE INTO library_counts (id, files, streams, song_length, file_size, artists, albums, playlists)" \
+  " SELECT 1, COUNT(*), IFNULL(SUM(data_kind = 1), 0), IFNULL(SUM(song_length), 0), IFNULL(SUM(file_size), 0)," \
+  "   COUNT(DISTINCT songartistid), COUNT(DISTINCT songalbumid),"	\
+  "   (SELECT COUNT(*) FROM playlists WHERE disabled = 0)"		\
+  " FROM files WHERE disabled = 0;"
+
+#define U_v2302_SCVER_MINOR                    \
+  "UPDATE admin SET value = '02' WHERE key = 'schema_version_minor';"
+
+// The triggers that maintain library_counts are created by db_init_triggers()
+static const struct db_upgrade_query db_upgrade_v2302_queries[] =
+  {
+    { U_v2302_CREATE_TABLE_LIBRARY_COUNTS, "create table library_counts" },
+    { U_v2302_LIBRARY_COUNTS_FILL, "fill library_counts" },
+
+    { U_v2302_SCVER_MINOR,    "set schema_version_minor to 02" },
+  };
+
 /* -------------------------- Main upgrade handler -------------------------- */
 
 int
@@ -1437,6 +1587,27 @@ db_upgrade(sqlite3 *hdl, int db_ver)
       if (ret < 0)
 	return -1;
 
+      /* FALLTHROUGH */
+
+    case 2200:
+      ret = db_upgrade_v2300(hdl);
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2300:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2301_queries, ARRAY_SIZE(db_upgrade_v2301_queries));
+      if (ret < 0)
+	return -1;
+
+      /* FALLTHROUGH */
+
+    case 2301:
+      ret = db_generic_upgrade(hdl, db_upgrade_v2302_queries, ARRAY_SIZE(db_upgrade_v2302_queries));
+      if (ret < 0)
+	return -1;
+
 
       /* Last case statement is the only one that ends with a break statement! */
       break;
@@ -211,7 +211,7 @@ dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str)
 }
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval)
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval)
 {
   union {
     int32_t v_i32;
@@ -386,13 +386,13 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct media_file_info *mfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav)
 {
   const struct dmap_field_map *dfm;
   const struct dmap_field *df;
-  char **strval;
+  char *strval;
   char *ptr;
-  int32_t val;
+  int64_t val;
   int want_mikd;
   int want_asdk;
   int want_ased;
@@ -458,44 +458,53 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
       DPRINTF(E_SPAM, L_DAAP, "Investigating %s\n", df->desc);
 
-      strval = (char **) ((char *)dbmfi + dfm->mfi_offset);
+      ptr = (char *)mfi + dfm->mfi_offset;
+
+      strval = NULL;
+      val = 0;
+
+      switch (dfm->mfi_type)
+	{
+	  case DB_TYPE_STRING:
+	    strval = *(char **)ptr;
+	    break;
+
+	  case DB_TYPE_INT:
+	    val = *(uint32_t *)ptr;
+	    break;
+
+	  case DB_TYPE_INT64:
+	    val = *(int64_t *)ptr;
+	    break;
+	}
 
-      if (!(*strval) || (**strval == '\0'))
+      if ((dfm->mfi_type == DB_TYPE_STRING) && (!strval || (*strval == '\0')))
 	continue;
 
       /* Here's one exception ... codectype (ascd) is actually an integer */
       if (dfm == &dfm_dmap_ascd)
 	{
-	  dmap_add_literal(song, df->tag, *strval, 4);
+	  dmap_add_literal(song, df->tag, strval, 4);
 	  continue;
 	}
 
-      val = 0;
-
       if (force_wav)
 	{
 	  switch (dfm->mfi_offset)
 	    {
-	      case dbmfi_offsetof(type):
-		ptr = "wav";
-		strval = &ptr;
+	      case mfi_offsetof(type):
+		strval = "wav";
 		break;
 
-	      case dbmfi_offsetof(bitrate):
-		val = 0;
-		ret = safe_atoi32(dbmfi->samplerate, &val);
-		if ((ret < 0) || (val == 0))
+	      case mfi_offsetof(bitrate):
+		if (mfi->samplerate == 0)
 		  val = 1411;
 		else
-		  val = (val * 8) / 250;
-
-		ptr = NULL;
-		strval = &ptr;
+		  val = (mfi->samplerate * 8) / 250;
 		break;
 
-	      case dbmfi_offsetof(description):
-		ptr = "wav audio file";
-		strval = &ptr;
+	      case mfi_offsetof(description):
+		strval = "wav audio file";
 		break;
 
 	      default:
@@ -503,9 +512,9 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 	    }
 	}
 
-      dmap_add_field(song, df, *strval, val);
+      dmap_add_field(song, df, strval, val);
 
-      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s (%s)\n", df->desc, *strval);
+      DPRINTF(E_SPAM, L_DAAP, "Done with meta tag %s\n", df->desc);
     }
 
   /* Required for artwork in iTunes, set songartworkcount (asac) = 1 */
@@ -517,13 +526,13 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
 
   if (sort_tags)
     {
-      dmap_add_string(song, "assn", dbmfi->title_sort);
-      dmap_add_string(song, "assa", dbmfi->artist_sort);
-      dmap_add_string(song, "assu", dbmfi->album_sort);
-      dmap_add_string(song, "assl", dbmfi->album_artist_sort);
+      dmap_add_string(song, "assn", mfi->title_sort);
+      dmap_add_string(song, "assa", mfi->artist_sort);
+      dmap_add_string(song, "assu", mfi->album_sort);
+      dmap_add_string(song, "assl", mfi->album_artist_sort);
 
-      if (dbmfi->composer_sort)
-	dmap_add_string(song, "assc", dbmfi->composer_sort);
+      if (mfi->composer_sort)
+	dmap_add_string(song, "assc", mfi->composer_sort);
     }
 
   val = 0;
@@ -535,21 +544,11 @@ dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, stru
   dmap_add_container(songlist, "mlit", evbuffer_get_length(song) + val);
 
   /* Prepend mikd & asdk if needed */
+  /* dmap.itemkind must come first */
   if (want_mikd)
-    {
-      /* dmap.itemkind must come first */
-      ret = safe_atoi32(dbmfi->item_kind, &val);
-      if (ret < 0)
-	val = 2; /* music by default */
-      dmap_add_char(songlist, "mikd", val);
-    }
+    dmap_add_char(songlist, "mikd", mfi->item_kind);
   if (want_asdk)
-    {
-      ret = safe_atoi32(dbmfi->data_kind, &val);
-      if (ret < 0)
-	val = 0;
-      dmap_add_char(songlist, "asdk", val);
-    }
+    dmap_add_char(songlist, "asdk", mfi->data_kind);
 
   ret = evbuffer_add_buffer(songlist, song);
   if (ret < 0)
@@ -27,6 +27,7 @@ struct dmap_field_map {
   ssize_t mfi_offset;
   ssize_t pli_offset;
   ssize_t gri_offset;
+  enum field_type mfi_type;
 };
 
 struct dmap_field {
@@ -73,7 +74,7 @@ void
 dmap_add_string(struct evbuffer *evbuf, const char *tag, const char *str);
 
 void
-dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int32_t intval);
+dmap_add_field(struct evbuffer *evbuf, const struct dmap_field *df, char *strval, int64_t intval);
 
 void
 dmap_error_make(struct evbuffer *evbuf, const char *container, const char *errmsg);
@@ -83,7 +84,7 @@ dmap_send_error(struct evhttp_request *req, const char *container, const char *e
 
 
 int
-dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_media_file_info *dbmfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
+dmap_encode_file_metadata(struct evbuffer *songlist, struct evbuffer *song, struct media_file_info *mfi, const struct dmap_field **meta, int nmeta, int sort_tags, int force_wav);
 
 int
 dmap_encode_queue_metadata(struct evbuffer *songlist, struct evbuffer *song, struct db_queue_item *queue_item);
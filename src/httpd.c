@@ -62,6 +62,7 @@
 #include "httpd_oauth.h"
 #include "httpd_artworkapi.h"
 #include "transcode.h"
+#include "artwork.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -81,6 +82,10 @@
 #define HTTPD_STREAM_BPS         16
 #define HTTPD_STREAM_CHANNELS    2
 
+// Number of db executor threads, and max number of jobs waiting for them
+#define DBEXEC_THREADS           2
+#define DBEXEC_QUEUE_MAX         64
+
 
 struct content_type_map {
   char *ext;
@@ -103,6 +108,42 @@ struct stream_ctx {
   struct transcode_ctx *xcode;
 };
 
+struct dbexec_job
+{
+  httpd_dbexec_cb job_cb;
+  httpd_dbexec_cb done_cb;
+  void *arg;
+  enum httpd_dbexec_prio prio;
+
+  struct dbexec_job *next;
+};
+
+struct dbexec_queue
+{
+  struct dbexec_job *head;
+  struct dbexec_job *tail;
+};
+
+struct dbexec_state
+{
+  pthread_mutex_t lck;
+  pthread_cond_t cond;
+
+  pthread_t tid[DBEXEC_THREADS];
+  int nthreads;
+  bool exit;
+
+  // Jobs waiting for an executor thread, one queue per priority
+  struct dbexec_queue pending[HTTPD_DBEXEC_PRIO_MAX];
+  int npending;
+  // Number of executor threads busy with a low priority job
+  int nrunning_low;
+
+  // Jobs waiting for their done_cb in the httpd thread
+  struct dbexec_queue done;
+  struct event *doneev;
+};
+
 static const struct content_type_map ext2ctype[] =
   {
     { ".html", "text/html; charset=utf-8" },
@@ -138,6 +179,8 @@ static int httpd_port;
 struct stream_ctx *g_st;
 #endif
 
+static struct dbexec_state dbexec = { .lck = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
 
 /* -------------------------------- HELPERS --------------------------------- */
 
@@ -747,6 +790,193 @@ stream_fail_cb(struct evhttp_connection *evcon, void *arg)
 }
 
 
+/* ------------------------------ DB EXECUTOR ------------------------------- */
+
+static void
+dbexec_queue_add(struct dbexec_queue *queue, struct dbexec_job *job)
+{
+  job->next = NULL;
+
+  if (queue->tail)
+    queue->tail->next = job;
+  else
+    queue->head = job;
+
+  queue->tail = job;
+}
+
+static struct dbexec_job *
+dbexec_queue_take(struct dbexec_queue *queue)
+{
+  struct dbexec_job *job;
+
+  job = queue->head;
+  if (!job)
+    return NULL;
+
+  queue->head = job->next;
+  if (!queue->head)
+    queue->tail = NULL;
+
+  job->next = NULL;
+  return job;
+}
+
+// Must be called with the lock held
+static struct dbexec_job *
+dbexec_job_next(void)
+{
+  struct dbexec_job *job;
+
+  job = dbexec_queue_take(&dbexec.pending[HTTPD_DBEXEC_PRIO_HIGH]);
+  if (job)
+    return job;
+
+  // Always leave a thread for high priority jobs, so that e.g. a queue listing
+  // doesn't have to wait for a couple of slow library listings to complete
+  if (dbexec.nthreads > 1 && dbexec.nrunning_low >= dbexec.nthreads - 1)
+    return NULL;
+
+  return dbexec_queue_take(&dbexec.pending[HTTPD_DBEXEC_PRIO_LOW]);
+}
+
+/* Thread: httpd_db */
+static void *
+dbexec_thread(void *arg)
+{
+  struct dbexec_job *job;
+  int ret;
+
+  ret = db_perthread_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_LOG, L_HTTPD, "Error: DB init failed (db executor)\n");
+
+      pthread_exit(NULL);
+    }
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&dbexec.lck));
+
+  while (!dbexec.exit)
+    {
+      job = dbexec_job_next();
+      if (!job)
+	{
+	  CHECK_ERR(L_HTTPD, pthread_cond_wait(&dbexec.cond, &dbexec.lck));
+	  continue;
+	}
+
+      dbexec.npending--;
+      if (job->prio == HTTPD_DBEXEC_PRIO_LOW)
+	dbexec.nrunning_low++;
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+      job->job_cb(job->arg);
+
+      CHECK_ERR(L_HTTPD, pthread_mutex_lock(&dbexec.lck));
+
+      if (job->prio == HTTPD_DBEXEC_PRIO_LOW)
+	dbexec.nrunning_low--;
+
+      dbexec_queue_add(&dbexec.done, job);
+      event_active(dbexec.doneev, 0, 0);
+    }
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+  db_perthread_deinit();
+
+  pthread_exit(NULL);
+}
+
+/* Thread: httpd */
+static void
+dbexec_done_cb(int fd, short what, void *arg)
+{
+  struct dbexec_queue done;
+  struct dbexec_job *job;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&dbexec.lck));
+  done = dbexec.done;
+  dbexec.done.head = NULL;
+  dbexec.done.tail = NULL;
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+  while ((job = dbexec_queue_take(&done)))
+    {
+      job->done_cb(job->arg);
+      free(job);
+    }
+}
+
+static int
+dbexec_init(void)
+{
+  int i;
+  int ret;
+
+  dbexec.exit = false;
+  dbexec.nthreads = 0;
+
+  CHECK_NULL(L_HTTPD, dbexec.doneev = event_new(evbase_httpd, -1, 0, dbexec_done_cb, NULL));
+
+  for (i = 0; i < DBEXEC_THREADS; i++)
+    {
+      ret = pthread_create(&dbexec.tid[i], NULL, dbexec_thread, NULL);
+      if (ret != 0)
+	{
+	  DPRINTF(E_LOG, L_HTTPD, "Could not spawn db executor thread: %s\n", strerror(ret));
+	  break;
+	}
+
+      thread_setname(dbexec.tid[i], "httpd_db");
+      dbexec.nthreads++;
+    }
+
+  if (dbexec.nthreads == 0)
+    {
+      event_free(dbexec.doneev);
+      return -1;
+    }
+
+  return 0;
+}
+
+/* Thread: main (after the httpd thread has been joined) */
+static void
+dbexec_deinit(void)
+{
+  struct dbexec_job *job;
+  int prio;
+  int i;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&dbexec.lck));
+  dbexec.exit = true;
+  CHECK_ERR(L_HTTPD, pthread_cond_broadcast(&dbexec.cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+  for (i = 0; i < dbexec.nthreads; i++)
+    {
+      CHECK_ERR(L_HTTPD, pthread_join(dbexec.tid[i], NULL));
+    }
+
+  // Let the owners clean up, both for the finished jobs and those that never ran
+  for (prio = 0; prio < HTTPD_DBEXEC_PRIO_MAX; prio++)
+    {
+      while ((job = dbexec_queue_take(&dbexec.pending[prio])))
+	dbexec_queue_add(&dbexec.done, job);
+    }
+
+  dbexec_done_cb(-1, 0, NULL);
+
+  dbexec.npending = 0;
+  dbexec.nthreads = 0;
+
+  event_free(dbexec.doneev);
+}
+
+
 /* ---------------------------- MAIN HTTPD THREAD --------------------------- */
 
 static void *
@@ -997,7 +1227,8 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
   hreq->req = req;
   hreq->uri_parsed = uri_parsed;
   hreq->query = &(uri_parsed->ev_query);
-  req_method = 0;
+  // Without a request, e.g. when building a cached reply, we only look for GET handlers
+  req_method = EVHTTP_REQ_GET;
 
   if (req)
     {
@@ -1027,6 +1258,7 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
       if (ret == 0)
         {
           hreq->handler = uri_map[i].handler;
+          hreq->handler_flags = uri_map[i].flags;
           return hreq; // Success
         }
     }
@@ -1037,6 +1269,44 @@ httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_par
   return NULL;
 }
 
+/* Thread: httpd */
+int
+httpd_dbexec(httpd_dbexec_cb job_cb, httpd_dbexec_cb done_cb, void *arg, enum httpd_dbexec_prio prio)
+{
+  struct dbexec_job *job;
+
+  CHECK_ERR(L_HTTPD, pthread_mutex_lock(&dbexec.lck));
+
+  if (dbexec.exit || dbexec.nthreads == 0)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+      return -1;
+    }
+
+  if (dbexec.npending >= DBEXEC_QUEUE_MAX)
+    {
+      CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+      DPRINTF(E_WARN, L_HTTPD, "Too many pending db requests (%d), rejecting request\n", dbexec.npending);
+      return -1;
+    }
+
+  CHECK_NULL(L_HTTPD, job = calloc(1, sizeof(struct dbexec_job)));
+
+  job->job_cb = job_cb;
+  job->done_cb = done_cb;
+  job->arg = arg;
+  job->prio = prio;
+
+  dbexec_queue_add(&dbexec.pending[prio], job);
+  dbexec.npending++;
+
+  CHECK_ERR(L_HTTPD, pthread_cond_signal(&dbexec.cond));
+  CHECK_ERR(L_HTTPD, pthread_mutex_unlock(&dbexec.lck));
+
+  return 0;
+}
+
 /* Thread: httpd */
 void
 httpd_stream_file(struct evhttp_request *req, int id)
@@ -1807,6 +2077,13 @@ httpd_init(const char *webroot)
 
   evhttp_set_gencb(evhttpd, httpd_gen_cb, NULL);
 
+  ret = dbexec_init();
+  if (ret < 0)
+    {
+      DPRINTF(E_FATAL, L_HTTPD, "Could not start db executor threads\n");
+      goto dbexec_fail;
+    }
+
   ret = pthread_create(&tid_httpd, NULL, httpd, NULL);
   if (ret != 0)
     {
@@ -1820,6 +2097,8 @@ httpd_init(const char *webroot)
   return 0;
 
  thread_fail:
+  dbexec_deinit();
+ dbexec_fail:
  bind_fail:
   evhttp_free(evhttpd);
  evhttpd_fail:
@@ -1888,6 +2167,12 @@ httpd_deinit(void)
       return;
     }
 
+  dbexec_deinit();
+
+  // Like the db executor jobs, outstanding artwork requests get their callback
+  // now, before the event base goes away
+  artwork_async_cancel(evbase_httpd);
+
   streaming_deinit();
 #ifdef HAVE_LIBWEBSOCKETS
   websocket_deinit();
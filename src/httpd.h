@@ -14,6 +14,23 @@ enum httpd_send_flags
   HTTPD_SEND_NO_GZIP =   (1 << 0),
 };
 
+enum httpd_handler_flags
+{
+  // Run the handler in a db executor thread instead of the httpd thread
+  HTTPD_HANDLER_DB =      (1 << 0),
+  // As above, but queued behind everything else (for bulk library listings)
+  HTTPD_HANDLER_DB_BULK = (1 << 1),
+};
+
+enum httpd_dbexec_prio
+{
+  HTTPD_DBEXEC_PRIO_HIGH,
+  HTTPD_DBEXEC_PRIO_LOW,
+  HTTPD_DBEXEC_PRIO_MAX,
+};
+
+typedef void (*httpd_dbexec_cb)(void *arg);
+
 /*
  * Contains a parsed version of the URI httpd got. The URI may have been
  * complete:
@@ -62,6 +79,8 @@ struct httpd_request {
 
   // A pointer to the handler that will process the request
   int (*handler)(struct httpd_request *hreq);
+  // Flags from the uri map, see enum httpd_handler_flags
+  int handler_flags;
 };
 
 /*
@@ -72,6 +91,7 @@ struct httpd_uri_map
   int method;
   char *regexp;
   int (*handler)(struct httpd_request *hreq);
+  int flags;
   regex_t preg;
 };
 
@@ -97,6 +117,24 @@ httpd_uri_parse(const char *uri);
 struct httpd_request *
 httpd_request_parse(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed, const char *user_agent, struct httpd_uri_map *uri_map);
 
+/*
+ * Queues a job for the db executor threads, so that db queries don't block the
+ * httpd event loop. job_cb runs in an executor thread (which has its own db
+ * connection), and when it has returned, done_cb is called in the httpd thread,
+ * where it is safe to send the reply. If httpd shuts down before the job runs,
+ * only done_cb is called, so it can always be used to clean up arg. High
+ * priority jobs are taken before low priority ones, and low priority jobs never
+ * occupy all the executor threads.
+ *
+ * @in  job_cb   Function that does the db work
+ * @in  done_cb  Function to call in the httpd thread when job_cb is done
+ * @in  arg      Argument for job_cb and done_cb
+ * @in  prio     Priority of the job
+ * @return       0 if queued, -1 if the queue is full or on error
+ */
+int
+httpd_dbexec(httpd_dbexec_cb job_cb, httpd_dbexec_cb done_cb, void *arg, enum httpd_dbexec_prio prio);
+
 void
 httpd_stream_file(struct evhttp_request *req, int id);
 
@@ -21,16 +21,26 @@
 #endif
 
 #include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <event2/bufferevent.h>
+
 #include "httpd_artworkapi.h"
 #include "logger.h"
 #include "misc.h"
 #include "player.h"
 #include "artwork.h"
 
+// Returned by a handler that has queued an async artwork request instead of
+// an HTTP status code, the reply is then sent from artwork_reply_done()
+#define ARTWORKAPI_REPLY_ASYNC -1
+
+extern struct event_base *evbase_httpd;
+
 static int
 request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
 {
@@ -60,9 +70,10 @@ request_process(struct httpd_request *hreq, uint32_t *max_w, uint32_t *max_h)
 }
 
 static int
-response_process(struct httpd_request *hreq, int format)
+response_process(struct httpd_request *hreq, int format, const char *hash)
 {
   struct evkeyvalq *headers;
+  char etag[ART_HASH_LEN + 2];
 
   headers = evhttp_request_get_output_headers(hreq->req);
 
@@ -73,9 +84,140 @@ response_process(struct httpd_request *hreq, int format)
   else
     return HTTP_NOCONTENT;
 
+  // The hash is of the image content, so it makes a strong ETag
+  if (hash[0] == '\0')
+    return HTTP_OK;
+
+  snprintf(etag, sizeof(etag), "\"%s\"", hash);
+  if (httpd_request_etag_matches(hreq->req, etag))
+    {
+      evbuffer_drain(hreq->reply, evbuffer_get_length(hreq->reply));
+      return HTTP_NOTMODIFIED;
+    }
+
   return HTTP_OK;
 }
 
+static void
+reply_send(struct httpd_request *hreq, int status_code)
+{
+  struct evhttp_request *req = hreq->req;
+
+  switch (status_code)
+    {
+      case HTTP_OK:                  /* 200 OK */
+	httpd_send_reply(req, status_code, "OK", hreq->reply, HTTPD_SEND_NO_GZIP);
+	break;
+      case HTTP_NOCONTENT:           /* 204 No Content */
+	httpd_send_reply(req, status_code, "No Content", hreq->reply, HTTPD_SEND_NO_GZIP);
+	break;
+      case HTTP_NOTMODIFIED:         /* 304 Not Modified */
+	httpd_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL, HTTPD_SEND_NO_GZIP);
+	break;
+      case HTTP_BADREQUEST:          /* 400 Bad Request */
+	httpd_send_error(req, status_code, "Bad Request");
+	break;
+      case HTTP_NOTFOUND:            /* 404 Not Found */
+	httpd_send_error(req, status_code, "Not Found");
+	break;
+      case HTTP_INTERNAL:            /* 500 Internal Server Error */
+      default:
+	httpd_send_error(req, HTTP_INTERNAL, "Internal Server Error");
+    }
+}
+
+static void
+artwork_reply_detach(struct httpd_request *hreq)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(hreq->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+}
+
+/* Thread: httpd */
+static void
+artwork_reply_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct httpd_request *hreq = arg;
+
+  DPRINTF(E_DBG, L_WEB, "Artwork api request: client closed connection\n");
+
+  // No callback will be made after this, and the request is ours to free,
+  // same as with the DAAP/DACP update requests
+  artwork_async_request_cancel(hreq->extra_data);
+
+  artwork_reply_detach(hreq);
+  evhttp_request_free(hreq->req);
+
+  evbuffer_free(hreq->reply);
+  free(hreq);
+}
+
+/* Thread: httpd */
+static void
+artwork_reply_done(struct evbuffer *evbuf, int format, const char *hash, void *arg)
+{
+  struct httpd_request *hreq = arg;
+
+  // Note that hreq->uri_parsed was freed when the request was handed over, and
+  // hreq->extra_data (the waiter) is freed after we return
+  artwork_reply_detach(hreq);
+
+  evbuffer_add_buffer(hreq->reply, evbuf);
+
+  reply_send(hreq, response_process(hreq, format, hash));
+
+  evbuffer_free(hreq->reply);
+  free(hreq);
+}
+
+// Decoding, rescaling and online lookups are left to the artwork threads, so
+// they don't hold up other requests. Falls back to getting the artwork here if
+// the request can't be queued.
+static int
+artwork_reply(struct httpd_request *hreq, bool is_group, uint32_t id, uint32_t max_w, uint32_t max_h)
+{
+  struct artwork_waiter *waiter;
+  struct evhttp_connection *evcon;
+  struct bufferevent *bufev;
+  char hash[ART_HASH_LEN];
+  int ret;
+
+  if (is_group)
+    waiter = artwork_get_group_async(evbase_httpd, id, max_w, max_h, 0, artwork_reply_done, hreq);
+  else
+    waiter = artwork_get_item_async(evbase_httpd, id, max_w, max_h, 0, artwork_reply_done, hreq);
+  if (waiter)
+    {
+      hreq->extra_data = waiter;
+
+      // If the client hangs up (e.g. scrolls past the album in a grid) before
+      // we have the artwork, the request must be cancelled
+      evcon = evhttp_request_get_connection(hreq->req);
+      if (evcon)
+	{
+	  evhttp_connection_set_closecb(evcon, artwork_reply_fail_cb, hreq);
+
+	  // Same workaround for libevent not detecting client hang ups as in
+	  // httpd_daap.c
+	  bufev = evhttp_connection_get_bufferevent(evcon);
+	  if (bufev)
+	    bufferevent_enable(bufev, EV_READ);
+	}
+
+      return ARTWORKAPI_REPLY_ASYNC;
+    }
+
+  if (is_group)
+    ret = artwork_get_group(hreq->reply, id, max_w, max_h, 0, hash);
+  else
+    ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0, hash);
+
+  return response_process(hreq, ret, hash);
+}
+
 static int
 artworkapi_reply_nowplaying(struct httpd_request *hreq)
 {
@@ -92,9 +234,7 @@ artworkapi_reply_nowplaying(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_NOTFOUND;
 
-  ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0);
-
-  return response_process(hreq, ret);
+  return artwork_reply(hreq, false, id, max_w, max_h);
 }
 
 static int
@@ -113,9 +253,7 @@ artworkapi_reply_item(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0);
-
-  return response_process(hreq, ret);
+  return artwork_reply(hreq, false, id, max_w, max_h);
 }
 
 static int
@@ -134,9 +272,7 @@ artworkapi_reply_group(struct httpd_request *hreq)
   if (ret != 0)
     return HTTP_BADREQUEST;
 
-  ret = artwork_get_group(hreq->reply, id, max_w, max_h, 0);
-
-  return response_process(hreq, ret);
+  return artwork_reply(hreq, true, id, max_w, max_h);
 }
 
 static struct httpd_uri_map artworkapi_handlers[] =
@@ -172,28 +308,10 @@ artworkapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_pars
   CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
 
   status_code = hreq->handler(hreq);
+  if (status_code == ARTWORKAPI_REPLY_ASYNC)
+    return;
 
-  switch (status_code)
-    {
-      case HTTP_OK:                  /* 200 OK */
-	httpd_send_reply(req, status_code, "OK", hreq->reply, HTTPD_SEND_NO_GZIP);
-	break;
-      case HTTP_NOCONTENT:           /* 204 No Content */
-	httpd_send_reply(req, status_code, "No Content", hreq->reply, HTTPD_SEND_NO_GZIP);
-	break;
-      case HTTP_NOTMODIFIED:         /* 304 Not Modified */
-	httpd_send_reply(req, HTTP_NOTMODIFIED, NULL, NULL, HTTPD_SEND_NO_GZIP);
-	break;
-      case HTTP_BADREQUEST:          /* 400 Bad Request */
-	httpd_send_error(req, status_code, "Bad Request");
-	break;
-      case HTTP_NOTFOUND:            /* 404 Not Found */
-	httpd_send_error(req, status_code, "Not Found");
-	break;
-      case HTTP_INTERNAL:            /* 500 Internal Server Error */
-      default:
-	httpd_send_error(req, HTTP_INTERNAL, "Internal Server Error");
-    }
+  reply_send(hreq, status_code);
 
   evbuffer_free(hreq->reply);
   free(hreq);
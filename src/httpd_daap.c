@@ -669,6 +669,38 @@ parse_meta(const struct dmap_field ***out_meta, const char *param)
   return nmeta;
 }
 
+/* Limits the columns fetched from the db to those needed for the requested meta
+ * tags, if there are none all columns are fetched */
+static void
+query_params_cols_set(struct query_params *qp, const struct dmap_field **meta, int nmeta, int sort_headers)
+{
+  int i;
+
+  if (nmeta <= 0)
+    return;
+
+  for (i = 0; i < nmeta; i++)
+    {
+      if (meta[i]->dfm && (meta[i]->dfm->mfi_offset >= 0))
+	db_query_add_col(qp, meta[i]->dfm->mfi_offset);
+    }
+
+  // Always needed for transcoding decision and bitrate when transcoding
+  db_query_add_col(qp, mfi_offsetof(id));
+  db_query_add_col(qp, mfi_offsetof(fname));
+  db_query_add_col(qp, mfi_offsetof(codectype));
+  db_query_add_col(qp, mfi_offsetof(samplerate));
+
+  if (sort_headers)
+    {
+      db_query_add_col(qp, mfi_offsetof(title_sort));
+      db_query_add_col(qp, mfi_offsetof(artist_sort));
+      db_query_add_col(qp, mfi_offsetof(album_sort));
+      db_query_add_col(qp, mfi_offsetof(album_artist_sort));
+      db_query_add_col(qp, mfi_offsetof(composer_sort));
+    }
+}
+
 static void
 daap_reply_send(struct httpd_request *hreq, enum daap_reply_result result)
 {
@@ -1174,7 +1206,7 @@ static enum daap_reply_result
 daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   struct evbuffer *song;
   struct evbuffer *songlist;
   struct evkeyvalq *headers;
@@ -1239,6 +1271,8 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	  DPRINTF(E_LOG, L_DAAP, "Failed to parse meta parameter in DAAP query\n");
 	  goto error;
 	}
+
+      query_params_cols_set(&qp, meta, nmeta, sort_headers);
     }
 
   ret = db_query_start(&qp);
@@ -1259,13 +1293,13 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 
   nsongs = 0;
   last_codectype = NULL;
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
       nsongs++;
 
-      if (!dbmfi.codectype)
+      if (!mfi.codectype)
 	{
-	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", dbmfi.fname);
+	  DPRINTF(E_LOG, L_DAAP, "Cannot transcode '%s', codec type is unknown\n", mfi.fname);
 
 	  transcode = 0;
 	}
@@ -1273,15 +1307,15 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 	{
 	  transcode = 1;
 	}
-      else if (!last_codectype || (strcmp(last_codectype, dbmfi.codectype) != 0))
+      else if (!last_codectype || (strcmp(last_codectype, mfi.codectype) != 0))
 	{
-	  transcode = transcode_needed(hreq->user_agent, client_codecs, dbmfi.codectype);
+	  transcode = transcode_needed(hreq->user_agent, client_codecs, mfi.codectype);
 
 	  free(last_codectype);
-	  last_codectype = strdup(dbmfi.codectype);
+	  last_codectype = strdup(mfi.codectype);
 	}
 
-      ret = dmap_encode_file_metadata(songlist, song, &dbmfi, meta, nmeta, sort_headers, transcode);
+      ret = dmap_encode_file_metadata(songlist, song, &mfi, meta, nmeta, sort_headers, transcode);
       if (ret < 0)
 	{
 	  DPRINTF(E_LOG, L_DAAP, "Failed to encode song metadata\n");
@@ -1292,7 +1326,7 @@ daap_reply_songlist_generic(struct httpd_request *hreq, int playlist)
 
       if (sort_headers)
 	{
-	  ret = daap_sort_build(sctx, dbmfi.title_sort);
+	  ret = daap_sort_build(sctx, mfi.title_sort);
 	  if (ret < 0)
 	    {
 	      DPRINTF(E_LOG, L_DAAP, "Could not add sort header to DAAP song list reply\n");
@@ -2009,9 +2043,9 @@ daap_reply_extra_data(struct httpd_request *hreq)
     }
 
   if (strcmp(hreq->uri_parsed->path_parts[2], "groups") == 0)
-    ret = artwork_get_group(hreq->reply, id, max_w, max_h, 0);
+    ret = artwork_get_group(hreq->reply, id, max_w, max_h, 0, NULL);
   else if (strcmp(hreq->uri_parsed->path_parts[2], "items") == 0)
-    ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0);
+    ret = artwork_get_item(hreq->reply, id, max_w, max_h, 0, NULL);
 
   len = evbuffer_get_length(hreq->reply);
 
@@ -40,8 +40,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/queue.h>
+
+#include <event2/bufferevent.h>
 
 #include "httpd_jsonapi.h"
+#include "cache.h"
 #include "conffile.h"
 #include "db.h"
 #ifdef LASTFM
@@ -113,9 +117,8 @@ safe_json_add_int_from_string(json_object *obj, const char *key, const char *val
 }
 
 static inline void
-safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_time(json_object *obj, const char *key, uint32_t value)
 {
-  uint32_t tmp;
   time_t timestamp;
   struct tm tm;
   char result[32];
@@ -123,31 +126,38 @@ safe_json_add_time_from_string(json_object *obj, const char *key, const char *va
   if (!value)
     return;
 
-  if (safe_atou32(value, &tmp) != 0)
+  timestamp = value;
+  if (gmtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %" PRIu32 "\n", value);
       return;
     }
 
-  if (!tmp)
+  strftime(result, sizeof(result), "%FT%TZ", &tm);
+
+  json_object_object_add(obj, key, json_object_new_string(result));
+}
+
+static inline void
+safe_json_add_time_from_string(json_object *obj, const char *key, const char *value)
+{
+  uint32_t tmp;
+
+  if (!value)
     return;
 
-  timestamp = tmp;
-  if (gmtime_r(&timestamp, &tm) == NULL)
+  if (safe_atou32(value, &tmp) != 0)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to gmtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to uint32_t: %s\n", value);
       return;
     }
 
-  strftime(result, sizeof(result), "%FT%TZ", &tm);
-
-  json_object_object_add(obj, key, json_object_new_string(result));
+  safe_json_add_time(obj, key, tmp);
 }
 
 static inline void
-safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+safe_json_add_date(json_object *obj, const char *key, int64_t value)
 {
-  int64_t tmp;
   time_t timestamp;
   struct tm tm;
   char result[32];
@@ -155,25 +165,33 @@ safe_json_add_date_from_string(json_object *obj, const char *key, const char *va
   if (!value)
     return;
 
-  if (safe_atoi64(value, &tmp) != 0)
+  timestamp = value;
+  if (localtime_r(&timestamp, &tm) == NULL)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to int64_t: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %" PRIi64 "\n", value);
       return;
     }
 
-  if (!tmp)
+  strftime(result, sizeof(result), "%F", &tm);
+
+  json_object_object_add(obj, key, json_object_new_string(result));
+}
+
+static inline void
+safe_json_add_date_from_string(json_object *obj, const char *key, const char *value)
+{
+  int64_t tmp;
+
+  if (!value)
     return;
 
-  timestamp = tmp;
-  if (localtime_r(&timestamp, &tm) == NULL)
+  if (safe_atoi64(value, &tmp) != 0)
     {
-      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to localtime: %s\n", value);
+      DPRINTF(E_LOG, L_WEB, "Error converting timestamp to int64_t: %s\n", value);
       return;
     }
 
-  strftime(result, sizeof(result), "%F", &tm);
-
-  json_object_object_add(obj, key, json_object_new_string(result));
+  safe_json_add_date(obj, key, tmp);
 }
 
 static json_object *
@@ -268,66 +286,83 @@ album_to_json(struct db_group_info *dbgri)
   return item;
 }
 
+// Columns that track_to_json() needs, so we don't fetch the others
+static const ssize_t track_cols[] =
+  {
+    mfi_offsetof(id), mfi_offsetof(path), mfi_offsetof(title), mfi_offsetof(title_sort),
+    mfi_offsetof(artist), mfi_offsetof(artist_sort), mfi_offsetof(album), mfi_offsetof(album_sort),
+    mfi_offsetof(songalbumid), mfi_offsetof(album_artist), mfi_offsetof(album_artist_sort),
+    mfi_offsetof(songartistid), mfi_offsetof(composer), mfi_offsetof(genre), mfi_offsetof(comment),
+    mfi_offsetof(year), mfi_offsetof(track), mfi_offsetof(disc), mfi_offsetof(song_length),
+    mfi_offsetof(rating), mfi_offsetof(play_count), mfi_offsetof(skip_count), mfi_offsetof(time_played),
+    mfi_offsetof(time_skipped), mfi_offsetof(time_added), mfi_offsetof(date_released), mfi_offsetof(seek),
+    mfi_offsetof(type), mfi_offsetof(samplerate), mfi_offsetof(bitrate), mfi_offsetof(channels),
+    mfi_offsetof(usermark), mfi_offsetof(media_kind), mfi_offsetof(data_kind),
+  };
+
+static void
+track_cols_set(struct query_params *qp)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(track_cols); i++)
+    db_query_add_col(qp, track_cols[i]);
+}
+
 static json_object *
-track_to_json(struct db_media_file_info *dbmfi)
+track_to_json(struct media_file_info *mfi)
 {
   json_object *item;
   char uri[100];
   char artwork_url[100];
-  int intval;
   int ret;
 
   item = json_object_new_object();
 
-  safe_json_add_int_from_string(item, "id", dbmfi->id);
-  safe_json_add_string(item, "title", dbmfi->title);
-  safe_json_add_string(item, "title_sort", dbmfi->title_sort);
-  safe_json_add_string(item, "artist", dbmfi->artist);
-  safe_json_add_string(item, "artist_sort", dbmfi->artist_sort);
-  safe_json_add_string(item, "album", dbmfi->album);
-  safe_json_add_string(item, "album_sort", dbmfi->album_sort);
-  safe_json_add_string(item, "album_id", dbmfi->songalbumid);
-  safe_json_add_string(item, "album_artist", dbmfi->album_artist);
-  safe_json_add_string(item, "album_artist_sort", dbmfi->album_artist_sort);
-  safe_json_add_string(item, "album_artist_id", dbmfi->songartistid);
-  safe_json_add_string(item, "composer", dbmfi->composer);
-  safe_json_add_string(item, "genre", dbmfi->genre);
-  safe_json_add_string(item, "comment", dbmfi->comment);
-  safe_json_add_int_from_string(item, "year", dbmfi->year);
-  safe_json_add_int_from_string(item, "track_number", dbmfi->track);
-  safe_json_add_int_from_string(item, "disc_number", dbmfi->disc);
-  safe_json_add_int_from_string(item, "length_ms", dbmfi->song_length);
-
-  safe_json_add_int_from_string(item, "rating", dbmfi->rating);
-  safe_json_add_int_from_string(item, "play_count", dbmfi->play_count);
-  safe_json_add_int_from_string(item, "skip_count", dbmfi->skip_count);
-  safe_json_add_time_from_string(item, "time_played", dbmfi->time_played);
-  safe_json_add_time_from_string(item, "time_skipped", dbmfi->time_skipped);
-  safe_json_add_time_from_string(item, "time_added", dbmfi->time_added);
-  safe_json_add_date_from_string(item, "date_released", dbmfi->date_released);
-  safe_json_add_int_from_string(item, "seek_ms", dbmfi->seek);
-
-  safe_json_add_string(item, "type", dbmfi->type);
-  safe_json_add_int_from_string(item, "samplerate", dbmfi->samplerate);
-  safe_json_add_int_from_string(item, "bitrate", dbmfi->bitrate);
-  safe_json_add_int_from_string(item, "channels", dbmfi->channels);
-  safe_json_add_int_from_string(item, "usermark", dbmfi->usermark);
-
-  ret = safe_atoi32(dbmfi->media_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "media_kind", db_media_kind_label(intval));
-
-  ret = safe_atoi32(dbmfi->data_kind, &intval);
-  if (ret == 0)
-    safe_json_add_string(item, "data_kind", db_data_kind_label(intval));
-
-  safe_json_add_string(item, "path", dbmfi->path);
-
-  ret = snprintf(uri, sizeof(uri), "%s:%s:%s", "library", "track", dbmfi->id);
+  json_object_object_add(item, "id", json_object_new_int(mfi->id));
+  safe_json_add_string(item, "title", mfi->title);
+  safe_json_add_string(item, "title_sort", mfi->title_sort);
+  safe_json_add_string(item, "artist", mfi->artist);
+  safe_json_add_string(item, "artist_sort", mfi->artist_sort);
+  safe_json_add_string(item, "album", mfi->album);
+  safe_json_add_string(item, "album_sort", mfi->album_sort);
+  safe_json_add_string_from_int64(item, "album_id", mfi->songalbumid);
+  safe_json_add_string(item, "album_artist", mfi->album_artist);
+  safe_json_add_string(item, "album_artist_sort", mfi->album_artist_sort);
+  safe_json_add_string_from_int64(item, "album_artist_id", mfi->songartistid);
+  safe_json_add_string(item, "composer", mfi->composer);
+  safe_json_add_string(item, "genre", mfi->genre);
+  safe_json_add_string(item, "comment", mfi->comment);
+  json_object_object_add(item, "year", json_object_new_int(mfi->year));
+  json_object_object_add(item, "track_number", json_object_new_int(mfi->track));
+  json_object_object_add(item, "disc_number", json_object_new_int(mfi->disc));
+  json_object_object_add(item, "length_ms", json_object_new_int(mfi->song_length));
+
+  json_object_object_add(item, "rating", json_object_new_int(mfi->rating));
+  json_object_object_add(item, "play_count", json_object_new_int(mfi->play_count));
+  json_object_object_add(item, "skip_count", json_object_new_int(mfi->skip_count));
+  safe_json_add_time(item, "time_played", mfi->time_played);
+  safe_json_add_time(item, "time_skipped", mfi->time_skipped);
+  safe_json_add_time(item, "time_added", mfi->time_added);
+  safe_json_add_date(item, "date_released", mfi->date_released);
+  json_object_object_add(item, "seek_ms", json_object_new_int(mfi->seek));
+
+  safe_json_add_string(item, "type", mfi->type);
+  json_object_object_add(item, "samplerate", json_object_new_int(mfi->samplerate));
+  json_object_object_add(item, "bitrate", json_object_new_int(mfi->bitrate));
+  json_object_object_add(item, "channels", json_object_new_int(mfi->channels));
+  json_object_object_add(item, "usermark", json_object_new_int(mfi->usermark));
+
+  safe_json_add_string(item, "media_kind", db_media_kind_label(mfi->media_kind));
+  safe_json_add_string(item, "data_kind", db_data_kind_label(mfi->data_kind));
+
+  safe_json_add_string(item, "path", mfi->path);
+
+  ret = snprintf(uri, sizeof(uri), "%s:%s:%" PRIu32, "library", "track", mfi->id);
   if (ret < sizeof(uri))
     json_object_object_add(item, "uri", json_object_new_string(uri));
 
-  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%s", dbmfi->id);
+  ret = snprintf(artwork_url, sizeof(artwork_url), "/artwork/item/%" PRIu32, mfi->id);
   if (ret < sizeof(artwork_url))
     json_object_object_add(item, "artwork_url", json_object_new_string(artwork_url));
 
@@ -456,17 +491,19 @@ directory_to_json(struct directory_info *directory_info)
 static int
 fetch_tracks(struct query_params *query_params, json_object *items, int *total)
 {
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *item;
   int ret;
 
+  track_cols_set(query_params);
+
   ret = db_query_start(query_params);
   if (ret < 0)
     goto error;
 
-  while ((ret = db_query_fetch_file(&dbmfi, query_params)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, query_params)) == 0)
     {
-      item = track_to_json(&dbmfi);
+      item = track_to_json(&mfi);
       if (!item)
 	{
 	  ret = -1;
@@ -786,6 +823,38 @@ query_params_limit_set(struct query_params *query_params, struct httpd_request *
   return 0;
 }
 
+// Switches a query to keyset pagination if the client passed a cursor, which
+// is empty for the first page and else the "next" of the previous page. Must
+// be called after query_params_limit_set() and after the type and sort of the
+// query are set, the offset is ignored. Returns -2 if the cursor is invalid.
+static int
+query_params_cursor_set(struct query_params *query_params, struct httpd_request *hreq)
+{
+  const char *param;
+
+  param = evhttp_find_header(hreq->query, "cursor");
+  if (!param)
+    return 0;
+
+  if (query_params->order)
+    {
+      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' is not supported with a custom sort order\n");
+      return -1;
+    }
+
+  query_params->idx_type = I_KEYSET;
+  query_params->cursor = param;
+  query_params->offset = 0;
+
+  if (!db_query_cursor_valid(query_params))
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'cursor' (%s)\n", param);
+      return -2;
+    }
+
+  return 0;
+}
+
 /* --------------------------- REPLY HANDLERS ------------------------------- */
 
 /*
@@ -2722,6 +2791,16 @@ jsonapi_reply_queue(struct httpd_request *hreq)
     {
       query_params.filter = db_mprintf("id = %d", item_id);
     }
+  else if (evhttp_find_header(hreq->query, "cursor"))
+    {
+      query_params.sort = status.shuffle ? S_SHUFFLE_POS : S_POS;
+
+      ret = query_params_limit_set(&query_params, hreq);
+      if (ret == 0)
+	ret = query_params_cursor_set(&query_params, hreq);
+      if (ret < 0)
+	goto db_start_error;
+    }
   else
     {
       param = evhttp_find_header(hreq->query, "start");
@@ -2753,6 +2832,8 @@ jsonapi_reply_queue(struct httpd_request *hreq)
       json_object_array_add(items, item);
     }
 
+  safe_json_add_string(reply, "next", query_params.next_cursor);
+
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
     DPRINTF(E_LOG, L_WEB, "outputs: Couldn't add outputs to response buffer.\n");
@@ -2762,7 +2843,10 @@ jsonapi_reply_queue(struct httpd_request *hreq)
  db_start_error:
   jparse_free(reply);
   free(query_params.filter);
+  free(query_params.next_cursor);
 
+  if (ret == -2)
+    return HTTP_BADREQUEST;
   if (ret < 0)
     return HTTP_INTERNAL;
 
@@ -2981,8 +3065,12 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   query_params.type = Q_GROUP_ARTISTS;
   query_params.sort = S_ARTIST;
 
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+    query_params.media_kind = media_kind;
 
   ret = fetch_artists(&query_params, items, &total);
   if (ret < 0)
@@ -2991,6 +3079,7 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next", query_params.next_cursor);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3000,6 +3089,8 @@ jsonapi_reply_library_artists(struct httpd_request *hreq)
   free_query_params(&query_params, 1);
   jparse_free(reply);
 
+  if (ret == -2)
+    return HTTP_BADREQUEST;
   if (ret < 0)
     return HTTP_INTERNAL;
 
@@ -3130,8 +3221,12 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   query_params.type = Q_GROUP_ALBUMS;
   query_params.sort = S_ALBUM;
 
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto error;
+
   if (media_kind)
-    query_params.filter = db_mprintf("(f.media_kind = %d)", media_kind);
+    query_params.media_kind = media_kind;
 
   ret = fetch_albums(&query_params, items, &total);
   if (ret < 0)
@@ -3140,6 +3235,7 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   json_object_object_add(reply, "total", json_object_new_int(total));
   json_object_object_add(reply, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(reply, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(reply, "next", query_params.next_cursor);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3149,6 +3245,8 @@ jsonapi_reply_library_albums(struct httpd_request *hreq)
   free_query_params(&query_params, 1);
   jparse_free(reply);
 
+  if (ret == -2)
+    return HTTP_BADREQUEST;
   if (ret < 0)
     return HTTP_INTERNAL;
 
@@ -3277,7 +3375,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
 {
   struct query_params query_params;
   const char *track_id;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   json_object *reply = NULL;
   int ret = 0;
   bool notfound = false;
@@ -3291,12 +3389,13 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
 
   query_params.type = Q_ITEMS;
   query_params.filter = db_mprintf("(f.id = %q)", track_id);
+  track_cols_set(&query_params);
 
   ret = db_query_start(&query_params);
   if (ret < 0)
     goto error;
 
-  ret = db_query_fetch_file(&dbmfi, &query_params);
+  ret = db_query_fetch_file_row(&mfi, &query_params);
   if (ret < 0)
     goto error;
   else if (ret == 1)
@@ -3307,7 +3406,7 @@ jsonapi_reply_library_tracks_get_byid(struct httpd_request *hreq)
       goto error;
     }
 
-  reply = track_to_json(&dbmfi);
+  reply = track_to_json(&mfi);
 
   ret = evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(reply));
   if (ret < 0)
@@ -3354,7 +3453,13 @@ jsonapi_reply_library_tracks_put(struct httpd_request *hreq)
       goto error;
     }
 
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    {
+      err = HTTP_INTERNAL;
+      goto error;
+    }
+
   i = 0;
   while ((track = json_object_array_get_idx(tracks, i)))
     {
@@ -4229,6 +4334,27 @@ jsonapi_reply_library_add(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+// Uses the full-text index if possible, otherwise LIKE
+static char *
+search_filter(const char *col, const char *param_query, enum media_kind media_kind)
+{
+  char *match;
+  char *filter;
+
+  match = db_fts_filter(&col, 1, param_query);
+  if (!match)
+    match = db_mprintf("%s LIKE '%%%q%%'", col, param_query);
+
+  if (media_kind)
+    filter = db_mprintf("(%s AND f.media_kind = %d)", match, media_kind);
+  else
+    filter = db_mprintf("(%s)", match);
+
+  free(match);
+
+  return filter;
+}
+
 static int
 search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_query, struct smartpl *smartpl_expression, enum media_kind media_kind)
 {
@@ -4254,10 +4380,11 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.title LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.title", param_query, media_kind);
+
+      ret = query_params_cursor_set(&query_params, hreq);
+      if (ret < 0)
+	goto out;
     }
   else
     {
@@ -4279,6 +4406,7 @@ search_tracks(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next", query_params.next_cursor);
 
  out:
   free_query_params(&query_params, 1);
@@ -4315,10 +4443,11 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album_artist LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.album_artist", param_query, media_kind);
+
+      ret = query_params_cursor_set(&query_params, hreq);
+      if (ret < 0)
+	goto out;
     }
   else
     {
@@ -4341,6 +4470,7 @@ search_artists(json_object *reply, struct httpd_request *hreq, const char *param
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next", query_params.next_cursor);
 
  out:
   free_query_params(&query_params, 1);
@@ -4377,10 +4507,11 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.album LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.album", param_query, media_kind);
+
+      ret = query_params_cursor_set(&query_params, hreq);
+      if (ret < 0)
+	goto out;
     }
   else
     {
@@ -4403,6 +4534,7 @@ search_albums(json_object *reply, struct httpd_request *hreq, const char *param_
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next", query_params.next_cursor);
 
  out:
   free_query_params(&query_params, 1);
@@ -4439,10 +4571,7 @@ search_composers(json_object *reply, struct httpd_request *hreq, const char *par
 
   if (param_query)
     {
-      if (media_kind)
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%' AND f.media_kind = %d)", param_query, media_kind);
-      else
-	query_params.filter = db_mprintf("(f.composer LIKE '%%%q%%')", param_query);
+      query_params.filter = search_filter("f.composer", param_query, media_kind);
     }
   else
     {
@@ -4490,13 +4619,18 @@ search_playlists(json_object *reply, struct httpd_request *hreq, const char *par
   if (ret < 0)
     goto out;
 
+  query_params.type = Q_PL;
+  query_params.sort = S_PLAYLIST;
+
+  ret = query_params_cursor_set(&query_params, hreq);
+  if (ret < 0)
+    goto out;
+
   type = json_object_new_object();
   json_object_object_add(reply, "playlists", type);
   items = json_object_new_array();
   json_object_object_add(type, "items", items);
 
-  query_params.type = Q_PL;
-  query_params.sort = S_PLAYLIST;
   query_params.filter = db_mprintf("((f.type = %d OR f.type = %d OR f.type = %d) AND f.title LIKE '%%%q%%')", PL_PLAIN, PL_SMART, PL_RSS, param_query);
 
   ret = fetch_playlists(&query_params, items, &total);
@@ -4506,6 +4640,7 @@ search_playlists(json_object *reply, struct httpd_request *hreq, const char *par
   json_object_object_add(type, "total", json_object_new_int(total));
   json_object_object_add(type, "offset", json_object_new_int(query_params.offset));
   json_object_object_add(type, "limit", json_object_new_int(query_params.limit));
+  safe_json_add_string(type, "next", query_params.next_cursor);
 
  out:
   free_query_params(&query_params, 1);
@@ -4539,6 +4674,14 @@ jsonapi_reply_search(struct httpd_request *hreq)
       return HTTP_BADREQUEST;
     }
 
+  // A cursor belongs to the sort order of one type
+  if (evhttp_find_header(hreq->query, "cursor") && strchr(param_type, ','))
+    {
+      DPRINTF(E_LOG, L_WEB, "Query parameter 'cursor' requires a single search type\n");
+
+      return HTTP_BADREQUEST;
+    }
+
   media_kind = 0;
   param_media_kind = evhttp_find_header(hreq->query, "media_kind");
   if (param_media_kind)
@@ -4609,6 +4752,8 @@ jsonapi_reply_search(struct httpd_request *hreq)
   jparse_free(reply);
   free_smartpl(&smartpl_expression, 1);
 
+  if (ret == -2)
+    return HTTP_BADREQUEST;
   if (ret < 0)
     return HTTP_INTERNAL;
 
@@ -4632,6 +4777,147 @@ jsonapi_reply_library_backup(struct httpd_request *hreq)
   return HTTP_OK;
 }
 
+static int
+jsonapi_reply_library_backup_status(struct httpd_request *hreq)
+{
+  struct db_backup_status status;
+  json_object *jreply;
+
+  db_backup_status_get(&status);
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  json_object_object_add(jreply, "running", json_object_new_boolean(status.running));
+  json_object_object_add(jreply, "pages_total", json_object_new_int(status.pages_total));
+  json_object_object_add(jreply, "pages_remaining", json_object_new_int(status.pages_remaining));
+  safe_json_add_time(jreply, "started_at", status.start);
+  safe_json_add_time(jreply, "finished_at", status.end);
+  if (status.end)
+    json_object_object_add(jreply, "success", json_object_new_boolean(status.result == 0));
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+/*
+ * Endpoint to get the run time statistics of the database queries, slowest in
+ * total first, with the query plan of the slowest query of each shape
+ */
+static int
+jsonapi_reply_library_query_stats(struct httpd_request *hreq)
+{
+  struct db_query_stats *stats;
+  const char *param;
+  json_object *jreply;
+  json_object *items;
+  json_object *item;
+  json_object *histogram;
+  uint64_t dropped;
+  char *plan;
+  bool full_scan;
+  int nstats;
+  int limit;
+  int i;
+  int j;
+  int ret;
+
+  limit = 20;
+  param = evhttp_find_header(hreq->query, "limit");
+  if (param && safe_atoi32(param, &limit) < 0)
+    {
+      DPRINTF(E_LOG, L_WEB, "Invalid value for query parameter 'limit' (%s)\n", param);
+      return HTTP_BADREQUEST;
+    }
+
+  ret = db_query_stats_get(&stats, &nstats, &dropped);
+  if (ret < 0)
+    return HTTP_INTERNAL;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+  CHECK_NULL(L_WEB, items = json_object_new_array());
+
+  json_object_object_add(jreply, "total", json_object_new_int(nstats));
+  json_object_object_add(jreply, "dropped", json_object_new_int64(dropped));
+  json_object_object_add(jreply, "items", items);
+
+  for (i = 0; i < nstats && (limit < 0 || i < limit); i++)
+    {
+      CHECK_NULL(L_WEB, item = json_object_new_object());
+      CHECK_NULL(L_WEB, histogram = json_object_new_array());
+
+      safe_json_add_string(item, "query", stats[i].query);
+      json_object_object_add(item, "count", json_object_new_int64(stats[i].count));
+      json_object_object_add(item, "total_us", json_object_new_int64(stats[i].total_us));
+      json_object_object_add(item, "avg_us", json_object_new_int64(stats[i].count ? stats[i].total_us / stats[i].count : 0));
+      json_object_object_add(item, "max_us", json_object_new_int64(stats[i].max_us));
+      for (j = 0; j < DB_QUERY_STATS_BUCKETS; j++)
+	json_object_array_add(histogram, json_object_new_int64(stats[i].histogram[j]));
+      json_object_object_add(item, "histogram", histogram);
+      json_object_object_add(item, "full_scan_steps", json_object_new_int64(stats[i].fullscan_steps));
+      json_object_object_add(item, "vm_steps", json_object_new_int64(stats[i].vm_steps));
+      json_object_object_add(item, "sorts", json_object_new_int64(stats[i].sorts));
+      json_object_object_add(item, "autoindexes", json_object_new_int64(stats[i].autoindexes));
+
+      if (stats[i].example && db_query_plan_get(&plan, &full_scan, stats[i].example) == 0)
+	{
+	  json_object_object_add(item, "full_scan", json_object_new_boolean(full_scan));
+	  safe_json_add_string(item, "plan", plan);
+	  free(plan);
+	}
+      safe_json_add_string(item, "slowest", stats[i].example);
+
+      json_object_array_add(items, item);
+    }
+
+  db_query_stats_free(stats, nstats);
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
+
+static int
+jsonapi_reply_library_query_stats_reset(struct httpd_request *hreq)
+{
+  db_query_stats_reset();
+
+  return HTTP_NOCONTENT;
+}
+/*
+ * Endpoint to get the hit/miss counters of the reply caches
+ */
+static int
+jsonapi_reply_library_cache_stats(struct httpd_request *hreq)
+{
+  struct cache_daap_stats daap_stats;
+  json_object *jreply;
+  json_object *jdaap;
+  int ret;
+
+  CHECK_NULL(L_WEB, jreply = json_object_new_object());
+
+  // Key is left out if the cache is disabled
+  ret = cache_daap_stats_get(&daap_stats);
+  if (ret == 0)
+    {
+      CHECK_NULL(L_WEB, jdaap = json_object_new_object());
+      json_object_object_add(jdaap, "memory_hits", json_object_new_int64(daap_stats.mem_hits));
+      json_object_object_add(jdaap, "db_hits", json_object_new_int64(daap_stats.db_hits));
+      json_object_object_add(jdaap, "misses", json_object_new_int64(daap_stats.misses));
+      json_object_object_add(jdaap, "memory_entries", json_object_new_int(daap_stats.mem_entries));
+      json_object_object_add(jdaap, "memory_size", json_object_new_int64(daap_stats.mem_size));
+      json_object_object_add(jdaap, "memory_max_size", json_object_new_int64(daap_stats.mem_max_size));
+      json_object_object_add(jreply, "daap", jdaap);
+    }
+
+  CHECK_ERRNO(L_WEB, evbuffer_add_printf(hreq->reply, "%s", json_object_to_json_string(jreply)));
+  jparse_free(jreply);
+
+  return HTTP_OK;
+}
 
 static struct httpd_uri_map adm_handlers[] =
   {
@@ -4674,7 +4960,7 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_PUT,    "^/api/player/volume$",                         jsonapi_reply_player_volume },
     { EVHTTP_REQ_PUT,    "^/api/player/seek$",                           jsonapi_reply_player_seek },
 
-    { EVHTTP_REQ_GET,    "^/api/queue$",                                 jsonapi_reply_queue },
+    { EVHTTP_REQ_GET,    "^/api/queue$",                                 jsonapi_reply_queue, HTTPD_HANDLER_DB },
     { EVHTTP_REQ_PUT,    "^/api/queue/clear$",                           jsonapi_reply_queue_clear },
     { EVHTTP_REQ_POST,   "^/api/queue/items/add$",                       jsonapi_reply_queue_tracks_add },
     { EVHTTP_REQ_PUT,    "^/api/queue/items/[[:digit:]]+$",              jsonapi_reply_queue_tracks_update },
@@ -4682,33 +4968,37 @@ static struct httpd_uri_map adm_handlers[] =
     { EVHTTP_REQ_DELETE, "^/api/queue/items/[[:digit:]]+$",              jsonapi_reply_queue_tracks_delete },
     { EVHTTP_REQ_POST,   "^/api/queue/save$",                            jsonapi_reply_queue_save},
 
-    { EVHTTP_REQ_GET,    "^/api/library/playlists$",                     jsonapi_reply_library_playlists },
-    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_get },
+    { EVHTTP_REQ_GET,    "^/api/library/playlists$",                     jsonapi_reply_library_playlists, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_get, HTTPD_HANDLER_DB },
     { EVHTTP_REQ_PUT,    "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_put },
-    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlist_tracks },
+    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlist_tracks, HTTPD_HANDLER_DB_BULK },
     { EVHTTP_REQ_PUT,    "^/api/library/playlists/[[:digit:]]+/tracks",  jsonapi_reply_library_playlist_tracks_put_byid},
 //    { EVHTTP_REQ_POST,   "^/api/library/playlists/[[:digit:]]+/tracks$", jsonapi_reply_library_playlists_tracks },
     { EVHTTP_REQ_DELETE, "^/api/library/playlists/[[:digit:]]+$",        jsonapi_reply_library_playlist_delete },
-    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+/playlists", jsonapi_reply_library_playlist_playlists },
-    { EVHTTP_REQ_GET,    "^/api/library/artists$",                       jsonapi_reply_library_artists },
-    { EVHTTP_REQ_GET,    "^/api/library/artists/[[:digit:]]+$",          jsonapi_reply_library_artist },
-    { EVHTTP_REQ_GET,    "^/api/library/artists/[[:digit:]]+/albums$",   jsonapi_reply_library_artist_albums },
-    { EVHTTP_REQ_GET,    "^/api/library/albums$",                        jsonapi_reply_library_albums },
-    { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+$",           jsonapi_reply_library_album },
-    { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks },
+    { EVHTTP_REQ_GET,    "^/api/library/playlists/[[:digit:]]+/playlists", jsonapi_reply_library_playlist_playlists, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/artists$",                       jsonapi_reply_library_artists, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/artists/[[:digit:]]+$",          jsonapi_reply_library_artist, HTTPD_HANDLER_DB },
+    { EVHTTP_REQ_GET,    "^/api/library/artists/[[:digit:]]+/albums$",   jsonapi_reply_library_artist_albums, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/albums$",                        jsonapi_reply_library_albums, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+$",           jsonapi_reply_library_album, HTTPD_HANDLER_DB },
+    { EVHTTP_REQ_GET,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks, HTTPD_HANDLER_DB_BULK },
     { EVHTTP_REQ_PUT,    "^/api/library/albums/[[:digit:]]+/tracks$",    jsonapi_reply_library_album_tracks_put_byid },
     { EVHTTP_REQ_PUT,    "^/api/library/tracks$",                        jsonapi_reply_library_tracks_put },
-    { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_get_byid },
+    { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_get_byid, HTTPD_HANDLER_DB },
     { EVHTTP_REQ_PUT,    "^/api/library/tracks/[[:digit:]]+$",           jsonapi_reply_library_tracks_put_byid },
-    { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+/playlists$", jsonapi_reply_library_track_playlists },
-    { EVHTTP_REQ_GET,    "^/api/library/(genres|composers)$",            jsonapi_reply_library_browse },
-    { EVHTTP_REQ_GET,    "^/api/library/(genres|composers)/.*$",         jsonapi_reply_library_browseitem },
-    { EVHTTP_REQ_GET,    "^/api/library/count$",                         jsonapi_reply_library_count },
-    { EVHTTP_REQ_GET,    "^/api/library/files$",                         jsonapi_reply_library_files },
+    { EVHTTP_REQ_GET,    "^/api/library/tracks/[[:digit:]]+/playlists$", jsonapi_reply_library_track_playlists, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/(genres|composers)$",            jsonapi_reply_library_browse, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/(genres|composers)/.*$",         jsonapi_reply_library_browseitem, HTTPD_HANDLER_DB_BULK },
+    { EVHTTP_REQ_GET,    "^/api/library/count$",                         jsonapi_reply_library_count, HTTPD_HANDLER_DB },
+    { EVHTTP_REQ_GET,    "^/api/library/files$",                         jsonapi_reply_library_files, HTTPD_HANDLER_DB_BULK },
     { EVHTTP_REQ_POST,   "^/api/library/add$",                           jsonapi_reply_library_add },
     { EVHTTP_REQ_PUT,    "^/api/library/backup$",                        jsonapi_reply_library_backup },
+    { EVHTTP_REQ_GET,    "^/api/library/backup$",                        jsonapi_reply_library_backup_status },
+    { EVHTTP_REQ_GET,    "^/api/library/query-stats$",                   jsonapi_reply_library_query_stats },
+    { EVHTTP_REQ_DELETE, "^/api/library/query-stats$",                   jsonapi_reply_library_query_stats_reset },
+    { EVHTTP_REQ_GET,    "^/api/library/cache-stats$",                   jsonapi_reply_library_cache_stats },
 
-    { EVHTTP_REQ_GET,    "^/api/search$",                                jsonapi_reply_search },
+    { EVHTTP_REQ_GET,    "^/api/search$",                                jsonapi_reply_search, HTTPD_HANDLER_DB_BULK },
 
     { 0, NULL, NULL }
   };
@@ -4716,33 +5006,14 @@ static struct httpd_uri_map adm_handlers[] =
 
 /* ------------------------------- JSON API --------------------------------- */
 
-void
-jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+static void
+jsonapi_reply_send(struct httpd_request *hreq, int status_code)
 {
-  struct httpd_request *hreq;
+  struct evhttp_request *req = hreq->req;
   struct evkeyvalq *headers;
-  int status_code;
-
-  DPRINTF(E_DBG, L_WEB, "JSON api request: '%s'\n", uri_parsed->uri);
-
-  if (!httpd_admin_check_auth(req))
-    return;
-
-  hreq = httpd_request_parse(req, uri_parsed, NULL, adm_handlers);
-  if (!hreq)
-    {
-      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in JSON api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
-
-      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
-      return;
-    }
-
-  CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
-
-  status_code = hreq->handler(hreq);
 
   if (status_code >= 400)
-    DPRINTF(E_LOG, L_WEB, "JSON api request failed with error code %d (%s)\n", status_code, uri_parsed->uri);
+    DPRINTF(E_LOG, L_WEB, "JSON api request failed with error code %d (%s)\n", status_code, hreq->uri_parsed->uri);
 
   switch (status_code)
     {
@@ -4775,11 +5046,261 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 	httpd_send_error(req, HTTP_INTERNAL, "Internal Server Error");
 	break;
     }
+}
+
+/* State of a request handed over to a db executor thread. The handler doesn't
+ * get the client's evhttp request, since that belongs to the httpd thread and
+ * is freed if the client goes away. Instead it gets a private request with
+ * copies of the conditional request headers, and the response headers it sets
+ * are copied to the client's request in jsonapi_request_dbexec_done().
+ */
+struct jsonapi_dbexec_job
+{
+  // The client's request, NULL if the connection was closed
+  struct evhttp_request *req;
+  // Private request given to the handler
+  struct evhttp_request *priv_req;
+  // Copy of the request uri, which belongs to req
+  char *uri;
+  int status_code;
+};
+
+static void
+jsonapi_request_dbexec_detach(struct jsonapi_dbexec_job *job)
+{
+  struct evhttp_connection *evcon;
+
+  evcon = evhttp_request_get_connection(job->req);
+  if (evcon)
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+
+  job->req = NULL;
+}
+
+/* Thread: httpd */
+static void
+jsonapi_request_dbexec_fail_cb(struct evhttp_connection *evcon, void *arg)
+{
+  struct jsonapi_dbexec_job *job = arg;
+  struct evhttp_request *req = job->req;
+
+  DPRINTF(E_DBG, L_WEB, "JSON api request: client closed connection\n");
+
+  // Like the DAAP/DACP update requests, the request is ours to free. The job
+  // is left to finish, and jsonapi_request_dbexec_done() drops the reply.
+  jsonapi_request_dbexec_detach(job);
+  evhttp_request_free(req);
+}
+
+/* Thread: httpd_db */
+static void
+jsonapi_request_dbexec_run(void *arg)
+{
+  struct httpd_request *hreq = arg;
+  struct jsonapi_dbexec_job *job = hreq->extra_data;
+
+  job->status_code = hreq->handler(hreq);
+}
+
+/* Thread: httpd */
+static void
+jsonapi_request_dbexec_done(void *arg)
+{
+  struct httpd_request *hreq = arg;
+  struct jsonapi_dbexec_job *job = hreq->extra_data;
+  struct evkeyvalq *priv_headers;
+  struct evkeyvalq *headers;
+  struct evkeyval *header;
+
+  if (job->req)
+    {
+      priv_headers = evhttp_request_get_output_headers(job->priv_req);
+      headers = evhttp_request_get_output_headers(job->req);
+      TAILQ_FOREACH(header, priv_headers, next)
+	evhttp_add_header(headers, header->key, header->value);
+
+      hreq->req = job->req;
+      jsonapi_request_dbexec_detach(job);
+      jsonapi_reply_send(hreq, job->status_code);
+    }
+  else
+    DPRINTF(E_DBG, L_WEB, "Dropping reply to JSON api request, client is gone: '%s'\n", job->uri);
+
+  evhttp_request_free(job->priv_req);
+  httpd_uri_free(hreq->uri_parsed);
+  evbuffer_free(hreq->reply);
+  free(job->uri);
+  free(job);
+  free(hreq);
+}
+
+// Hands the request over to a db executor thread, the reply is sent from
+// jsonapi_request_dbexec_done(). Returns -1 if the request wasn't taken.
+static int
+jsonapi_request_dbexec(struct httpd_request *hreq)
+{
+  const char *conditional_headers[] = { "If-Modified-Since", "If-None-Match" };
+  struct jsonapi_dbexec_job *job;
+  struct httpd_uri_parsed *uri_parsed;
+  struct httpd_uri_parsed *uri_parsed_orig = hreq->uri_parsed;
+  struct evhttp_request *req = hreq->req;
+  struct evhttp_connection *evcon;
+  struct bufferevent *bufev;
+  struct evkeyvalq *input_headers;
+  struct evkeyvalq *priv_headers;
+  enum httpd_dbexec_prio prio;
+  const char *value;
+  int ret;
+  int i;
+
+  CHECK_NULL(L_WEB, job = calloc(1, sizeof(struct jsonapi_dbexec_job)));
+  CHECK_NULL(L_WEB, job->uri = strdup(uri_parsed_orig->uri));
+  CHECK_NULL(L_WEB, job->priv_req = evhttp_request_new(NULL, NULL));
+
+  // The parsed uri we got is freed by httpd when we return, so make our own
+  uri_parsed = httpd_uri_parse(job->uri);
+  if (!uri_parsed)
+    goto error;
+
+  input_headers = evhttp_request_get_input_headers(req);
+  priv_headers = evhttp_request_get_input_headers(job->priv_req);
+  for (i = 0; i < ARRAY_SIZE(conditional_headers); i++)
+    {
+      value = evhttp_find_header(input_headers, conditional_headers[i]);
+      if (value)
+	evhttp_add_header(priv_headers, conditional_headers[i], value);
+    }
+
+  job->req = req;
+
+  hreq->req = job->priv_req;
+  hreq->uri_parsed = uri_parsed;
+  hreq->query = &uri_parsed->ev_query;
+  hreq->extra_data = job;
+  // These point into the request and the connection, which might be gone when
+  // the handler runs
+  hreq->user_agent = NULL;
+  hreq->peer_address = NULL;
+
+  prio = (hreq->handler_flags & HTTPD_HANDLER_DB_BULK) ? HTTPD_DBEXEC_PRIO_LOW : HTTPD_DBEXEC_PRIO_HIGH;
+
+  ret = httpd_dbexec(jsonapi_request_dbexec_run, jsonapi_request_dbexec_done, hreq, prio);
+  if (ret < 0)
+    {
+      hreq->req = req;
+      hreq->uri_parsed = uri_parsed_orig;
+      hreq->query = &uri_parsed_orig->ev_query;
+      hreq->extra_data = NULL;
+      httpd_uri_free(uri_parsed);
+      goto error;
+    }
+
+  // If the client hangs up before the job is done, we need to know
+  evcon = evhttp_request_get_connection(req);
+  if (evcon)
+    {
+      evhttp_connection_set_closecb(evcon, jsonapi_request_dbexec_fail_cb, job);
+
+      // Same workaround for libevent not detecting client hang ups as in
+      // httpd_daap.c
+      bufev = evhttp_connection_get_bufferevent(evcon);
+      if (bufev)
+	bufferevent_enable(bufev, EV_READ);
+    }
+
+  return 0;
+
+ error:
+  evhttp_request_free(job->priv_req);
+  free(job->uri);
+  free(job);
+  return -1;
+}
+
+void
+jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
+{
+  struct httpd_request *hreq;
+  int status_code;
+  int ret;
+
+  DPRINTF(E_DBG, L_WEB, "JSON api request: '%s'\n", uri_parsed->uri);
+
+  if (!httpd_admin_check_auth(req))
+    return;
+
+  hreq = httpd_request_parse(req, uri_parsed, NULL, adm_handlers);
+  if (!hreq)
+    {
+      DPRINTF(E_LOG, L_WEB, "Unrecognized path '%s' in JSON api request: '%s'\n", uri_parsed->path, uri_parsed->uri);
+
+      httpd_send_error(req, HTTP_BADREQUEST, "Bad Request");
+      return;
+    }
+
+  CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
+
+  if (hreq->handler_flags & (HTTPD_HANDLER_DB | HTTPD_HANDLER_DB_BULK))
+    {
+      ret = jsonapi_request_dbexec(hreq);
+      if (ret == 0)
+	return;
+
+      status_code = HTTP_SERVUNAVAIL;
+    }
+  else
+    status_code = hreq->handler(hreq);
+
+  jsonapi_reply_send(hreq, status_code);
 
   evbuffer_free(hreq->reply);
   free(hreq);
 }
 
+// Thread: any, but see the handler flags
+struct evbuffer *
+jsonapi_reply_build(const char *uri, int *status_code)
+{
+  struct httpd_request *hreq;
+  struct httpd_uri_parsed *uri_parsed;
+  struct evhttp_request *req;
+  struct evbuffer *reply;
+
+  DPRINTF(E_DBG, L_WEB, "Building reply for JSON api request: '%s'\n", uri);
+
+  reply = NULL;
+  *status_code = HTTP_BADREQUEST;
+
+  uri_parsed = httpd_uri_parse(uri);
+  if (!uri_parsed)
+    return NULL;
+
+  // Only looks up GET handlers, since there is no request with a method
+  hreq = httpd_request_parse(NULL, uri_parsed, NULL, adm_handlers);
+  if (!hreq)
+    {
+      DPRINTF(E_LOG, L_WEB, "Cannot build reply, unrecognized path '%s' in request: '%s'\n", uri_parsed->path, uri_parsed->uri);
+      goto out_free_uri;
+    }
+
+  // Handlers may look at the request headers, so give them an empty request
+  CHECK_NULL(L_WEB, req = evhttp_request_new(NULL, NULL));
+  hreq->req = req;
+
+  CHECK_NULL(L_WEB, hreq->reply = evbuffer_new());
+
+  *status_code = hreq->handler(hreq);
+
+  reply = hreq->reply;
+
+  evhttp_request_free(req);
+  free(hreq);
+ out_free_uri:
+  httpd_uri_free(uri_parsed);
+
+  return reply;
+}
+
 int
 jsonapi_is_request(const char *path)
 {
@@ -16,4 +16,11 @@ jsonapi_request(struct evhttp_request *req, struct httpd_uri_parsed *uri_parsed)
 int
 jsonapi_is_request(const char *path);
 
+/*
+ * Runs the handler of a JSON api GET request without a client connection, e.g.
+ * for benchmarking. Returns the reply body, must be freed by the caller.
+ */
+struct evbuffer *
+jsonapi_reply_build(const char *uri, int *status_code);
+
 #endif /* !__HTTPD_JSONAPI_H__ */
@@ -139,6 +139,42 @@ library_media_save(struct media_file_info *mfi)
     return db_file_update(mfi);
 }
 
+// Like library_media_save(), but saves all the files in one go. Files that
+// are missing required values are skipped. Returns the number of files saved.
+int
+library_media_save_batch(struct media_file_info **mfis, int nmfis)
+{
+  struct media_file_info *valid[DB_FILE_BATCH_SIZE];
+  int i;
+  int n;
+
+  if (nmfis > DB_FILE_BATCH_SIZE)
+    {
+      DPRINTF(E_LOG, L_LIB, "Bug! Batch of %d media files exceeds max batch size\n", nmfis);
+      return -1;
+    }
+
+  for (i = 0, n = 0; i < nmfis; i++)
+    {
+      if (!mfis[i]->path || !mfis[i]->fname || !mfis[i]->scan_kind)
+	{
+	  DPRINTF(E_LOG, L_LIB, "Ignoring media file with missing values (path='%s', fname='%s', scan_kind='%d', data_kind='%d')\n",
+		  mfis[i]->path, mfis[i]->fname, mfis[i]->scan_kind, mfis[i]->data_kind);
+	  continue;
+	}
+
+      if (!mfis[i]->directory_id || !mfis[i]->virtual_path)
+	{
+	  DPRINTF(E_WARN, L_LIB, "Media file with missing values (path='%s', directory='%d', virtual_path='%s')\n",
+		  mfis[i]->path, mfis[i]->directory_id, mfis[i]->virtual_path);
+	}
+
+      valid[n++] = mfis[i];
+    }
+
+  return db_file_save_batch(valid, n);
+}
+
 int
 library_playlist_save(struct playlist_info *pli)
 {
@@ -292,11 +328,13 @@ handle_deferred_update_notifications(void)
 static void
 purge_cruft(time_t start, enum scan_kind scan_kind)
 {
+  // The purge keeps the unchanged files seen by the scan, see db_scan_seen_begin()
   DPRINTF(E_DBG, L_LIB, "Purging old library content\n");
   if (scan_kind > 0)
     db_purge_cruft_bysource(start, scan_kind);
   else
     db_purge_cruft(start);
+  db_scan_seen_end();
   db_groups_cleanup();
   db_queue_cleanup();
 
@@ -318,6 +356,7 @@ rescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  db_scan_seen_begin();
 
   scan_kind = arg;
 
@@ -370,6 +409,7 @@ metarescan(void *arg, int *ret)
   DPRINTF(E_LOG, L_LIB, "Library meta rescan triggered\n");
   listener_notify(LISTENER_UPDATE);
   starttime = time(NULL);
+  db_scan_seen_begin();
 
   scan_kind = arg;
 
@@ -729,6 +769,10 @@ initscan()
       db_queue_clear(0);
     }
 
+  // Unchanged files are pinged together by purge_cruft() below
+  if (! (cfg_getbool(cfg_getsec(cfg, "library"), "filescan_disable")))
+    db_scan_seen_begin();
+
   for (i = 0; sources[i]; i++)
     {
       if (!sources[i]->disabled && sources[i]->initscan)
@@ -778,6 +822,10 @@ library_update_trigger(short update_events)
   short *events;
   int ret;
 
+  // Nothing to notify if the library isn't running, e.g. in bench-db
+  if (!cmdbase)
+    return;
+
   pthread_t current_thread = pthread_self();
   if (pthread_equal(current_thread, tid_library))
     {
@@ -125,6 +125,17 @@ struct library_source
 int
 library_media_save(struct media_file_info *mfi);
 
+/*
+ * Adds or updates a batch of mfi's, see library_media_save(). Only updates
+ * listeners once for the whole batch.
+ *
+ * @param mfis  Array of media to save
+ * @param nmfis Number of entries in mfis, max DB_FILE_BATCH_SIZE
+ * @return      Number of files saved, -1 on failure.
+ */
+int
+library_media_save_batch(struct media_file_info **mfis, int nmfis);
+
 /*
  * Adds a playlist if pli->id == 0, otherwise updates.
  *
@@ -106,6 +106,13 @@ struct stacked_dir {
   struct stacked_dir *next;
 };
 
+struct batched_file {
+  char *path;
+  struct stat sb;
+  int type;
+  int directory_id;
+};
+
 static int inofd;
 static struct event *inoev;
 static struct deferred_pl *playlists;
@@ -132,6 +139,12 @@ static struct event *deferred_inoev;
 /* Count of files scanned during a bulk scan */
 static int counter;
 
+/* During a bulk scan regular files are collected here, so that they can be
+ * looked up and saved with a few queries per batch instead of per file
+ */
+static struct batched_file file_batch[DB_FILE_BATCH_SIZE];
+static int file_batch_count;
+
 /* When copying into the lib (eg. if a file is moved to the lib by copying into
  * a Samba network share) inotify might give us IN_CREATE -> n x IN_ATTRIB ->
  * IN_CLOSE_WRITE, but we don't want to do any scanning before the
@@ -550,12 +563,68 @@ process_deferred_playlists(void)
     }
 }
 
+/* Thread: scan */
+static int
+file_metadata_get(struct media_file_info *mfi, const char *file, struct stat *sb, int type, int dir_id)
+{
+  char virtual_path[PATH_MAX];
+  int ret;
+
+  memset(mfi, 0, sizeof(struct media_file_info));
+
+  mfi->fname = strdup(filename_from_path(file));
+  mfi->path = strdup(file);
+
+  mfi->time_modified = sb->st_mtime;
+  mfi->file_size = sb->st_size;
+
+  snprintf(virtual_path, PATH_MAX, "/file:%s", file);
+  mfi->virtual_path = strdup(virtual_path);
+
+  mfi->directory_id = dir_id;
+  mfi->scan_kind = SCAN_KIND_FILES;
+
+  if (S_ISFIFO(sb->st_mode))
+    {
+      mfi->data_kind = DATA_KIND_PIPE;
+      mfi->type = strdup("wav");
+      mfi->codectype = strdup("wav");
+      mfi->description = strdup("PCM16 pipe");
+      mfi->media_kind = MEDIA_KIND_MUSIC;
+    }
+  else
+    {
+      mfi->data_kind = DATA_KIND_FILE;
+      mfi->file_size = sb->st_size;
+
+      if (type & F_SCAN_TYPE_AUDIOBOOK)
+	mfi->media_kind = MEDIA_KIND_AUDIOBOOK;
+      else if (type & F_SCAN_TYPE_PODCAST)
+	mfi->media_kind = MEDIA_KIND_PODCAST;
+
+      if (type & F_SCAN_TYPE_COMPILATION)
+	{
+	  mfi->compilation = 1;
+	  mfi->album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
+	}
+
+      ret = scan_metadata_ffmpeg(mfi, file);
+      if (ret < 0)
+	{
+	  free_mfi(mfi, 1);
+	  return -1;
+	}
+    }
+
+  return 0;
+}
+
+/* Thread: scan */
 static void
 process_regular_file(const char *file, struct stat *sb, int type, int flags, int dir_id)
 {
   bool is_bulkscan = (flags & F_SCAN_BULK);
   struct media_file_info mfi;
-  char virtual_path[PATH_MAX];
   int ret;
 
   // Will return 0 if file is not in library or if file mtime is newer than library timestamp
@@ -568,61 +637,116 @@ process_regular_file(const char *file, struct stat *sb, int type, int flags, int
     }
 
   // File is new or modified - (re)scan metadata and update file in library
-  memset(&mfi, 0, sizeof(struct media_file_info));
+  ret = file_metadata_get(&mfi, file, sb, type, dir_id);
+  if (ret < 0)
+    return;
 
   // Sets id=0 if file is not in the library already
   mfi.id = db_file_id_bypath(file);
 
-  mfi.fname = strdup(filename_from_path(file));
-  mfi.path = strdup(file);
+  library_media_save(&mfi);
 
-  mfi.time_modified = sb->st_mtime;
-  mfi.file_size = sb->st_size;
+  cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
+  // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
 
-  snprintf(virtual_path, PATH_MAX, "/file:%s", file);
-  mfi.virtual_path = strdup(virtual_path);
+  free_mfi(&mfi, 1);
+}
 
-  mfi.directory_id = dir_id;
-  mfi.scan_kind = SCAN_KIND_FILES;
+/* Thread: scan */
+static void
+file_batch_clear(void)
+{
+  int i;
 
-  if (S_ISFIFO(sb->st_mode))
+  for (i = 0; i < file_batch_count; i++)
+    free(file_batch[i].path);
+
+  file_batch_count = 0;
+}
+
+/* Thread: scan */
+static void
+file_batch_process(int flags)
+{
+  struct db_file_batch_item items[DB_FILE_BATCH_SIZE];
+  struct media_file_info *mfis[DB_FILE_BATCH_SIZE];
+  struct batched_file *bf;
+  int nmfis;
+  int i;
+  int ret;
+
+  if (file_batch_count == 0)
+    return;
+
+  for (i = 0; i < file_batch_count; i++)
     {
-      mfi.data_kind = DATA_KIND_PIPE;
-      mfi.type = strdup("wav");
-      mfi.codectype = strdup("wav");
-      mfi.description = strdup("PCM16 pipe");
-      mfi.media_kind = MEDIA_KIND_MUSIC;
+      items[i].path = file_batch[i].path;
+      items[i].mtime = file_batch[i].sb.st_mtime;
     }
-  else
-    {
-      mfi.data_kind = DATA_KIND_FILE;
-      mfi.file_size = sb->st_size;
 
-      if (type & F_SCAN_TYPE_AUDIOBOOK)
-	mfi.media_kind = MEDIA_KIND_AUDIOBOOK;
-      else if (type & F_SCAN_TYPE_PODCAST)
-	mfi.media_kind = MEDIA_KIND_PODCAST;
+  // Gets the ids and pings files that are unchanged, like process_regular_file()
+  ret = db_file_ping_bypath_batch(items, file_batch_count, !(flags & F_SCAN_METARESCAN));
+  if (ret < 0)
+    {
+      DPRINTF(E_WARN, L_SCAN, "Batch lookup of %d files failed, falling back to processing one by one\n", file_batch_count);
 
-      if (type & F_SCAN_TYPE_COMPILATION)
+      for (i = 0; i < file_batch_count; i++)
 	{
-	  mfi.compilation = 1;
-	  mfi.album_artist = safe_strdup(cfg_getstr(cfg_getsec(cfg, "library"), "compilation_artist"));
+	  bf = &file_batch[i];
+	  process_regular_file(bf->path, &bf->sb, bf->type, flags, bf->directory_id);
 	}
 
-      ret = scan_metadata_ffmpeg(&mfi, file);
+      file_batch_clear();
+      return;
+    }
+
+  for (i = 0, nmfis = 0; i < file_batch_count; i++)
+    {
+      bf = &file_batch[i];
+
+      // Note if mtime is 0 then we always scan the file
+      if (items[i].pinged && (bf->sb.st_mtime != 0))
+	continue;
+
+      CHECK_NULL(L_SCAN, mfis[nmfis] = malloc(sizeof(struct media_file_info)));
+
+      ret = file_metadata_get(mfis[nmfis], bf->path, &bf->sb, bf->type, bf->directory_id);
       if (ret < 0)
 	{
-	  free_mfi(&mfi, 1);
-	  return;
+	  free(mfis[nmfis]);
+	  continue;
 	}
+
+      mfis[nmfis]->id = items[i].id;
+      nmfis++;
     }
 
-  library_media_save(&mfi);
+  if (nmfis > 0)
+    library_media_save_batch(mfis, nmfis);
 
-  cache_artwork_ping(file, sb->st_mtime, !is_bulkscan);
-  // TODO [artworkcache] If entry in artwork cache exists for no artwork available, delete the entry if media file has embedded artwork
+  for (i = 0; i < nmfis; i++)
+    {
+      cache_artwork_ping(mfis[i]->path, mfis[i]->time_modified, 0);
+      free_mfi(mfis[i], 0);
+    }
 
-  free_mfi(&mfi, 1);
+  file_batch_clear();
+}
+
+/* Thread: scan */
+static void
+file_batch_add(const char *file, struct stat *sb, int type, int dir_id)
+{
+  struct batched_file *bf;
+
+  bf = &file_batch[file_batch_count];
+
+  CHECK_NULL(L_SCAN, bf->path = strdup(file));
+  bf->sb = *sb;
+  bf->type = type;
+  bf->directory_id = dir_id;
+
+  file_batch_count++;
 }
 
 /* Thread: scan */
@@ -632,16 +756,21 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
   switch (file_type)
     {
       case FILE_REGULAR:
-	process_regular_file(file, sb, scan_type, flags, dir_id);
+	if (flags & F_SCAN_BULK)
+	  file_batch_add(file, sb, scan_type, dir_id);
+	else
+	  process_regular_file(file, sb, scan_type, flags, dir_id);
 
 	counter++;
 
-	/* When in bulk mode, split transaction in pieces of 200 */
-	if ((flags & F_SCAN_BULK) && (counter % 200 == 0))
+	/* When in bulk mode, process and commit the files in batches */
+	if ((flags & F_SCAN_BULK) && (file_batch_count == DB_FILE_BATCH_SIZE))
 	  {
+	    file_batch_process(flags);
+
 	    DPRINTF(E_LOG, L_SCAN, "Scanned %d files...\n", counter);
 	    db_transaction_end();
-	    db_transaction_begin();
+	    db_transaction_begin_write();
 	  }
 	break;
 
@@ -664,6 +793,11 @@ process_file(char *file, struct stat *sb, enum file_type file_type, int scan_typ
 
 	// TODO [artworkcache] If entry in artwork cache exists for no artwork available for a album with files in the same directory, delete the entry
 
+	// The source memos don't know about image files, so forget them. After a
+	// bulk scan the negative ones are purged anyway.
+	if (!(flags & F_SCAN_BULK))
+	  cache_artwork_source_clear();
+
 	break;
 
       case FILE_CTRL_REMOTE:
@@ -1042,9 +1176,15 @@ bulk_scan(int flags)
 	  continue;
 	}
 
-      db_transaction_begin();
+      db_transaction_begin_write();
 
       process_directories(deref, parent_id, flags);
+
+      if (library_is_exiting())
+	file_batch_clear();
+      else
+	file_batch_process(flags);
+
       db_transaction_end();
 
       free(deref);
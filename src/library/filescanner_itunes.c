@@ -599,7 +599,7 @@ process_tracks(struct itml_to_db_map **id_map, plist_t tracks)
       return 0;
     }
 
-  db_transaction_begin();
+  db_transaction_begin_write();
 
   ntracks = 0;
   nloaded = 0;
@@ -671,7 +671,7 @@ process_tracks(struct itml_to_db_map **id_map, plist_t tracks)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks...\n", ntracks);
 	  db_transaction_end();
-	  db_transaction_begin();
+	  db_transaction_begin_write();
 	}
 
       if (mfi_id <= 0)
@@ -707,7 +707,7 @@ process_pl_items(plist_t items, int pl_id, const char *name, struct itml_to_db_m
   int ntracks;
   int ret;
 
-  db_transaction_begin();
+  db_transaction_begin_write();
 
   ntracks = 0;
 
@@ -742,7 +742,7 @@ process_pl_items(plist_t items, int pl_id, const char *name, struct itml_to_db_m
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Processed %d tracks from playlist '%s'...\n", ntracks, name);
 	  db_transaction_end();
-	  db_transaction_begin();
+	  db_transaction_begin_write();
 	}
     }
 
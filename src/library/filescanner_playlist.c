@@ -441,7 +441,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
       return;
     }
 
-  db_transaction_begin();
+  db_transaction_begin_write();
 
   memset(&mfi, 0, sizeof(struct media_file_info));
   ntracks = 0;
@@ -491,7 +491,7 @@ scan_playlist(const char *file, time_t mtime, int dir_id)
 	{
 	  DPRINTF(E_LOG, L_SCAN, "Processed %d items...\n", ntracks);
 	  db_transaction_end();
-	  db_transaction_begin();
+	  db_transaction_begin_write();
 	}
 
       if (ret == 0)
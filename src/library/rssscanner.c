@@ -452,7 +452,13 @@ rss_save(struct playlist_info *pli, int *count, enum rss_scan_type scan_type)
 
   // Walk through the xml, saving each item
   *count = 0;
-  db_transaction_begin();
+  ret = db_transaction_begin_write();
+  if (ret < 0)
+    {
+      mxmlDelete(xml);
+      return -1;
+    }
+
   db_pl_clear_items(pli->id);
   while ((ret = rss_xml_parse_item(&ri, xml, &ptr)) == 0 && (*count < pli->query_limit))
     {
@@ -1054,8 +1054,7 @@ request_episode(const char *path, struct spotify_credentials *credentials)
 static int
 transaction_start(void *arg)
 {
-  db_transaction_begin();
-  return 0;
+  return db_transaction_begin_write();
 }
 
 static int
@@ -1527,7 +1526,7 @@ saved_album_add(json_object *item, int index, int total, enum spotify_request_ty
   album.mtime = jparse_time_from_obj(item, "added_at");
 
   // Now map the album tracks and insert/update them in the files database
-  db_transaction_begin();
+  db_transaction_begin_write();
 
   // Get or create the directory structure for this album
   dir_id = prepare_directories(album.artist, album.name);
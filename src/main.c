@@ -71,6 +71,7 @@
 #include "player.h"
 #include "worker.h"
 #include "library.h"
+#include "artwork.h"
 #ifdef LASTFM
 # include "lastfm.h"
 #endif
@@ -805,6 +806,16 @@ main(int argc, char **argv)
       goto player_fail;
     }
 
+  /* Spawn artwork threads */
+  ret = artwork_init();
+  if (ret != 0)
+    {
+      DPRINTF(E_FATAL, L_MAIN, "Artwork thread failed to start\n");
+
+      ret = EXIT_FAILURE;
+      goto artwork_fail;
+    }
+
   /* Spawn HTTPd thread */
   ret = httpd_init(webroot);
   if (ret != 0)
@@ -938,6 +949,10 @@ main(int argc, char **argv)
   httpd_deinit();
 
  httpd_fail:
+  DPRINTF(E_LOG, L_MAIN, "Artwork deinit\n");
+  artwork_deinit();
+
+ artwork_fail:
   DPRINTF(E_LOG, L_MAIN, "Player deinit\n");
   player_deinit();
 
@@ -173,24 +173,24 @@ struct mpd_tagtype
 
 static struct mpd_tagtype tagtypes[] =
   {
-    /* tag               | db field             | db sort field                        | db group field  | type             | media_file offset                | group_in_listcommand */
+    /* tag               | db field             | db sort field                            | db group field  | type             | media_file offset                | group_in_listcommand */
 
     // We treat the artist tag as album artist, this allows grouping over the artist-persistent-id index and increases performance
-    // { "Artist",           "f.artist",             "f.artist",             "f.artist",             MPD_TYPE_STRING,   dbmfi_offsetof(artist), },
-    { "Artist",           "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist),      false, },
-    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   dbmfi_offsetof(album_artist_sort), false, },
-    { "Album",            "f.album",              "f.album_sort, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   dbmfi_offsetof(album),             false, },
-    { "Title",            "f.title",              "f.title",                             "f.title",        MPD_TYPE_STRING,   dbmfi_offsetof(title),             true, },
-    { "Track",            "f.track",              "f.track",                             "f.track",        MPD_TYPE_INT,      dbmfi_offsetof(track),             true, },
-    { "Genre",            "f.genre",              "f.genre",                             "f.genre",        MPD_TYPE_STRING,   dbmfi_offsetof(genre),             true, },
-    { "Disc",             "f.disc",               "f.disc",                              "f.disc",         MPD_TYPE_INT,      dbmfi_offsetof(disc),              true, },
-    { "Date",             "f.year",               "f.year",                              "f.year",         MPD_TYPE_INT,      dbmfi_offsetof(year),              true, },
-    { "file",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "base",             NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "any",              NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
-    { "modified-since",   NULL,                   NULL,                                  NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    // { "Artist",           "f.artist",             "f.artist",             "f.artist",             MPD_TYPE_STRING,   mfi_offsetof(artist),   },
+    { "Artist",           "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist),        false, },
+    { "ArtistSort",       "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist_sort),   false, },
+    { "AlbumArtist",      "f.album_artist",       "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist),        false, },
+    { "AlbumArtistSort",  "f.album_artist_sort",  "f.album_artist_sort_key, f.album_artist", "f.songartistid", MPD_TYPE_STRING,   mfi_offsetof(album_artist_sort),   false, },
+    { "Album",            "f.album",              "f.album_sort_key, f.album",               "f.songalbumid",  MPD_TYPE_STRING,   mfi_offsetof(album),               false, },
+    { "Title",            "f.title",              "f.title",                                 "f.title",        MPD_TYPE_STRING,   mfi_offsetof(title),               true, },
+    { "Track",            "f.track",              "f.track",                                 "f.track",        MPD_TYPE_INT,      mfi_offsetof(track),               true, },
+    { "Genre",            "f.genre",              "f.genre",                                 "f.genre",        MPD_TYPE_STRING,   mfi_offsetof(genre),               true, },
+    { "Disc",             "f.disc",               "f.disc",                                  "f.disc",         MPD_TYPE_INT,      mfi_offsetof(disc),                true, },
+    { "Date",             "f.year",               "f.year",                                  "f.year",         MPD_TYPE_INT,      mfi_offsetof(year),                true, },
+    { "file",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "base",             NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "any",              NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
+    { "modified-since",   NULL,                   NULL,                                      NULL,             MPD_TYPE_SPECIAL,  -1,                                true, },
 
   };
 
@@ -598,26 +598,12 @@ mpd_add_db_queue_item(struct evbuffer *evbuf, struct db_queue_item *queue_item)
  * @return the number of bytes added if successful, or -1 if an error occurred.
  */
 static int
-mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *dbmfi)
+mpd_add_db_media_file_info(struct evbuffer *evbuf, struct media_file_info *mfi)
 {
   char modified[32];
-  uint32_t time_modified;
-  uint32_t songlength;
   int ret;
 
-  if (safe_atou32(dbmfi->time_modified, &time_modified) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting time modified to uint32_t: %s\n", dbmfi->time_modified);
-      return -1;
-    }
-
-  mpd_time(modified, sizeof(modified), time_modified);
-
-  if (safe_atou32(dbmfi->song_length, &songlength) != 0)
-    {
-      DPRINTF(E_LOG, L_MPD, "Error converting song length to uint32_t: %s\n", dbmfi->song_length);
-      return -1;
-    }
+  mpd_time(modified, sizeof(modified), mfi->time_modified);
 
   ret = evbuffer_add_printf(evbuf,
       "file: %s\n"
@@ -630,28 +616,51 @@ mpd_add_db_media_file_info(struct evbuffer *evbuf, struct db_media_file_info *db
       "AlbumArtistSort: %s\n"
       "Album: %s\n"
       "Title: %s\n"
-      "Track: %s\n"
-      "Date: %s\n"
+      "Track: %d\n"
+      "Date: %d\n"
       "Genre: %s\n"
-      "Disc: %s\n",
-      (dbmfi->virtual_path + 1),
+      "Disc: %d\n",
+      (mfi->virtual_path + 1),
       modified,
-      (songlength / 1000),
-      ((float) songlength / 1000),
-      dbmfi->artist,
-      dbmfi->album_artist,
-      dbmfi->artist_sort,
-      dbmfi->album_artist_sort,
-      dbmfi->album,
-      dbmfi->title,
-      dbmfi->track,
-      dbmfi->year,
-      dbmfi->genre,
-      dbmfi->disc);
+      (mfi->song_length / 1000),
+      ((float) mfi->song_length / 1000),
+      mfi->artist,
+      mfi->album_artist,
+      mfi->artist_sort,
+      mfi->album_artist_sort,
+      mfi->album,
+      mfi->title,
+      mfi->track,
+      mfi->year,
+      mfi->genre,
+      mfi->disc);
 
   return ret;
 }
 
+/*
+ * Limits the columns fetched by the query to those used by
+ * mpd_add_db_media_file_info()
+ */
+static void
+mpd_file_info_cols_set(struct query_params *qp)
+{
+  db_query_add_col(qp, mfi_offsetof(id));
+  db_query_add_col(qp, mfi_offsetof(virtual_path));
+  db_query_add_col(qp, mfi_offsetof(time_modified));
+  db_query_add_col(qp, mfi_offsetof(song_length));
+  db_query_add_col(qp, mfi_offsetof(artist));
+  db_query_add_col(qp, mfi_offsetof(album_artist));
+  db_query_add_col(qp, mfi_offsetof(artist_sort));
+  db_query_add_col(qp, mfi_offsetof(album_artist_sort));
+  db_query_add_col(qp, mfi_offsetof(album));
+  db_query_add_col(qp, mfi_offsetof(title));
+  db_query_add_col(qp, mfi_offsetof(track));
+  db_query_add_col(qp, mfi_offsetof(year));
+  db_query_add_col(qp, mfi_offsetof(genre));
+  db_query_add_col(qp, mfi_offsetof(disc));
+}
+
 static void
 append_string(char **a, const char *b, const char *separator)
 {
@@ -678,7 +687,9 @@ append_string(char **a, const char *b, const char *separator)
 static int
 parse_filter_window_params(int argc, char **argv, bool exact_match, struct query_params *qp)
 {
+  static const char *any_cols[] = { "f.artist", "f.album", "f.title" };
   struct mpd_tagtype *tagtype;
+  const char *col;
   char *c1;
   int start_pos;
   int end_pos;
@@ -707,9 +718,12 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 
 	  if (tagtype->type == MPD_TYPE_STRING)
 	    {
+	      col = tagtype->field;
+
+	      // For search the full-text index is used if possible
 	      if (exact_match)
 		c1 = db_mprintf("(%s = '%q')", tagtype->field, argv[i + 1]);
-	      else
+	      else if (!(c1 = db_fts_filter(&col, 1, argv[i + 1])))
 		c1 = db_mprintf("(%s LIKE '%%%q%%')", tagtype->field, argv[i + 1]);
 	    }
 	  else if (tagtype->type == MPD_TYPE_INT)
@@ -724,7 +738,8 @@ parse_filter_window_params(int argc, char **argv, bool exact_match, struct query
 	    {
 	      if (0 == strcasecmp(tagtype->tag, "any"))
 	        {
-		  c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
+		  if (!(c1 = db_fts_filter(any_cols, ARRAY_SIZE(any_cols), argv[i + 1])))
+		    c1 = db_mprintf("(f.artist LIKE '%%%q%%' OR f.album LIKE '%%%q%%' OR f.title LIKE '%%%q%%')", argv[i + 1], argv[i + 1], argv[i + 1]);
 		}
 	      else if (0 == strcasecmp(tagtype->tag, "file"))
 	        {
@@ -2279,7 +2294,7 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
   char *path;
   struct playlist_info *pli;
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (!default_pl_dir || strstr(argv[1], ":/"))
@@ -2307,6 +2322,8 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
   qp.idx_type = I_NONE;
   qp.id = pli->id;
 
+  db_query_add_col(&qp, mfi_offsetof(virtual_path));
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2318,11 +2335,11 @@ mpd_command_listplaylist(struct evbuffer *evbuf, int argc, char **argv, char **e
       return ACK_ERROR_UNKNOWN;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
       evbuffer_add_printf(evbuf,
 	  "file: %s\n",
-	  (dbmfi.virtual_path + 1));
+	  (mfi.virtual_path + 1));
     }
 
   db_query_end(&qp);
@@ -2342,7 +2359,7 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
   char *path;
   struct playlist_info *pli;
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (!default_pl_dir || strstr(argv[1], ":/"))
@@ -2370,6 +2387,8 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
   qp.idx_type = I_NONE;
   qp.id = pli->id;
 
+  mpd_file_info_cols_set(&qp);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2381,12 +2400,12 @@ mpd_command_listplaylistinfo(struct evbuffer *evbuf, int argc, char **argv, char
       return ACK_ERROR_UNKNOWN;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_db_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -2646,7 +2665,7 @@ static int
 mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -2663,6 +2682,8 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 
   parse_filter_window_params(argc - 1, argv + 1, true, &qp);
 
+  mpd_file_info_cols_set(&qp);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2673,12 +2694,12 @@ mpd_command_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return ACK_ERROR_UNKNOWN;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_db_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -2722,6 +2743,32 @@ mpd_command_findadd(struct evbuffer *evbuf, int argc, char **argv, char **errmsg
   return 0;
 }
 
+/*
+ * Adds "<tag>: <value>" for the given tag type to the response, returns -1 if
+ * the value is empty (string tags only) and nothing was added.
+ */
+static int
+mpd_add_tagtype_value(struct evbuffer *evbuf, struct mpd_tagtype *tagtype, struct media_file_info *mfi)
+{
+  char *strval;
+  uint32_t intval;
+
+  if (tagtype->type == MPD_TYPE_INT)
+    {
+      intval = *(uint32_t *) ((char *)mfi + tagtype->mfi_offset);
+
+      evbuffer_add_printf(evbuf, "%s: %" PRIu32 "\n", tagtype->tag, intval);
+      return 0;
+    }
+
+  strval = *(char **) ((char *)mfi + tagtype->mfi_offset);
+  if (!strval || (*strval == '\0'))
+    return -1;
+
+  evbuffer_add_printf(evbuf, "%s: %s\n", tagtype->tag, strval);
+  return 0;
+}
+
 static int
 mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
@@ -2729,8 +2776,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   struct query_params qp;
   struct mpd_tagtype **group;
   int groupsize;
-  struct db_media_file_info dbmfi;
-  char **strval;
+  struct media_file_info mfi;
   int i;
   int ret;
 
@@ -2766,6 +2812,13 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
   groupsize = 0;
   parse_group_params(argc - 2, argv + 2, tagtype->group_in_listcommand, &qp, &group, &groupsize);
 
+  db_query_add_col(&qp, tagtype->mfi_offset);
+  for (i = 0; i < groupsize; i++)
+    {
+      if (group[i] && group[i]->mfi_offset >= 0)
+	db_query_add_col(&qp, group[i]->mfi_offset);
+    }
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2778,18 +2831,12 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
       return ACK_ERROR_UNKNOWN;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
-      strval = (char **) ((char *)&dbmfi + tagtype->mfi_offset);
-
-      if (!(*strval) || (**strval == '\0'))
+      ret = mpd_add_tagtype_value(evbuf, tagtype, &mfi);
+      if (ret < 0)
 	continue;
 
-      evbuffer_add_printf(evbuf,
-			  "%s: %s\n",
-			  tagtype->tag,
-			  *strval);
-
       if (group && groupsize > 0)
 	{
 	  for (i = 0; i < groupsize; i++)
@@ -2797,15 +2844,7 @@ mpd_command_list(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, s
 	      if (!group[i])
 		continue;
 
-	      strval = (char **) ((char *)&dbmfi + group[i]->mfi_offset);
-
-	      if (!(*strval) || (**strval == '\0'))
-		continue;
-
-	      evbuffer_add_printf(evbuf,
-	      			  "%s: %s\n",
-				  group[i]->tag,
-	      			  *strval);
+	      mpd_add_tagtype_value(evbuf, group[i], &mfi);
 	    }
 	}
     }
@@ -2827,7 +2866,7 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   struct db_playlist_info dbpli;
   char modified[32];
   uint32_t time_modified;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   // Load playlists for dir-id
@@ -2910,6 +2949,7 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
   qp.sort = S_ARTIST;
   qp.idx_type = I_NONE;
   qp.filter = db_mprintf("(f.directory_id = %d)", directory_id);
+  mpd_file_info_cols_set(&qp);
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -2918,21 +2958,21 @@ mpd_add_directory(struct evbuffer *evbuf, int directory_id, int listall, int lis
       *errmsg = safe_asprintf("Could not start query");
       return ACK_ERROR_UNKNOWN;
     }
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
       if (listinfo)
 	{
-	  ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+	  ret = mpd_add_db_media_file_info(evbuf, &mfi);
 	  if (ret < 0)
 	    {
-	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	      DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	    }
 	}
       else
 	{
 	  evbuffer_add_printf(evbuf,
 	    "file: %s\n",
-	    (dbmfi.virtual_path + 1));
+	    (mfi.virtual_path + 1));
 	}
     }
   db_query_end(&qp);
@@ -3114,7 +3154,7 @@ static int
 mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, struct mpd_client_ctx *ctx)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   int ret;
 
   if (argc < 3 || ((argc - 1) % 2) != 0)
@@ -3131,6 +3171,8 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
 
   parse_filter_window_params(argc - 1, argv + 1, false, &qp);
 
+  mpd_file_info_cols_set(&qp);
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -3141,12 +3183,12 @@ mpd_command_search(struct evbuffer *evbuf, int argc, char **argv, char **errmsg,
       return ACK_ERROR_UNKNOWN;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
-      ret = mpd_add_db_media_file_info(evbuf, &dbmfi);
+      ret = mpd_add_db_media_file_info(evbuf, &mfi);
       if (ret < 0)
 	{
-	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	  DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
 	}
     }
 
@@ -3327,7 +3369,7 @@ static int
 mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, const char *virtual_path)
 {
   struct query_params qp;
-  struct db_media_file_info dbmfi;
+  struct media_file_info mfi;
   uint32_t rating = 0;
   uint32_t rating_arg = 0;
   const char *operator;
@@ -3382,6 +3424,9 @@ mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, c
       return ret;
     }
 
+  db_query_add_col(&qp, mfi_offsetof(virtual_path));
+  db_query_add_col(&qp, mfi_offsetof(rating));
+
   ret = db_query_start(&qp);
   if (ret < 0)
     {
@@ -3393,24 +3438,16 @@ mpd_sticker_find(struct evbuffer *evbuf, int argc, char **argv, char **errmsg, c
       return ret;
     }
 
-  while ((ret = db_query_fetch_file(&dbmfi, &qp)) == 0)
+  while ((ret = db_query_fetch_file_row(&mfi, &qp)) == 0)
     {
-      ret = safe_atou32(dbmfi.rating, &rating);
-      if (ret < 0)
-	{
-	  DPRINTF(E_LOG, L_MPD, "Error rating=%s doesn't convert to integer, song id: %s\n",
-		  dbmfi.rating, dbmfi.id);
-	  continue;
-	}
-
-      rating /= MPD_RATING_FACTOR;
+      rating = mfi.rating / MPD_RATING_FACTOR;
       ret = evbuffer_add_printf(evbuf,
 				"file: %s\n"
 				"sticker: rating=%d\n",
-				(dbmfi.virtual_path + 1),
+				(mfi.virtual_path + 1),
 				rating);
       if (ret < 0)
-	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %s\n", dbmfi.id);
+	DPRINTF(E_LOG, L_MPD, "Error adding song to the evbuffer, song id: %d\n", mfi.id);
     }
 
   db_query_end(&qp);
@@ -4710,7 +4747,7 @@ artwork_cb(struct evhttp_request *req, void *arg)
       return;
     }
 
-  format = artwork_get_item(evbuffer, itemid, ART_DEFAULT_WIDTH, ART_DEFAULT_HEIGHT, 0);
+  format = artwork_get_item(evbuffer, itemid, ART_DEFAULT_WIDTH, ART_DEFAULT_HEIGHT, 0, NULL);
   if (format < 0)
     {
       httpd_send_error(req, HTTP_NOTFOUND, "Document was not found");
@@ -284,6 +284,33 @@ static void sql_str_escape(char **value)
   free(s);
 }
 
+// Appends a full-text search clause for a '*value*' wildcard, if the full-text
+// index is available and has the column. Returns false otherwise, in which case
+// the caller should use LIKE.
+static bool sql_append_fts(struct daap_result *result, const char *col, const char *wildcard)
+{
+  char *value;
+  char *filter;
+  size_t len;
+
+  len = strlen(wildcard);
+  if (len < 3)
+    return false;
+
+  value = strndup(wildcard + 1, len - 2); // Strip the '*'
+  if (strchr(value, '\''))
+    safe_snreplace(value, len - 1, "\\'", "'"); // See sql_str_escape()
+
+  filter = db_fts_filter(&col, 1, value);
+  free(value);
+  if (!filter)
+    return false;
+
+  sql_append(result, "%s", filter);
+  free(filter);
+  return true;
+}
+
 static void sql_append_dmap_clause(struct daap_result *result, struct ast *a)
 {
   const struct dmap_query_field_map *dqfm;
@@ -333,6 +360,10 @@ static void sql_append_dmap_clause(struct daap_result *result, struct ast *a)
       sql_append(result, "%s %s NULL)", dqfm->db_col, is_equal ? "IS" : "IS NOT");
       return;
     }
+  else if (!dqfm->as_int && v->type == DAAP_T_WILDCARD && is_equal && sql_append_fts(result, dqfm->db_col, (char *)v->data))
+    {
+      return;
+    }
   else if (!dqfm->as_int && v->type == DAAP_T_WILDCARD)
     {
       sql_like_escape((char **)&v->data, &escape_char);
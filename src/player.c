@@ -334,6 +334,31 @@ static uint32_t cur_plversion;
 // Play history
 static struct player_history *history;
 
+// Cached index of the queue item ids in both orders, so the player can step
+// through the queue without running a query per lookup. It is validated
+// against db_queue_version_get() and rebuilt after every queue change.
+struct queue_index_slot
+{
+  uint32_t item_id; // 0 means empty slot
+  int pos;
+  int shuffle_pos;
+};
+
+struct queue_index
+{
+  bool valid;
+  int version;
+  int count;
+  uint32_t *ids;         // Item ids by pos
+  uint32_t *shuffle_ids; // Item ids by shuffle_pos
+
+  // Open addressing hash table from item id to positions
+  struct queue_index_slot *slots;
+  uint32_t slots_mask;
+};
+
+static struct queue_index queue_index;
+
 // When we receive track metadata from the input we have to wait until playback
 // has reached the position before using it. We use this to record the update.
 struct metadata_pending_register
@@ -432,6 +457,122 @@ seek_save(void)
     db_file_seek_update(ps->id, ps->pos_ms);
 }
 
+static void
+queue_index_clear(void)
+{
+  free(queue_index.ids);
+  free(queue_index.shuffle_ids);
+  free(queue_index.slots);
+  memset(&queue_index, 0, sizeof(struct queue_index));
+}
+
+static inline uint32_t
+queue_index_hash(uint32_t item_id)
+{
+  return item_id * 2654435761u; // Knuth's multiplicative hash
+}
+
+static struct queue_index_slot *
+queue_index_slot_get(uint32_t item_id)
+{
+  struct queue_index_slot *slot;
+  uint32_t i;
+
+  for (i = queue_index_hash(item_id) & queue_index.slots_mask; ; i = (i + 1) & queue_index.slots_mask)
+    {
+      slot = &queue_index.slots[i];
+      if (slot->item_id == item_id || slot->item_id == 0)
+	return slot;
+    }
+}
+
+static int
+queue_index_build(void)
+{
+  struct queue_index_slot *slot;
+  uint32_t nslots;
+  int i;
+  int ret;
+
+  queue_index_clear();
+
+  ret = db_queue_get_ids(&queue_index.ids, &queue_index.shuffle_ids, &queue_index.count, &queue_index.version);
+  if (ret < 0)
+    return -1;
+
+  // Keep the load factor below 0.5
+  for (nslots = 16; nslots < 2 * queue_index.count; nslots *= 2)
+    ; /* EMPTY */
+
+  CHECK_NULL(L_PLAYER, queue_index.slots = calloc(nslots, sizeof(struct queue_index_slot)));
+  queue_index.slots_mask = nslots - 1;
+
+  for (i = 0; i < queue_index.count; i++)
+    {
+      slot = queue_index_slot_get(queue_index.ids[i]);
+      slot->item_id = queue_index.ids[i];
+      slot->pos = i;
+    }
+
+  for (i = 0; i < queue_index.count; i++)
+    {
+      slot = queue_index_slot_get(queue_index.shuffle_ids[i]);
+      slot->shuffle_pos = i;
+    }
+
+  queue_index.valid = true;
+
+  DPRINTF(E_DBG, L_PLAYER, "Rebuilt queue index (version %d, %d items)\n", queue_index.version, queue_index.count);
+
+  return 0;
+}
+
+// Returns the item id at pos_offset from the given item, 0 if there is no such
+// item, or -1 if the index could not be built (then caller should use the db)
+static int64_t
+queue_index_id_relative(uint32_t item_id, int pos_offset, char shuffle)
+{
+  struct queue_index_slot *slot;
+  int pos;
+  int ret;
+
+  if (!queue_index.valid || queue_index.version != db_queue_version_get())
+    {
+      ret = queue_index_build();
+      if (ret < 0)
+	{
+	  queue_index_clear();
+	  return -1;
+	}
+    }
+
+  slot = queue_index_slot_get(item_id);
+  if (slot->item_id == 0)
+    return 0;
+
+  pos = (shuffle ? slot->shuffle_pos : slot->pos) + pos_offset;
+  if (pos < 0 || pos >= queue_index.count)
+    return 0;
+
+  return shuffle ? queue_index.shuffle_ids[pos] : queue_index.ids[pos];
+}
+
+// Like db_queue_fetch_byposrelativetoitem(), but only the resulting item is
+// fetched from the db (with its metadata)
+static struct db_queue_item *
+queue_item_relative(uint32_t item_id, int pos_offset, char shuffle)
+{
+  int64_t id;
+
+  id = queue_index_id_relative(item_id, pos_offset, shuffle);
+  if (id < 0)
+    return db_queue_fetch_byposrelativetoitem(pos_offset, item_id, shuffle);
+  else if (id == 0)
+    return NULL;
+
+  return db_queue_fetch_byitemid(id);
+}
+
 /*
  * Returns the next queue item based on the current streaming source and repeat mode
  *
@@ -452,7 +593,7 @@ queue_item_next(uint32_t item_id)
     }
   else
     {
-      queue_item = db_queue_fetch_next(item_id, shuffle);
+      queue_item = queue_item_relative(item_id, 1, shuffle);
       if (!queue_item && repeat == REPEAT_ALL)
 	{
 	  if (shuffle)
@@ -480,7 +621,7 @@ queue_item_next(uint32_t item_id)
 static struct db_queue_item *
 queue_item_prev(uint32_t item_id)
 {
-  return db_queue_fetch_prev(item_id, shuffle);
+  return queue_item_relative(item_id, -1, shuffle);
 }
 
 
@@ -3795,6 +3936,7 @@ player_deinit(void)
     }
 
   free(history);
+  queue_index_clear();
 
   event_free(pb_timer_ev);
   event_base_free(evbase_player);